@@ -0,0 +1,207 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+/* Compares the CPU cost and fairness of one bandwidth pulse under the
+ * round-robin in tr_bandwidthAllocate () with the random picking that it
+ * replaced. The peers are simulated: each has some bytes queued at the
+ * start of a pulse, and a speed limit can be shared by all of them.
+ *
+ * Usage: bandwidth-bench [peers [pulses [limit-KiB-per-pulse]]] */
+
+#include <stdio.h>
+#include <stdlib.h> /* atoi () */
+
+#include "transmission.h"
+#include "bandwidth.h"
+#include "crypto-utils.h"
+#include "utils.h"
+
+struct fake_peer
+{
+  tr_priority_t priority;
+  size_t queued;
+  uint64_t moved;
+};
+
+static size_t bytesLeft;
+static bool isLimited;
+static uint64_t ioCalls;
+
+static size_t
+fake_io (void * vpeer, tr_direction dir UNUSED, size_t limit)
+{
+  struct fake_peer * peer = vpeer;
+  size_t n = MIN (limit, peer->queued);
+
+  if (isLimited)
+    {
+      n = MIN (n, bytesLeft);
+      bytesLeft -= n;
+    }
+
+  peer->queued -= n;
+  peer->moved += n;
+  ++ioCalls;
+  return n;
+}
+
+/* the allocator as it was: pick a peer at random and give it 3000 bytes
+ * until every peer is done, once for the high priority peers, then for
+ * the high and normal ones, then for all of them */
+static void
+random_phase (struct fake_peer ** peers, int n)
+{
+  while (n > 0)
+    {
+      const int i = tr_rand_int_weak (n);
+      const size_t increment = 3000;
+
+      if (fake_io (peers[i], TR_UP, increment) != increment)
+        {
+          struct fake_peer * tmp = peers[i];
+          peers[i] = peers[n-1];
+          peers[n-1] = tmp;
+          --n;
+        }
+    }
+}
+
+static void
+random_pulse (struct fake_peer * peers, int peerCount, struct fake_peer ** tmp)
+{
+  int i, n;
+  tr_priority_t pri;
+
+  for (pri=TR_PRI_HIGH; pri>=TR_PRI_LOW; --pri)
+    {
+      for (i=n=0; i<peerCount; ++i)
+        if (peers[i].priority >= pri)
+          tmp[n++] = &peers[i];
+
+      random_phase (tmp, n);
+    }
+}
+
+static void
+round_robin_pulse (struct fake_peer * peers, int peerCount, void ** queue, size_t * quanta, size_t quantum)
+{
+  int i;
+  static int start = 0;
+
+  /* as tr_bandwidthAllocate () does */
+  start = (start + 1) % peerCount;
+  for (i=0; i<peerCount; ++i)
+    {
+      struct fake_peer * peer = &peers[(start + i) % peerCount];
+      queue[i] = peer;
+      quanta[i] = quantum << (peer->priority - TR_PRI_LOW);
+    }
+
+  tr_bandwidthRoundRobin (queue, quanta, peerCount, TR_UP, fake_io);
+}
+
+static void
+run (const char         * name,
+     struct fake_peer   * peers,
+     int                  peerCount,
+     int                  pulses,
+     size_t               limit,
+     size_t               quantum)
+{
+  int i, pulse;
+  uint64_t begin, msec;
+  uint64_t moved[3] = { 0, 0, 0 };
+  int counts[3] = { 0, 0, 0 };
+  struct fake_peer ** tmp = tr_new (struct fake_peer *, peerCount);
+  void ** queue = tr_new (void *, peerCount);
+  size_t * quanta = tr_new (size_t, peerCount);
+
+  for (i=0; i<peerCount; ++i)
+    peers[i].moved = 0;
+  ioCalls = 0;
+  isLimited = limit > 0;
+
+  begin = tr_time_msec ();
+  for (pulse=0; pulse<pulses; ++pulse)
+    {
+      /* the same backlog for every run, so that they're comparable */
+      for (i=0; i<peerCount; ++i)
+        peers[i].queued = (size_t) ((i * 7919 + pulse * 104729) % (64 * 1024));
+      bytesLeft = limit;
+
+      if (quantum == 0)
+        random_pulse (peers, peerCount, tmp);
+      else
+        round_robin_pulse (peers, peerCount, queue, quanta, quantum);
+    }
+  msec = tr_time_msec () - begin;
+
+  for (i=0; i<peerCount; ++i)
+    {
+      moved[peers[i].priority - TR_PRI_LOW] += peers[i].moved;
+      ++counts[peers[i].priority - TR_PRI_LOW];
+    }
+
+  printf ("%-20s %9.1f usec/pulse %9.1f calls/pulse   KiB/peer/pulse: high %6.1f normal %6.1f low %6.1f\n",
+          name,
+          (double) msec * 1000 / pulses,
+          (double) ioCalls / pulses,
+          counts[2] ? (double) moved[2] / counts[2] / pulses / 1024 : 0.0,
+          counts[1] ? (double) moved[1] / counts[1] / pulses / 1024 : 0.0,
+          counts[0] ? (double) moved[0] / counts[0] / pulses / 1024 : 0.0);
+
+  tr_free (quanta);
+  tr_free (queue);
+  tr_free (tmp);
+}
+
+int
+main (int argc, char ** argv)
+{
+  int i, l;
+  const int peerCount = argc > 1 ? atoi (argv[1]) : 2000;
+  const int pulses = argc > 2 ? atoi (argv[2]) : 1000;
+  const size_t limitKiB = argc > 3 ? (size_t) atoi (argv[3]) : 8 * 1024;
+  const size_t quanta[] = { 3000, 16 * 1024, 64 * 1024 };
+  struct fake_peer * peers;
+
+  if (peerCount <= 0 || pulses <= 0)
+    {
+      fprintf (stderr, "Usage: %s [peers [pulses [limit-KiB-per-pulse]]]\n", argv[0]);
+      return 1;
+    }
+
+  /* one peer in ten is high priority, one in five is low */
+  peers = tr_new0 (struct fake_peer, peerCount);
+  for (i=0; i<peerCount; ++i)
+    peers[i].priority = i % 10 == 0 ? TR_PRI_HIGH : i % 5 == 1 ? TR_PRI_LOW : TR_PRI_NORMAL;
+
+  printf ("%d peers, %d pulses\n", peerCount, pulses);
+
+  for (l=0; l<2; ++l)
+    {
+      const size_t limit = l == 0 ? 0 : limitKiB * 1024;
+
+      if (limit == 0)
+        printf ("\nunlimited:\n");
+      else
+        printf ("\nlimited to %zu KiB per pulse:\n", limitKiB);
+
+      run ("random, 3000", peers, peerCount, pulses, limit, 0);
+      for (i=0; i<(int) (sizeof (quanta) / sizeof (*quanta)); ++i)
+        {
+          char name[32];
+          tr_snprintf (name, sizeof (name), "round-robin, %zu", quanta[i]);
+          run (name, peers, peerCount, pulses, limit, quanta[i]);
+        }
+    }
+
+  tr_free (peers);
+  return 0;
+}
@@ -12,9 +12,9 @@
 
 #include "transmission.h"
 #include "bandwidth.h"
-#include "crypto-utils.h" /* tr_rand_int_weak () */
 #include "log.h"
 #include "peer-io.h"
+#include "platform.h" /* tr_lock */
 #include "utils.h"
 
 #define dbgmsg(...) \
@@ -105,6 +105,7 @@ tr_bandwidthConstruct (tr_bandwidth * b, tr_session * session, tr_bandwidth * pa
   static unsigned int uniqueKey = 0;
 
   b->session = session;
+  b->lock = tr_lockNew ();
   b->children = TR_PTR_ARRAY_INIT;
   b->magicNumber = BANDWIDTH_MAGIC_NUMBER;
   b->uniqueKey = uniqueKey++;
@@ -120,6 +121,7 @@ tr_bandwidthDestruct (tr_bandwidth * b)
 
   tr_bandwidthSetParent (b, NULL);
   tr_ptrArrayDestruct (&b->children, NULL);
+  tr_lockFree (b->lock);
 
   memset (b, ~0, sizeof (tr_bandwidth));
 }
@@ -132,14 +134,23 @@ void
 tr_bandwidthSetParent (tr_bandwidth  * b,
                        tr_bandwidth  * parent)
 {
+  tr_bandwidth * old;
+
   assert (tr_isBandwidth (b));
   assert (b != parent);
 
-  if (b->parent)
+  /* network threads walk up from a peer's bandwidth, so the link
+   * is changed with b's lock held. The children are only used by
+   * tr_bandwidthAllocate (), on the same thread as this. */
+  tr_lockLock (b->lock);
+  old = b->parent;
+  b->parent = parent;
+  tr_lockUnlock (b->lock);
+
+  if (old)
     {
-      assert (tr_isBandwidth (b->parent));
-      tr_ptrArrayRemoveSortedPointer (&b->parent->children, b, compareBandwidth);
-      b->parent = NULL;
+      assert (tr_isBandwidth (old));
+      tr_ptrArrayRemoveSortedPointer (&old->children, b, compareBandwidth);
     }
 
   if (parent)
@@ -150,7 +161,6 @@ tr_bandwidthSetParent (tr_bandwidth  * b,
       assert (tr_ptrArrayFindSorted (&parent->children, b, compareBandwidth) == NULL);
       tr_ptrArrayInsertSorted (&parent->children, b, compareBandwidth);
       assert (tr_ptrArrayFindSorted (&parent->children, b, compareBandwidth) == b);
-      b->parent = parent;
     }
 }
 
@@ -174,7 +184,9 @@ allocateBandwidth (tr_bandwidth  * b,
   if (b->band[dir].isLimited)
     {
       const uint64_t nextPulseSpeed = b->band[dir].desiredSpeed_Bps;
+      tr_lockLock (b->lock);
       b->band[dir].bytesLeft = nextPulseSpeed * period_msec / 1000u;
+      tr_lockUnlock (b->lock);
     }
 
   /* add this bandwidth's peer, if any, to the peer pool */
@@ -195,55 +207,98 @@ allocateBandwidth (tr_bandwidth  * b,
     }
 }
 
-static void
-phaseOne (tr_ptrArray * peerArray, tr_direction dir)
+void
+tr_bandwidthRoundRobin (void                 ** peers,
+                        size_t                * quanta,
+                        int                     peerCount,
+                        tr_direction            dir,
+                        tr_bandwidth_io_func    io_func)
 {
-  int n;
-  int peerCount = tr_ptrArraySize (peerArray);
-  struct tr_peerIo ** peers = (struct tr_peerIo**) tr_ptrArrayBase (peerArray);
+  int i, n;
+  int round = 0;
 
-  /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
-   * peers from starving the others. Loop through the peers, giving each a
-   * small chunk of bandwidth. Keep looping until we run out of bandwidth
-   * and/or peers that can use it */
-  n = peerCount;
-  dbgmsg ("%d peers to go round-robin for %s", n, (dir==TR_UP?"upload":"download"));
-  while (n > 0)
+  dbgmsg ("%d peers to go round-robin for %s", peerCount, (dir==TR_UP?"upload":"download"));
+
+  while (peerCount > 0)
     {
-      const int i = tr_rand_int_weak (n); /* pick a peer at random */
+      /* a peer that uses less than its quantum is done for now;
+       * keep the rest, in the same order, for the next round */
+      for (i=n=0; i<peerCount; ++i)
+        {
+          const size_t bytesUsed = io_func (peers[i], dir, quanta[i]);
 
-      /* value of 3000 bytes chosen so that when using uTP we'll send a full-size
-       * frame right away and leave enough buffered data for the next frame to go
-       * out in a timely manner. */
-      const size_t increment = 3000;
+          assert (quanta[i] > 0);
 
-      const int bytesUsed = tr_peerIoFlush (peers[i], dir, increment);
+          if (bytesUsed >= quanta[i])
+            {
+              peers[n] = peers[i];
+              quanta[n] = quanta[i];
+              ++n;
+            }
+        }
 
-      dbgmsg ("peer #%d of %d used %d bytes in this pass", i, n, bytesUsed);
+      dbgmsg ("round %d: %d of %d peers used their whole quantum", round, n, peerCount);
+      peerCount = n;
+      ++round;
+    }
+}
 
-      if (bytesUsed != (int)increment)
-        {
-          /* peer is done writing for now; move it to the end of the list */
-          tr_peerIo * pio = peers[i];
-          peers[i] = peers[n-1];
-          peers[n-1] = pio;
-          --n;
-        }
+static size_t
+flushPeer (void * peer, tr_direction dir, size_t limit)
+{
+  const int bytesUsed = tr_peerIoFlush (peer, dir, limit);
+
+  return bytesUsed > 0 ? (size_t) bytesUsed : 0;
+}
+
+/* Go round the peers, giving each a quantum of bandwidth weighted by its
+ * priority. Keep going round until we run out of bandwidth and/or peers
+ * that can use it. Each pulse starts one peer further along, so that the
+ * peers at the front of the list don't always get the last of it. */
+static void
+phaseOne (tr_ptrArray * peerArray, tr_direction dir, unsigned int start, size_t quantum)
+{
+  int i;
+  const int peerCount = tr_ptrArraySize (peerArray);
+  struct tr_peerIo ** peers = (struct tr_peerIo**) tr_ptrArrayBase (peerArray);
+  void ** queue;
+  size_t * quanta;
+
+  if (peerCount == 0)
+    return;
+
+  queue = tr_new (void *, peerCount);
+  quanta = tr_new (size_t, peerCount);
+
+  for (i=0; i<peerCount; ++i)
+    {
+      tr_peerIo * io = peers[(start + i) % peerCount];
+      queue[i] = io;
+      quanta[i] = quantum << (io->priority - TR_PRI_LOW);
     }
+
+  tr_bandwidthRoundRobin (queue, quanta, peerCount, dir, flushPeer);
+
+  tr_free (quanta);
+  tr_free (queue);
 }
 
 void
 tr_bandwidthAllocate (tr_bandwidth  * b,
                       tr_direction    dir,
-                      unsigned int    period_msec)
+                      unsigned int    period_msec,
+                      size_t          quantum)
 {
   int i, peerCount;
+  unsigned int start;
   tr_ptrArray tmp = TR_PTR_ARRAY_INIT;
   tr_ptrArray low = TR_PTR_ARRAY_INIT;
   tr_ptrArray high = TR_PTR_ARRAY_INIT;
   tr_ptrArray normal = TR_PTR_ARRAY_INIT;
   struct tr_peerIo ** peers;
 
+  assert (quantum > 0);
+
   /* allocateBandwidth () is a helper function with two purposes:
    * 1. allocate bandwidth to b and its subtree
    * 2. accumulate an array of all the peerIos from b and its subtree. */
@@ -267,12 +322,12 @@ tr_bandwidthAllocate (tr_bandwidth  * b,
     }
 
   /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
-   * peers from starving the others. Loop through the peers, giving each a
-   * small chunk of bandwidth. Keep looping until we run out of bandwidth
-   * and/or peers that can use it */
-  phaseOne (&high, dir);
-  phaseOne (&normal, dir);
-  phaseOne (&low, dir);
+   * peers from starving the others. The high priority peers go round first,
+   * then the normal ones join them, then everyone. */
+  start = b->band[dir].roundRobinStart++;
+  phaseOne (&high, dir, start, quantum);
+  phaseOne (&normal, dir, start, quantum);
+  phaseOne (&low, dir, start, quantum);
 
   /* Second phase of IO. To help us scale in high bandwidth situations,
    * enable on-demand IO for peers with bandwidth left to burn.
@@ -304,92 +359,202 @@ tr_bandwidthSetPeer (tr_bandwidth * b, tr_peerIo * peer)
 ****
 ***/
 
+/* Each bandwidth has its own lock for its bytes left and its speed
+ * history. Walking up to the parents takes one lock at a time, so
+ * network threads only contend on the bands that they share. */
+
+/* how much of byteCount b itself allows. Call with b->lock held */
+static unsigned int
+bandClamp (const tr_bandwidth  * b,
+           uint64_t              now,
+           tr_direction          dir,
+           unsigned int          byteCount)
+{
+  if (b->band[dir].isLimited)
+    {
+      byteCount = MIN (byteCount, b->band[dir].bytesLeft);
+
+      /* if we're getting close to exceeding the speed limit,
+       * clamp down harder on the bytes available */
+      if (byteCount > 0)
+        {
+          double current;
+          double desired;
+          double r;
+
+          current = getSpeed_Bps (&b->band[TR_DOWN].raw, HISTORY_MSEC, now);
+          desired = tr_bandwidthGetDesiredSpeed_Bps (b, TR_DOWN);
+          r = desired >= 1 ? current / desired : 0;
+
+               if (r > 1.0) byteCount = 0;
+          else if (r > 0.9) byteCount *= 0.8;
+          else if (r > 0.8) byteCount *= 0.9;
+        }
+    }
+
+  return byteCount;
+}
+
 static unsigned int
 bandwidthClamp (const tr_bandwidth  * b,
                 uint64_t              now,
                 tr_direction          dir,
                 unsigned int          byteCount)
 {
+  const tr_bandwidth * parent;
+
   assert (tr_isBandwidth (b));
   assert (tr_isDirection (dir));
 
-  if (b)
-    {
-      if (b->band[dir].isLimited)
-        {
-          byteCount = MIN (byteCount, b->band[dir].bytesLeft);
+  tr_lockLock (b->lock);
+  byteCount = bandClamp (b, now, dir, byteCount);
+  parent = b->band[dir].honorParentLimits ? b->parent : NULL;
+  tr_lockUnlock (b->lock);
 
-          /* if we're getting close to exceeding the speed limit,
-           * clamp down harder on the bytes available */
-          if (byteCount > 0)
-            {
-              double current;
-              double desired;
-              double r;
+  if (parent && (byteCount > 0))
+    byteCount = bandwidthClamp (parent, now, dir, byteCount);
+
+  return byteCount;
+}
+
+unsigned int
+tr_bandwidthClamp (const tr_bandwidth  * b,
+                   tr_direction          dir,
+                   unsigned int          byteCount)
+{
+  return bandwidthClamp (b, 0, dir, byteCount);
+}
+
+/* take up to byteCount out of the bytes left of b and its ancestors,
+ * like bandwidthUsed () does. If clamp is set, take no more than
+ * each band allows and give the difference back to the ones below */
+static unsigned int
+bandwidthReserve (tr_bandwidth  * b,
+                  uint64_t        now,
+                  tr_direction    dir,
+                  unsigned int    byteCount,
+                  bool            clamp)
+{
+  tr_bandwidth * parent;
+  struct tr_band * band = &b->band[dir];
 
-              if (now == 0)
-                now = tr_time_msec ();
+  assert (tr_isBandwidth (b));
+  assert (tr_isDirection (dir));
 
-              current = tr_bandwidthGetRawSpeed_Bps (b, now, TR_DOWN);
-              desired = tr_bandwidthGetDesiredSpeed_Bps (b, TR_DOWN);
-              r = desired >= 1 ? current / desired : 0;
+  tr_lockLock (b->lock);
+  if (band->isLimited)
+    {
+      if (clamp)
+        byteCount = bandClamp (b, now, dir, byteCount);
+      band->bytesLeft -= MIN (band->bytesLeft, byteCount);
+    }
+  clamp = clamp && band->honorParentLimits;
+  parent = b->parent;
+  tr_lockUnlock (b->lock);
 
-                   if (r > 1.0) byteCount = 0;
-              else if (r > 0.9) byteCount *= 0.8;
-              else if (r > 0.8) byteCount *= 0.9;
-            }
-        }
+  if (parent && (byteCount > 0))
+    {
+      const unsigned int granted = bandwidthReserve (parent, now, dir, byteCount, clamp);
+
+      if (granted < byteCount)
+        {
+          tr_lockLock (b->lock);
+          if (band->isLimited)
+            band->bytesLeft += byteCount - granted;
+          tr_lockUnlock (b->lock);
 
-      if (b->parent && b->band[dir].honorParentLimits && (byteCount > 0))
-        byteCount = bandwidthClamp (b->parent, now, dir, byteCount);
+          byteCount = granted;
+        }
     }
 
   return byteCount;
 }
 
 unsigned int
-tr_bandwidthClamp (const tr_bandwidth  * b,
-                   tr_direction          dir,
-                   unsigned int          byteCount)
+tr_bandwidthReserve (tr_bandwidth  * b,
+                     tr_direction    dir,
+                     unsigned int    byteCount)
 {
-  return bandwidthClamp (b, 0, dir, byteCount);
+  return bandwidthReserve (b, 0, dir, byteCount, true);
 }
 
+void
+tr_bandwidthRelease (tr_bandwidth  * b,
+                     tr_direction    dir,
+                     unsigned int    byteCount)
+{
+  while (b != NULL && byteCount > 0)
+    {
+      tr_bandwidth * parent;
+      struct tr_band * band = &b->band[dir];
+
+      assert (tr_isBandwidth (b));
+
+      tr_lockLock (b->lock);
+      if (band->isLimited)
+        band->bytesLeft += byteCount;
+      parent = b->parent;
+      tr_lockUnlock (b->lock);
+
+      b = parent;
+    }
+}
 
 unsigned int
 tr_bandwidthGetRawSpeed_Bps (const tr_bandwidth * b, const uint64_t now, const tr_direction dir)
 {
+  unsigned int speed;
+
   assert (tr_isBandwidth (b));
   assert (tr_isDirection (dir));
 
-  return getSpeed_Bps (&b->band[dir].raw, HISTORY_MSEC, now);
+  tr_lockLock (b->lock);
+  speed = getSpeed_Bps (&b->band[dir].raw, HISTORY_MSEC, now);
+  tr_lockUnlock (b->lock);
+
+  return speed;
 }
 
 unsigned int
 tr_bandwidthGetPieceSpeed_Bps (const tr_bandwidth * b, const uint64_t now, const tr_direction dir)
 {
+  unsigned int speed;
+
   assert (tr_isBandwidth (b));
   assert (tr_isDirection (dir));
 
-  return getSpeed_Bps (&b->band[dir].piece, HISTORY_MSEC, now);
+  tr_lockLock (b->lock);
+  speed = getSpeed_Bps (&b->band[dir].piece, HISTORY_MSEC, now);
+  tr_lockUnlock (b->lock);
+
+  return speed;
 }
 
-void
-tr_bandwidthUsed (tr_bandwidth  * b,
-                  tr_direction    dir,
-                  size_t          byteCount,
-                  bool            isPieceData,
-                  uint64_t        now)
+static void
+bandwidthUsed (tr_bandwidth  * b,
+               tr_direction    dir,
+               size_t          byteCount,
+               bool            isPieceData,
+               bool            isReserved,
+               uint64_t        now)
 {
   struct tr_band * band;
+  tr_bandwidth * parent;
 
   assert (tr_isBandwidth (b));
   assert (tr_isDirection (dir));
 
   band = &b->band[dir];
 
-  if (band->isLimited && isPieceData)
+  tr_lockLock (b->lock);
+
+  /* only piece data counts against the speed limit. Reserved bytes were
+   * taken out before anyone knew what they were, so the ones that turn
+   * out not to be piece data go back */
+  if (band->isLimited && isPieceData && !isReserved)
     band->bytesLeft -= MIN (band->bytesLeft, byteCount);
+  else if (band->isLimited && !isPieceData && isReserved)
+    band->bytesLeft += byteCount;
 
 #ifdef DEBUG_DIRECTION
 if ((dir == DEBUG_DIRECTION) && (band->isLimited))
@@ -402,6 +567,29 @@ fprintf (stderr, "%p consumed %5zu bytes of %5s data... was %6zu, now %6zu left\
   if (isPieceData)
     bytesUsed (now, &band->piece, byteCount);
 
-  if (b->parent != NULL)
-    tr_bandwidthUsed (b->parent, dir, byteCount, isPieceData, now);
+  parent = b->parent;
+  tr_lockUnlock (b->lock);
+
+  if (parent != NULL)
+    bandwidthUsed (parent, dir, byteCount, isPieceData, isReserved, now);
+}
+
+void
+tr_bandwidthUsed (tr_bandwidth  * b,
+                  tr_direction    dir,
+                  size_t          byteCount,
+                  bool            isPieceData,
+                  uint64_t        now)
+{
+  bandwidthUsed (b, dir, byteCount, isPieceData, false, now);
+}
+
+void
+tr_bandwidthUsedReserved (tr_bandwidth  * b,
+                          tr_direction    dir,
+                          size_t          byteCount,
+                          bool            isPieceData,
+                          uint64_t        now)
+{
+  bandwidthUsed (b, dir, byteCount, isPieceData, true, now);
 }
@@ -55,6 +55,7 @@ struct tr_band
   bool honorParentLimits;
   unsigned int bytesLeft;
   unsigned int desiredSpeed_Bps;
+  unsigned int roundRobinStart; /* where tr_bandwidthAllocate () starts next */
   struct bratecontrol raw;
   struct bratecontrol piece;
 };
@@ -104,6 +105,7 @@ typedef struct tr_bandwidth
    * it's included in the header for inlining and composition. */
 
   struct tr_band band[2];
+  struct tr_lock * lock; /* guards band[] and parent */
   struct tr_bandwidth * parent;
   tr_priority_t priority;
   int magicNumber;
@@ -188,10 +190,38 @@ tr_bandwidthIsLimited (const tr_bandwidth  * bandwidth,
 
 /**
  * @brief allocate the next period_msec's worth of bandwidth for the peer-ios to consume
+ *
+ * The peer-ios are then given up to quantum bytes each, twice that for
+ * normal priority and four times that for high priority, in rounds until
+ * none of them has any more to read or write or bandwidth left to do it with.
  */
 void tr_bandwidthAllocate (tr_bandwidth  * bandwidth,
                            tr_direction    direction,
-                           unsigned int    period_msec);
+                           unsigned int    period_msec,
+                           size_t          quantum);
+
+/** @brief the I/O function used by tr_bandwidthRoundRobin ().
+    @return the number of bytes read or written, at most limit */
+typedef size_t (* tr_bandwidth_io_func) (void          * peer,
+                                         tr_direction    direction,
+                                         size_t          limit);
+
+/**
+ * @brief weighted round-robin over peers, as done by tr_bandwidthAllocate ()
+ *
+ * Each round calls io_func once for each peer that's still in the running,
+ * with that peer's quanta[i] as the limit. A peer that does less than that
+ * is done. This costs O(peers) per round and the order never changes,
+ * so every peer gets its share of a round before any peer gets more.
+ *
+ * peers and quanta are reordered as peers drop out.
+ * This is exposed for bandwidth-bench.
+ */
+void tr_bandwidthRoundRobin (void                 ** peers,
+                             size_t                * quanta,
+                             int                     peerCount,
+                             tr_direction            direction,
+                             tr_bandwidth_io_func    io_func);
 
 /**
  * @brief clamps byteCount down to a number that this bandwidth will allow to be consumed
@@ -200,6 +230,23 @@ unsigned int tr_bandwidthClamp (const tr_bandwidth  * bandwidth,
                                 tr_direction          direction,
                                 unsigned int          byteCount);
 
+/**
+ * @brief like tr_bandwidthClamp (), but also takes the bytes out of what's left.
+ *
+ * This is for peer-ios whose I/O happens on a network thread, where another
+ * thread could use the same bytes between a clamp and tr_bandwidthUsed ().
+ * Give back whatever isn't used with tr_bandwidthRelease () and report the
+ * rest with tr_bandwidthUsedReserved ().
+ */
+unsigned int tr_bandwidthReserve (tr_bandwidth  * bandwidth,
+                                  tr_direction    direction,
+                                  unsigned int    byteCount);
+
+/** @brief give back bytes that were reserved with tr_bandwidthReserve () but not used */
+void tr_bandwidthRelease (tr_bandwidth  * bandwidth,
+                          tr_direction    direction,
+                          unsigned int    byteCount);
+
 /******
 *******
 ******/
@@ -224,6 +271,18 @@ void tr_bandwidthUsed (tr_bandwidth  * bandwidth,
                        bool            isPieceData,
                        uint64_t        now);
 
+/**
+ * @brief like tr_bandwidthUsed (), for bytes that tr_bandwidthReserve () has already taken.
+ *
+ * Bytes that aren't piece data are given back, so that they're counted
+ * against the speed limit the same way tr_bandwidthUsed () counts them.
+ */
+void tr_bandwidthUsedReserved (tr_bandwidth  * bandwidth,
+                               tr_direction    direction,
+                               size_t          byteCount,
+                               bool            isPieceData,
+                               uint64_t        now);
+
 /******
 *******
 ******/
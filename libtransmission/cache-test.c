@@ -0,0 +1,1048 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <string.h> /* memcmp () */
+
+#ifndef _WIN32
+ #include <sys/types.h>
+ #include <sys/socket.h> /* recv () */
+#endif
+
+#include <event2/buffer.h>
+#include <event2/util.h> /* evutil_socketpair () */
+
+#include "transmission.h"
+#include "cache.h"
+#include "crypto-utils.h" /* tr_sha1 () */
+#include "file.h"
+#include "inout.h"
+#include "peer-common.h" /* MAX_BLOCK_SIZE */
+#include "torrent.h"
+#include "trevent.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+struct cache_test_data
+{
+  tr_session * session;
+  tr_torrent * tor;
+  const tr_block_index_t * order;
+  int64_t cache_limit;
+  uint8_t * cached;  /* the torrent's contents, read back from the cache */
+  uint8_t * flushed; /* the torrent's contents, read back from disk */
+  uint8_t * sent;    /* the torrent's contents, read back as file segments */
+  bool hashed;       /* the pieces were hashed right as they were written */
+  bool done;
+};
+
+static uint8_t
+block_pattern (tr_block_index_t block)
+{
+  return (uint8_t)(block ^ 0x5a);
+}
+
+#ifndef _WIN32
+
+/* file segments can only be drained into a file descriptor,
+   so write buf out to a socket and read it back from the other end */
+static void
+send_through_socket (struct evbuffer * buf, uint8_t * setme)
+{
+  evutil_socket_t fds[2];
+
+  if (evutil_socketpair (AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return;
+
+  while (evbuffer_get_length (buf) > 0)
+    {
+      const int n = evbuffer_write (buf, fds[0]);
+      if (n <= 0 || recv (fds[1], setme, n, MSG_WAITALL) != n)
+        break;
+      setme += n;
+    }
+
+  evutil_closesocket (fds[1]);
+  evutil_closesocket (fds[0]);
+}
+
+#endif
+
+static void
+cache_test_threadfunc (void * vdata)
+{
+  tr_block_index_t i;
+  struct cache_test_data * data = vdata;
+  tr_torrent * tor = data->tor;
+  tr_cache * cache = data->session->cache;
+  uint8_t * block_buf = tr_new (uint8_t, tor->blockSize);
+  struct evbuffer * buf = evbuffer_new ();
+
+  tr_cacheSetLimit (cache, data->cache_limit);
+
+  for (i=0; i<tor->blockCount; ++i)
+    {
+      const tr_block_index_t block = data->order[i];
+      const uint32_t len = tr_torBlockCountBytes (tor, block);
+      const tr_piece_index_t piece = tr_torBlockPiece (tor, block);
+      const uint32_t offset = block * tor->blockSize - piece * tor->info.pieceSize;
+
+      memset (block_buf, block_pattern (block), len);
+      evbuffer_add (buf, block_buf, len);
+      tr_cacheWriteBlock (cache, tor, piece, offset, len, buf);
+    }
+
+  for (i=0; i<tor->blockCount; ++i)
+    {
+      const tr_piece_index_t piece = tr_torBlockPiece (tor, i);
+      const uint32_t offset = i * tor->blockSize - piece * tor->info.pieceSize;
+      tr_cacheReadBlock (cache, tor, piece, offset, tr_torBlockCountBytes (tor, i), data->cached + i * tor->blockSize);
+    }
+
+  data->hashed = true;
+  for (i=0; i<tor->info.pieceCount; ++i)
+    {
+      uint8_t hash[SHA_DIGEST_LENGTH];
+      uint8_t expected_hash[SHA_DIGEST_LENGTH];
+      const uint8_t * piece_data = data->cached + (size_t)i * tor->info.pieceSize;
+
+      if (!tr_cacheGetPieceHash (cache, tor, i, hash)
+          || !tr_sha1 (expected_hash, piece_data, (int)tr_torPieceCountBytes (tor, i), NULL)
+          || memcmp (hash, expected_hash, SHA_DIGEST_LENGTH) != 0)
+        data->hashed = false;
+    }
+
+  tr_cacheFlushTorrent (cache, tor);
+
+  for (i=0; i<tor->blockCount; ++i)
+    {
+      const tr_piece_index_t piece = tr_torBlockPiece (tor, i);
+      const uint32_t offset = i * tor->blockSize - piece * tor->info.pieceSize;
+      tr_ioRead (tor, piece, offset, tr_torBlockCountBytes (tor, i), data->flushed + i * tor->blockSize);
+    }
+
+#ifndef _WIN32
+  for (i=0; i<tor->blockCount; ++i)
+    {
+      const uint32_t len = tr_torBlockCountBytes (tor, i);
+      const tr_piece_index_t piece = tr_torBlockPiece (tor, i);
+      const uint32_t offset = i * tor->blockSize - piece * tor->info.pieceSize;
+
+      if (!tr_cacheReadBlockToBuffer (cache, tor, piece, offset, len, buf))
+        send_through_socket (buf, data->sent + i * tor->blockSize);
+      evbuffer_drain (buf, evbuffer_get_length (buf));
+    }
+#else
+  memcpy (data->sent, data->flushed, (size_t)tor->blockCount * tor->blockSize);
+#endif
+
+  evbuffer_free (buf);
+  tr_free (block_buf);
+  data->done = true;
+}
+
+static int
+test_cache_order_impl (tr_block_index_t (* get_block) (tr_block_index_t, tr_block_index_t),
+                       int64_t cache_limit,
+                       tr_preallocation_mode preallocation)
+{
+  tr_block_index_t i;
+  tr_session * session;
+  tr_torrent * tor;
+  struct cache_test_data data;
+  tr_block_index_t * order;
+  uint8_t * expected;
+  size_t n;
+  tr_variant settings;
+  tr_session_cache_stats stats;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddInt (&settings, TR_KEY_preallocation, preallocation);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+  tor = libttest_zero_torrent_init (session);
+
+  n = (size_t)tor->blockCount * tor->blockSize;
+  order = tr_new (tr_block_index_t, tor->blockCount);
+  expected = tr_new0 (uint8_t, n);
+  for (i=0; i<tor->blockCount; ++i)
+    {
+      order[i] = get_block (i, tor->blockCount);
+      memset (expected + i * tor->blockSize, block_pattern (i), tr_torBlockCountBytes (tor, i));
+    }
+
+  memset (&data, 0, sizeof (data));
+  data.session = session;
+  data.tor = tor;
+  data.order = order;
+  data.cache_limit = cache_limit;
+  data.cached = tr_new0 (uint8_t, n);
+  data.flushed = tr_new0 (uint8_t, n);
+  data.sent = tr_new0 (uint8_t, n);
+  tr_runInEventThread (session, cache_test_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+
+  check (memcmp (expected, data.cached, n) == 0);
+  check (memcmp (expected, data.flushed, n) == 0);
+  check (memcmp (expected, data.sent, n) == 0);
+  check (data.hashed);
+
+  /* every block went through the cache and out to disk */
+  tr_sessionGetCacheStats (session, &stats);
+  check_uint_eq (tor->blockCount, stats.blockWrites);
+  check_uint_eq (tor->info.totalSize, stats.blockWriteBytes);
+  check_uint_eq (tor->blockCount, stats.flushBlocks);
+  check_uint_eq (tor->info.totalSize, stats.flushBytes);
+  check (stats.flushCount > 0);
+  check (stats.averageRunLength >= 1.0);
+  check (stats.readBytes >= tor->info.totalSize);
+
+  /* no piece had to be read back to be hashed unless
+     some of its blocks were flushed before their turn */
+  check_uint_eq (tor->info.pieceCount, stats.hashedPieces + stats.rehashedPieces);
+  if (cache_limit >= (int64_t)n)
+    check_uint_eq (tor->info.pieceCount, stats.hashedPieces);
+
+  /* cleanup */
+  tr_free (data.sent);
+  tr_free (data.flushed);
+  tr_free (data.cached);
+  tr_free (expected);
+  tr_free (order);
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_cache_order (tr_block_index_t (* get_block) (tr_block_index_t, tr_block_index_t), int64_t cache_limit)
+{
+  return test_cache_order_impl (get_block, cache_limit, TR_PREALLOCATE_SPARSE);
+}
+
+/***
+****
+***/
+
+struct read_cache_test_data
+{
+  tr_session * session;
+  tr_torrent * tor;
+  int64_t read_limit;
+  uint64_t hits[2];
+  uint64_t misses[2];
+  bool done;
+};
+
+/* read blocks [first..last) and return how many of them were cache hits */
+static uint64_t
+read_test_blocks (tr_torrent * tor, tr_block_index_t first, tr_block_index_t last, uint64_t * setme_misses)
+{
+  tr_block_index_t i;
+  uint64_t hits, misses, new_hits, new_misses;
+  tr_cache * cache = tor->session->cache;
+  uint8_t * block_buf = tr_new (uint8_t, tor->blockSize);
+
+  tr_cacheGetReadStats (cache, &hits, &misses);
+
+  for (i=first; i<last; ++i)
+    {
+      const tr_piece_index_t piece = tr_torBlockPiece (tor, i);
+      const uint32_t offset = i * tor->blockSize - piece * tor->info.pieceSize;
+      tr_cacheReadBlock (cache, tor, piece, offset, tr_torBlockCountBytes (tor, i), block_buf);
+    }
+
+  tr_cacheGetReadStats (cache, &new_hits, &new_misses);
+  if (setme_misses != NULL)
+    *setme_misses = new_misses - misses;
+
+  tr_free (block_buf);
+  return new_hits - hits;
+}
+
+static void
+read_cache_test_threadfunc (void * vdata)
+{
+  int pass;
+  struct read_cache_test_data * data = vdata;
+  tr_torrent * tor = data->tor;
+
+  tr_cacheSetReadLimit (data->session->cache, data->read_limit);
+
+  for (pass=0; pass<2; ++pass)
+    data->hits[pass] = read_test_blocks (tor, 0, tor->blockCount, &data->misses[pass]);
+
+  data->done = true;
+}
+
+static int
+test_read_cache_impl (int64_t read_limit, bool fits_in_cache)
+{
+  uint64_t expected_hits;
+  tr_session * session;
+  tr_torrent * tor;
+  struct read_cache_test_data data;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+
+  memset (&data, 0, sizeof (data));
+  data.session = session;
+  data.tor = tor;
+  data.read_limit = read_limit;
+  tr_runInEventThread (session, read_cache_test_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+  expected_hits = fits_in_cache ? tor->blockCount : 0;
+
+  /* the first pass reads everything from disk... */
+  check_uint_eq (0, data.hits[0]);
+  check_uint_eq (tor->blockCount, data.misses[0]);
+
+  /* ...and the second one reads whatever stayed in the read cache */
+  check_uint_eq (expected_hits, data.hits[1]);
+  check_uint_eq (tor->blockCount - expected_hits, data.misses[1]);
+
+  /* cleanup */
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+enum
+{
+  SCAN_TEST_READ_BLOCKS = 16,
+  SCAN_TEST_HOT_BLOCKS = 8
+};
+
+static void
+read_cache_scan_threadfunc (void * vdata)
+{
+  struct read_cache_test_data * data = vdata;
+  tr_torrent * tor = data->tor;
+
+  tr_cacheSetReadLimit (data->session->cache, data->read_limit);
+
+  /* the hot set is read twice, which moves it to the protected segment */
+  read_test_blocks (tor, 0, SCAN_TEST_HOT_BLOCKS, NULL);
+  data->hits[0] = read_test_blocks (tor, 0, SCAN_TEST_HOT_BLOCKS, NULL);
+
+  /* a cold scan that's bigger than the whole read cache
+     should only churn the probationary segment... */
+  read_test_blocks (tor, SCAN_TEST_HOT_BLOCKS, tor->blockCount, NULL);
+
+  /* ...so the hot set is still there afterwards */
+  data->hits[1] = read_test_blocks (tor, 0, SCAN_TEST_HOT_BLOCKS, &data->misses[1]);
+
+  data->done = true;
+}
+
+static int
+test_read_cache_scan (void)
+{
+  tr_session * session;
+  tr_torrent * tor;
+  struct read_cache_test_data data;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  check (tor->blockCount - SCAN_TEST_HOT_BLOCKS > SCAN_TEST_READ_BLOCKS);
+
+  memset (&data, 0, sizeof (data));
+  data.session = session;
+  data.tor = tor;
+  data.read_limit = MAX_BLOCK_SIZE * SCAN_TEST_READ_BLOCKS;
+  tr_runInEventThread (session, read_cache_scan_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+
+  check_uint_eq (SCAN_TEST_HOT_BLOCKS, data.hits[0]);
+  check_uint_eq (SCAN_TEST_HOT_BLOCKS, data.hits[1]);
+  check_uint_eq (0, data.misses[1]);
+
+  /* cleanup */
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_read_cache (void)
+{
+  int rv;
+
+  /* big enough to hold the whole torrent */
+  if ((rv = test_read_cache_impl (1024 * 1024 * 64, true)))
+    return rv;
+
+  /* disabled */
+  if ((rv = test_read_cache_impl (0, false)))
+    return rv;
+
+  /* a hot set survives a scan through everything else */
+  if ((rv = test_read_cache_scan ()))
+    return rv;
+
+  return 0;
+}
+
+/***
+****
+***/
+
+struct piece_hash_test_data
+{
+  tr_session * session;
+  tr_torrent * tor;
+  bool matched[3];
+  bool done;
+};
+
+static void
+write_test_block (tr_torrent * tor, tr_piece_index_t piece, uint32_t offset, uint8_t * data, uint8_t pattern)
+{
+  struct evbuffer * buf = evbuffer_new ();
+
+  memset (data + offset, pattern, tor->blockSize);
+  evbuffer_add (buf, data + offset, tor->blockSize);
+  tr_cacheWriteBlock (tor->session->cache, tor, piece, offset, tor->blockSize, buf);
+  evbuffer_free (buf);
+}
+
+static bool
+piece_hash_matches (tr_torrent * tor, tr_piece_index_t piece, const uint8_t * data)
+{
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  uint8_t expected[SHA_DIGEST_LENGTH];
+
+  return tr_cacheGetPieceHash (tor->session->cache, tor, piece, hash)
+      && tr_sha1 (expected, data, (int)tor->info.pieceSize, NULL)
+      && memcmp (hash, expected, SHA_DIGEST_LENGTH) == 0;
+}
+
+static void
+piece_hash_threadfunc (void * vdata)
+{
+  struct piece_hash_test_data * data = vdata;
+  tr_torrent * tor = data->tor;
+  const uint32_t block_size = tor->blockSize;
+  uint8_t * piece_data = tr_new (uint8_t, tor->info.pieceSize);
+
+  /* the second block is flushed before the first one arrives,
+     so it has to be read back */
+  write_test_block (tor, 0, block_size, piece_data, 1);
+  tr_cacheFlushTorrent (tor->session->cache, tor);
+  write_test_block (tor, 0, 0, piece_data, 2);
+  data->matched[0] = piece_hash_matches (tor, 0, piece_data);
+
+  /* the blocks arrive in order */
+  write_test_block (tor, 1, 0, piece_data, 3);
+  write_test_block (tor, 1, block_size, piece_data, 4);
+  data->matched[1] = piece_hash_matches (tor, 1, piece_data);
+
+  /* a block that's already been hashed is written again */
+  write_test_block (tor, 2, 0, piece_data, 5);
+  write_test_block (tor, 2, block_size, piece_data, 6);
+  write_test_block (tor, 2, 0, piece_data, 7);
+  data->matched[2] = piece_hash_matches (tor, 2, piece_data);
+
+  tr_free (piece_data);
+  data->done = true;
+}
+
+static int
+test_piece_hash (void)
+{
+  int i;
+  tr_session * session;
+  tr_torrent * tor;
+  struct piece_hash_test_data data;
+  tr_session_cache_stats stats;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  check_uint_eq (2, tor->blockCountInPiece);
+
+  memset (&data, 0, sizeof (data));
+  data.session = session;
+  data.tor = tor;
+  tr_runInEventThread (session, piece_hash_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+
+  for (i=0; i<3; ++i)
+    check (data.matched[i]);
+
+  tr_sessionGetCacheStats (session, &stats);
+  check_uint_eq (2, stats.hashedPieces);
+  check_uint_eq (1, stats.rehashedPieces);
+
+  /* cleanup */
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+struct check_piece_test_data
+{
+  tr_torrent * tor;
+  tr_piece_index_t piece;
+  bool done;
+};
+
+static void
+check_piece_threadfunc (void * vdata)
+{
+  struct check_piece_test_data * data = vdata;
+
+  tr_torrentCheckPieceAsync (data->tor, data->piece);
+}
+
+static void
+check_piece_poll_threadfunc (void * vdata)
+{
+  struct check_piece_test_data * data = vdata;
+
+  data->done = data->tor->pieceChecks == NULL;
+}
+
+/* wait for the checks that were queued before this */
+static void
+wait_for_piece_checks (tr_torrent * tor)
+{
+  struct check_piece_test_data data;
+
+  memset (&data, 0, sizeof (data));
+  data.tor = tor;
+
+  do
+    {
+      tr_wait_msec (50);
+      tr_runInEventThread (tor->session, check_piece_poll_threadfunc, &data);
+      tr_wait_msec (50);
+    }
+  while (!data.done);
+}
+
+static void
+check_piece_async (tr_torrent * tor, tr_piece_index_t piece)
+{
+  struct check_piece_test_data data;
+
+  memset (&data, 0, sizeof (data));
+  data.tor = tor;
+  data.piece = piece;
+  tr_runInEventThread (tor->session, check_piece_threadfunc, &data);
+  wait_for_piece_checks (tor);
+}
+
+static int
+test_check_piece_async (void)
+{
+  char * path;
+  tr_sys_file_t fd;
+  tr_sys_path_info info;
+  tr_session * session;
+  tr_torrent * tor;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+
+  /* a check is stamped with tr_time (), which can lag behind the
+     file's mtime for up to a second and make the piece look modified */
+  path = tr_torrentFindFile (tor, 0);
+  check (tr_sys_path_get_info (path, 0, &info, NULL));
+  while (tr_time () < info.last_modified_at)
+    tr_wait_msec (100);
+  tr_free (path);
+
+  /* a good piece passes... */
+  tor->info.pieces[0].timeChecked = 0;
+  check (tr_torrentPieceNeedsCheck (tor, 0));
+  check_piece_async (tor, 0);
+  check (!tr_torrentPieceNeedsCheck (tor, 0));
+  check (tr_torrentPieceIsComplete (tor, 0));
+
+  /* ...and a corrupt one is marked as missing */
+  path = tr_torrentFindFile (tor, 0);
+  fd = tr_sys_file_open (path, TR_SYS_FILE_WRITE, 0600, NULL);
+  check (fd != TR_BAD_SYS_FILE);
+  check (tr_sys_file_write (fd, "\1", 1, NULL, NULL));
+  tr_sys_file_close (fd, NULL);
+  tr_free (path);
+  tor->info.pieces[0].timeChecked = 0;
+  check_piece_async (tor, 0);
+  check (!tr_torrentPieceNeedsCheck (tor, 0));
+  check (!tr_torrentPieceIsComplete (tor, 0));
+
+  /* cleanup */
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+struct got_piece_test_data
+{
+  tr_torrent * tor;
+  tr_piece_index_t piece;
+  uint8_t pattern;
+  bool checking;
+};
+
+/* the second block reaches the disk before it's hashed,
+   so the piece has to be finished in the background */
+static void
+got_piece_threadfunc (void * vdata)
+{
+  tr_block_index_t first, last;
+  struct got_piece_test_data * data = vdata;
+  tr_torrent * tor = data->tor;
+  uint8_t * piece_data = tr_new0 (uint8_t, tor->info.pieceSize);
+
+  write_test_block (tor, data->piece, tor->blockSize, piece_data, data->pattern);
+  tr_cacheFlushTorrent (tor->session->cache, tor);
+  write_test_block (tor, data->piece, 0, piece_data, 0);
+
+  tr_torGetPieceBlockRange (tor, data->piece, &first, &last);
+  tr_torrentGotBlock (tor, first);
+  tr_torrentGotBlock (tor, last);
+  data->checking = tor->pieceChecks != NULL;
+
+  tr_free (piece_data);
+}
+
+static int
+test_got_piece_async (void)
+{
+  tr_session * session;
+  tr_torrent * tor;
+  struct got_piece_test_data data;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  libttest_blockingTorrentVerify (tor);
+  check_uint_eq (2, tor->blockCountInPiece);
+
+  /* the zeroes match the torrent's checksums... */
+  memset (&data, 0, sizeof (data));
+  data.tor = tor;
+  data.piece = 0;
+  tr_runInEventThread (session, got_piece_threadfunc, &data);
+  wait_for_piece_checks (tor);
+  check (data.checking);
+  check (tr_torrentPieceIsComplete (tor, 0));
+  check_uint_eq (0, tor->corruptCur);
+
+  /* ...and anything else doesn't */
+  data.piece = 1;
+  data.pattern = 1;
+  data.checking = false;
+  tr_runInEventThread (session, got_piece_threadfunc, &data);
+  wait_for_piece_checks (tor);
+  check (data.checking);
+  check (!tr_torrentPieceIsComplete (tor, 1));
+  check_uint_eq (tor->info.pieceSize, tor->corruptCur);
+
+  /* cleanup */
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+static tr_block_index_t
+get_block_sequential (tr_block_index_t i, tr_block_index_t n UNUSED)
+{
+  return i;
+}
+
+/* write the odd blocks after the even ones, so that runs get merged */
+static tr_block_index_t
+get_block_interleaved (tr_block_index_t i, tr_block_index_t n)
+{
+  const tr_block_index_t evens = (n + 1) / 2;
+  return i < evens ? i * 2 : (i - evens) * 2 + 1;
+}
+
+/* write the odd blocks first, so that in a small cache the second
+   half of each piece is flushed before the first half arrives */
+static tr_block_index_t
+get_block_odd_first (tr_block_index_t i, tr_block_index_t n)
+{
+  const tr_block_index_t odds = n / 2;
+  return i < odds ? i * 2 + 1 : (i - odds) * 2;
+}
+
+/* walk backwards, so that runs grow at their front */
+static tr_block_index_t
+get_block_reversed (tr_block_index_t i, tr_block_index_t n)
+{
+  return n - 1 - i;
+}
+
+/* jump around; only a permutation if n isn't a multiple of 7 */
+static tr_block_index_t
+get_block_scattered (tr_block_index_t i, tr_block_index_t n)
+{
+  return (i * 7) % n;
+}
+
+static int
+test_cache_runs (void)
+{
+  const int64_t cache_limit = 1024 * 1024 * 64;
+  int rv;
+
+  if ((rv = test_cache_order (get_block_sequential, cache_limit)))
+    return rv;
+  if ((rv = test_cache_order (get_block_interleaved, cache_limit)))
+    return rv;
+  if ((rv = test_cache_order (get_block_reversed, cache_limit)))
+    return rv;
+  if ((rv = test_cache_order (get_block_scattered, cache_limit)))
+    return rv;
+
+  return 0;
+}
+
+static int
+test_cache_trim (void)
+{
+  /* small enough to force flushes while the blocks are being written */
+  const int64_t cache_limit = MAX_BLOCK_SIZE * 8;
+  int rv;
+
+  if ((rv = test_cache_order (get_block_interleaved, cache_limit)))
+    return rv;
+  if ((rv = test_cache_order (get_block_scattered, cache_limit)))
+    return rv;
+  if ((rv = test_cache_order (get_block_odd_first, cache_limit)))
+    return rv;
+
+  return 0;
+}
+
+/* every block is written twice while the first copies are being flushed.
+   Whether a flush has started yet or not, only the second copy may be
+   read back or end up on disk */
+static void
+cache_rewrite_threadfunc (void * vdata)
+{
+  int pass;
+  tr_block_index_t i;
+  struct cache_test_data * data = vdata;
+  tr_torrent * tor = data->tor;
+  tr_cache * cache = data->session->cache;
+  uint8_t * block_buf = tr_new (uint8_t, tor->blockSize);
+  struct evbuffer * buf = evbuffer_new ();
+
+  tr_cacheSetLimit (cache, data->cache_limit);
+
+  for (pass=0; pass<2; ++pass)
+    {
+      for (i=0; i<tor->blockCount; ++i)
+        {
+          const uint32_t len = tr_torBlockCountBytes (tor, i);
+          const tr_piece_index_t piece = tr_torBlockPiece (tor, i);
+          const uint32_t offset = i * tor->blockSize - piece * tor->info.pieceSize;
+
+          memset (block_buf, pass == 0 ? ~block_pattern (i) : block_pattern (i), len);
+          evbuffer_add (buf, block_buf, len);
+          tr_cacheWriteBlock (cache, tor, piece, offset, len, buf);
+        }
+    }
+
+  for (i=0; i<tor->blockCount; ++i)
+    {
+      const tr_piece_index_t piece = tr_torBlockPiece (tor, i);
+      const uint32_t offset = i * tor->blockSize - piece * tor->info.pieceSize;
+      tr_cacheReadBlock (cache, tor, piece, offset, tr_torBlockCountBytes (tor, i), data->cached + i * tor->blockSize);
+    }
+
+  tr_cacheFlushTorrent (cache, tor);
+
+  for (i=0; i<tor->blockCount; ++i)
+    {
+      const tr_piece_index_t piece = tr_torBlockPiece (tor, i);
+      const uint32_t offset = i * tor->blockSize - piece * tor->info.pieceSize;
+      tr_ioRead (tor, piece, offset, tr_torBlockCountBytes (tor, i), data->flushed + i * tor->blockSize);
+    }
+
+  evbuffer_free (buf);
+  tr_free (block_buf);
+  data->done = true;
+}
+
+static int
+test_cache_rewrite (void)
+{
+  tr_block_index_t i;
+  tr_session * session;
+  tr_torrent * tor;
+  struct cache_test_data data;
+  uint8_t * expected;
+  size_t n;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+
+  n = (size_t)tor->blockCount * tor->blockSize;
+  expected = tr_new0 (uint8_t, n);
+  for (i=0; i<tor->blockCount; ++i)
+    memset (expected + i * tor->blockSize, block_pattern (i), tr_torBlockCountBytes (tor, i));
+
+  memset (&data, 0, sizeof (data));
+  data.session = session;
+  data.tor = tor;
+  data.cache_limit = MAX_BLOCK_SIZE * 2;
+  data.cached = tr_new0 (uint8_t, n);
+  data.flushed = tr_new0 (uint8_t, n);
+  tr_runInEventThread (session, cache_rewrite_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+
+  check (memcmp (expected, data.cached, n) == 0);
+  check (memcmp (expected, data.flushed, n) == 0);
+
+  /* cleanup */
+  tr_free (data.flushed);
+  tr_free (data.cached);
+  tr_free (expected);
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/* the blocks are on disk by the time an async flush calls back,
+   including the ones that were written again while it was running */
+static void
+onTorrentFlushed (tr_torrent * tor, int err, void * vdata)
+{
+  tr_block_index_t i;
+  struct cache_test_data * data = vdata;
+
+  if (err == 0)
+    {
+      for (i=0; i<tor->blockCount; ++i)
+        {
+          const tr_piece_index_t piece = tr_torBlockPiece (tor, i);
+          const uint32_t offset = i * tor->blockSize - piece * tor->info.pieceSize;
+          tr_ioRead (tor, piece, offset, tr_torBlockCountBytes (tor, i), data->flushed + i * tor->blockSize);
+        }
+    }
+
+  data->done = true;
+}
+
+static void
+cache_flush_async_threadfunc (void * vdata)
+{
+  int pass;
+  tr_block_index_t i;
+  struct cache_test_data * data = vdata;
+  tr_torrent * tor = data->tor;
+  tr_cache * cache = data->session->cache;
+  uint8_t * block_buf = tr_new (uint8_t, tor->blockSize);
+  struct evbuffer * buf = evbuffer_new ();
+
+  tr_cacheSetLimit (cache, data->cache_limit);
+
+  for (pass=0; pass<2; ++pass)
+    {
+      for (i=0; i<tor->blockCount; ++i)
+        {
+          const uint32_t len = tr_torBlockCountBytes (tor, i);
+          const tr_piece_index_t piece = tr_torBlockPiece (tor, i);
+          const uint32_t offset = i * tor->blockSize - piece * tor->info.pieceSize;
+
+          memset (block_buf, pass == 0 ? ~block_pattern (i) : block_pattern (i), len);
+          evbuffer_add (buf, block_buf, len);
+          tr_cacheWriteBlock (cache, tor, piece, offset, len, buf);
+        }
+    }
+
+  tr_cacheFlushTorrentAsync (cache, tor, onTorrentFlushed, data);
+
+  evbuffer_free (buf);
+  tr_free (block_buf);
+}
+
+static int
+test_cache_flush_async (void)
+{
+  tr_block_index_t i;
+  tr_session * session;
+  tr_torrent * tor;
+  struct cache_test_data data;
+  uint8_t * expected;
+  size_t n;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+
+  n = (size_t)tor->blockCount * tor->blockSize;
+  expected = tr_new0 (uint8_t, n);
+  for (i=0; i<tor->blockCount; ++i)
+    memset (expected + i * tor->blockSize, block_pattern (i), tr_torBlockCountBytes (tor, i));
+
+  memset (&data, 0, sizeof (data));
+  data.session = session;
+  data.tor = tor;
+  data.cache_limit = MAX_BLOCK_SIZE * 2;
+  data.flushed = tr_new0 (uint8_t, n);
+  tr_runInEventThread (session, cache_flush_async_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+
+  check (memcmp (expected, data.flushed, n) == 0);
+
+  /* cleanup */
+  tr_free (data.flushed);
+  tr_free (expected);
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/* a held torrent's blocks stay in the cache, and flushes of it
+   aren't called back until it's released */
+struct cache_hold_data
+{
+  struct cache_test_data * data;
+  bool held;
+  bool flushed_while_held;
+  bool holding_back;
+};
+
+static void
+onTorrentHeld (tr_torrent * tor UNUSED, int err, void * vhold)
+{
+  struct cache_hold_data * hold = vhold;
+
+  hold->held = err == 0;
+}
+
+static void
+cache_hold_threadfunc (void * vhold)
+{
+  tr_block_index_t i;
+  struct cache_hold_data * hold = vhold;
+  struct cache_test_data * data = hold->data;
+  tr_torrent * tor = data->tor;
+  tr_cache * cache = data->session->cache;
+  uint8_t * block_buf = tr_new (uint8_t, tor->blockSize);
+  struct evbuffer * buf = evbuffer_new ();
+
+  tr_cacheSetLimit (cache, data->cache_limit);
+  tr_cacheHoldTorrent (cache, tor, onTorrentHeld, hold);
+
+  for (i=0; i<tor->blockCount; ++i)
+    {
+      const uint32_t len = tr_torBlockCountBytes (tor, i);
+      const tr_piece_index_t piece = tr_torBlockPiece (tor, i);
+      const uint32_t offset = i * tor->blockSize - piece * tor->info.pieceSize;
+
+      memset (block_buf, block_pattern (i), len);
+      evbuffer_add (buf, block_buf, len);
+      tr_cacheWriteBlock (cache, tor, piece, offset, len, buf);
+    }
+
+  hold->holding_back = tr_cacheIsHoldingBack (cache, tor);
+  tr_cacheFlushTorrentAsync (cache, tor, onTorrentFlushed, data);
+  hold->flushed_while_held = data->done;
+
+  tr_cacheReleaseTorrent (cache, tor);
+
+  evbuffer_free (buf);
+  tr_free (block_buf);
+}
+
+static int
+test_cache_hold (void)
+{
+  tr_block_index_t i;
+  tr_session * session;
+  tr_torrent * tor;
+  struct cache_test_data data;
+  struct cache_hold_data hold;
+  uint8_t * expected;
+  size_t n;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+
+  n = (size_t)tor->blockCount * tor->blockSize;
+  expected = tr_new0 (uint8_t, n);
+  for (i=0; i<tor->blockCount; ++i)
+    memset (expected + i * tor->blockSize, block_pattern (i), tr_torBlockCountBytes (tor, i));
+
+  memset (&data, 0, sizeof (data));
+  data.session = session;
+  data.tor = tor;
+  data.cache_limit = MAX_BLOCK_SIZE * 2;
+  data.flushed = tr_new0 (uint8_t, n);
+  memset (&hold, 0, sizeof (hold));
+  hold.data = &data;
+  tr_runInEventThread (session, cache_hold_threadfunc, &hold);
+  do { tr_wait_msec (50); } while (!data.done);
+
+  check (hold.held);
+  check (hold.holding_back);
+  check (!hold.flushed_while_held);
+  check (memcmp (expected, data.flushed, n) == 0);
+
+  /* cleanup */
+  tr_free (data.flushed);
+  tr_free (expected);
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/* the files are preallocated in the background while the
+   blocks are written, so the writes have to wait for that */
+static int
+test_cache_preallocate_full (void)
+{
+  const int64_t cache_limit = MAX_BLOCK_SIZE * 8;
+  int rv;
+
+  if ((rv = test_cache_order_impl (get_block_scattered, cache_limit, TR_PREALLOCATE_FULL)))
+    return rv;
+  if ((rv = test_cache_order_impl (get_block_sequential, 1024 * 1024 * 64, TR_PREALLOCATE_FULL)))
+    return rv;
+
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_cache_runs,
+                             test_cache_trim,
+                             test_cache_preallocate_full,
+                             test_cache_rewrite,
+                             test_cache_flush_async,
+                             test_cache_hold,
+                             test_read_cache,
+                             test_piece_hash,
+                             test_check_piece_async,
+                             test_got_piece_async };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
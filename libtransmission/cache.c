@@ -7,15 +7,21 @@
  * $Id: cache.c 14644 2015-12-29 19:37:31Z mikedld $
  */
 
+#include <errno.h> /* ECANCELED */
 #include <stdlib.h> /* qsort () */
+#include <string.h> /* memcpy () */
 
 #include <event2/buffer.h>
 
 #include "transmission.h"
 #include "cache.h"
+#include "crypto-utils.h" /* tr_sha1_init () */
+#include "disk-io.h"
+#include "file.h" /* tr_sys_path_get_device (), tr_sys_iovec */
 #include "inout.h"
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
+#include "platform.h" /* tr_lock */
 #include "ptrarray.h"
 #include "torrent.h"
 #include "trevent.h"
@@ -35,82 +41,485 @@
 *****
 ****/
 
-struct cache_block
+struct cache_run;
+
+/* what the block tables are keyed by. Must be the first member of
+ * the structs stored in them so that a key can be cast back to them */
+struct block_key
 {
   tr_torrent * tor;
+  tr_block_index_t block;
+  struct block_key * hash_next; /* next entry in the same hash bucket */
+};
+
+/* a hash table of blocks, keyed by torrent and block index */
+struct block_table
+{
+  struct block_key ** buckets;
+  size_t bucket_count;
+  int count;
+};
+
+/* a block that's been written by a peer but not flushed to disk yet */
+struct cache_block
+{
+  struct block_key key;
 
   tr_piece_index_t piece;
   uint32_t offset;
   uint32_t length;
 
   time_t time;
-  tr_block_index_t block;
 
   struct evbuffer * evbuf;
+
+  struct cache_run * run;         /* the contiguous run this block is in */
+  struct cache_block * prev;      /* previous block in the run */
+  struct cache_block * next;      /* next block in the run */
+
+  struct cache_flush * flush;     /* the flush that's writing this block */
+};
+
+/* a run of contiguous blocks of one torrent.
+ * Runs are kept up-to-date as blocks are added, so deciding
+ * what to flush doesn't require a scan of the whole cache. */
+struct cache_run
+{
+  struct cache_torrent * ct;
+
+  struct cache_block * first;
+  struct cache_block * last;
+  int len;
+
+  time_t time; /* when a block was last added to the run */
+};
+
+/* a torrent's runs, sorted by block index */
+struct cache_torrent
+{
+  tr_torrent * tor;
+  tr_ptrArray runs;
+  uint64_t device; /* where the torrent's files are; 0 if unknown */
+};
+
+/* a run of blocks that's been handed to the disk I/O threads.
+ * The blocks are written straight from their evbuffers and
+ * stay readable until the write is finished.
+ *
+ * A block that's written again before the write starts is changed in
+ * place. After that, the new copy waits in `newer' and goes back into
+ * the cache when the write is done, so the old copy can't land on disk
+ * after it. */
+struct cache_flush
+{
+  tr_cache * cache;
+  tr_torrent * tor;
+
+  tr_block_index_t first_block;
+  tr_block_index_t last_block;
+
+  struct cache_block ** blocks; /* indexed by block - first_block */
+  struct cache_block ** newer;  /* likewise; NULL until it's needed */
+
+  bool started; /* set by the disk I/O thread; guarded by cache->flush_lock */
+
+  uint64_t started_usec;
+
+  struct cache_flush * prev; /* in cache->flushes */
+  struct cache_flush * next;
+};
+
+enum waiter_type
+{
+  WAIT_FOR_RANGE,   /* tr_cacheFlushFileAsync () */
+  WAIT_FOR_TORRENT, /* tr_cacheFlushTorrentAsync () */
+  WAIT_FOR_HOLD     /* tr_cacheHoldTorrent () */
+};
+
+/* someone who's waiting for a range of a torrent's blocks to be on disk.
+ * It's checked each time a flush is done, and called back once none of
+ * the flushes that are still running touch its range.
+ *
+ * While a torrent is held, its new blocks aren't flushed, so only the
+ * hold's own waiter is called back until it's released. */
+struct cache_waiter
+{
+  tr_torrent * tor;
+
+  tr_block_index_t first_block;
+  tr_block_index_t last_block;
+  enum waiter_type type;
+
+  int err;
+  int requeued_blocks; /* cache->requeued_blocks when it last flushed */
+
+  tr_io_done_func done_func;
+  void * user_data;
+
+  struct cache_waiter * next;
+};
+
+/* a clean copy of a block that was read from disk.
+ *
+ * These are kept in a segmented LRU: blocks start out in the probationary
+ * segment and move to the protected one when they're read again. A peer
+ * that reads through a whole torrent once only churns the probationary
+ * segment and can't push out the blocks that many peers keep asking for. */
+struct read_block
+{
+  struct block_key key;
+
+  uint32_t length;
+  bool is_protected;
+
+  struct read_block * prev; /* more recently used */
+  struct read_block * next; /* less recently used */
+
+  uint8_t * data;
+};
+
+/* the SHA-1 of a piece that's being downloaded. Its blocks are hashed
+ * in order as they're written to the cache, so checking the piece when
+ * it's done doesn't need to read it back. Blocks that arrive out of
+ * order wait in the cache until the ones before them are hashed. */
+struct piece_hash
+{
+  struct block_key key; /* key.block is the piece's index */
+
+  tr_sha1_ctx_t sha;
+  uint32_t offset; /* how much of the piece has been hashed */
+};
+
+struct read_lru
+{
+  struct read_block * head; /* most recently used */
+  struct read_block * tail; /* least recently used */
+  int count;
 };
 
 struct tr_cache
 {
-  tr_ptrArray blocks;
+  struct block_table blocks;
+  int run_count;
+
+  tr_ptrArray torrents; /* struct cache_torrent, sorted by torrent id */
+  struct block_table flushing; /* blocks that are being written to disk */
+  struct cache_flush * flushes; /* the flushes that are running */
+  tr_lock * flush_lock;
+  int requeued_blocks; /* blocks put back by onFlushDone () */
+
+  struct cache_waiter * waiters;
+  bool is_checking_waiters;
+
+  tr_ptrArray held; /* tr_torrent *, whose new blocks stay in memory */
   int max_blocks;
   size_t max_bytes;
 
-  size_t disk_writes;
-  size_t disk_write_bytes;
-  size_t cache_writes;
-  size_t cache_write_bytes;
+  struct block_table read_blocks;
+  struct read_lru probation;
+  struct read_lru protected;
+  int max_read_blocks;
+  size_t max_read_bytes;
+
+  uint64_t read_hits;
+  uint64_t read_misses;
+
+  struct block_table piece_hashes;
+  uint64_t hashed_pieces;
+  uint64_t rehashed_pieces;
+
+  uint64_t disk_writes;
+  uint64_t disk_write_blocks;
+  uint64_t disk_write_bytes;
+  uint64_t disk_write_usec;
+  uint64_t cache_writes;
+  uint64_t cache_write_bytes;
 };
 
 /****
-*****
+*****  Block index
 ****/
 
-struct run_info
+enum
 {
-  int pos;
-  int rank;
-  time_t last_block_time;
-  bool is_multi_piece;
-  bool is_piece_done;
-  unsigned int len;
+  MIN_BUCKET_COUNT = 256
 };
 
+static inline size_t
+hashBlock (const tr_torrent * tor, tr_block_index_t block)
+{
+  uint32_t h = ((uint32_t)tor->uniqueId * 0x9E3779B1u) ^ block;
+
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+
+  return h;
+}
+
+static void *
+tableFind (const struct block_table * table, const tr_torrent * tor, tr_block_index_t block)
+{
+  struct block_key * key = NULL;
+
+  if (table->bucket_count != 0)
+    for (key=table->buckets[hashBlock (tor, block) & (table->bucket_count - 1)]; key!=NULL; key=key->hash_next)
+      if (key->block == block && key->tor == tor)
+        break;
+
+  return key;
+}
+
+static void
+tableResize (struct block_table * table, size_t bucket_count)
+{
+  size_t i;
+  struct block_key ** buckets = tr_new0 (struct block_key *, bucket_count);
+
+  for (i=0; i<table->bucket_count; ++i)
+    {
+      struct block_key * key = table->buckets[i];
+
+      while (key != NULL)
+        {
+          struct block_key * next = key->hash_next;
+          const size_t bucket = hashBlock (key->tor, key->block) & (bucket_count - 1);
+          key->hash_next = buckets[bucket];
+          buckets[bucket] = key;
+          key = next;
+        }
+    }
+
+  tr_free (table->buckets);
+  table->buckets = buckets;
+  table->bucket_count = bucket_count;
+}
+
+static void
+tableInsert (struct block_table * table, struct block_key * key)
+{
+  size_t bucket;
+
+  if ((size_t)table->count >= table->bucket_count)
+    tableResize (table, MAX (MIN_BUCKET_COUNT, table->bucket_count * 2));
+
+  bucket = hashBlock (key->tor, key->block) & (table->bucket_count - 1);
+  key->hash_next = table->buckets[bucket];
+  table->buckets[bucket] = key;
+  ++table->count;
+}
+
+static void
+tableRemove (struct block_table * table, struct block_key * key)
+{
+  struct block_key ** walk = &table->buckets[hashBlock (key->tor, key->block) & (table->bucket_count - 1)];
 
-/* return a count of how many contiguous blocks there are starting at this pos */
+  while (*walk != key)
+    walk = &(*walk)->hash_next;
+
+  *walk = key->hash_next;
+  key->hash_next = NULL;
+  --table->count;
+}
+
+static void
+tableDestruct (struct block_table * table)
+{
+  assert (table->count == 0);
+  tr_free (table->buckets);
+}
+
+/****
+*****  Runs
+****/
+
+static int
+compareTorrents (const void * va, const void * vb)
+{
+  const struct cache_torrent * a = va;
+  const struct cache_torrent * b = vb;
+
+  if (a->tor->uniqueId != b->tor->uniqueId)
+    return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
+
+  return 0;
+}
+
+/* runs never overlap, so sorting them by their first block is enough */
 static int
-getBlockRun (const tr_cache * cache, int pos, struct run_info * info)
+compareRunsByBlock (const void * va, const void * vb)
+{
+  const struct cache_run * a = va;
+  const struct cache_run * b = vb;
+
+  if (a->first->key.block != b->first->key.block)
+    return a->first->key.block < b->first->key.block ? -1 : 1;
+
+  return 0;
+}
+
+static struct cache_torrent *
+findTorrent (tr_cache * cache, tr_torrent * tor)
+{
+  struct cache_torrent key;
+  key.tor = tor;
+  return tr_ptrArrayFindSorted (&cache->torrents, &key, compareTorrents);
+}
+
+static struct cache_torrent *
+getTorrent (tr_cache * cache, tr_torrent * tor)
+{
+  struct cache_torrent * ct = findTorrent (cache, tor);
+
+  if (ct == NULL)
+    {
+      ct = tr_new0 (struct cache_torrent, 1);
+      ct->tor = tor;
+      ct->runs = TR_PTR_ARRAY_INIT;
+
+      if (tor->currentDir == NULL || !tr_sys_path_get_device (tor->currentDir, &ct->device, NULL))
+        ct->device = 0;
+      tr_ptrArrayInsertSorted (&cache->torrents, ct, compareTorrents);
+    }
+
+  return ct;
+}
+
+/* the torrent's position in cache->held, or -1 */
+static int
+findHeld (const tr_cache * cache, const tr_torrent * tor)
 {
   int i;
-  const int n = tr_ptrArraySize (&cache->blocks);
-  const struct cache_block * const * blocks = (const struct cache_block* const *) tr_ptrArrayBase (&cache->blocks);
-  const struct cache_block * ref = blocks[pos];
-  tr_block_index_t block = ref->block;
+  void * const * held = tr_ptrArrayBase (&cache->held);
+  const int n = tr_ptrArraySize (&cache->held);
 
-  for (i=pos; i<n; ++i, ++block)
+  for (i=0; i<n; ++i)
+    if (held[i] == tor)
+      return i;
+
+  return -1;
+}
+
+static inline bool
+isHeld (const tr_cache * cache, const tr_torrent * tor)
+{
+  return !tr_ptrArrayEmpty (&cache->held) && findHeld (cache, tor) >= 0;
+}
+
+static void
+removeRun (tr_cache * cache, struct cache_run * run)
+{
+  struct cache_torrent * ct = run->ct;
+
+  tr_ptrArrayRemoveSortedPointer (&ct->runs, run, compareRunsByBlock);
+  --cache->run_count;
+  tr_free (run);
+
+  if (tr_ptrArrayEmpty (&ct->runs))
     {
-      const struct cache_block * b = blocks[i];
-      if (b->block != block)
-        break;
-      if (b->tor != ref->tor)
-        break;
-      //fprintf (stderr, "pos %d tor %d block %zu time %zu\n", i, b->tor->uniqueId, (size_t)b->block, (size_t)b->time);
+      tr_ptrArrayRemoveSortedPointer (&cache->torrents, ct, compareTorrents);
+      tr_ptrArrayDestruct (&ct->runs, NULL);
+      tr_free (ct);
     }
+}
+
+/* join two adjacent runs, keeping the bigger one so that fewer
+ * blocks need to be told which run they're in now */
+static void
+mergeRuns (tr_cache * cache, struct cache_run * left, struct cache_run * right)
+{
+  struct cache_block * cb;
+  struct cache_run * keep = left->len >= right->len ? left : right;
+  struct cache_run * drop = keep == left ? right : left;
+
+  assert (left->ct == right->ct);
+  assert (left->last->key.block + 1 == right->first->key.block);
+
+  /* take it out of the sorted list before `keep's first block changes */
+  tr_ptrArrayRemoveSortedPointer (&drop->ct->runs, drop, compareRunsByBlock);
+  --cache->run_count;
+
+  for (cb=drop->first; cb!=NULL; cb=cb->next)
+    cb->run = keep;
+
+  left->last->next = right->first;
+  right->first->prev = left->last;
+  keep->first = left->first;
+  keep->last = right->last;
+  keep->len = left->len + right->len;
+  keep->time = MAX (left->time, right->time);
+
+  tr_free (drop);
+}
+
+/* add a new block to the cache, joining it to its neighbours' runs */
+static void
+addBlock (tr_cache * cache, struct cache_block * cb)
+{
+  struct cache_block * prev = cb->key.block > 0 ? tableFind (&cache->blocks, cb->key.tor, cb->key.block - 1) : NULL;
+  struct cache_block * next = tableFind (&cache->blocks, cb->key.tor, cb->key.block + 1);
+
+  tableInsert (&cache->blocks, &cb->key);
 
-  //fprintf (stderr, "run is %d long from [%d to %d)\n", (int)(i-pos), i, (int)pos);
+  cb->prev = NULL;
+  cb->next = NULL;
 
-  if (info != NULL)
+  if (prev != NULL)
     {
-      const struct cache_block * b = blocks[i-1];
-      info->last_block_time = b->time;
-      info->is_piece_done = tr_torrentPieceIsComplete (b->tor, b->piece);
-      info->is_multi_piece = b->piece != blocks[pos]->piece;
-      info->len = i - pos;
-      info->pos = pos;
+      struct cache_run * run = prev->run;
+
+      assert (run->last == prev);
+      prev->next = cb;
+      cb->prev = prev;
+      cb->run = run;
+      run->last = cb;
+      ++run->len;
+
+      if (next != NULL)
+        mergeRuns (cache, run, next->run);
+    }
+  else if (next != NULL)
+    {
+      /* prepending doesn't change the run's place among the torrent's runs */
+      struct cache_run * run = next->run;
+
+      assert (run->first == next);
+      next->prev = cb;
+      cb->next = next;
+      cb->run = run;
+      run->first = cb;
+      ++run->len;
+    }
+  else
+    {
+      struct cache_run * run = tr_new0 (struct cache_run, 1);
+
+      run->ct = getTorrent (cache, cb->key.tor);
+      run->first = cb;
+      run->last = cb;
+      run->len = 1;
+      cb->run = run;
+      tr_ptrArrayInsertSorted (&run->ct->runs, run, compareRunsByBlock);
+      ++cache->run_count;
     }
 
-  return i-pos;
+  cb->run->time = MAX (cb->run->time, cb->time);
 }
 
+/****
+*****
+****/
+
+struct run_info
+{
+  struct cache_run * run;
+  int rank;
+  time_t last_block_time;
+  bool is_multi_piece;
+  bool is_piece_done;
+  unsigned int len;
+};
+
 /* higher rank comes before lower rank */
 static int
 compareRuns (const void * va, const void * vb)
@@ -129,89 +538,228 @@ enum
 
 /* Calculte runs
  *   - Stale runs, runs sitting in cache for a long time or runs not growing, get priority.
+ *   - The runs of held torrents are left out.
  *     Returns number of runs.
  */
 static int
 calcRuns (tr_cache * cache, struct run_info * runs)
 {
-  const int n = tr_ptrArraySize (&cache->blocks);
-  int i = 0, pos;
+  int i = 0;
+  int t;
+  const int torrent_count = tr_ptrArraySize (&cache->torrents);
   const time_t now = tr_time ();
 
-  for (pos = 0; pos < n; pos += runs[i++].len)
+  for (t=0; t<torrent_count; ++t)
     {
-      int rank = getBlockRun (cache, pos, &runs[i]);
+      int r;
+      struct cache_torrent * ct = tr_ptrArrayNth (&cache->torrents, t);
+      const int run_count = tr_ptrArraySize (&ct->runs);
+
+      if (isHeld (cache, ct->tor))
+        continue;
 
-      /* This adds ~2 to the relative length of a run for every minute it has
-       * languished in the cache. */
-      rank += (now - runs[i].last_block_time) / 32;
+      for (r=0; r<run_count; ++r, ++i)
+        {
+          int rank;
+          struct cache_run * run = tr_ptrArrayNth (&ct->runs, r);
 
-      /* Flushing stale blocks should be a top priority as the probability of them
-       * growing is very small, for blocks on piece boundaries, and nonexistant for
-       * blocks inside pieces. */
-      rank |= runs[i].is_piece_done ? DONEFLAG : 0;
+          runs[i].run = run;
+          runs[i].len = run->len;
+          runs[i].last_block_time = run->time;
+          runs[i].is_piece_done = tr_torrentPieceIsComplete (ct->tor, run->last->piece);
+          runs[i].is_multi_piece = run->first->piece != run->last->piece;
 
-      /* Move the multi piece runs higher */
-      rank |= runs[i].is_multi_piece ? MULTIFLAG : 0;
+          rank = run->len;
 
-      runs[i].rank = rank;
+          /* This adds ~2 to the relative length of a run for every minute it has
+           * languished in the cache. */
+          rank += (now - runs[i].last_block_time) / 32;
 
-      //fprintf (stderr,"block run at pos %d of length %d and age %ld adjusted +%d\n",runs[i].pos,runs[i].len,now-runs[i].last_block_time,rank-runs[i].len);
+          /* Flushing stale blocks should be a top priority as the probability of them
+           * growing is very small, for blocks on piece boundaries, and nonexistant for
+           * blocks inside pieces. */
+          rank |= runs[i].is_piece_done ? DONEFLAG : 0;
+
+          /* Move the multi piece runs higher */
+          rank |= runs[i].is_multi_piece ? MULTIFLAG : 0;
+
+          runs[i].rank = rank;
+        }
     }
 
-  //fprintf (stderr, "%d block runs\n", i);
+  assert (i <= cache->run_count);
+
   qsort (runs, i, sizeof (struct run_info), compareRuns);
   return i;
 }
 
+/* called in a disk I/O thread */
+static void
+onFlushStart (void * vflush)
+{
+  struct cache_flush * flush = vflush;
+  tr_lock * lock = flush->cache->flush_lock;
+
+  tr_lockLock (lock);
+  flush->started = true;
+  tr_lockUnlock (lock);
+}
+
+static void
+freeBlock (struct cache_block * cb)
+{
+  evbuffer_free (cb->evbuf);
+  tr_free (cb);
+}
+
+static void checkWaiters (tr_cache * cache);
+
+static void
+onFlushDone (tr_torrent * tor UNUSED, int err, void * vflush)
+{
+  tr_block_index_t b;
+  struct cache_flush * flush = vflush;
+  tr_cache * cache = flush->cache;
+
+  cache->disk_write_usec += tr_time_usec () - flush->started_usec;
+
+  if (flush->prev != NULL)
+    flush->prev->next = flush->next;
+  else
+    cache->flushes = flush->next;
+  if (flush->next != NULL)
+    flush->next->prev = flush->prev;
+
+  /* write errors have already been reported by inout.c */
+  for (b=0; b<=flush->last_block-flush->first_block; ++b)
+    {
+      tableRemove (&cache->flushing, &flush->blocks[b]->key);
+      freeBlock (flush->blocks[b]);
+
+      /* the blocks that were written again while this flush was
+       * running go back into the cache to be flushed later */
+      if (flush->newer != NULL && flush->newer[b] != NULL)
+        {
+          if (err == ECANCELED)
+            {
+              freeBlock (flush->newer[b]);
+            }
+          else
+            {
+              addBlock (cache, flush->newer[b]);
+              ++cache->requeued_blocks;
+            }
+        }
+    }
+
+  tr_free (flush->newer);
+  tr_free (flush->blocks);
+  tr_free (flush);
+
+  if (cache->waiters != NULL)
+    checkWaiters (cache);
+}
+
+/* write out a run and remove its blocks from the cache */
 static int
-flushContiguous (tr_cache * cache, int pos, int n)
+flushRun (tr_cache * cache, struct cache_run * run)
 {
   int i;
   int err = 0;
-  uint8_t * buf = tr_new (uint8_t, n * MAX_BLOCK_SIZE);
-  uint8_t * walk = buf;
-  struct cache_block ** blocks = (struct cache_block**) tr_ptrArrayBase (&cache->blocks);
-
-  struct cache_block * b = blocks[pos];
-  tr_torrent * tor = b->tor;
+  size_t n;
+  size_t vec_count = 0;
+  uint32_t length = 0;
+  struct evbuffer_iovec * chunks;
+  tr_sys_iovec * vecs;
+  struct cache_flush * flush = tr_new0 (struct cache_flush, 1);
+
+  struct cache_block * b = run->first;
+  tr_torrent * tor = b->key.tor;
   const tr_piece_index_t piece = b->piece;
   const uint32_t offset = b->offset;
+  const int block_count = run->len;
+
+  flush->cache = cache;
+  flush->tor = tor;
+  flush->first_block = run->first->key.block;
+  flush->last_block = run->last->key.block;
+  flush->blocks = tr_new (struct cache_block *, block_count);
+  flush->started_usec = tr_time_usec ();
+
+  flush->next = cache->flushes;
+  if (flush->next != NULL)
+    flush->next->prev = flush;
+  cache->flushes = flush;
+
+  /* the run's blocks are its sort key, so remove it first */
+  removeRun (cache, run);
 
-  for (i=pos; i<pos+n; ++i)
+  /* the blocks stay findable by their key while they're being written */
+  for (i=0; i<block_count; ++i, b=b->next)
     {
-      b = blocks[i];
-      evbuffer_copyout (b->evbuf, walk, b->length);
-      walk += b->length;
-      evbuffer_free (b->evbuf);
-      tr_free (b);
+      tableRemove (&cache->blocks, &b->key);
+      tableInsert (&cache->flushing, &b->key);
+      b->flush = flush;
+      flush->blocks[i] = b;
+      vec_count += evbuffer_peek (b->evbuf, -1, NULL, NULL, 0);
+      length += b->length;
     }
-  tr_ptrArrayErase (&cache->blocks, pos, pos+n);
 
-  err = tr_ioWrite (tor, piece, offset, walk-buf, buf);
-  tr_free (buf);
+  /* write the blocks straight from their evbuffers' memory */
+  chunks = tr_new (struct evbuffer_iovec, vec_count);
+  vecs = tr_new (tr_sys_iovec, vec_count);
+  for (i=0, n=0; i<block_count; ++i)
+    n += evbuffer_peek (flush->blocks[i]->evbuf, -1, NULL, chunks + n, vec_count - n);
+  for (n=0; n<vec_count; ++n)
+    {
+      vecs[n].base = chunks[n].iov_base;
+      vecs[n].length = chunks[n].iov_len;
+    }
+
+  /* the write finishes in the background;
+   * until then, tr_cacheReadBlock () reads from flush->blocks */
+  err = tr_ioWriteVecAsync (tor, piece, offset, length, vecs, vec_count, onFlushStart, onFlushDone, flush);
+  if (err)
+    onFlushDone (tor, err, flush);
+
+  tr_free (vecs);
+  tr_free (chunks);
 
   ++cache->disk_writes;
-  cache->disk_write_bytes += walk-buf;
+  cache->disk_write_blocks += block_count;
+  cache->disk_write_bytes += length;
   return err;
 }
 
+/* runs on the same device are flushed in the order they are on disk,
+ * so that a batch of flushes doesn't make the disk seek back and forth */
+static int
+compareRunsByPosition (const void * va, const void * vb)
+{
+  const struct run_info * a = va;
+  const struct run_info * b = vb;
+  const struct cache_torrent * act = a->run->ct;
+  const struct cache_torrent * bct = b->run->ct;
+
+  if (act->device != bct->device)
+    return act->device < bct->device ? -1 : 1;
+
+  if (act != bct)
+    return compareTorrents (act, bct);
+
+  return compareRunsByBlock (a->run, b->run);
+}
+
 static int
 flushRuns (tr_cache * cache, struct run_info * runs, int n)
 {
   int i;
   int err = 0;
 
-  for (i=0; !err && i<n; i++)
-    {
-      int j;
-
-      err = flushContiguous (cache, runs[i].pos, runs[i].len);
+  qsort (runs, n, sizeof (struct run_info), compareRunsByPosition);
 
-      for (j=i+1; j<n; j++)
-        if (runs[j].pos > runs[i].pos)
-          runs[j].pos -= runs[i].len;
-    }
+  for (i=0; !err && i<n; i++)
+    err = flushRun (cache, runs[i].run);
 
   return err;
 }
@@ -221,22 +769,401 @@ cacheTrim (tr_cache * cache)
 {
   int err = 0;
 
-  if (tr_ptrArraySize (&cache->blocks) > cache->max_blocks)
+  if (cache->blocks.count > cache->max_blocks)
     {
       /* Amount of cache that should be removed by the flush. This influences how large
        * runs can grow as well as how often flushes will happen. */
       const int cacheCutoff = 1 + cache->max_blocks / 4;
-      struct run_info * runs = tr_new (struct run_info, tr_ptrArraySize (&cache->blocks));
+      struct run_info * runs = tr_new (struct run_info, cache->run_count);
       int i=0, j=0;
+      const int n = calcRuns (cache, runs);
+
+      while (i < n && j < cacheCutoff)
+        j += runs[i++].len;
+      err = flushRuns (cache, runs, i);
+      tr_free (runs);
+    }
+
+  return err;
+}
+
+/***
+****
+***/
+
+static struct cache_block *
+findBlock (tr_cache           * cache,
+           tr_torrent         * torrent,
+           tr_piece_index_t     piece,
+           uint32_t             offset)
+{
+  return tableFind (&cache->blocks, torrent, _tr_block (torrent, piece, offset));
+}
+
+static struct cache_flush *
+findFlush (tr_cache         * cache,
+           tr_torrent       * torrent,
+           tr_block_index_t   block)
+{
+  const struct cache_block * cb = tableFind (&cache->flushing, torrent, block);
+
+  return cb != NULL ? cb->flush : NULL;
+}
+
+/* the newest copy of a block that's being flushed */
+static struct cache_block *
+flushGetBlock (const struct cache_flush * flush, tr_block_index_t block)
+{
+  const size_t i = block - flush->first_block;
+
+  if (flush->newer != NULL && flush->newer[i] != NULL)
+    return flush->newer[i];
+
+  return flush->blocks[i];
+}
+
+/* if the block is in the cache, copy it into setme and return true */
+static bool
+copyFromCache (tr_cache         * cache,
+               tr_torrent       * torrent,
+               tr_piece_index_t   piece,
+               uint32_t           offset,
+               uint32_t           len,
+               uint8_t          * setme)
+{
+  struct cache_block * cb;
+  struct cache_flush * flush;
+
+  if ((cb = findBlock (cache, torrent, piece, offset)))
+    {
+      evbuffer_copyout (cb->evbuf, setme, len);
+      return true;
+    }
+
+  if ((flush = findFlush (cache, torrent, _tr_block (torrent, piece, offset))))
+    {
+      cb = flushGetBlock (flush, _tr_block (torrent, piece, offset));
+
+      if (len <= cb->length)
+        {
+          evbuffer_copyout (cb->evbuf, setme, len);
+          return true;
+        }
+    }
+
+  return false;
+}
+
+/****
+*****  Piece hashes
+****/
+
+/* a block that's in memory, either in the cache or being flushed */
+static struct cache_block *
+findCachedBlock (tr_cache * cache, tr_torrent * torrent, tr_block_index_t block)
+{
+  struct cache_block * cb;
+  struct cache_flush * flush;
+
+  if ((cb = tableFind (&cache->blocks, torrent, block)) == NULL)
+    if ((flush = findFlush (cache, torrent, block)) != NULL)
+      cb = flushGetBlock (flush, block);
+
+  return cb;
+}
+
+/* the disk I/O threads might be writing from the evbuffer,
+ * so it's only peeked at, not pulled up */
+static void
+hashEvbuffer (tr_sha1_ctx_t sha, struct evbuffer * buf, size_t len)
+{
+  int i;
+  const int n = evbuffer_peek (buf, len, NULL, NULL, 0);
+  struct evbuffer_iovec * iovec = tr_new (struct evbuffer_iovec, n);
+
+  evbuffer_peek (buf, len, NULL, iovec, n);
+
+  for (i=0; i<n && len>0; ++i)
+    {
+      const size_t chunk = MIN (iovec[i].iov_len, len);
+      tr_sha1_update (sha, iovec[i].iov_base, chunk);
+      len -= chunk;
+    }
+
+  tr_free (iovec);
+}
+
+static void
+pieceHashFree (tr_cache * cache, struct piece_hash * ph)
+{
+  tableRemove (&cache->piece_hashes, &ph->key);
+  tr_sha1_final (ph->sha, NULL);
+  tr_free (ph);
+}
+
+/* hash as many of the piece's next blocks as are in memory */
+static void
+pieceHashUpdate (tr_cache * cache, struct piece_hash * ph)
+{
+  tr_torrent * tor = ph->key.tor;
+  const tr_piece_index_t piece = ph->key.block;
+  const uint32_t piece_size = tr_torPieceCountBytes (tor, piece);
+
+  while (ph->offset < piece_size)
+    {
+      const struct cache_block * cb = findCachedBlock (cache, tor, _tr_block (tor, piece, ph->offset));
+
+      if (cb == NULL || cb->piece != piece || cb->offset != ph->offset)
+        break;
+
+      hashEvbuffer (ph->sha, cb->evbuf, cb->length);
+      ph->offset += cb->length;
+    }
+}
+
+static void
+pieceHashBlockWritten (tr_cache * cache, tr_torrent * torrent, tr_piece_index_t piece, uint32_t offset)
+{
+  struct piece_hash * ph = tableFind (&cache->piece_hashes, torrent, piece);
+
+  /* a block that's been hashed has changed, e.g. because the
+     piece failed its check and is being downloaded again */
+  if (ph != NULL && offset < ph->offset)
+    {
+      pieceHashFree (cache, ph);
+      ph = NULL;
+    }
+
+  if (ph == NULL && offset == 0)
+    {
+      ph = tr_new0 (struct piece_hash, 1);
+      ph->key.tor = torrent;
+      ph->key.block = piece;
+      ph->sha = tr_sha1_init ();
+      tableInsert (&cache->piece_hashes, &ph->key);
+    }
+
+  if (ph != NULL && offset == ph->offset)
+    pieceHashUpdate (cache, ph);
+}
+
+static void
+pieceHashRemove (tr_cache * cache, tr_torrent * torrent, tr_piece_index_t piece)
+{
+  struct piece_hash * ph = tableFind (&cache->piece_hashes, torrent, piece);
+
+  if (ph != NULL)
+    pieceHashFree (cache, ph);
+}
+
+/* torrent is NULL to remove them all */
+static void
+pieceHashRemoveTorrent (tr_cache * cache, tr_torrent * torrent)
+{
+  size_t i;
+
+  for (i=0; i<cache->piece_hashes.bucket_count; ++i)
+    {
+      struct block_key * key = cache->piece_hashes.buckets[i];
+
+      while (key != NULL)
+        {
+          struct block_key * next = key->hash_next;
+          if (torrent == NULL || key->tor == torrent)
+            pieceHashFree (cache, (struct piece_hash *) key);
+          key = next;
+        }
+    }
+}
+
+/****
+*****  Read cache
+****/
+
+enum
+{
+  /* how much of the read cache can be used by blocks that were read twice */
+  READ_PROTECTED_PERCENT = 80
+};
+
+static void
+lruRemove (struct read_lru * lru, struct read_block * rb)
+{
+  if (rb->prev != NULL)
+    rb->prev->next = rb->next;
+  else
+    lru->head = rb->next;
+
+  if (rb->next != NULL)
+    rb->next->prev = rb->prev;
+  else
+    lru->tail = rb->prev;
+
+  rb->prev = rb->next = NULL;
+  --lru->count;
+}
+
+static void
+lruPushHead (struct read_lru * lru, struct read_block * rb)
+{
+  rb->prev = NULL;
+  rb->next = lru->head;
+
+  if (lru->head != NULL)
+    lru->head->prev = rb;
+  else
+    lru->tail = rb;
+
+  lru->head = rb;
+  ++lru->count;
+}
+
+static inline struct read_lru *
+getLru (tr_cache * cache, const struct read_block * rb)
+{
+  return rb->is_protected ? &cache->protected : &cache->probation;
+}
+
+static void
+readCacheEvict (tr_cache * cache, struct read_block * rb)
+{
+  lruRemove (getLru (cache, rb), rb);
+  tableRemove (&cache->read_blocks, &rb->key);
+  tr_free (rb->data);
+  tr_free (rb);
+}
+
+static void
+readCacheTrim (tr_cache * cache)
+{
+  const int max_protected = (int)((int64_t)cache->max_read_blocks * READ_PROTECTED_PERCENT / 100);
+
+  while (cache->protected.count > max_protected)
+    {
+      struct read_block * rb = cache->protected.tail;
+      lruRemove (&cache->protected, rb);
+      rb->is_protected = false;
+      lruPushHead (&cache->probation, rb);
+    }
+
+  while (cache->read_blocks.count > cache->max_read_blocks)
+    readCacheEvict (cache, cache->probation.tail != NULL ? cache->probation.tail
+                                                         : cache->protected.tail);
+}
+
+/* a block that's read again gets promoted to the protected segment */
+static void
+readCacheTouch (tr_cache * cache, struct read_block * rb)
+{
+  lruRemove (getLru (cache, rb), rb);
+
+  if (!rb->is_protected)
+    {
+      rb->is_protected = true;
+      lruPushHead (&cache->protected, rb);
+      readCacheTrim (cache);
+    }
+  else
+    {
+      lruPushHead (&cache->protected, rb);
+    }
+}
+
+static bool
+readCacheCopy (tr_cache         * cache,
+               tr_torrent       * torrent,
+               tr_piece_index_t   piece,
+               uint32_t           offset,
+               uint32_t           len,
+               uint8_t          * setme)
+{
+  const tr_block_index_t block = _tr_block (torrent, piece, offset);
+  struct read_block * rb = tableFind (&cache->read_blocks, torrent, block);
+
+  if (rb != NULL)
+    {
+      const uint64_t pos = tr_pieceOffset (torrent, piece, offset, 0) - (uint64_t)block * torrent->blockSize;
+
+      if (pos + len <= rb->length)
+        {
+          memcpy (setme, rb->data + pos, len);
+          readCacheTouch (cache, rb);
+          return true;
+        }
+    }
+
+  return false;
+}
+
+/* remember a block that was just read from disk */
+static void
+readCacheAdd (tr_cache         * cache,
+              tr_torrent       * torrent,
+              tr_piece_index_t   piece,
+              uint32_t           offset,
+              uint32_t           len,
+              const uint8_t    * data)
+{
+  struct read_block * rb;
+  const tr_block_index_t block = _tr_block (torrent, piece, offset);
+
+  if (cache->max_read_blocks < 1)
+    return;
+
+  /* only whole blocks are kept */
+  if ((tr_pieceOffset (torrent, piece, offset, 0) != (uint64_t)block * torrent->blockSize)
+      || (len != tr_torBlockCountBytes (torrent, block)))
+    return;
+
+  /* don't keep a copy that's older than what's in the write cache */
+  if (tableFind (&cache->blocks, torrent, block) != NULL || findFlush (cache, torrent, block) != NULL)
+    return;
+
+  if (tableFind (&cache->read_blocks, torrent, block) != NULL)
+    return;
+
+  rb = tr_new0 (struct read_block, 1);
+  rb->key.tor = torrent;
+  rb->key.block = block;
+  rb->length = len;
+  rb->data = tr_memdup (data, len);
+  tableInsert (&cache->read_blocks, &rb->key);
+  lruPushHead (&cache->probation, rb);
+
+  readCacheTrim (cache);
+}
+
+/* called when a block is about to change */
+static void
+readCacheRemove (tr_cache * cache, tr_torrent * torrent, tr_block_index_t block)
+{
+  struct read_block * rb = tableFind (&cache->read_blocks, torrent, block);
+
+  if (rb != NULL)
+    readCacheEvict (cache, rb);
+}
+
+static void
+readCacheRemoveTorrent (tr_cache * cache, tr_torrent * torrent)
+{
+  struct read_lru * lrus[2];
+  int i;
 
-      calcRuns (cache, runs);
-      while (j < cacheCutoff)
-        j += runs[i++].len;
-      err = flushRuns (cache, runs, i);
-      tr_free (runs);
-    }
+  lrus[0] = &cache->probation;
+  lrus[1] = &cache->protected;
 
-  return err;
+  for (i=0; i<2; ++i)
+    {
+      struct read_block * rb = lrus[i]->head;
+
+      while (rb != NULL)
+        {
+          struct read_block * next = rb->next;
+          if (rb->key.tor == torrent)
+            readCacheEvict (cache, rb);
+          rb = next;
+        }
+    }
 }
 
 /***
@@ -269,11 +1196,55 @@ tr_cacheGetLimit (const tr_cache * cache)
   return cache->max_bytes;
 }
 
+void
+tr_cacheSetReadLimit (tr_cache * cache, int64_t max_bytes)
+{
+  char buf[128];
+
+  cache->max_read_bytes = max_bytes;
+  cache->max_read_blocks = getMaxBlocks (max_bytes);
+
+  tr_formatter_mem_B (buf, cache->max_read_bytes, sizeof (buf));
+  tr_logAddNamedDbg (MY_NAME, "Maximum read cache size set to %s (%d blocks)", buf, cache->max_read_blocks);
+
+  readCacheTrim (cache);
+}
+
+int64_t
+tr_cacheGetReadLimit (const tr_cache * cache)
+{
+  return cache->max_read_bytes;
+}
+
+void
+tr_cacheGetReadStats (const tr_cache * cache, uint64_t * setme_hits, uint64_t * setme_misses)
+{
+  *setme_hits = cache->read_hits;
+  *setme_misses = cache->read_misses;
+}
+
+void
+tr_cacheGetStats (const tr_cache * cache, tr_session_cache_stats * setme)
+{
+  setme->readHits = cache->read_hits;
+  setme->readMisses = cache->read_misses;
+  setme->hashedPieces = cache->hashed_pieces;
+  setme->rehashedPieces = cache->rehashed_pieces;
+  setme->blockWrites = cache->cache_writes;
+  setme->blockWriteBytes = cache->cache_write_bytes;
+  setme->flushCount = cache->disk_writes;
+  setme->flushBlocks = cache->disk_write_blocks;
+  setme->flushBytes = cache->disk_write_bytes;
+  setme->flushMsec = cache->disk_write_usec / 1000;
+}
+
 tr_cache *
 tr_cacheNew (int64_t max_bytes)
 {
   tr_cache * cache = tr_new0 (tr_cache, 1);
-  cache->blocks = TR_PTR_ARRAY_INIT;
+  cache->torrents = TR_PTR_ARRAY_INIT;
+  cache->held = TR_PTR_ARRAY_INIT;
+  cache->flush_lock = tr_lockNew ();
   cache->max_bytes = max_bytes;
   cache->max_blocks = getMaxBlocks (max_bytes);
   return cache;
@@ -282,8 +1253,20 @@ tr_cacheNew (int64_t max_bytes)
 void
 tr_cacheFree (tr_cache * cache)
 {
-  assert (tr_ptrArrayEmpty (&cache->blocks));
-  tr_ptrArrayDestruct (&cache->blocks, NULL);
+  assert (tr_ptrArrayEmpty (&cache->torrents));
+  assert (cache->waiters == NULL);
+  tr_ptrArrayDestruct (&cache->torrents, NULL);
+  tr_ptrArrayDestruct (&cache->held, NULL);
+  tr_lockFree (cache->flush_lock);
+  tableDestruct (&cache->blocks);
+  tableDestruct (&cache->flushing);
+
+  cache->max_read_blocks = 0;
+  readCacheTrim (cache);
+  tableDestruct (&cache->read_blocks);
+
+  pieceHashRemoveTorrent (cache, NULL);
+  tableDestruct (&cache->piece_hashes);
   tr_free (cache);
 }
 
@@ -291,34 +1274,60 @@ tr_cacheFree (tr_cache * cache)
 ****
 ***/
 
-static int
-cache_block_compare (const void * va, const void * vb)
+/* a block is written again while an older copy is being flushed */
+static void
+rewriteFlushBlock (struct cache_flush  * flush,
+                   tr_block_index_t      block,
+                   uint32_t              length,
+                   struct evbuffer     * writeme)
 {
-  const struct cache_block * a = va;
-  const struct cache_block * b = vb;
+  const size_t i = block - flush->first_block;
+  struct cache_block * old = flush->blocks[i];
+  struct cache_block * cb;
+  bool replaced = false;
 
-  /* primary key: torrent id */
-  if (a->tor->uniqueId != b->tor->uniqueId)
-    return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
+  assert (old->length == length);
+
+  /* if the write hasn't started yet, change the old copy in place */
+  tr_lockLock (flush->cache->flush_lock);
+  if (!flush->started)
+    {
+      int j;
+      const int n = evbuffer_peek (old->evbuf, -1, NULL, NULL, 0);
+      struct evbuffer_iovec * chunks = tr_new (struct evbuffer_iovec, n);
 
-  /* secondary key: block # */
-  if (a->block != b->block)
-    return a->block < b->block ? -1 : 1;
+      evbuffer_peek (old->evbuf, -1, NULL, chunks, n);
+      for (j=0; j<n; ++j)
+        evbuffer_remove (writeme, chunks[j].iov_base, chunks[j].iov_len);
 
-  /* they're equal */
-  return 0;
-}
+      tr_free (chunks);
+      old->time = tr_time ();
+      replaced = true;
+    }
+  tr_lockUnlock (flush->cache->flush_lock);
 
-static struct cache_block *
-findBlock (tr_cache           * cache,
-           tr_torrent         * torrent,
-           tr_piece_index_t     piece,
-           uint32_t             offset)
-{
-  struct cache_block key;
-  key.tor = torrent;
-  key.block = _tr_block (torrent, piece, offset);
-  return tr_ptrArrayFindSorted (&cache->blocks, &key, cache_block_compare);
+  if (replaced)
+    return;
+
+  /* otherwise keep the new copy beside the flush */
+  if (flush->newer == NULL)
+    flush->newer = tr_new0 (struct cache_block *, flush->last_block - flush->first_block + 1);
+
+  if ((cb = flush->newer[i]) == NULL)
+    {
+      cb = tr_new (struct cache_block, 1);
+      cb->key.tor = old->key.tor;
+      cb->key.block = block;
+      cb->piece = old->piece;
+      cb->offset = old->offset;
+      cb->length = length;
+      cb->evbuf = evbuffer_new ();
+      flush->newer[i] = cb;
+    }
+
+  cb->time = tr_time ();
+  evbuffer_drain (cb->evbuf, evbuffer_get_length (cb->evbuf));
+  evbuffer_remove_buffer (writeme, cb->evbuf, length);
 }
 
 int
@@ -329,23 +1338,42 @@ tr_cacheWriteBlock (tr_cache         * cache,
                     uint32_t           length,
                     struct evbuffer  * writeme)
 {
+  struct cache_flush * flush;
   struct cache_block * cb = findBlock (cache, torrent, piece, offset);
+  const tr_block_index_t block = _tr_block (torrent, piece, offset);
 
   assert (tr_amInEventThread (torrent->session));
 
+  readCacheRemove (cache, torrent, block);
+
+  /* a block can't be in the cache and in a flush at the same time */
+  if (cb == NULL && (flush = findFlush (cache, torrent, block)) != NULL)
+    {
+      rewriteFlushBlock (flush, block, length, writeme);
+
+      cache->cache_writes++;
+      cache->cache_write_bytes += length;
+      pieceHashBlockWritten (cache, torrent, piece, offset);
+      return 0;
+    }
+
   if (cb == NULL)
     {
       cb = tr_new (struct cache_block, 1);
-      cb->tor = torrent;
+      cb->key.tor = torrent;
       cb->piece = piece;
       cb->offset = offset;
       cb->length = length;
-      cb->block = _tr_block (torrent, piece, offset);
+      cb->key.block = _tr_block (torrent, piece, offset);
       cb->evbuf = evbuffer_new ();
-      tr_ptrArrayInsertSorted (&cache->blocks, cb, cache_block_compare);
+      cb->time = tr_time ();
+      addBlock (cache, cb);
+    }
+  else
+    {
+      cb->time = tr_time ();
+      cb->run->time = MAX (cb->run->time, cb->time);
     }
-
-  cb->time = tr_time ();
 
   assert (cb->length == length);
   evbuffer_drain (cb->evbuf, evbuffer_get_length (cb->evbuf));
@@ -354,6 +1382,9 @@ tr_cacheWriteBlock (tr_cache         * cache,
   cache->cache_writes++;
   cache->cache_write_bytes += cb->length;
 
+  /* before cacheTrim () can flush it */
+  pieceHashBlockWritten (cache, torrent, piece, offset);
+
   return cacheTrim (cache);
 }
 
@@ -366,55 +1397,309 @@ tr_cacheReadBlock (tr_cache         * cache,
                    uint8_t          * setme)
 {
   int err = 0;
-  struct cache_block * cb = findBlock (cache, torrent, piece, offset);
 
-  if (cb)
-    evbuffer_copyout (cb->evbuf, setme, len);
+  if (copyFromCache (cache, torrent, piece, offset, len, setme)
+      || readCacheCopy (cache, torrent, piece, offset, len, setme))
+    {
+      ++cache->read_hits;
+    }
+  else
+    {
+      ++cache->read_misses;
+
+      if (!(err = tr_ioRead (torrent, piece, offset, len, setme)))
+        readCacheAdd (cache, torrent, piece, offset, len, setme);
+    }
+
+  return err;
+}
+
+struct read_fill
+{
+  tr_cache * cache;
+  tr_piece_index_t piece;
+  uint32_t offset;
+  uint32_t len;
+  uint8_t * buf;
+  tr_io_done_func done_func;
+  void * user_data;
+};
+
+static void
+onReadDone (tr_torrent * tor, int err, void * vfill)
+{
+  struct read_fill * fill = vfill;
+
+  /* if it was cancelled, the torrent might be gone */
+  if (err == 0)
+    readCacheAdd (fill->cache, tor, fill->piece, fill->offset, fill->len, fill->buf);
+
+  fill->done_func (tor, err, fill->user_data);
+  tr_free (fill);
+}
+
+int
+tr_cacheReadBlockAsync (tr_cache         * cache,
+                        tr_torrent       * torrent,
+                        tr_piece_index_t   piece,
+                        uint32_t           offset,
+                        uint32_t           len,
+                        uint8_t          * setme,
+                        const void       * owner,
+                        tr_io_done_func    done_func,
+                        void             * user_data)
+{
+  int err = 0;
+
+  if (copyFromCache (cache, torrent, piece, offset, len, setme)
+      || readCacheCopy (cache, torrent, piece, offset, len, setme))
+    {
+      ++cache->read_hits;
+      done_func (torrent, 0, user_data);
+    }
+  else
+    {
+      struct read_fill * fill = tr_new (struct read_fill, 1);
+
+      ++cache->read_misses;
+
+      fill->cache = cache;
+      fill->piece = piece;
+      fill->offset = offset;
+      fill->len = len;
+      fill->buf = setme;
+      fill->done_func = done_func;
+      fill->user_data = user_data;
+
+      if ((err = tr_ioReadAsync (torrent, piece, offset, len, setme, owner, onReadDone, fill)))
+        tr_free (fill);
+    }
+
+  return err;
+}
+
+int
+tr_cacheReadBlockToBuffer (tr_cache         * cache,
+                           tr_torrent       * torrent,
+                           tr_piece_index_t   piece,
+                           uint32_t           offset,
+                           uint32_t           len,
+                           struct evbuffer  * buf)
+{
+  int err = 0;
+  struct evbuffer_iovec iovec[1];
+
+  /* if it's in memory, copy it; the disk might not have it yet */
+  evbuffer_reserve_space (buf, len, iovec, 1);
+
+  if (copyFromCache (cache, torrent, piece, offset, len, iovec[0].iov_base)
+      || readCacheCopy (cache, torrent, piece, offset, len, iovec[0].iov_base))
+    {
+      ++cache->read_hits;
+      iovec[0].iov_len = len;
+      evbuffer_commit_space (buf, iovec, 1);
+    }
   else
-    err = tr_ioRead (torrent, piece, offset, len, setme);
+    {
+      ++cache->read_misses;
+      evbuffer_commit_space (buf, iovec, 0);
+      err = tr_ioReadToBuffer (torrent, piece, offset, len, buf);
+    }
 
   return err;
 }
 
+void
+tr_cacheForgetPiece (tr_cache * cache, tr_torrent * torrent, tr_piece_index_t piece)
+{
+  tr_block_index_t block, first, last;
+
+  tr_torGetPieceBlockRange (torrent, piece, &first, &last);
+
+  for (block=first; block<=last; ++block)
+    readCacheRemove (cache, torrent, block);
+
+  pieceHashRemove (cache, torrent, piece);
+}
+
+tr_sha1_ctx_t
+tr_cacheTakePieceHash (tr_cache         * cache,
+                       tr_torrent       * torrent,
+                       tr_piece_index_t   piece,
+                       uint32_t         * setme_offset)
+{
+  tr_sha1_ctx_t sha;
+  struct piece_hash * ph = tableFind (&cache->piece_hashes, torrent, piece);
+
+  if (ph == NULL)
+    {
+      ++cache->rehashed_pieces;
+      *setme_offset = 0;
+      return NULL;
+    }
+
+  tableRemove (&cache->piece_hashes, &ph->key);
+
+  /* blocks that were flushed while they waited to be hashed
+     have to be read back, but the ones before them don't */
+  if (ph->offset < tr_torPieceCountBytes (torrent, piece))
+    ++cache->rehashed_pieces;
+  else
+    ++cache->hashed_pieces;
+
+  sha = ph->sha;
+  *setme_offset = ph->offset;
+  tr_free (ph);
+  return sha;
+}
+
+bool
+tr_cacheGetPieceHash (tr_cache         * cache,
+                      tr_torrent       * torrent,
+                      tr_piece_index_t   piece,
+                      uint8_t          * setme)
+{
+  uint32_t offset;
+  bool success = true;
+  uint8_t * buf = NULL;
+  const uint32_t piece_size = tr_torPieceCountBytes (torrent, piece);
+  const tr_sha1_ctx_t sha = tr_cacheTakePieceHash (cache, torrent, piece, &offset);
+
+  if (sha == NULL)
+    return false;
+
+  if (offset < piece_size)
+    buf = tr_valloc (torrent->blockSize);
+
+  while (success && offset < piece_size)
+    {
+      const uint32_t len = MIN (piece_size - offset, torrent->blockSize);
+
+      success = !tr_cacheReadBlock (cache, torrent, piece, offset, len, buf)
+             && tr_sha1_update (sha, buf, len);
+      offset += len;
+    }
+
+  success = tr_sha1_final (sha, success ? setme : NULL) && success;
+
+  tr_free (buf);
+  return success;
+}
+
 int
 tr_cachePrefetchBlock (tr_cache         * cache,
                        tr_torrent       * torrent,
                        tr_piece_index_t   piece,
                        uint32_t           offset,
-                       uint32_t           len)
+                       uint32_t           len,
+                       const void       * owner,
+                       tr_io_done_func    done_func,
+                       void             * user_data)
 {
   int err = 0;
-  struct cache_block * cb = findBlock (cache, torrent, piece, offset);
+  const tr_block_index_t block = _tr_block (torrent, piece, offset);
 
-  if (cb == NULL)
-    err = tr_ioPrefetch (torrent, piece, offset, len);
+  if (tableFind (&cache->blocks, torrent, block) == NULL
+      && tableFind (&cache->read_blocks, torrent, block) == NULL)
+    err = tr_ioPrefetchAsync (torrent, piece, offset, len, owner, done_func, user_data);
+  else if (done_func != NULL)
+    done_func (torrent, 0, user_data);
 
   return err;
 }
 
-/***
-****
-***/
+bool
+tr_cacheHasBlock (tr_cache         * cache,
+                  tr_torrent       * torrent,
+                  tr_piece_index_t   piece,
+                  uint32_t           offset)
+{
+  const tr_block_index_t block = _tr_block (torrent, piece, offset);
+
+  return tableFind (&cache->blocks, torrent, block) != NULL
+      || tableFind (&cache->read_blocks, torrent, block) != NULL
+      || findFlush (cache, torrent, block) != NULL;
+}
+
+enum
+{
+  /* how many read cache blocks to look at for tr_cacheGetCachedPieces () */
+  CACHED_PIECES_SCAN_BLOCKS = 512
+};
 
 static int
-findBlockPos (tr_cache * cache, tr_torrent * torrent, tr_piece_index_t block)
+addCachedPiece (tr_piece_index_t * pieces, int n, int max, tr_piece_index_t piece)
+{
+  int i;
+
+  for (i=0; i<n; ++i)
+    if (pieces[i] == piece)
+      return n;
+
+  if (n < max)
+    pieces[n++] = piece;
+
+  return n;
+}
+
+int
+tr_cacheGetCachedPieces (tr_cache         * cache,
+                         tr_torrent       * torrent,
+                         tr_piece_index_t * setme,
+                         int                max)
 {
-  struct cache_block key;
-  key.tor = torrent;
-  key.block = block;
-  return tr_ptrArrayLowerBound (&cache->blocks, &key, cache_block_compare, NULL);
+  int i;
+  int n = 0;
+  int scanned = 0;
+  struct read_lru * lrus[2];
+  const struct cache_torrent * ct = findTorrent (cache, torrent);
+
+  /* pieces that were just downloaded are the ones other peers are
+   * least likely to have yet, and they won't be read back from disk */
+  if (ct != NULL)
+    {
+      const int run_count = tr_ptrArraySize (&ct->runs);
+      struct cache_run ** runs = (struct cache_run **) tr_ptrArrayBase (&ct->runs);
+
+      for (i=0; i<run_count && n<max; ++i)
+        {
+          tr_piece_index_t piece = runs[i]->first->piece;
+          const tr_piece_index_t last = runs[i]->last->piece;
+
+          for (; piece<=last && n<max; ++piece)
+            n = addCachedPiece (setme, n, max, piece);
+        }
+    }
+
+  lrus[0] = &cache->protected;
+  lrus[1] = &cache->probation;
+
+  for (i=0; i<2 && n<max; ++i)
+    {
+      const struct read_block * rb;
+
+      for (rb=lrus[i]->head; rb!=NULL && n<max && scanned<CACHED_PIECES_SCAN_BLOCKS; rb=rb->next, ++scanned)
+        if (rb->key.tor == torrent)
+          n = addCachedPiece (setme, n, max, tr_torBlockPiece (torrent, rb->key.block));
+    }
+
+  return n;
 }
 
+/***
+****
+***/
+
 int tr_cacheFlushDone (tr_cache * cache)
 {
   int err = 0;
 
-  if (tr_ptrArraySize (&cache->blocks) > 0)
+  if (cache->run_count > 0)
     {
       int i, n;
       struct run_info * runs;
 
-      runs = tr_new (struct run_info, tr_ptrArraySize (&cache->blocks));
+      runs = tr_new (struct run_info, cache->run_count);
       i = 0;
       n = calcRuns (cache, runs);
 
@@ -428,50 +1713,279 @@ int tr_cacheFlushDone (tr_cache * cache)
   return err;
 }
 
-int
-tr_cacheFlushFile (tr_cache * cache, tr_torrent * torrent, tr_file_index_t i)
+static int
+flushBlockRange (tr_cache * cache, tr_torrent * torrent, tr_block_index_t first, tr_block_index_t last)
 {
   int pos;
   int err = 0;
+  struct cache_torrent * ct;
+
+  if ((ct = findTorrent (cache, torrent)) != NULL && !isHeld (cache, torrent))
+    {
+      struct cache_block key_block;
+      struct cache_run key;
+
+      key_block.key.block = first;
+      key.first = &key_block;
+      pos = tr_ptrArrayLowerBound (&ct->runs, &key, compareRunsByBlock, NULL);
+
+      /* the run before that one may reach into the file, too */
+      if (pos > 0 && ((struct cache_run*)tr_ptrArrayNth (&ct->runs, pos-1))->last->key.block >= first)
+        --pos;
+
+      /* flush out all the runs that touch that file.
+       * when the torrent's last run is flushed, ct is freed */
+      while (!err)
+        {
+          const int n = tr_ptrArraySize (&ct->runs);
+          struct cache_run * run;
+
+          if (pos >= n)
+            break;
+
+          run = tr_ptrArrayNth (&ct->runs, pos);
+          if (run->first->key.block > last)
+            break;
+
+          err = flushRun (cache, run);
+
+          if (n == 1)
+            break;
+        }
+    }
+
+  return err;
+}
+
+static bool
+waiterIsFlushing (const tr_cache * cache, const struct cache_waiter * w)
+{
+  const struct cache_flush * flush;
+
+  for (flush=cache->flushes; flush!=NULL; flush=flush->next)
+    if (flush->tor == w->tor && flush->first_block <= w->last_block && w->first_block <= flush->last_block)
+      return true;
+
+  return false;
+}
+
+static void
+checkWaiters (tr_cache * cache)
+{
+  struct cache_waiter * w;
+  struct cache_waiter ** pw;
+  struct cache_waiter * done = NULL;
+  struct cache_waiter ** done_tail = &done;
+
+  /* flushBlockRange () finishes a flush right away if it fails.
+   * The loops below look at every waiter after that anyway */
+  if (cache->is_checking_waiters)
+    return;
+  cache->is_checking_waiters = true;
+
+  /* blocks that were written again while they were being flushed
+   * have come back into the cache; flush them, too */
+  for (w=cache->waiters; w!=NULL; w=w->next)
+    {
+      if (!w->err && w->requeued_blocks != cache->requeued_blocks)
+        {
+          w->requeued_blocks = cache->requeued_blocks;
+          w->err = flushBlockRange (cache, w->tor, w->first_block, w->last_block);
+        }
+    }
+
+  pw = &cache->waiters;
+  while ((w = *pw) != NULL)
+    {
+      if (waiterIsFlushing (cache, w) || (w->type != WAIT_FOR_HOLD && isHeld (cache, w->tor)))
+        {
+          pw = &w->next;
+        }
+      else
+        {
+          *pw = w->next;
+          w->next = NULL;
+          *done_tail = w;
+          done_tail = &w->next;
+        }
+    }
+
+  cache->is_checking_waiters = false;
+
+  /* the callbacks may flush or wait for more, so they're
+   * called after the list has been settled */
+  while ((w = done) != NULL)
+    {
+      done = w->next;
+
+      if (w->type == WAIT_FOR_TORRENT)
+        {
+          readCacheRemoveTorrent (cache, w->tor);
+          pieceHashRemoveTorrent (cache, w->tor);
+        }
+
+      w->done_func (w->tor, w->err, w->user_data);
+      tr_free (w);
+    }
+}
+
+static void
+addWaiter (tr_cache         * cache,
+           tr_torrent       * torrent,
+           tr_block_index_t   first,
+           tr_block_index_t   last,
+           enum waiter_type   type,
+           tr_io_done_func    done_func,
+           void             * user_data)
+{
+  struct cache_waiter ** pw;
+  struct cache_waiter * w = tr_new0 (struct cache_waiter, 1);
+
+  w->tor = torrent;
+  w->first_block = first;
+  w->last_block = last;
+  w->type = type;
+  w->done_func = done_func;
+  w->user_data = user_data;
+  w->requeued_blocks = cache->requeued_blocks;
+  w->err = flushBlockRange (cache, torrent, first, last);
+
+  for (pw=&cache->waiters; *pw!=NULL; pw=&(*pw)->next)
+    ;
+  *pw = w;
+
+  /* if nothing in its range is being written, it's done already */
+  checkWaiters (cache);
+}
+
+void
+tr_cacheFlushFileAsync (tr_cache         * cache,
+                        tr_torrent       * torrent,
+                        tr_file_index_t    i,
+                        tr_io_done_func    done_func,
+                        void             * user_data)
+{
   tr_block_index_t first;
   tr_block_index_t last;
 
   tr_torGetFileBlockRange (torrent, i, &first, &last);
-  pos = findBlockPos (cache, torrent, first);
   dbgmsg ("flushing file %d from cache to disk: blocks [%zu...%zu]", (int)i, (size_t)first, (size_t)last);
 
-  /* flush out all the blocks in that file */
-  while (!err && (pos < tr_ptrArraySize (&cache->blocks)))
-    {
-      const struct cache_block * b = tr_ptrArrayNth (&cache->blocks, pos);
+  addWaiter (cache, torrent, first, last, WAIT_FOR_RANGE, done_func, user_data);
+}
 
-      if (b->tor != torrent)
-        break;
-      if ((b->block < first) || (b->block > last))
-        break;
+void
+tr_cacheFlushTorrentAsync (tr_cache         * cache,
+                           tr_torrent       * torrent,
+                           tr_io_done_func    done_func,
+                           void             * user_data)
+{
+  const tr_block_index_t last = torrent->blockCount > 0 ? torrent->blockCount - 1 : 0;
+
+  addWaiter (cache, torrent, 0, last, WAIT_FOR_TORRENT, done_func, user_data);
+}
 
-      err = flushContiguous (cache, pos, getBlockRun (cache, pos, NULL));
+static void
+cancelWaiters (tr_cache * cache, tr_torrent * torrent, bool holdOnly)
+{
+  struct cache_waiter * w;
+  struct cache_waiter ** pw;
+  struct cache_waiter * cancelled = NULL;
+
+  pw = &cache->waiters;
+  while ((w = *pw) != NULL)
+    {
+      if (w->tor == torrent && (!holdOnly || w->type == WAIT_FOR_HOLD))
+        {
+          *pw = w->next;
+          w->next = cancelled;
+          cancelled = w;
+        }
+      else
+        {
+          pw = &w->next;
+        }
     }
 
-  return err;
+  while ((w = cancelled) != NULL)
+    {
+      cancelled = w->next;
+      w->done_func (w->tor, ECANCELED, w->user_data);
+      tr_free (w);
+    }
+}
+
+void
+tr_cacheHoldTorrent (tr_cache         * cache,
+                     tr_torrent       * torrent,
+                     tr_io_done_func    done_func,
+                     void             * user_data)
+{
+  const tr_block_index_t last = torrent->blockCount > 0 ? torrent->blockCount - 1 : 0;
+
+  if (!isHeld (cache, torrent))
+    tr_ptrArrayAppend (&cache->held, torrent);
+
+  addWaiter (cache, torrent, 0, last, WAIT_FOR_HOLD, done_func, user_data);
+}
+
+void
+tr_cacheReleaseTorrent (tr_cache * cache, tr_torrent * torrent)
+{
+  struct cache_waiter * w;
+  const int pos = findHeld (cache, torrent);
+
+  if (pos < 0)
+    return;
+
+  tr_ptrArrayRemove (&cache->held, pos);
+  cancelWaiters (cache, torrent, true);
+
+  /* the torrent's waiters can have its blocks flushed now */
+  for (w=cache->waiters; w!=NULL; w=w->next)
+    if (w->tor == torrent && !w->err)
+      w->err = flushBlockRange (cache, torrent, w->first_block, w->last_block);
+
+  checkWaiters (cache);
+}
+
+bool
+tr_cacheIsHoldingBack (const tr_cache * cache, const tr_torrent * torrent)
+{
+  return cache->blocks.count >= cache->max_blocks && isHeld (cache, torrent);
+}
+
+void
+tr_cacheCancelFlushes (tr_cache * cache, tr_torrent * torrent)
+{
+  const int pos = findHeld (cache, torrent);
+
+  if (pos >= 0)
+    tr_ptrArrayRemove (&cache->held, pos);
+
+  cancelWaiters (cache, torrent, false);
 }
 
 int
 tr_cacheFlushTorrent (tr_cache * cache, tr_torrent * torrent)
 {
   int err = 0;
-  const int pos = findBlockPos (cache, torrent, 0);
+  struct cache_torrent * ct;
 
-  /* flush out all the blocks in that torrent */
-  while (!err && (pos < tr_ptrArraySize (&cache->blocks)))
+  /* flush out all the runs in that torrent, including the
+   * blocks that come back from flushes that were running */
+  do
     {
-      const struct cache_block * b = tr_ptrArrayNth (&cache->blocks, pos);
-
-      if (b->tor != torrent)
-        break;
+      while (!err && (ct = findTorrent (cache, torrent)) != NULL)
+        err = flushRun (cache, tr_ptrArrayNth (&ct->runs, 0));
 
-      err = flushContiguous (cache, pos, getBlockRun (cache, pos, NULL));
+      tr_diskIoWait (torrent->session->diskIo, torrent);
     }
+  while (!err && findTorrent (cache, torrent) != NULL);
+
+  /* the torrent is being stopped, moved, or removed */
+  readCacheRemoveTorrent (cache, torrent);
+  pieceHashRemoveTorrent (cache, torrent);
 
   return err;
 }
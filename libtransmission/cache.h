@@ -13,6 +13,9 @@
 
 #pragma once
 
+#include "crypto-utils.h" /* tr_sha1_ctx_t */
+#include "inout.h" /* tr_io_done_func */
+
 struct evbuffer;
 
 typedef struct tr_cache tr_cache;
@@ -33,6 +36,25 @@ int tr_cacheSetLimit (tr_cache * cache, int64_t max_bytes);
 
 int64_t tr_cacheGetLimit (const tr_cache *);
 
+/**
+ * Blocks read from disk are kept in a separate read cache so that pieces
+ * requested by many peers don't have to be read again and again.
+ * A limit of zero disables the read cache.
+ */
+void tr_cacheSetReadLimit (tr_cache * cache, int64_t max_bytes);
+
+int64_t tr_cacheGetReadLimit (const tr_cache *);
+
+/** @brief how many reads were served from memory, and how many from disk */
+void tr_cacheGetReadStats (const tr_cache * cache,
+                           uint64_t       * setme_hits,
+                           uint64_t       * setme_misses);
+
+/** @brief fill in the cache's part of tr_sessionGetCacheStats ():
+           the read hits and misses, and the block and flush counters */
+void tr_cacheGetStats (const tr_cache         * cache,
+                       tr_session_cache_stats * setme);
+
 int tr_cacheWriteBlock (tr_cache         * cache,
                         tr_torrent       * torrent,
                         tr_piece_index_t   piece,
@@ -47,11 +69,99 @@ int tr_cacheReadBlock (tr_cache         * cache,
                        uint32_t           len,
                        uint8_t          * setme);
 
+/**
+ * Like tr_cacheReadBlock (), but blocks that aren't in the cache
+ * are read by the disk I/O threads. done_func is called right away
+ * if the block is in the cache.
+ *
+ * @see tr_ioReadAsync ()
+ */
+int tr_cacheReadBlockAsync (tr_cache         * cache,
+                            tr_torrent       * torrent,
+                            tr_piece_index_t   piece,
+                            uint32_t           offset,
+                            uint32_t           len,
+                            uint8_t          * setme,
+                            const void       * owner,
+                            tr_io_done_func    done_func,
+                            void             * user_data);
+
+/**
+ * Appends a block to `buf'. Blocks that are in the cache are copied;
+ * the rest are added as file segments that the kernel reads when buf
+ * is written to a socket.
+ *
+ * @see tr_ioReadToBuffer ()
+ */
+int tr_cacheReadBlockToBuffer (tr_cache         * cache,
+                               tr_torrent       * torrent,
+                               tr_piece_index_t   piece,
+                               uint32_t           offset,
+                               uint32_t           len,
+                               struct evbuffer  * buf);
+
+/**
+ * Take the SHA-1 of a piece that was fed its blocks as they were
+ * written to the cache. The piece's bytes from *setme_offset on
+ * were flushed before their turn came, and still have to be hashed.
+ *
+ * @return NULL if the piece wasn't being hashed, in which case the
+ *         caller has to hash the whole piece itself. Otherwise the
+ *         caller owns the context and has to tr_sha1_final () it.
+ */
+tr_sha1_ctx_t tr_cacheTakePieceHash (tr_cache         * cache,
+                                     tr_torrent       * torrent,
+                                     tr_piece_index_t   piece,
+                                     uint32_t         * setme_offset);
+
+/**
+ * Like tr_cacheTakePieceHash (), but the rest of the piece is read back
+ * and hashed right away. This blocks on the disk.
+ *
+ * @return false if the piece wasn't being hashed or couldn't be read
+ */
+bool tr_cacheGetPieceHash (tr_cache         * cache,
+                           tr_torrent       * torrent,
+                           tr_piece_index_t   piece,
+                           uint8_t          * setme);
+
+/** @brief drop a piece's blocks from the read cache,
+           e.g. because its file was changed behind our back */
+void tr_cacheForgetPiece (tr_cache         * cache,
+                          tr_torrent       * torrent,
+                          tr_piece_index_t   piece);
+
+/** @brief true if the block is in memory, so sending it won't touch the disk */
+bool tr_cacheHasBlock (tr_cache         * cache,
+                       tr_torrent       * torrent,
+                       tr_piece_index_t   piece,
+                       uint32_t           offset);
+
+/**
+ * Lists up to `max' pieces of a torrent that have blocks in memory:
+ * the ones that were just written first, then the ones that were read
+ * most recently. These are the cheapest pieces to upload.
+ *
+ * @return the number of pieces in setme
+ */
+int tr_cacheGetCachedPieces (tr_cache         * cache,
+                             tr_torrent       * torrent,
+                             tr_piece_index_t * setme,
+                             int                max);
+
+/**
+ * Asks the OS to start reading a block that isn't in the cache.
+ * done_func is optional. If it's set, it's called like it is for
+ * tr_cacheReadBlockAsync (), right away if the block is in memory.
+ */
 int tr_cachePrefetchBlock (tr_cache         * cache,
                            tr_torrent       * torrent,
                            tr_piece_index_t   piece,
                            uint32_t           offset,
-                           uint32_t           len);
+                           uint32_t           len,
+                           const void       * owner,
+                           tr_io_done_func    done_func,
+                           void             * user_data);
 
 /***
 ****
@@ -62,7 +172,49 @@ int tr_cacheFlushDone (tr_cache * cache);
 int tr_cacheFlushTorrent (tr_cache    * cache,
                           tr_torrent  * torrent);
 
-int tr_cacheFlushFile (tr_cache         * cache,
-                       tr_torrent       * torrent,
-                       tr_file_index_t    file);
+/**
+ * Flushes a file's blocks to disk in the background and calls done_func
+ * in the libtransmission thread once they're written. done_func may be
+ * called before this returns if there's nothing to wait for.
+ */
+void tr_cacheFlushFileAsync (tr_cache         * cache,
+                             tr_torrent       * torrent,
+                             tr_file_index_t    file,
+                             tr_io_done_func    done_func,
+                             void             * user_data);
+
+/**
+ * Like tr_cacheFlushTorrent (), but done_func is called when
+ * the torrent's blocks are written instead of waiting for them.
+ */
+void tr_cacheFlushTorrentAsync (tr_cache         * cache,
+                                tr_torrent       * torrent,
+                                tr_io_done_func    done_func,
+                                void             * user_data);
+
+/**
+ * Stops writing the torrent's blocks to disk: new ones stay in the cache
+ * until tr_cacheReleaseTorrent (), and its other flushes aren't called
+ * back until then. done_func is called once the writes that were already
+ * running are finished, or with ECANCELED if the hold is released first.
+ */
+void tr_cacheHoldTorrent (tr_cache         * cache,
+                          tr_torrent       * torrent,
+                          tr_io_done_func    done_func,
+                          void             * user_data);
+
+void tr_cacheReleaseTorrent (tr_cache    * cache,
+                             tr_torrent  * torrent);
+
+/**
+ * @return true if no more of the torrent's blocks should be requested for
+ *         now, because it's being held and the cache is full
+ */
+bool tr_cacheIsHoldingBack (const tr_cache    * cache,
+                            const tr_torrent  * torrent);
+
+/** Calls back the torrent's pending flushes with ECANCELED
+    and releases it if it's being held. */
+void tr_cacheCancelFlushes (tr_cache    * cache,
+                            tr_torrent  * torrent);
 
@@ -0,0 +1,103 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+/* Compares the tr_sha1_many () kernels with hashing the same pieces one
+ * at a time through the crypto backend (EVP, when built with OpenSSL).
+ *
+ * Usage: crypto-bench [piece-size-KiB [pieces [total-MiB]]] */
+
+#include <stdio.h>
+#include <stdlib.h> /* atoi () */
+#include <string.h> /* memcmp () */
+
+#include "transmission.h"
+#include "crypto-utils.h"
+#include "utils.h"
+
+static const char * const kernels[] = { "backend", "simd4", "avx2x8", "sha-ni", "auto" };
+
+static void
+report (const char * name, uint64_t bytes, uint64_t msec)
+{
+  printf ("%-20s %8.1f MiB/s\n", name,
+          msec > 0 ? (double) bytes / (1024 * 1024) / ((double) msec / 1000) : 0.0);
+}
+
+int
+main (int argc, char ** argv)
+{
+  size_t i, k;
+  uint64_t begin, done;
+  const size_t pieceSize = (argc > 1 ? (size_t) atoi (argv[1]) : 256) * 1024;
+  const size_t pieceCount = argc > 2 ? (size_t) atoi (argv[2]) : 8;
+  const uint64_t total = (uint64_t) (argc > 3 ? atoi (argv[3]) : 512) * 1024 * 1024;
+  const uint64_t batchBytes = (uint64_t) pieceSize * pieceCount;
+  const char * const defaultKernel = tr_sha1_many_kernel (pieceCount);
+  uint8_t * buf;
+  const void ** pieces;
+  size_t * lengths;
+  uint8_t * expected;
+  uint8_t * hashes;
+
+  if (pieceSize == 0 || pieceCount == 0 || total == 0)
+    {
+      fprintf (stderr, "Usage: %s [piece-size-KiB [pieces [total-MiB]]]\n", argv[0]);
+      return 1;
+    }
+
+  buf = tr_valloc (batchBytes);
+  pieces = tr_new (const void *, pieceCount);
+  lengths = tr_new (size_t, pieceCount);
+  expected = tr_new (uint8_t, pieceCount * SHA_DIGEST_LENGTH);
+  hashes = tr_new (uint8_t, pieceCount * SHA_DIGEST_LENGTH);
+
+  tr_rand_buffer (buf, batchBytes);
+  for (i=0; i<pieceCount; ++i)
+    {
+      pieces[i] = buf + i * pieceSize;
+      lengths[i] = pieceSize;
+    }
+
+  printf ("%zu pieces of %zu KiB per batch, %" PRIu64 " MiB per run, default kernel: %s\n\n",
+          pieceCount, pieceSize / 1024, total / (1024 * 1024), defaultKernel);
+
+  /* the baseline: one piece at a time, as before tr_sha1_many () */
+  begin = tr_time_msec ();
+  for (done=0; done<total; done+=batchBytes)
+    for (i=0; i<pieceCount; ++i)
+      tr_sha1 (expected + i * SHA_DIGEST_LENGTH, pieces[i], (int) lengths[i], NULL);
+  report ("tr_sha1", done, tr_time_msec () - begin);
+
+  for (k=0; k<sizeof (kernels) / sizeof (*kernels); ++k)
+    {
+      if (!tr_sha1_many_use_kernel (kernels[k]))
+        {
+          printf ("%-20s unsupported\n", kernels[k]);
+          continue;
+        }
+
+      begin = tr_time_msec ();
+      for (done=0; done<total; done+=batchBytes)
+        tr_sha1_many (pieceCount, pieces, lengths, hashes);
+      report (kernels[k], done, tr_time_msec () - begin);
+
+      if (memcmp (hashes, expected, pieceCount * SHA_DIGEST_LENGTH) != 0)
+        {
+          fprintf (stderr, "%s: wrong hashes!\n", kernels[k]);
+          return 1;
+        }
+    }
+
+  tr_free (hashes);
+  tr_free (expected);
+  tr_free (lengths);
+  tr_free (pieces);
+  tr_free (buf);
+  return 0;
+}
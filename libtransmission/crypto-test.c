@@ -114,6 +114,64 @@ test_sha1 (void)
   return 0;
 }
 
+static int
+test_sha1_many (void)
+{
+  size_t i, k;
+  const char * const kernels[] = { "backend", "simd4", "avx2x8", "sha-ni" };
+  enum { COUNT = 11 };
+  uint8_t * bufs[COUNT];
+  const void * data[COUNT];
+  size_t lengths[COUNT];
+  uint8_t expected[COUNT * SHA_DIGEST_LENGTH];
+  uint8_t hashes[COUNT * SHA_DIGEST_LENGTH];
+
+  /* lengths around the 55/56/64 byte padding boundaries,
+     and buffers of different lengths in the same batch */
+  for (i = 0; i < COUNT; ++i)
+    {
+      static const size_t test_lengths[COUNT] = { 0, 1, 55, 56, 63, 64, 65, 119, 120, 4096, 16384 + 7 };
+
+      lengths[i] = test_lengths[i];
+      bufs[i] = tr_malloc (lengths[i] + 1);
+      tr_rand_buffer (bufs[i], lengths[i] + 1);
+      data[i] = bufs[i];
+      check (tr_sha1 (expected + i * SHA_DIGEST_LENGTH, data[i], (int)lengths[i], NULL));
+    }
+
+  for (k = 0; k < sizeof (kernels) / sizeof (*kernels); ++k)
+    {
+      if (!tr_sha1_many_use_kernel (kernels[k]))
+        continue;
+
+      check_streq (kernels[k], tr_sha1_many_kernel (COUNT));
+
+      /* every batch size from 0 to COUNT */
+      for (i = 0; i <= COUNT; ++i)
+        {
+          memset (hashes, 0, sizeof (hashes));
+          check (tr_sha1_many (i, data, lengths, hashes));
+          check (memcmp (hashes, expected, i * SHA_DIGEST_LENGTH) == 0);
+        }
+    }
+
+  check (!tr_sha1_many_use_kernel ("no-such-kernel"));
+  check (tr_sha1_many_use_kernel ("auto"));
+
+  /* the picked kernels must work too */
+  for (i = 0; i <= COUNT; ++i)
+    {
+      memset (hashes, 0, sizeof (hashes));
+      check (tr_sha1_many (i, data, lengths, hashes));
+      check (memcmp (hashes, expected, i * SHA_DIGEST_LENGTH) == 0);
+    }
+
+  for (i = 0; i < COUNT; ++i)
+    tr_free (bufs[i]);
+
+  return 0;
+}
+
 static int
 test_ssha1 (void)
 {
@@ -284,6 +342,7 @@ main (void)
   const testFunc tests[] = { test_torrent_hash,
                              test_encrypt_decrypt,
                              test_sha1,
+                             test_sha1_many,
                              test_ssha1,
                              test_random,
                              test_base64 };
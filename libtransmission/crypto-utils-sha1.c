@@ -0,0 +1,677 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+/* SHA1 kernels for hashing many pieces at once.
+ *
+ * The crypto backends hash one buffer at a time. When we have several
+ * whole pieces in memory (verify, makemeta) we can do better:
+ *
+ *  - "sha-ni": the x86 SHA extensions. One buffer at a time, but several
+ *    times faster than a plain C implementation.
+ *  - "avx2x8" and "simd4": multi-buffer SHA1, hashing 8 (AVX2) or 4
+ *    (SSE2 or NEON) buffers in the lanes of one vector register.
+ *  - "backend": whatever tr_sha1 () uses.
+ *
+ * Which one wins depends on the CPU and on how good the crypto library's
+ * own SHA1 is, so the first call times each kernel the CPU supports on a
+ * small batch and on a single buffer and keeps the fastest for each. */
+
+#include <assert.h>
+#include <string.h> /* memcpy (), memset (), strcmp () */
+#include <time.h> /* clock () */
+
+#include "transmission.h"
+#include "crypto-utils.h"
+#include "utils.h"
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+ #define TR_SHA1_X86
+ #include <cpuid.h>
+ #include <immintrin.h>
+#endif
+
+#if defined (__GNUC__) && (defined (__SSE2__) || defined (__ARM_NEON) || defined (__aarch64__))
+ #define TR_SHA1_LANES4
+#endif
+
+#ifdef TR_SHA1_X86
+ #define TR_SHA1_LANES8
+ #define TR_SHA1_SHANI
+#endif
+
+/***
+****  Helpers shared by the kernels
+***/
+
+enum
+{
+  SHA1_BLOCK_SIZE = 64,
+  SHA1_MAX_LANES = 8
+};
+
+static const uint32_t sha1_init_state[5] =
+{
+  0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+static inline uint32_t
+load_be32 (const uint8_t * p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void
+store_be32 (uint8_t * p, uint32_t v)
+{
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)(v);
+}
+
+/* Copy the message's last partial block into `tail' and add SHA1's
+ * padding and length. Returns how many blocks (1 or 2) that makes. */
+static size_t
+sha1_pad_tail (const uint8_t * data, size_t len, uint8_t tail[2 * SHA1_BLOCK_SIZE])
+{
+  const size_t rem = len % SHA1_BLOCK_SIZE;
+  const size_t blocks = rem < SHA1_BLOCK_SIZE - 8 ? 1 : 2;
+  const uint64_t bits = (uint64_t)len * 8;
+  uint8_t * end = tail + blocks * SHA1_BLOCK_SIZE;
+
+  memset (tail, 0, 2 * SHA1_BLOCK_SIZE);
+  memcpy (tail, data + len - rem, rem);
+  tail[rem] = 0x80;
+  store_be32 (end - 8, (uint32_t)(bits >> 32));
+  store_be32 (end - 4, (uint32_t)bits);
+
+  return blocks;
+}
+
+static void
+sha1_export (const uint32_t state[5], uint8_t * hash)
+{
+  int i;
+
+  for (i=0; i<5; ++i)
+    store_be32 (hash + i * 4, state[i]);
+}
+
+/***
+****  SHA extensions (x86)
+***/
+
+#ifdef TR_SHA1_SHANI
+
+/* four rounds, plus the message schedule for later rounds */
+#define SHANI_ROUNDS4(g) \
+  do \
+    { \
+      if ((g) == 0) \
+        e[0] = _mm_add_epi32 (e[0], msg[0]); \
+      else \
+        e[(g) % 2] = _mm_sha1nexte_epu32 (e[(g) % 2], msg[(g) % 4]); \
+      e[((g) + 1) % 2] = abcd; \
+      if ((g) >= 3 && (g) <= 18) \
+        msg[((g) + 1) % 4] = _mm_sha1msg2_epu32 (msg[((g) + 1) % 4], msg[(g) % 4]); \
+      abcd = _mm_sha1rnds4_epu32 (abcd, e[(g) % 2], (g) / 5); \
+      if ((g) >= 1 && (g) <= 16) \
+        msg[((g) + 3) % 4] = _mm_sha1msg1_epu32 (msg[((g) + 3) % 4], msg[(g) % 4]); \
+      if ((g) >= 2 && (g) <= 17) \
+        msg[((g) + 2) % 4] = _mm_xor_si128 (msg[((g) + 2) % 4], msg[(g) % 4]); \
+    } \
+  while (0)
+
+__attribute__ ((target ("sha,sse4.1")))
+static void
+sha1_shani_blocks (uint32_t state[5], const uint8_t * data, size_t blocks)
+{
+  __m128i abcd, abcd_save, e_save;
+  __m128i e[2];
+  __m128i msg[4];
+  const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+  abcd = _mm_loadu_si128 ((const __m128i *) state);
+  abcd = _mm_shuffle_epi32 (abcd, 0x1B);
+  e[0] = _mm_set_epi32 ((int)state[4], 0, 0, 0);
+  e[1] = _mm_setzero_si128 ();
+
+  while (blocks-- > 0)
+    {
+      abcd_save = abcd;
+      e_save = e[0];
+
+      msg[0] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(data + 0)), mask);
+      msg[1] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(data + 16)), mask);
+      msg[2] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(data + 32)), mask);
+      msg[3] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(data + 48)), mask);
+
+      SHANI_ROUNDS4 (0);  SHANI_ROUNDS4 (1);  SHANI_ROUNDS4 (2);  SHANI_ROUNDS4 (3);
+      SHANI_ROUNDS4 (4);  SHANI_ROUNDS4 (5);  SHANI_ROUNDS4 (6);  SHANI_ROUNDS4 (7);
+      SHANI_ROUNDS4 (8);  SHANI_ROUNDS4 (9);  SHANI_ROUNDS4 (10); SHANI_ROUNDS4 (11);
+      SHANI_ROUNDS4 (12); SHANI_ROUNDS4 (13); SHANI_ROUNDS4 (14); SHANI_ROUNDS4 (15);
+      SHANI_ROUNDS4 (16); SHANI_ROUNDS4 (17); SHANI_ROUNDS4 (18); SHANI_ROUNDS4 (19);
+
+      e[0] = _mm_sha1nexte_epu32 (e[0], e_save);
+      abcd = _mm_add_epi32 (abcd, abcd_save);
+
+      data += SHA1_BLOCK_SIZE;
+    }
+
+  abcd = _mm_shuffle_epi32 (abcd, 0x1B);
+  _mm_storeu_si128 ((__m128i *) state, abcd);
+  state[4] = (uint32_t) _mm_extract_epi32 (e[0], 3);
+}
+
+#undef SHANI_ROUNDS4
+
+static void
+sha1_shani (const uint8_t * data, size_t len, uint8_t * hash)
+{
+  uint32_t state[5];
+  uint8_t tail[2 * SHA1_BLOCK_SIZE];
+  const size_t tail_blocks = sha1_pad_tail (data, len, tail);
+
+  memcpy (state, sha1_init_state, sizeof (state));
+  sha1_shani_blocks (state, data, len / SHA1_BLOCK_SIZE);
+  sha1_shani_blocks (state, tail, tail_blocks);
+  sha1_export (state, hash);
+}
+
+#endif /* TR_SHA1_SHANI */
+
+/***
+****  Multi-buffer SHA1
+****
+****  Each lane of a vector holds the state of a different message, so
+****  every instruction works on 4 or 8 messages at once. The rounds are
+****  written with GCC's vector extensions, which map to SSE2/AVX2 on x86
+****  and to NEON on ARM.
+***/
+
+#if defined (TR_SHA1_LANES4) || defined (TR_SHA1_LANES8)
+
+/* state[i * lanes + lane] is word i of that lane's state */
+typedef void (* sha1_lanes_func) (uint32_t * state, const uint8_t * const * blocks);
+
+#define SHA1_VEC_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define SHA1_VEC_ROUND(f, k) \
+  do \
+    { \
+      tmp = SHA1_VEC_ROL (a, 5) + (f) + e + (k) + w[t & 15]; \
+      e = d; d = c; c = SHA1_VEC_ROL (b, 30); b = a; a = tmp; \
+    } \
+  while (0)
+
+#define SHA1_VEC_SCHEDULE() \
+  do \
+    { \
+      if (t >= 16) \
+        { \
+          tmp = w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15]; \
+          w[t & 15] = SHA1_VEC_ROL (tmp, 1); \
+        } \
+    } \
+  while (0)
+
+#define SHA1_VEC_COMPRESS(vec_t, lanes) \
+  do \
+    { \
+      int i, t; \
+      vec_t a, b, c, d, e, tmp; \
+      vec_t w[16]; \
+      vec_t s[5]; \
+\
+      for (i=0; i<5; ++i) \
+        memcpy (&s[i], state + i * (lanes), sizeof (vec_t)); \
+\
+      for (t=0; t<16; ++t) \
+        for (i=0; i<(lanes); ++i) \
+          w[t][i] = load_be32 (blocks[i] + t * 4); \
+\
+      a = s[0]; b = s[1]; c = s[2]; d = s[3]; e = s[4]; \
+\
+      for (t=0; t<20; ++t) \
+        { SHA1_VEC_SCHEDULE (); SHA1_VEC_ROUND (d ^ (b & (c ^ d)), 0x5A827999u); } \
+      for (; t<40; ++t) \
+        { SHA1_VEC_SCHEDULE (); SHA1_VEC_ROUND (b ^ c ^ d, 0x6ED9EBA1u); } \
+      for (; t<60; ++t) \
+        { SHA1_VEC_SCHEDULE (); SHA1_VEC_ROUND ((b & c) | (d & (b | c)), 0x8F1BBCDCu); } \
+      for (; t<80; ++t) \
+        { SHA1_VEC_SCHEDULE (); SHA1_VEC_ROUND (b ^ c ^ d, 0xCA62C1D6u); } \
+\
+      s[0] += a; s[1] += b; s[2] += c; s[3] += d; s[4] += e; \
+\
+      for (i=0; i<5; ++i) \
+        memcpy (state + i * (lanes), &s[i], sizeof (vec_t)); \
+    } \
+  while (0)
+
+#ifdef TR_SHA1_LANES4
+typedef uint32_t sha1_vec4 __attribute__ ((vector_size (16)));
+
+static void
+sha1_lanes4_compress (uint32_t * state, const uint8_t * const * blocks)
+{
+  SHA1_VEC_COMPRESS (sha1_vec4, 4);
+}
+#endif
+
+#ifdef TR_SHA1_LANES8
+typedef uint32_t sha1_vec8 __attribute__ ((vector_size (32)));
+
+__attribute__ ((target ("avx2")))
+static void
+sha1_lanes8_compress (uint32_t * state, const uint8_t * const * blocks)
+{
+  SHA1_VEC_COMPRESS (sha1_vec8, 8);
+}
+#endif
+
+#undef SHA1_VEC_COMPRESS
+#undef SHA1_VEC_SCHEDULE
+#undef SHA1_VEC_ROUND
+#undef SHA1_VEC_ROL
+
+struct sha1_lane
+{
+  bool active;
+  size_t job;
+
+  const uint8_t * data;
+  size_t blocks_left;
+
+  uint8_t tail[2 * SHA1_BLOCK_SIZE];
+  size_t tail_blocks;
+  size_t tail_pos;
+};
+
+static void
+sha1_lane_start (struct sha1_lane  * lane,
+                 uint32_t          * state,
+                 size_t              lane_index,
+                 size_t              lanes,
+                 size_t              job,
+                 const uint8_t     * data,
+                 size_t              len)
+{
+  int i;
+
+  lane->active = true;
+  lane->job = job;
+  lane->data = data;
+  lane->blocks_left = len / SHA1_BLOCK_SIZE;
+  lane->tail_blocks = sha1_pad_tail (data, len, lane->tail);
+  lane->tail_pos = 0;
+
+  for (i=0; i<5; ++i)
+    state[i * lanes + lane_index] = sha1_init_state[i];
+}
+
+static const uint8_t *
+sha1_lane_next_block (struct sha1_lane * lane)
+{
+  const uint8_t * block;
+
+  if (lane->blocks_left > 0)
+    {
+      block = lane->data;
+      lane->data += SHA1_BLOCK_SIZE;
+      --lane->blocks_left;
+    }
+  else
+    {
+      block = lane->tail + lane->tail_pos * SHA1_BLOCK_SIZE;
+      ++lane->tail_pos;
+    }
+
+  return block;
+}
+
+static void
+sha1_lanes (size_t                  lanes,
+            sha1_lanes_func         compress,
+            size_t                  count,
+            const void * const    * data,
+            const size_t          * lengths,
+            uint8_t               * hashes)
+{
+  size_t i;
+  size_t next_job = 0;
+  size_t active = 0;
+  uint32_t state[5 * SHA1_MAX_LANES];
+  const uint8_t * blocks[SHA1_MAX_LANES];
+  struct sha1_lane lane[SHA1_MAX_LANES];
+  static const uint8_t idle_block[SHA1_BLOCK_SIZE];
+
+  assert (lanes <= SHA1_MAX_LANES);
+
+  memset (lane, 0, sizeof (lane));
+  memset (state, 0, sizeof (state));
+
+  for (i=0; i<lanes && next_job<count; ++i, ++next_job, ++active)
+    sha1_lane_start (&lane[i], state, i, lanes, next_job, data[next_job], lengths[next_job]);
+
+  while (active > 0)
+    {
+      for (i=0; i<lanes; ++i)
+        blocks[i] = lane[i].active ? sha1_lane_next_block (&lane[i]) : idle_block;
+
+      compress (state, blocks);
+
+      /* when a lane finishes its message, give it the next one */
+      for (i=0; i<lanes; ++i)
+        {
+          int k;
+          uint32_t words[5];
+
+          if (!lane[i].active || lane[i].blocks_left > 0 || lane[i].tail_pos < lane[i].tail_blocks)
+            continue;
+
+          for (k=0; k<5; ++k)
+            words[k] = state[k * lanes + i];
+          sha1_export (words, hashes + lane[i].job * SHA_DIGEST_LENGTH);
+
+          if (next_job < count)
+            {
+              sha1_lane_start (&lane[i], state, i, lanes, next_job, data[next_job], lengths[next_job]);
+              ++next_job;
+            }
+          else
+            {
+              lane[i].active = false;
+              --active;
+            }
+        }
+    }
+}
+
+#endif /* TR_SHA1_LANES4 || TR_SHA1_LANES8 */
+
+/***
+****  Runtime dispatch
+***/
+
+enum
+{
+  KERNEL_BACKEND,
+  KERNEL_LANES4,
+  KERNEL_LANES8,
+  KERNEL_SHANI
+};
+
+static const char * const kernel_names[] =
+{
+  "backend",
+  "simd4",
+  "avx2x8",
+  "sha-ni"
+};
+
+/* the kernel set by tr_sha1_many_use_kernel (), or -1 to pick one by batch size */
+static int kernel = -1;
+
+/* the fastest kernels for single buffers and for batches, or -1 if not timed yet */
+static int single_kernel = -1;
+static int batch_kernel = -1;
+
+#ifdef TR_SHA1_X86
+
+static bool
+cpu_has_avx_state (void)
+{
+  uint32_t eax, edx;
+
+  /* the OS has to save the YMM registers for us */
+  __asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+  return (eax & 0x6) == 0x6;
+}
+
+static void
+cpu_features (bool * shani, bool * avx2)
+{
+  unsigned int eax, ebx, ecx, edx;
+  unsigned int max_level;
+
+  *shani = false;
+  *avx2 = false;
+
+  max_level = __get_cpuid_max (0, NULL);
+  if (max_level < 7)
+    return;
+
+  __cpuid (1, eax, ebx, ecx, edx);
+  if (!(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+    return;
+
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+  *shani = (ebx & (1u << 29)) != 0;
+  *avx2 = (ebx & (1u << 5)) != 0 && (ecx & (1u << 27)) != 0 && cpu_has_avx_state ();
+}
+
+#endif
+
+static bool
+kernel_is_supported (int k)
+{
+#ifdef TR_SHA1_X86
+  bool shani, avx2;
+  cpu_features (&shani, &avx2);
+#endif
+
+  switch (k)
+    {
+      case KERNEL_BACKEND:
+        return true;
+
+#ifdef TR_SHA1_LANES4
+      case KERNEL_LANES4:
+        return true;
+#endif
+
+#ifdef TR_SHA1_LANES8
+      case KERNEL_LANES8:
+        return avx2;
+#endif
+
+#ifdef TR_SHA1_SHANI
+      case KERNEL_SHANI:
+        return shani;
+#endif
+
+      default:
+        return false;
+    }
+}
+
+static bool
+run_kernel (int                   k,
+            size_t                count,
+            const void * const  * data,
+            const size_t        * data_lengths,
+            uint8_t             * hashes)
+{
+  size_t i;
+  bool ret = true;
+
+#ifdef TR_SHA1_SHANI
+  if (k == KERNEL_SHANI)
+    {
+      for (i=0; i<count; ++i)
+        sha1_shani (data[i], data_lengths[i], hashes + i * SHA_DIGEST_LENGTH);
+      return true;
+    }
+#endif
+
+#ifdef TR_SHA1_LANES8
+  /* with only a few messages, most of the lanes would sit idle */
+  if (k == KERNEL_LANES8 && count > 4)
+    {
+      sha1_lanes (8, sha1_lanes8_compress, count, data, data_lengths, hashes);
+      return true;
+    }
+#endif
+
+#ifdef TR_SHA1_LANES4
+  if ((k == KERNEL_LANES8 || k == KERNEL_LANES4) && count > 1)
+    {
+      sha1_lanes (4, sha1_lanes4_compress, count, data, data_lengths, hashes);
+      return true;
+    }
+#endif
+
+  for (i=0; i<count && ret; ++i)
+    ret = tr_sha1 (hashes + i * SHA_DIGEST_LENGTH, data[i], (int)data_lengths[i], NULL);
+
+  return ret;
+}
+
+enum
+{
+  BENCH_BUFFER_SIZE = 32 * 1024,
+  BENCH_BATCH = SHA1_MAX_LANES,
+  BENCH_MAX_ROUNDS = 256
+};
+
+/* CPU time per call of kernel `k', averaged over at least 2 msec */
+static double
+time_kernel (int                   k,
+             size_t                count,
+             const void * const  * data,
+             const size_t        * data_lengths,
+             uint8_t             * hashes)
+{
+  int rounds = 0;
+  clock_t elapsed;
+  const clock_t begin = clock ();
+
+  do
+    {
+      run_kernel (k, count, data, data_lengths, hashes);
+      elapsed = clock () - begin;
+    }
+  while (++rounds < BENCH_MAX_ROUNDS && elapsed < CLOCKS_PER_SEC / 500);
+
+  return (double) elapsed / rounds;
+}
+
+static void
+pick_kernels (void)
+{
+  int k;
+  size_t i;
+  int best_single = KERNEL_BACKEND;
+  int best_batch = KERNEL_BACKEND;
+  double best_single_time = 0;
+  double best_batch_time = 0;
+  uint8_t * buf = tr_new0 (uint8_t, BENCH_BATCH * BENCH_BUFFER_SIZE);
+  const void * data[BENCH_BATCH];
+  size_t lengths[BENCH_BATCH];
+  uint8_t hashes[BENCH_BATCH * SHA_DIGEST_LENGTH];
+
+  for (i=0; i<BENCH_BATCH; ++i)
+    {
+      data[i] = buf + i * BENCH_BUFFER_SIZE;
+      lengths[i] = BENCH_BUFFER_SIZE;
+    }
+
+  for (k=KERNEL_BACKEND; k<=KERNEL_SHANI; ++k)
+    {
+      double t;
+
+      if (!kernel_is_supported (k))
+        continue;
+
+      /* the multi-buffer kernels hash a single buffer with the backend */
+      if (k == KERNEL_BACKEND || k == KERNEL_SHANI)
+        {
+          t = time_kernel (k, 1, data, lengths, hashes);
+          if (k == KERNEL_BACKEND || t < best_single_time)
+            {
+              best_single = k;
+              best_single_time = t;
+            }
+        }
+
+      t = time_kernel (k, BENCH_BATCH, data, lengths, hashes);
+      if (k == KERNEL_BACKEND || t < best_batch_time)
+        {
+          best_batch = k;
+          best_batch_time = t;
+        }
+    }
+
+  tr_free (buf);
+
+  /* both are valid kernels at any time, so racing callers are harmless */
+  single_kernel = best_single;
+  batch_kernel = best_batch;
+}
+
+static int
+get_kernel (size_t count)
+{
+  int k = kernel;
+
+  if (k < 0)
+    {
+      k = count > 1 ? batch_kernel : single_kernel;
+
+      if (k < 0)
+        {
+          pick_kernels ();
+          k = count > 1 ? batch_kernel : single_kernel;
+        }
+    }
+
+  return k;
+}
+
+const char *
+tr_sha1_many_kernel (size_t count)
+{
+  return kernel_names[get_kernel (count)];
+}
+
+bool
+tr_sha1_many_use_kernel (const char * name)
+{
+  size_t i;
+
+  if (strcmp (name, "auto") == 0)
+    {
+      kernel = -1;
+      return true;
+    }
+
+  for (i=0; i<sizeof (kernel_names) / sizeof (*kernel_names); ++i)
+    {
+      if (strcmp (name, kernel_names[i]) == 0 && kernel_is_supported ((int)i))
+        {
+          kernel = (int)i;
+          return true;
+        }
+    }
+
+  return false;
+}
+
+bool
+tr_sha1_many (size_t                count,
+              const void * const  * data,
+              const size_t        * data_lengths,
+              uint8_t             * hashes)
+{
+  assert (count == 0 || data != NULL);
+  assert (count == 0 || data_lengths != NULL);
+  assert (count == 0 || hashes != NULL);
+
+  return run_kernel (get_kernel (count), count, data, data_lengths, hashes);
+}
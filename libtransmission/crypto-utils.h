@@ -60,6 +60,32 @@ bool             tr_sha1_update        (tr_sha1_ctx_t    handle,
 bool             tr_sha1_final         (tr_sha1_ctx_t    handle,
                                         uint8_t        * hash);
 
+/**
+ * @brief Generate the SHA1 hashes of several independent buffers at once.
+ *
+ * Depending on the CPU this uses the SHA extensions, multi-buffer SIMD code
+ * that hashes several buffers in parallel or the crypto backend, whichever
+ * was timed fastest for that batch size, so it pays to hand it as many
+ * buffers as are available. `hashes' gets `count' consecutive digests.
+ */
+bool             tr_sha1_many          (size_t                count,
+                                        const void * const  * data,
+                                        const size_t        * data_lengths,
+                                        uint8_t             * hashes);
+
+/**
+ * @brief Name of the kernel tr_sha1_many () uses for `count' buffers.
+ */
+const char     * tr_sha1_many_kernel   (size_t                count);
+
+/**
+ * @brief Make tr_sha1_many () use a given kernel (for tests and benchmarks).
+ *
+ * "auto" goes back to picking the fastest kernel for each batch size.
+ * @return `false' if the CPU doesn't support it.
+ */
+bool             tr_sha1_many_use_kernel (const char  * name);
+
 /**
  * @brief Allocate and initialize new RC4 cipher context.
  */
@@ -0,0 +1,446 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+
+#include "transmission.h"
+#include "disk-io.h"
+#include "log.h"
+#include "platform.h" /* tr_lock, tr_cond, tr_threadNew () */
+#include "session.h"
+#include "trevent.h"
+#include "utils.h"
+
+#define MY_NAME "DiskIO"
+
+#define dbgmsg(...) \
+  do \
+    { \
+      if (tr_logGetDeepEnabled ()) \
+        tr_logAddDeep (__FILE__, __LINE__, MY_NAME, __VA_ARGS__); \
+    } \
+  while (0)
+
+/***
+****
+***/
+
+struct disk_job
+{
+  const void * owner;
+  tr_disk_work_func work_func;
+  tr_disk_done_func done_func;
+  void * data;
+  bool cancelled;
+  struct disk_job * next;
+};
+
+struct job_queue
+{
+  struct disk_job * head;
+  struct disk_job * tail;
+};
+
+struct tr_diskIo
+{
+  tr_session * session;
+
+  tr_lock * lock;
+  tr_cond * job_added;
+  tr_cond * job_finished;
+
+  struct job_queue queued;
+  struct job_queue running;
+  struct job_queue finished;
+
+  int thread_count;
+  int threads_alive;
+
+  bool delivery_scheduled;
+  bool closing;
+};
+
+/***
+****
+***/
+
+static void
+queue_push (struct job_queue * q, struct disk_job * job)
+{
+  job->next = NULL;
+
+  if (q->tail != NULL)
+    q->tail->next = job;
+  else
+    q->head = job;
+
+  q->tail = job;
+}
+
+static struct disk_job *
+queue_pop (struct job_queue * q)
+{
+  struct disk_job * job = q->head;
+
+  if (job != NULL)
+    {
+      q->head = job->next;
+      if (q->head == NULL)
+        q->tail = NULL;
+      job->next = NULL;
+    }
+
+  return job;
+}
+
+/* remove and return the owner's first job, or NULL if it has none */
+static struct disk_job *
+queue_remove_owner (struct job_queue * q, const void * owner)
+{
+  struct disk_job * prev = NULL;
+  struct disk_job * job;
+
+  for (job=q->head; job!=NULL; prev=job, job=job->next)
+    {
+      if (job->owner != owner)
+        continue;
+
+      if (prev != NULL)
+        prev->next = job->next;
+      else
+        q->head = job->next;
+
+      if (q->tail == job)
+        q->tail = prev;
+
+      job->next = NULL;
+      return job;
+    }
+
+  return NULL;
+}
+
+static void
+queue_remove (struct job_queue * q, struct disk_job * job)
+{
+  struct disk_job * prev = NULL;
+  struct disk_job * walk;
+
+  for (walk=q->head; walk!=NULL; prev=walk, walk=walk->next)
+    {
+      if (walk != job)
+        continue;
+
+      if (prev != NULL)
+        prev->next = job->next;
+      else
+        q->head = job->next;
+
+      if (q->tail == job)
+        q->tail = prev;
+
+      job->next = NULL;
+      break;
+    }
+}
+
+static bool
+queue_has_owner (const struct job_queue * q, const void * owner)
+{
+  const struct disk_job * job;
+
+  for (job=q->head; job!=NULL; job=job->next)
+    if (job->owner == owner)
+      return true;
+
+  return false;
+}
+
+/***
+****
+***/
+
+static void
+finishJob (struct disk_job * job)
+{
+  job->done_func (job->data, job->cancelled);
+  tr_free (job);
+}
+
+/* called in the libtransmission thread after workers finish some jobs */
+static void
+deliverFinishedJobs (void * vsession)
+{
+  struct disk_job * job;
+  tr_session * session = vsession;
+  tr_diskIo * io = session->diskIo;
+
+  /* the pool may have been freed while this call was in the event queue */
+  if (io == NULL)
+    return;
+
+  tr_lockLock (io->lock);
+  io->delivery_scheduled = false;
+
+  while ((job = queue_pop (&io->finished)))
+    {
+      tr_lockUnlock (io->lock);
+      finishJob (job);
+      tr_lockLock (io->lock);
+    }
+
+  tr_lockUnlock (io->lock);
+}
+
+static void
+workerThreadFunc (void * vio)
+{
+  tr_diskIo * io = vio;
+
+  tr_lockLock (io->lock);
+
+  for (;;)
+    {
+      bool schedule_delivery;
+      struct disk_job * job;
+
+      if (io->closing || io->threads_alive > io->thread_count)
+        break;
+
+      if ((job = queue_pop (&io->queued)) == NULL)
+        {
+          tr_condWait (io->job_added, io->lock);
+          continue;
+        }
+
+      queue_push (&io->running, job);
+      tr_lockUnlock (io->lock);
+
+      job->work_func (job->data);
+
+      tr_lockLock (io->lock);
+      queue_remove (&io->running, job);
+      queue_push (&io->finished, job);
+      schedule_delivery = !io->delivery_scheduled;
+      io->delivery_scheduled = true;
+      tr_condBroadcast (io->job_finished);
+
+      /* don't hold our lock while writing to the event pipe */
+      if (schedule_delivery)
+        {
+          tr_lockUnlock (io->lock);
+          tr_runInEventThread (io->session, deliverFinishedJobs, io->session);
+          tr_lockLock (io->lock);
+        }
+    }
+
+  --io->threads_alive;
+  dbgmsg ("worker thread exiting; %d left", io->threads_alive);
+  tr_condBroadcast (io->job_finished);
+  tr_lockUnlock (io->lock);
+}
+
+/***
+****
+***/
+
+tr_diskIo *
+tr_diskIoNew (tr_session * session, int thread_count)
+{
+  tr_diskIo * io = tr_new0 (tr_diskIo, 1);
+
+  io->session = session;
+  io->lock = tr_lockNew ();
+  io->job_added = tr_condNew ();
+  io->job_finished = tr_condNew ();
+
+  tr_diskIoSetThreadCount (io, thread_count);
+
+  return io;
+}
+
+void
+tr_diskIoFree (tr_diskIo * io)
+{
+  struct disk_job * job;
+
+  if (io == NULL)
+    return;
+
+  tr_lockLock (io->lock);
+
+  io->closing = true;
+  tr_condBroadcast (io->job_added);
+  while (io->threads_alive > 0)
+    tr_condWait (io->job_finished, io->lock);
+
+  /* nobody is left to run these... */
+  while ((job = queue_pop (&io->queued)))
+    {
+      job->cancelled = true;
+      queue_push (&io->finished, job);
+    }
+
+  while ((job = queue_pop (&io->finished)))
+    {
+      tr_lockUnlock (io->lock);
+      finishJob (job);
+      tr_lockLock (io->lock);
+    }
+
+  tr_lockUnlock (io->lock);
+
+  tr_condFree (io->job_finished);
+  tr_condFree (io->job_added);
+  tr_lockFree (io->lock);
+  tr_free (io);
+}
+
+void
+tr_diskIoSetThreadCount (tr_diskIo * io, int thread_count)
+{
+  struct disk_job * job;
+
+  assert (io != NULL);
+
+  thread_count = MAX (thread_count, 0);
+
+  tr_lockLock (io->lock);
+
+  if (io->thread_count != thread_count)
+    tr_logAddNamedDbg (MY_NAME, "Using %d disk I/O threads", thread_count);
+
+  io->thread_count = thread_count;
+
+  while (io->threads_alive < io->thread_count)
+    {
+      ++io->threads_alive;
+      tr_threadNew (workerThreadFunc, io);
+    }
+
+  /* wake up any surplus workers so they can exit */
+  tr_condBroadcast (io->job_added);
+
+  /* without workers, whatever is still queued has to be run here */
+  if (io->thread_count == 0)
+    {
+      while ((job = queue_pop (&io->queued)))
+        {
+          tr_lockUnlock (io->lock);
+          job->work_func (job->data);
+          finishJob (job);
+          tr_lockLock (io->lock);
+        }
+    }
+
+  tr_lockUnlock (io->lock);
+}
+
+int
+tr_diskIoGetThreadCount (const tr_diskIo * io)
+{
+  return io->thread_count;
+}
+
+void
+tr_diskIoSubmit (tr_diskIo         * io,
+                 const void        * owner,
+                 tr_disk_work_func   work_func,
+                 tr_disk_done_func   done_func,
+                 void              * job_data)
+{
+  struct disk_job * job;
+
+  assert (io != NULL);
+  assert (work_func != NULL);
+  assert (done_func != NULL);
+  assert (tr_amInEventThread (io->session));
+
+  job = tr_new0 (struct disk_job, 1);
+  job->owner = owner;
+  job->work_func = work_func;
+  job->done_func = done_func;
+  job->data = job_data;
+
+  tr_lockLock (io->lock);
+
+  if (io->thread_count > 0)
+    {
+      queue_push (&io->queued, job);
+      tr_condSignal (io->job_added);
+      job = NULL;
+    }
+
+  tr_lockUnlock (io->lock);
+
+  if (job != NULL)
+    {
+      job->work_func (job->data);
+      finishJob (job);
+    }
+}
+
+static void
+flushOwner (tr_diskIo * io, const void * owner, bool cancel)
+{
+  struct disk_job * job;
+
+  assert (io != NULL);
+  assert (tr_amInEventThread (io->session));
+
+  tr_lockLock (io->lock);
+
+  if (cancel)
+    {
+      while ((job = queue_remove_owner (&io->queued, owner)))
+        {
+          job->cancelled = true;
+          queue_push (&io->finished, job);
+        }
+
+      for (job=io->running.head; job!=NULL; job=job->next)
+        if (job->owner == owner)
+          job->cancelled = true;
+    }
+
+  for (;;)
+    {
+      if ((job = queue_remove_owner (&io->finished, owner)))
+        {
+          if (cancel)
+            job->cancelled = true;
+
+          tr_lockUnlock (io->lock);
+          finishJob (job);
+          tr_lockLock (io->lock);
+        }
+      else if (queue_has_owner (&io->queued, owner) || queue_has_owner (&io->running, owner))
+        {
+          tr_condWait (io->job_finished, io->lock);
+        }
+      else
+        {
+          break;
+        }
+    }
+
+  tr_lockUnlock (io->lock);
+}
+
+void
+tr_diskIoWait (tr_diskIo * io, const void * owner)
+{
+  flushOwner (io, owner, false);
+}
+
+void
+tr_diskIoCancel (tr_diskIo * io, const void * owner)
+{
+  flushOwner (io, owner, true);
+}
@@ -0,0 +1,62 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#pragma once
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * A pool of worker threads that run blocking disk operations
+ * so that the libtransmission thread never has to wait on a slow disk.
+ *
+ * Each job has an owner (a torrent, a peer, ...) used to wait for or
+ * cancel all of that owner's jobs at once. The job's done function is
+ * always called in the libtransmission thread.
+ *
+ * With zero threads, jobs are run synchronously in tr_diskIoSubmit ().
+ */
+typedef struct tr_diskIo tr_diskIo;
+
+/** @brief does the blocking part of a job. Called in a worker thread. */
+typedef void (* tr_disk_work_func) (void * job_data);
+
+/** @brief called in the libtransmission thread when a job is finished.
+    If `cancelled' is true, the job's owner is going away and must not be used. */
+typedef void (* tr_disk_done_func) (void * job_data, bool cancelled);
+
+tr_diskIo * tr_diskIoNew (tr_session * session, int thread_count);
+
+void tr_diskIoFree (tr_diskIo * io);
+
+void tr_diskIoSetThreadCount (tr_diskIo * io, int thread_count);
+
+int  tr_diskIoGetThreadCount (const tr_diskIo * io);
+
+void tr_diskIoSubmit (tr_diskIo         * io,
+                      const void        * owner,
+                      tr_disk_work_func   work_func,
+                      tr_disk_done_func   done_func,
+                      void              * job_data);
+
+/** @brief block until all of the owner's jobs are done and their
+           done functions have been called */
+void tr_diskIoWait (tr_diskIo * io, const void * owner);
+
+/** @brief drop the owner's queued jobs and wait for its running ones.
+           Every one of them gets its done function called as cancelled. */
+void tr_diskIoCancel (tr_diskIo * io, const void * owner);
+
+/* @} */
@@ -0,0 +1,169 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include "transmission.h"
+#include "fdlimit.h"
+#include "file.h"
+#include "session.h" /* tr_sessionLock () */
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+/* every cached entry opens the same file; only the torrent id and
+   file index tell them apart */
+static char *
+create_test_file (tr_session * session)
+{
+  char * path = tr_buildPath (tr_sessionGetDownloadDir (session), "fdlimit-test.txt", NULL);
+
+  libtest_create_file_with_string_contents (path, "hello, world!\n");
+  return path;
+}
+
+static bool
+checkout (tr_session * session, const char * path, int torrent_id, tr_file_index_t i)
+{
+  return tr_fdFileCheckout (session, torrent_id, i, path, false, TR_PREALLOCATE_NONE, 0) != TR_BAD_SYS_FILE;
+}
+
+static bool
+is_cached (tr_session * session, int torrent_id, tr_file_index_t i)
+{
+  return tr_fdFileGetCached (session, torrent_id, i, false) != TR_BAD_SYS_FILE;
+}
+
+static int
+test_lru (void)
+{
+  tr_file_index_t i;
+  tr_sys_file_t fd;
+  tr_session * session = libttest_session_init (NULL);
+  char * path = create_test_file (session);
+
+  tr_fdSetFileLimit (session, 3);
+  check_int_eq (3, tr_fdGetFileLimit (session));
+
+  /* only the three most recently used files stay open */
+  for (i=0; i<5; ++i)
+    check (checkout (session, path, 1, i));
+  check (!is_cached (session, 1, 0));
+  check (!is_cached (session, 1, 1));
+  check (is_cached (session, 1, 2));
+  check (is_cached (session, 1, 3));
+  check (is_cached (session, 1, 4));
+
+  /* using file 2 again makes file 3 the least recently used one */
+  fd = tr_fdFileGetCached (session, 1, 2, false);
+  check (tr_fdFileCheckout (session, 1, 2, path, false, TR_PREALLOCATE_NONE, 0) == fd);
+  check (checkout (session, path, 1, 5));
+  check (is_cached (session, 1, 2));
+  check (!is_cached (session, 1, 3));
+  check (is_cached (session, 1, 4));
+  check (is_cached (session, 1, 5));
+
+  /* shrinking the limit closes the least recently used files */
+  tr_fdSetFileLimit (session, 1);
+  check (!is_cached (session, 1, 2));
+  check (!is_cached (session, 1, 4));
+  check (is_cached (session, 1, 5));
+
+  tr_sys_path_remove (path, NULL);
+  tr_free (path);
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_hash (void)
+{
+  int id;
+  tr_file_index_t i;
+  enum { TORRENT_COUNT = 4, FILE_COUNT = 25 };
+  tr_session * session = libttest_session_init (NULL);
+  char * path = create_test_file (session);
+
+  tr_sessionSetPeerLimit (session, 8);
+  tr_fdSetFileLimit (session, TORRENT_COUNT * FILE_COUNT);
+
+  /* the same file indices in several torrents, enough to grow the table a few times */
+  for (id=1; id<=TORRENT_COUNT; ++id)
+    for (i=0; i<FILE_COUNT; ++i)
+      check (checkout (session, path, id, i));
+
+  for (id=1; id<=TORRENT_COUNT; ++id)
+    for (i=0; i<FILE_COUNT; ++i)
+      check (is_cached (session, id, i));
+  check (!is_cached (session, TORRENT_COUNT + 1, 0));
+  check (!is_cached (session, 1, FILE_COUNT));
+
+  /* closing one torrent's files leaves the others alone */
+  tr_sessionLock (session);
+  tr_fdTorrentClose (session, 2);
+  tr_sessionUnlock (session);
+  for (id=1; id<=TORRENT_COUNT; ++id)
+    for (i=0; i<FILE_COUNT; ++i)
+      check (is_cached (session, id, i) == (id != 2));
+
+  tr_sys_path_remove (path, NULL);
+  tr_free (path);
+  libttest_session_close (session);
+  return 0;
+}
+
+#ifndef _WIN32
+
+static int
+test_peer_limit (void)
+{
+  tr_file_index_t i;
+  tr_session * session = libttest_session_init (NULL);
+  char * path = create_test_file (session);
+
+  /* with no descriptors left over for files, only one is kept open */
+  tr_sessionSetPeerLimit (session, UINT16_MAX);
+  tr_fdSetFileLimit (session, 10);
+  check_int_eq (10, tr_fdGetFileLimit (session));
+  for (i=0; i<3; ++i)
+    check (checkout (session, path, 1, i));
+  check (!is_cached (session, 1, 0));
+  check (!is_cached (session, 1, 1));
+  check (is_cached (session, 1, 2));
+
+  /* lowering the peer limit gives the files their descriptors back */
+  tr_sessionSetPeerLimit (session, 8);
+  check_int_eq (10, tr_fdGetFileLimit (session));
+  for (i=0; i<3; ++i)
+    check (checkout (session, path, 1, i));
+  for (i=0; i<3; ++i)
+    check (is_cached (session, 1, i));
+
+  tr_sys_path_remove (path, NULL);
+  tr_free (path);
+  libttest_session_close (session);
+  return 0;
+}
+
+#endif
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_lru,
+                             test_hash,
+#ifndef _WIN32
+                             test_peer_limit,
+#endif
+                           };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
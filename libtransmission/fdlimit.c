@@ -10,8 +10,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h> /* INT_MAX */
 #include <string.h>
 
+#include <event2/event.h> /* event_base_get_method () */
+
 #ifndef _WIN32
  #include <sys/time.h> /* getrlimit */
  #include <sys/resource.h> /* getrlimit */
@@ -22,9 +25,11 @@
 #include "error-types.h"
 #include "fdlimit.h"
 #include "file.h"
+#include "inout.h" /* TR_IO_MAX_FILE_SEGMENTS */
 #include "log.h"
 #include "session.h"
 #include "torrent.h" /* tr_isTorrent () */
+#include "web.h" /* tr_webUsesSelect () */
 
 #define dbgmsg(...) \
   do \
@@ -40,6 +45,12 @@
 ****
 ***/
 
+enum
+{
+  /* how many zeroes to write at a time when the system can't preallocate */
+  PREALLOCATE_BUFFER_SIZE = 1024 * 1024
+};
+
 static bool
 preallocate_file_sparse (tr_sys_file_t fd, uint64_t length, tr_error ** error)
 {
@@ -71,8 +82,12 @@ preallocate_file_sparse (tr_sys_file_t fd, uint64_t length, tr_error ** error)
   return false;
 }
 
-static bool
-preallocate_file_full (tr_sys_file_t fd, uint64_t length, tr_error ** error)
+bool
+tr_fdPreallocateFull (tr_sys_file_t             fd,
+                      uint64_t                  length,
+                      const volatile bool     * stop,
+                      volatile uint64_t       * bytes_done,
+                      tr_error               ** error)
 {
   tr_error * my_error = NULL;
 
@@ -80,27 +95,36 @@ preallocate_file_full (tr_sys_file_t fd, uint64_t length, tr_error ** error)
     return true;
 
   if (tr_sys_file_preallocate (fd, length, 0, &my_error))
-    return true;
+    {
+      if (bytes_done != NULL)
+        *bytes_done = length;
+      return true;
+    }
 
   dbgmsg ("Preallocating (full, normal) failed (%d): %s", my_error->code, my_error->message);
 
   if (!TR_ERROR_IS_ENOSPC (my_error->code))
     {
-      uint8_t buf[4096];
+      uint8_t * buf = tr_new0 (uint8_t, PREALLOCATE_BUFFER_SIZE);
+      uint64_t offset = 0;
       bool success = true;
 
-      memset (buf, 0, sizeof (buf));
       tr_error_clear (&my_error);
 
       /* fallback: the old-fashioned way */
-      while (success && length > 0)
+      while (success && offset < length && (stop == NULL || !*stop))
         {
-          const uint64_t thisPass = MIN (length, sizeof (buf));
+          const uint64_t thisPass = MIN (length - offset, PREALLOCATE_BUFFER_SIZE);
           uint64_t bytes_written;
-          success = tr_sys_file_write (fd, buf, thisPass, &bytes_written, &my_error);
-          length -= bytes_written;
+          success = tr_sys_file_write_at (fd, buf, thisPass, offset, &bytes_written, &my_error);
+          offset += bytes_written;
+
+          if (bytes_done != NULL)
+            *bytes_done = offset;
         }
 
+      tr_free (buf);
+
       if (success)
         return true;
 
@@ -117,39 +141,13 @@ preallocate_file_full (tr_sys_file_t fd, uint64_t length, tr_error ** error)
 ******
 *****/
 
-struct tr_cached_file
-{
-  bool is_writable;
-  tr_sys_file_t fd;
-  int torrent_id;
-  tr_file_index_t file_index;
-  time_t used_at;
-};
-
-static inline bool
-cached_file_is_open (const struct tr_cached_file * o)
-{
-  assert (o != NULL);
-
-  return o->fd != TR_BAD_SYS_FILE;
-}
-
-static void
-cached_file_close (struct tr_cached_file * o)
-{
-  assert (cached_file_is_open (o));
-
-  tr_sys_file_close (o->fd, NULL);
-  o->fd = TR_BAD_SYS_FILE;
-}
-
 /**
  * returns 0 on success, or an errno value on failure.
  * errno values include ENOENT if the parent folder doesn't exist,
  * plus the errno values set by tr_sys_dir_create () and tr_sys_file_open ().
  */
 static int
-cached_file_open (struct tr_cached_file  * o,
+cached_file_open (tr_sys_file_t          * setme,
                   const char             * filename,
                   bool                     writable,
                   tr_preallocation_mode    allocation,
@@ -204,7 +202,7 @@ cached_file_open (struct tr_cached_file  * o,
 
       if (allocation == TR_PREALLOCATE_FULL)
         {
-          success = preallocate_file_full (fd, file_size, &error);
+          success = tr_fdPreallocateFull (fd, file_size, NULL, NULL, &error);
           type = _("full");
         }
       else if (allocation == TR_PREALLOCATE_SPARSE)
@@ -237,7 +235,7 @@ cached_file_open (struct tr_cached_file  * o,
       goto fail;
     }
 
-  o->fd = fd;
+  *setme = fd;
   return 0;
 
 fail:
@@ -256,91 +254,247 @@ fail:
 ****
 ***/
 
+struct tr_cached_file
+{
+  bool is_writable;
+  tr_sys_file_t fd;
+  int torrent_id;
+  tr_file_index_t file_index;
+
+  struct tr_cached_file * hash_next; /* next file in the same hash bucket */
+  struct tr_cached_file * lru_prev;  /* more recently used */
+  struct tr_cached_file * lru_next;  /* less recently used */
+
+  /* a pinned file isn't closed while a disk I/O thread is using it.
+   * If it's removed from the set meanwhile, it's closed when unpinned */
+  int pin_count;
+  bool is_removed;
+};
+
+/* the open files. A hash table finds a file by torrent and file index,
+ * and a least-recently-used list picks the file to close when the limit
+ * is reached, so both stay fast however many files are kept open */
 struct tr_fileset
 {
-  struct tr_cached_file * begin;
-  const struct tr_cached_file * end;
+  struct tr_cached_file ** buckets;
+  size_t bucket_count;
+
+  struct tr_cached_file * lru_head; /* most recently used */
+  struct tr_cached_file * lru_tail; /* least recently used */
+
+  int count;
+  int limit;
+};
+
+enum
+{
+  FILESET_MIN_BUCKET_COUNT = 64
 };
 
+static inline size_t
+fileset_hash (int torrent_id, tr_file_index_t i)
+{
+  uint32_t h = ((uint32_t)torrent_id * 0x9E3779B1u) ^ i;
+
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+
+  return h;
+}
+
 static void
-fileset_construct (struct tr_fileset * set, int n)
+fileset_resize (struct tr_fileset * set, size_t bucket_count)
 {
-  struct tr_cached_file * o;
-  const struct tr_cached_file TR_CACHED_FILE_INIT = { false, TR_BAD_SYS_FILE, 0, 0, 0 };
+  size_t i;
+  struct tr_cached_file ** buckets = tr_new0 (struct tr_cached_file *, bucket_count);
+
+  for (i=0; i<set->bucket_count; ++i)
+    {
+      struct tr_cached_file * o = set->buckets[i];
 
-  set->begin = tr_new (struct tr_cached_file, n);
-  set->end = set->begin + n;
+      while (o != NULL)
+        {
+          struct tr_cached_file * next = o->hash_next;
+          const size_t bucket = fileset_hash (o->torrent_id, o->file_index) & (bucket_count - 1);
+          o->hash_next = buckets[bucket];
+          buckets[bucket] = o;
+          o = next;
+        }
+    }
 
-  for (o=set->begin; o!=set->end; ++o)
-    *o = TR_CACHED_FILE_INIT;
+  tr_free (set->buckets);
+  set->buckets = buckets;
+  set->bucket_count = bucket_count;
 }
 
 static void
-fileset_close_all (struct tr_fileset * set)
+fileset_construct (struct tr_fileset * set, int limit)
 {
-  struct tr_cached_file * o;
+  memset (set, 0, sizeof (*set));
+  set->limit = limit;
+}
+
+static void
+lru_remove (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  if (o->lru_prev != NULL)
+    o->lru_prev->lru_next = o->lru_next;
+  else
+    set->lru_head = o->lru_next;
+
+  if (o->lru_next != NULL)
+    o->lru_next->lru_prev = o->lru_prev;
+  else
+    set->lru_tail = o->lru_prev;
+
+  o->lru_prev = o->lru_next = NULL;
+}
+
+static void
+lru_push_head (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  o->lru_prev = NULL;
+  o->lru_next = set->lru_head;
+
+  if (set->lru_head != NULL)
+    set->lru_head->lru_prev = o;
+  else
+    set->lru_tail = o;
+
+  set->lru_head = o;
+}
+
+static void
+cached_file_free (struct tr_cached_file * o)
+{
+  tr_sys_file_close (o->fd, NULL);
+  tr_free (o);
+}
+
+/* forget about the file and close it, or let the last unpin close it */
+static void
+fileset_remove (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  struct tr_cached_file ** walk = &set->buckets[fileset_hash (o->torrent_id, o->file_index) & (set->bucket_count - 1)];
+
+  while (*walk != o)
+    walk = &(*walk)->hash_next;
+  *walk = o->hash_next;
 
+  lru_remove (set, o);
+  --set->count;
+
+  if (o->pin_count > 0)
+    o->is_removed = true;
+  else
+    cached_file_free (o);
+}
+
+/* close the least recently used files until there are at most `limit' open.
+ * Pinned files are skipped, so there may be more than that for a while */
+static void
+fileset_trim (struct tr_fileset * set, int limit)
+{
+  struct tr_cached_file * o = set->lru_tail;
+
+  while (set->count > limit && o != NULL)
+    {
+      struct tr_cached_file * prev = o->lru_prev;
+
+      if (o->pin_count == 0)
+        fileset_remove (set, o);
+
+      o = prev;
+    }
+}
+
+static void
+fileset_close_all (struct tr_fileset * set)
+{
   if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if (cached_file_is_open (o))
-        cached_file_close (o);
+    while (set->lru_tail != NULL)
+      fileset_remove (set, set->lru_tail);
 }
 
 static void
 fileset_destruct (struct tr_fileset * set)
 {
   fileset_close_all (set);
-  tr_free (set->begin);
-  set->end = set->begin = NULL;
+  tr_free (set->buckets);
+  set->buckets = NULL;
+  set->bucket_count = 0;
 }
 
 static void
 fileset_close_torrent (struct tr_fileset * set, int torrent_id)
 {
   struct tr_cached_file * o;
+  struct tr_cached_file * next;
 
   if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if ((o->torrent_id == torrent_id) && cached_file_is_open (o))
-        cached_file_close (o);
+    for (o=set->lru_head; o!=NULL; o=next)
+      {
+        next = o->lru_next;
+
+        if (o->torrent_id == torrent_id)
+          fileset_remove (set, o);
+      }
 }
 
 static struct tr_cached_file *
 fileset_lookup (struct tr_fileset * set, int torrent_id, tr_file_index_t i)
 {
-  struct tr_cached_file * o;
+  struct tr_cached_file * o = NULL;
 
-  if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if ((torrent_id == o->torrent_id) && (i == o->file_index) && cached_file_is_open (o))
-        return o;
+  if (set != NULL && set->bucket_count != 0)
+    for (o=set->buckets[fileset_hash (torrent_id, i) & (set->bucket_count - 1)]; o!=NULL; o=o->hash_next)
+      if ((torrent_id == o->torrent_id) && (i == o->file_index))
+        break;
+
+  return o;
+}
 
-  return NULL;
+/* mark a file as the most recently used */
+static void
+fileset_touch (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  if (set->lru_head != o)
+    {
+      lru_remove (set, o);
+      lru_push_head (set, o);
+    }
 }
 
+/* add a newly-opened file, closing the least recently used one if needed */
 static struct tr_cached_file *
-fileset_get_empty_slot (struct tr_fileset * set)
+fileset_add (struct tr_fileset * set,
+             int                 torrent_id,
+             tr_file_index_t     i,
+             tr_sys_file_t       fd,
+             bool                is_writable)
 {
-  struct tr_cached_file * cull = NULL;
+  size_t bucket;
+  struct tr_cached_file * o = tr_new0 (struct tr_cached_file, 1);
 
-  if (set->begin != NULL)
-    {
-      struct tr_cached_file * o;
+  fileset_trim (set, set->limit - 1);
 
-      /* try to find an unused slot */
-      for (o=set->begin; o!=set->end; ++o)
-        if (!cached_file_is_open (o))
-          return o;
+  if ((size_t)set->count >= set->bucket_count)
+    fileset_resize (set, MAX (FILESET_MIN_BUCKET_COUNT, set->bucket_count * 2));
 
-      /* all slots are full... recycle the least recently used */
-      for (cull=NULL, o=set->begin; o!=set->end; ++o)
-        if (!cull || o->used_at < cull->used_at)
-          cull = o;
+  o->fd = fd;
+  o->is_writable = is_writable;
+  o->torrent_id = torrent_id;
+  o->file_index = i;
 
-      cached_file_close (cull);
-    }
+  bucket = fileset_hash (torrent_id, i) & (set->bucket_count - 1);
+  o->hash_next = set->buckets[bucket];
+  set->buckets[bucket] = o;
+
+  lru_push_head (set, o);
+  ++set->count;
 
-  return cull;
+  return o;
 }
 
 /***
@@ -352,9 +506,30 @@ fileset_get_empty_slot (struct tr_fileset * set)
 struct tr_fdInfo
 {
   int peerCount;
+  int fileLimit; /* the limit asked for; the fileset's may be lower */
   struct tr_fileset fileset;
 };
 
+enum
+{
+  /* descriptors left for listening sockets, DHT, uTP, RPC, logs, verify... */
+  FD_RESERVE = 32,
+
+  /* how far to raise the descriptor limit when nothing uses select ().
+     It's OPEN_MAX on OS X, and room for thousands of files and peers */
+  FD_LIMIT_MAX = 10240
+};
+
+/* select () can't watch descriptors at or above FD_SETSIZE, so if
+ * anything uses it, there can't be more descriptors than that */
+static bool
+fdsAreSelected (const tr_session * session)
+{
+  return tr_webUsesSelect ()
+      || session->event_base == NULL
+      || strcmp (event_base_get_method (session->event_base), "select") == 0;
+}
+
 static void
 ensureSessionFdInfoExists (tr_session * session)
 {
@@ -363,20 +538,24 @@ ensureSessionFdInfoExists (tr_session * session)
   if (session->fdInfo == NULL)
     {
       struct tr_fdInfo * i;
-      const int FILE_CACHE_SIZE = 32;
 
-      /* Create the local file cache */
+      /* Create the local file cache. It's sized by tr_fdSetFileLimit ()
+       * when the session's open-file-limit setting is loaded */
       i = tr_new0 (struct tr_fdInfo, 1);
-      fileset_construct (&i->fileset, FILE_CACHE_SIZE);
+      i->fileLimit = 1;
+      fileset_construct (&i->fileset, i->fileLimit);
       session->fdInfo = i;
 
 #ifndef _WIN32
-      /* set the open-file limit to the largest safe size wrt FD_SETSIZE */
+      /* set the open-file limit to the largest safe size wrt FD_SETSIZE,
+         or, if nothing uses select (), raise it to make room for more */
       struct rlimit limit;
       if (!getrlimit (RLIMIT_NOFILE, &limit))
         {
+          const bool selected = fdsAreSelected (session);
           const int old_limit = (int) limit.rlim_cur;
-          const int new_limit = MIN (limit.rlim_max, FD_SETSIZE);
+          const int new_limit = selected ? (int) MIN (limit.rlim_max, FD_SETSIZE)
+                                         : (int) MAX (limit.rlim_cur, MIN (limit.rlim_max, FD_LIMIT_MAX));
           if (new_limit != old_limit)
             {
               limit.rlim_cur = new_limit;
@@ -415,34 +594,108 @@ get_fileset (tr_session * session)
   return &session->fdInfo->fileset;
 }
 
+/* the most local files that can be kept open without running out of
+ * descriptors for the peers' sockets and the zero-copy uploads' dup ()s */
+static int
+getSafeFileLimit (const tr_session * session, int limit)
+{
+#ifndef _WIN32
+  struct rlimit rl;
+
+  if (!getrlimit (RLIMIT_NOFILE, &rl))
+    {
+      const int fd_limit = fdsAreSelected (session) ? (int) MIN (rl.rlim_cur, FD_SETSIZE)
+                                                    : (int) MIN (rl.rlim_cur, INT_MAX);
+      const int available = fd_limit - session->peerLimit - TR_IO_MAX_FILE_SEGMENTS - FD_RESERVE;
+
+      limit = MIN (limit, available);
+    }
+#endif
+
+  return MAX (1, limit);
+}
+
+void
+tr_fdSetFileLimit (tr_session * session, int limit)
+{
+  struct tr_fileset * set = get_fileset (session);
+  const int safe_limit = getSafeFileLimit (session, limit);
+
+  if (safe_limit < limit && safe_limit != set->limit)
+    tr_logAddError (_("Open file limit %1$d is too high for %2$d peers; keeping at most %3$d files open"),
+                    limit, (int) session->peerLimit, safe_limit);
+
+  session->fdInfo->fileLimit = limit;
+  set->limit = safe_limit;
+  fileset_trim (set, set->limit);
+}
+
+int
+tr_fdGetFileLimit (tr_session * session)
+{
+  get_fileset (session);
+  return session->fdInfo->fileLimit;
+}
+
 void
 tr_fdFileClose (tr_session * s, const tr_torrent * tor, tr_file_index_t i)
 {
+  struct tr_fileset * set = get_fileset (s);
   struct tr_cached_file * o;
 
-  if ((o = fileset_lookup (get_fileset (s), tr_torrentId (tor), i)))
+  if ((o = fileset_lookup (set, tr_torrentId (tor), i)))
     {
       /* flush writable files so that their mtimes will be
        * up-to-date when this function returns to the caller... */
       if (o->is_writable)
         tr_sys_file_flush (o->fd, NULL);
 
-      cached_file_close (o);
+      fileset_remove (set, o);
     }
 }
 
 tr_sys_file_t
 tr_fdFileGetCached (tr_session * s, int torrent_id, tr_file_index_t i, bool writable)
 {
-  struct tr_cached_file * o = fileset_lookup (get_fileset (s), torrent_id, i);
+  struct tr_fileset * set = get_fileset (s);
+  struct tr_cached_file * o = fileset_lookup (set, torrent_id, i);
 
   if (!o || (writable && !o->is_writable))
     return TR_BAD_SYS_FILE;
 
-  o->used_at = tr_time ();
+  fileset_touch (set, o);
   return o->fd;
 }
 
+struct tr_cached_file *
+tr_fdFilePin (tr_session * s, int torrent_id, tr_file_index_t i, bool writable, tr_sys_file_t * setme_fd)
+{
+  struct tr_cached_file * o = fileset_lookup (get_fileset (s), torrent_id, i);
+
+  if (!o || (writable && !o->is_writable))
+    return NULL;
+
+  ++o->pin_count;
+  *setme_fd = o->fd;
+  return o;
+}
+
+void
+tr_fdFileUnpin (tr_session * s, struct tr_cached_file * o)
+{
+  struct tr_fileset * set = get_fileset (s);
+
+  assert (o->pin_count > 0);
+
+  if (--o->pin_count > 0)
+    return;
+
+  if (o->is_removed)
+    cached_file_free (o);
+  else if (set->count > set->limit)
+    fileset_trim (set, set->limit);
+}
+
 bool
 tr_fdFileGetCachedMTime (tr_session * s, int torrent_id, tr_file_index_t i, time_t * mtime)
 {
@@ -478,13 +731,16 @@ tr_fdFileCheckout (tr_session             * session,
   struct tr_cached_file * o = fileset_lookup (set, torrent_id, i);
 
   if (o && writable && !o->is_writable)
-    cached_file_close (o); /* close it so we can reopen in rw mode */
-  else if (!o)
-    o = fileset_get_empty_slot (set);
+    {
+      /* close it so we can reopen in rw mode */
+      fileset_remove (set, o);
+      o = NULL;
+    }
 
-  if (!cached_file_is_open (o))
+  if (o == NULL)
     {
-      const int err = cached_file_open (o, filename, writable, allocation, file_size);
+      tr_sys_file_t fd = TR_BAD_SYS_FILE;
+      const int err = cached_file_open (&fd, filename, writable, allocation, file_size);
       if (err)
         {
           errno = err;
@@ -492,13 +748,11 @@ tr_fdFileCheckout (tr_session             * session,
         }
 
       dbgmsg ("opened '%s' writable %c", filename, writable?'y':'n');
-      o->is_writable = writable;
+      o = fileset_add (set, torrent_id, i, fd, writable);
     }
 
   dbgmsg ("checking out '%s'", filename);
-  o->torrent_id = torrent_id;
-  o->file_index = i;
-  o->used_at = tr_time ();
+  fileset_touch (set, o);
   return o->fd;
 }
 
@@ -47,11 +47,43 @@ tr_sys_file_t  tr_fdFileCheckout (tr_session             * session,
                                   tr_preallocation_mode    preallocation_mode,
                                   uint64_t                 preallocation_file_size);
 
+/**
+ * Reserve all of a file's space, writing zeroes over it if the system
+ * has no quicker way. That can take a long time on a big file, so
+ * inout.c calls this from a disk I/O thread rather than letting
+ * tr_fdFileCheckout () do it.
+ *
+ * If `stop' becomes true, the zeroing ends early. `bytes_done' is updated
+ * as it goes. Both are optional.
+ */
+bool tr_fdPreallocateFull (tr_sys_file_t             fd,
+                           uint64_t                  length,
+                           const volatile bool     * stop,
+                           volatile uint64_t       * bytes_done,
+                           struct tr_error        ** error);
+
 tr_sys_file_t tr_fdFileGetCached (tr_session             * session,
                                   int                      torrent_id,
                                   tr_file_index_t          file_num,
                                   bool                     doWrite);
 
+/**
+ * Keeps an open file in the pool from being closed until tr_fdFileUnpin ()
+ * is called, even if tr_fdFileClose () closes it or it's pushed out of the
+ * pool meanwhile. This lets the disk I/O threads use the pool's descriptor
+ * instead of needing copies of their own.
+ *
+ * @return the pinned file, or NULL if it isn't open in the right mode
+ */
+struct tr_cached_file * tr_fdFilePin (tr_session             * session,
+                                      int                      torrent_id,
+                                      tr_file_index_t          file_num,
+                                      bool                     doWrite,
+                                      tr_sys_file_t          * setme_fd);
+
+void tr_fdFileUnpin (tr_session             * session,
+                     struct tr_cached_file  * file);
+
 bool tr_fdFileGetCachedMTime (tr_session       * session,
                               int                torrent_id,
                               tr_file_index_t    file_num,
@@ -76,6 +108,19 @@ void tr_fdFileClose (tr_session        * session,
  */
 void tr_fdTorrentClose (tr_session * session, int torrentId);
 
+/**
+ * Sets how many local files may be kept open at once.
+ * Torrents with many small files need a bigger pool to avoid
+ * reopening the same files over and over again.
+ *
+ * The pool is kept smaller if the process' descriptor limit wouldn't
+ * leave enough room for the session's peer limit. Call this again when
+ * the peer limit changes. tr_fdGetFileLimit () returns the limit as set.
+ */
+void tr_fdSetFileLimit (tr_session * session, int limit);
+
+int  tr_fdGetFileLimit (tr_session * session);
+
 
 /***********************************************************************
  * Sockets
@@ -15,7 +15,7 @@
  #define _XOPEN_SOURCE 600
 #endif
 
-#if (defined (HAVE_FALLOCATE64) || defined (HAVE_CANONICALIZE_FILE_NAME)) && !defined (_GNU_SOURCE)
+#if (defined (HAVE_FALLOCATE64) || defined (HAVE_CANONICALIZE_FILE_NAME) || defined (HAVE_COPY_FILE_RANGE)) && !defined (_GNU_SOURCE)
  #define _GNU_SOURCE
 #endif
 
@@ -35,12 +35,18 @@
 #include <sys/mman.h> /* mmap (), munmap () */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h> /* pwritev () */
 #include <unistd.h> /* lseek (), write (), ftruncate (), pread (), pwrite (), pathconf (), etc */
 
 #ifdef HAVE_XFS_XFS_H
  #include <xfs/xfs.h>
 #endif
 
+#ifdef HAVE_LINUX_FS_H
+ #include <sys/ioctl.h> /* ioctl () */
+ #include <linux/fs.h> /* FICLONE */
+#endif
+
 #include "transmission.h"
 #include "error.h"
 #include "file.h"
@@ -65,11 +71,19 @@
  #define PATH_MAX 4096
 #endif
 
+/* the most regions passed to one pwritev () call */
+#define MAX_WRITE_VEC_COUNT 256
+#if defined (IOV_MAX) && IOV_MAX < MAX_WRITE_VEC_COUNT
+ #undef MAX_WRITE_VEC_COUNT
+ #define MAX_WRITE_VEC_COUNT IOV_MAX
+#endif
+
 /* don't use pread/pwrite on old versions of uClibc because they're buggy.
  * https://trac.transmissionbt.com/ticket/3826 */
 #if defined (__UCLIBC__) && !TR_UCLIBC_CHECK_VERSION (0, 9, 28)
  #undef HAVE_PREAD
  #undef HAVE_PWRITE
+ #undef HAVE_PWRITEV
 #endif
 
 #ifdef __APPLE__
@@ -285,6 +299,27 @@ tr_sys_path_is_same (const char  * path1,
   return ret;
 }
 
+bool
+tr_sys_path_get_device (const char  * path,
+                        uint64_t    * device,
+                        tr_error   ** error)
+{
+  bool ret;
+  struct stat sb;
+
+  assert (path != NULL);
+  assert (device != NULL);
+
+  ret = stat (path, &sb) != -1;
+
+  if (ret)
+    *device = (uint64_t) sb.st_dev;
+  else
+    set_system_error (error, errno);
+
+  return ret;
+}
+
 char *
 tr_sys_path_resolve (const char  * path,
                      tr_error   ** error)
@@ -487,6 +522,26 @@ tr_sys_file_open_temp (char      * path_template,
   return ret;
 }
 
+tr_sys_file_t
+tr_sys_file_dup (tr_sys_file_t    handle,
+                 tr_error      ** error)
+{
+  tr_sys_file_t ret;
+
+  assert (handle != TR_BAD_SYS_FILE);
+
+#ifdef F_DUPFD_CLOEXEC
+  ret = fcntl (handle, F_DUPFD_CLOEXEC, 0);
+#else
+  ret = dup (handle);
+#endif
+
+  if (ret == TR_BAD_SYS_FILE)
+    set_system_error (error, errno);
+
+  return ret;
+}
+
 bool
 tr_sys_file_close (tr_sys_file_t    handle,
                    tr_error      ** error)
@@ -711,6 +766,87 @@ tr_sys_file_write_at (tr_sys_file_t    handle,
   return ret;
 }
 
+bool
+tr_sys_file_write_vec_at (tr_sys_file_t        handle,
+                          const tr_sys_iovec * vec,
+                          size_t               vec_count,
+                          uint64_t             offset,
+                          uint64_t           * bytes_written,
+                          tr_error          ** error)
+{
+  bool ret = false;
+  ssize_t my_bytes_written;
+
+  TR_STATIC_ASSERT (sizeof (*bytes_written) >= sizeof (my_bytes_written), "");
+
+  assert (handle != TR_BAD_SYS_FILE);
+  assert (vec != NULL || vec_count == 0);
+  /* seek requires signed offset, so it should be in mod range */
+  assert (offset < UINT64_MAX / 2);
+
+#ifdef HAVE_PWRITEV
+
+  {
+    size_t i;
+    struct iovec iov[MAX_WRITE_VEC_COUNT];
+
+    vec_count = MIN (vec_count, MAX_WRITE_VEC_COUNT);
+
+    for (i = 0; i < vec_count; ++i)
+      {
+        iov[i].iov_base = vec[i].base;
+        iov[i].iov_len = vec[i].length;
+      }
+
+    my_bytes_written = pwritev (handle, iov, (int) vec_count, offset);
+  }
+
+#else
+
+  {
+    size_t i;
+    tr_error * my_error = NULL;
+
+    /* write the regions one at a time, stopping at the first short write */
+    for (i = 0, my_bytes_written = 0; i < vec_count; ++i)
+      {
+        uint64_t n;
+
+        if (!tr_sys_file_write_at (handle, vec[i].base, vec[i].length, offset + my_bytes_written, &n, &my_error))
+          {
+            if (my_bytes_written == 0)
+              {
+                tr_error_propagate (error, &my_error);
+                return false;
+              }
+
+            tr_error_free (my_error);
+            break;
+          }
+
+        my_bytes_written += n;
+
+        if (n < vec[i].length)
+          break;
+      }
+  }
+
+#endif
+
+  if (my_bytes_written != -1)
+    {
+      if (bytes_written != NULL)
+        *bytes_written = my_bytes_written;
+      ret = true;
+    }
+  else
+    {
+      set_system_error (error, errno);
+    }
+
+  return ret;
+}
+
 bool
 tr_sys_file_flush (tr_sys_file_t    handle,
                    tr_error      ** error)
@@ -881,6 +1017,84 @@ out:
   return ret;
 }
 
+bool
+tr_sys_file_clone (tr_sys_file_t    source,
+                   tr_sys_file_t    dest,
+                   tr_error      ** error)
+{
+  bool ret = false;
+
+  assert (source != TR_BAD_SYS_FILE);
+  assert (dest != TR_BAD_SYS_FILE);
+
+#ifdef FICLONE
+
+  ret = ioctl (dest, FICLONE, source) != -1;
+
+  if (!ret)
+    set_system_error (error, errno);
+
+#else
+
+  (void) source;
+  (void) dest;
+
+  set_system_error (error, ENOSYS);
+
+#endif
+
+  return ret;
+}
+
+bool
+tr_sys_file_copy_range (tr_sys_file_t    source,
+                        tr_sys_file_t    dest,
+                        uint64_t         offset,
+                        uint64_t         size,
+                        uint64_t       * bytes_copied,
+                        tr_error      ** error)
+{
+  bool ret = false;
+
+  assert (source != TR_BAD_SYS_FILE);
+  assert (dest != TR_BAD_SYS_FILE);
+  /* seek requires signed offset, so it should be in mod range */
+  assert (offset < UINT64_MAX / 2);
+
+#ifdef HAVE_COPY_FILE_RANGE
+
+  {
+    loff_t in_offset = offset;
+    loff_t out_offset = offset;
+    const ssize_t my_bytes_copied = copy_file_range (source, &in_offset, dest, &out_offset, size, 0);
+
+    if (my_bytes_copied != -1)
+      {
+        if (bytes_copied != NULL)
+          *bytes_copied = my_bytes_copied;
+        ret = true;
+      }
+    else
+      {
+        set_system_error (error, errno);
+      }
+  }
+
+#else
+
+  (void) source;
+  (void) dest;
+  (void) offset;
+  (void) size;
+  (void) bytes_copied;
+
+  set_system_error (error, ENOSYS);
+
+#endif
+
+  return ret;
+}
+
 void *
 tr_sys_file_map_for_reading (tr_sys_file_t    handle,
                              uint64_t         offset,
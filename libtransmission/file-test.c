@@ -1191,6 +1191,105 @@ test_file_truncate (void)
   return 0;
 }
 
+static int
+test_file_dup (void)
+{
+  char * const test_dir = create_test_dir (__FUNCTION__);
+  tr_error * err = NULL;
+  char * path1;
+  tr_sys_file_t fd, fd2;
+  uint64_t n;
+  char buf[16];
+
+  path1 = tr_buildPath (test_dir, "a", NULL);
+
+  libtest_create_file_with_string_contents (path1, "test");
+
+  fd = tr_sys_file_open (path1, TR_SYS_FILE_READ | TR_SYS_FILE_WRITE, 0600, NULL);
+  fd2 = tr_sys_file_dup (fd, &err);
+  check (fd2 != TR_BAD_SYS_FILE);
+  check (err == NULL);
+
+  /* the duplicate outlives the original */
+  tr_sys_file_close (fd, NULL);
+
+  check (tr_sys_file_write_at (fd2, "TE", 2, 0, NULL, &err));
+  check (err == NULL);
+  check (tr_sys_file_read_at (fd2, buf, 4, 0, &n, &err));
+  check (err == NULL);
+  check_uint_eq (4, n);
+  check (memcmp (buf, "TEst", 4) == 0);
+
+  tr_sys_file_close (fd2, NULL);
+
+  tr_sys_path_remove (path1, NULL);
+
+  tr_free (path1);
+
+  tr_free (test_dir);
+  return 0;
+}
+
+static int
+test_file_write_vec_at (void)
+{
+  char * const test_dir = create_test_dir (__FUNCTION__);
+  tr_error * err = NULL;
+  char * path1;
+  tr_sys_file_t fd;
+  uint64_t n;
+  size_t i;
+  char buf[16];
+  char many[1000];
+  char many_read[1000];
+  tr_sys_iovec vec[3];
+  tr_sys_iovec many_vec[1000];
+
+  path1 = tr_buildPath (test_dir, "a", NULL);
+
+  fd = tr_sys_file_open (path1, TR_SYS_FILE_READ | TR_SYS_FILE_WRITE | TR_SYS_FILE_CREATE, 0600, NULL);
+
+  vec[0].base = (void *) "te";
+  vec[0].length = 2;
+  vec[1].base = (void *) "";
+  vec[1].length = 0;
+  vec[2].base = (void *) "st";
+  vec[2].length = 2;
+
+  check (tr_sys_file_write_vec_at (fd, vec, 3, 2, &n, &err));
+  check (err == NULL);
+  check_uint_eq (4, n);
+  check (tr_sys_file_read_at (fd, buf, 6, 0, &n, &err));
+  check (err == NULL);
+  check_uint_eq (6, n);
+  check (memcmp (buf, "\0\0test", 6) == 0);
+
+  /* more regions than one call may take; whatever was written must be right */
+  for (i = 0; i < sizeof (many); ++i)
+    {
+      many[i] = (char) ('a' + i % 26);
+      many_vec[i].base = many + i;
+      many_vec[i].length = 1;
+    }
+
+  check (tr_sys_file_write_vec_at (fd, many_vec, sizeof (many), 0, &n, &err));
+  check (err == NULL);
+  check (n > 0);
+  check (n <= sizeof (many));
+  check (tr_sys_file_read_at (fd, many_read, n, 0, NULL, &err));
+  check (err == NULL);
+  check (memcmp (many, many_read, n) == 0);
+
+  tr_sys_file_close (fd, NULL);
+
+  tr_sys_path_remove (path1, NULL);
+
+  tr_free (path1);
+
+  tr_free (test_dir);
+  return 0;
+}
+
 static int
 test_file_preallocate (void)
 {
@@ -1246,6 +1345,74 @@ test_file_preallocate (void)
   return 0;
 }
 
+static int
+test_file_clone_copy_range (void)
+{
+  char * const test_dir = create_test_dir (__FUNCTION__);
+  tr_error * err = NULL;
+  char * path1;
+  char * path2;
+  tr_sys_file_t fd1;
+  tr_sys_file_t fd2;
+  uint64_t n;
+  char buf[16];
+
+  path1 = tr_buildPath (test_dir, "a", NULL);
+  path2 = tr_buildPath (test_dir, "b", NULL);
+
+  libtest_create_file_with_string_contents (path1, "0123456789");
+
+  fd1 = tr_sys_file_open (path1, TR_SYS_FILE_READ, 0, NULL);
+  fd2 = tr_sys_file_open (path2, TR_SYS_FILE_READ | TR_SYS_FILE_WRITE | TR_SYS_FILE_CREATE, 0600, NULL);
+
+  if (tr_sys_file_clone (fd1, fd2, &err))
+    {
+      check (err == NULL);
+      check (tr_sys_file_read_at (fd2, buf, sizeof (buf), 0, &n, NULL));
+      check_uint_eq (10, n);
+      check (memcmp (buf, "0123456789", 10) == 0);
+      check (tr_sys_file_truncate (fd2, 0, NULL));
+    }
+  else
+    {
+      /* most file systems can't do this */
+      check (err != NULL);
+      tr_error_clear (&err);
+    }
+
+  if (tr_sys_file_copy_range (fd1, fd2, 2, 5, &n, &err))
+    {
+      check (err == NULL);
+      check (n > 0);
+      check (n <= 5);
+      check (tr_sys_file_read_at (fd2, buf, n, 2, NULL, NULL));
+      check (memcmp (buf, "23456", n) == 0);
+
+      /* nothing left to copy past the end of the file */
+      check (tr_sys_file_copy_range (fd1, fd2, 10, 5, &n, &err));
+      check (err == NULL);
+      check_uint_eq (0, n);
+    }
+  else
+    {
+      check (err != NULL);
+      fprintf (stderr, "WARNING: [%s] unable to copy a file range: %s (%d)\n", __FUNCTION__, err->message, err->code);
+      tr_error_clear (&err);
+    }
+
+  tr_sys_file_close (fd2, NULL);
+  tr_sys_file_close (fd1, NULL);
+
+  tr_sys_path_remove (path2, NULL);
+  tr_sys_path_remove (path1, NULL);
+
+  tr_free (path2);
+  tr_free (path1);
+
+  tr_free (test_dir);
+  return 0;
+}
+
 static int
 test_file_map (void)
 {
@@ -1523,6 +1690,41 @@ test_dir_read (void)
   return 0;
 }
 
+static int
+test_path_get_device (void)
+{
+  char * const test_dir = create_test_dir (__FUNCTION__);
+  tr_error * err = NULL;
+  char * path1, * path2;
+  uint64_t device1, device2;
+
+  path1 = tr_buildPath (test_dir, "a", NULL);
+  path2 = tr_buildPath (test_dir, "b", NULL);
+
+  /* Non-existent file has no device */
+  check (!tr_sys_path_get_device (path1, &device1, &err));
+  check (err != NULL);
+  tr_error_clear (&err);
+
+  /* Files in the same directory are on the same device */
+  libtest_create_file_with_string_contents (path1, "test");
+  tr_sys_dir_create (path2, 0, 0777, NULL);
+  check (tr_sys_path_get_device (path1, &device1, &err));
+  check (err == NULL);
+  check (tr_sys_path_get_device (path2, &device2, &err));
+  check (err == NULL);
+  check_uint_eq (device1, device2);
+
+  tr_sys_path_remove (path2, NULL);
+  tr_sys_path_remove (path1, NULL);
+
+  tr_free (path2);
+  tr_free (path1);
+
+  tr_free (test_dir);
+  return 0;
+}
+
 int
 main (void)
 {
@@ -1532,6 +1734,7 @@ main (void)
       test_path_exists,
       test_path_is_relative,
       test_path_is_same,
+      test_path_get_device,
       test_path_resolve,
       test_path_basename_dirname,
       test_path_rename,
@@ -1539,7 +1742,10 @@ main (void)
       test_file_open,
       test_file_read_write_seek,
       test_file_truncate,
+      test_file_dup,
+      test_file_write_vec_at,
       test_file_preallocate,
+      test_file_clone_copy_range,
       test_file_map,
       test_file_utilities,
       test_dir_create,
@@ -481,6 +481,38 @@ cleanup:
   return ret;
 }
 
+bool
+tr_sys_path_get_device (const char  * path,
+                        uint64_t    * device,
+                        tr_error   ** error)
+{
+  bool ret = false;
+  wchar_t * wide_path;
+  wchar_t volume_path[MAX_PATH + 1];
+  DWORD serial_number;
+
+  assert (path != NULL);
+  assert (device != NULL);
+
+  wide_path = path_to_native_path (path);
+
+  if (wide_path != NULL &&
+      GetFileAttributesW (wide_path) != INVALID_FILE_ATTRIBUTES &&
+      GetVolumePathNameW (wide_path, volume_path, MAX_PATH + 1) &&
+      GetVolumeInformationW (volume_path, NULL, 0, &serial_number, NULL, NULL, NULL, 0))
+    {
+      *device = serial_number;
+      ret = true;
+    }
+
+  if (!ret)
+    set_system_error (error, GetLastError ());
+
+  tr_free (wide_path);
+
+  return ret;
+}
+
 char *
 tr_sys_path_resolve (const char  * path,
                      tr_error   ** error)
@@ -791,6 +823,26 @@ tr_sys_file_open_temp (char      * path_template,
   return ret;
 }
 
+tr_sys_file_t
+tr_sys_file_dup (tr_sys_file_t    handle,
+                 tr_error      ** error)
+{
+  tr_sys_file_t ret;
+  HANDLE process;
+
+  assert (handle != TR_BAD_SYS_FILE);
+
+  process = GetCurrentProcess ();
+
+  if (!DuplicateHandle (process, handle, process, &ret, 0, FALSE, DUPLICATE_SAME_ACCESS))
+    {
+      set_system_error (error, GetLastError ());
+      ret = TR_BAD_SYS_FILE;
+    }
+
+  return ret;
+}
+
 bool
 tr_sys_file_close (tr_sys_file_t    handle,
                    tr_error      ** error)
@@ -1009,6 +1061,51 @@ tr_sys_file_write_at (tr_sys_file_t    handle,
   return ret;
 }
 
+bool
+tr_sys_file_write_vec_at (tr_sys_file_t        handle,
+                          const tr_sys_iovec * vec,
+                          size_t               vec_count,
+                          uint64_t             offset,
+                          uint64_t           * bytes_written,
+                          tr_error          ** error)
+{
+  size_t i;
+  uint64_t my_bytes_written = 0;
+  tr_error * my_error = NULL;
+
+  assert (handle != TR_BAD_SYS_FILE);
+  assert (vec != NULL || vec_count == 0);
+
+  /* WriteFileGather () wants page-sized, page-aligned buffers,
+     so write the regions one at a time, stopping at the first short write */
+  for (i = 0; i < vec_count; ++i)
+    {
+      uint64_t n;
+
+      if (!tr_sys_file_write_at (handle, vec[i].base, vec[i].length, offset + my_bytes_written, &n, &my_error))
+        {
+          if (my_bytes_written == 0)
+            {
+              tr_error_propagate (error, &my_error);
+              return false;
+            }
+
+          tr_error_free (my_error);
+          break;
+        }
+
+      my_bytes_written += n;
+
+      if (n < vec[i].length)
+        break;
+    }
+
+  if (bytes_written != NULL)
+    *bytes_written = my_bytes_written;
+
+  return true;
+}
+
 bool
 tr_sys_file_flush (tr_sys_file_t    handle,
                    tr_error      ** error)
@@ -1087,6 +1184,33 @@ tr_sys_file_preallocate (tr_sys_file_t    handle,
   return tr_sys_file_truncate (handle, size, error);
 }
 
+bool
+tr_sys_file_clone (tr_sys_file_t    source,
+                   tr_sys_file_t    dest,
+                   tr_error      ** error)
+{
+  assert (source != TR_BAD_SYS_FILE);
+  assert (dest != TR_BAD_SYS_FILE);
+
+  set_system_error (error, ERROR_NOT_SUPPORTED);
+  return false;
+}
+
+bool
+tr_sys_file_copy_range (tr_sys_file_t    source,
+                        tr_sys_file_t    dest,
+                        uint64_t         offset UNUSED,
+                        uint64_t         size UNUSED,
+                        uint64_t       * bytes_copied UNUSED,
+                        tr_error      ** error)
+{
+  assert (source != TR_BAD_SYS_FILE);
+  assert (dest != TR_BAD_SYS_FILE);
+
+  set_system_error (error, ERROR_NOT_SUPPORTED);
+  return false;
+}
+
 void *
 tr_sys_file_map_for_reading (tr_sys_file_t    handle,
                              uint64_t         offset,
@@ -111,6 +111,14 @@ typedef struct tr_sys_path_info
 }
 tr_sys_path_info;
 
+/** @brief A memory region for vectored I/O, like POSIX `struct iovec'. */
+typedef struct tr_sys_iovec
+{
+  void   * base;
+  size_t   length;
+}
+tr_sys_iovec;
+
 /**
  * @name Platform-specific wrapper functions
  *
@@ -183,6 +191,24 @@ bool            tr_sys_path_is_same         (const char         * path1,
                                              const char         * path2,
                                              struct tr_error   ** error);
 
+/**
+ * @brief Get an identifier of the device (disk, volume) a path is on.
+ *
+ * Paths with the same identifier share the same physical storage, e.g. to
+ * avoid having several threads seek back and forth on the same disk.
+ *
+ * @param[in]  path   Path to file or directory.
+ * @param[out] device Device identifier (`st_dev` on POSIX, volume serial
+ *                    number on Windows).
+ * @param[out] error  Pointer to error object. Optional, pass `NULL` if you are
+ *                    not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool            tr_sys_path_get_device      (const char         * path,
+                                             uint64_t           * device,
+                                             struct tr_error   ** error);
+
 /**
  * @brief Portability wrapper for `realpath ()`.
  *
@@ -309,6 +335,22 @@ tr_sys_file_t   tr_sys_file_open            (const char         * path,
 tr_sys_file_t   tr_sys_file_open_temp       (char               * path_template,
                                              struct tr_error   ** error);
 
+/**
+ * @brief Portability wrapper for `dup ()`.
+ *
+ * The new descriptor refers to the same open file but has its own lifetime,
+ * so it stays valid even if the original descriptor is closed.
+ *
+ * @param[in]  handle Valid file descriptor.
+ * @param[out] error  Pointer to error object. Optional, pass `NULL` if you are
+ *                    not interested in error details.
+ *
+ * @return Duplicated file descriptor on success, `TR_BAD_SYS_FILE` otherwise
+ *         (with `error` set accordingly).
+ */
+tr_sys_file_t   tr_sys_file_dup             (tr_sys_file_t        handle,
+                                             struct tr_error   ** error);
+
 /**
  * @brief Portability wrapper for `close ()`.
  *
@@ -436,6 +478,31 @@ bool            tr_sys_file_write_at        (tr_sys_file_t        handle,
                                              uint64_t           * bytes_written,
                                              struct tr_error   ** error);
 
+/**
+ * @brief Like `pwritev ()`, except that the position is undefined afterwards.
+ *        Not thread-safe.
+ *
+ * As with `pwritev ()`, fewer bytes than asked for may be written (e.g. when
+ * there are more regions than the system can take in one call).
+ *
+ * @param[in]  handle        Valid file descriptor.
+ * @param[in]  vec           Memory regions to get data being written from.
+ * @param[in]  vec_count     Number of regions in `vec`.
+ * @param[in]  offset        File offset in bytes to start writing from.
+ * @param[out] bytes_written Number of bytes actually written. Optional, pass
+ *                           `NULL` if you are not interested.
+ * @param[out] error         Pointer to error object. Optional, pass `NULL` if you
+ *                           are not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool            tr_sys_file_write_vec_at    (tr_sys_file_t        handle,
+                                             const tr_sys_iovec * vec,
+                                             size_t               vec_count,
+                                             uint64_t             offset,
+                                             uint64_t           * bytes_written,
+                                             struct tr_error   ** error);
+
 /**
  * @brief Portability wrapper for `fsync ()`.
  *
@@ -494,6 +561,46 @@ bool            tr_sys_file_preallocate     (tr_sys_file_t        handle,
                                              int                  flags,
                                              struct tr_error   ** error);
 
+/**
+ * @brief Make a file share the data of another one (a "reflink"), so that
+ *        nothing needs to be copied. Only some file systems can do this, and
+ *        only within the same file system.
+ *
+ * @param[in]  source Valid file descriptor to get data from.
+ * @param[in]  dest   Valid file descriptor, open for writing.
+ * @param[out] error  Pointer to error object. Optional, pass `NULL` if you are
+ *                    not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool            tr_sys_file_clone           (tr_sys_file_t        source,
+                                             tr_sys_file_t        dest,
+                                             struct tr_error   ** error);
+
+/**
+ * @brief Portability wrapper for `copy_file_range ()`: copy part of a file
+ *        to the same offset in another one, without passing the data through
+ *        user space. Fails if the system can't, in which case the caller has
+ *        to read and write the data itself.
+ *
+ * @param[in]  source       Valid file descriptor to get data from.
+ * @param[in]  dest         Valid file descriptor, open for writing.
+ * @param[in]  offset       File offset in bytes to start copying from.
+ * @param[in]  size         Number of bytes to copy.
+ * @param[out] bytes_copied Number of bytes actually copied. Optional, pass
+ *                          `NULL` if you are not interested.
+ * @param[out] error        Pointer to error object. Optional, pass `NULL` if
+ *                          you are not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool            tr_sys_file_copy_range      (tr_sys_file_t        source,
+                                             tr_sys_file_t        dest,
+                                             uint64_t             offset,
+                                             uint64_t             size,
+                                             uint64_t           * bytes_copied,
+                                             struct tr_error   ** error);
+
 /**
  * @brief Portability wrapper for `mmap ()` for files.
  *
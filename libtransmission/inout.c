@@ -12,17 +12,22 @@
 #include <stdlib.h> /* bsearch () */
 #include <string.h> /* memcmp () */
 
+#include <event2/buffer.h>
+#include <event2/event.h> /* LIBEVENT_VERSION_NUMBER */
+
 #include "transmission.h"
-#include "cache.h" /* tr_cacheReadBlock () */
-#include "crypto-utils.h"
+#include "disk-io.h"
 #include "error.h"
 #include "fdlimit.h"
 #include "file.h"
 #include "inout.h"
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
+#include "platform.h" /* tr_lock */
+#include "relocate.h" /* tr_relocateFileWritten () */
 #include "stats.h" /* tr_statsFileCreated () */
 #include "torrent.h"
+#include "trevent.h" /* tr_amInEventThread () */
 #include "utils.h"
 
 /****
@@ -37,15 +42,20 @@ enum
   TR_IO_WRITE
 };
 
+static void startPreallocation (tr_torrent      * tor,
+                                tr_file_index_t   fileIndex,
+                                const char      * filename);
+
+static struct tr_preallocation * findPreallocation (const tr_torrent * tor,
+                                                    tr_file_index_t    fileIndex);
+
 /* returns 0 on success, or an errno on failure */
 static int
-readOrWriteBytes (tr_session       * session,
-                  tr_torrent       * tor,
-                  int                ioMode,
-                  tr_file_index_t    fileIndex,
-                  uint64_t           fileOffset,
-                  void             * buf,
-                  size_t             buflen)
+getFileDescriptor (tr_session       * session,
+                   tr_torrent       * tor,
+                   int                ioMode,
+                   tr_file_index_t    fileIndex,
+                   tr_sys_file_t    * setme)
 {
   tr_sys_file_t fd;
   int err = 0;
@@ -54,15 +64,6 @@ readOrWriteBytes (tr_session       * session,
   const tr_file * const file = &info->files[fileIndex];
 
   assert (fileIndex < info->fileCount);
-  assert (!file->length || (fileOffset < file->length));
-  assert (fileOffset + buflen <= file->length);
-
-  if (!file->length)
-    return 0;
-
-  /***
-  ****  Find the fd
-  ***/
 
   fd = tr_fdFileGetCached (session, tr_torrentId (tor), fileIndex, doWrite);
   if (fd == TR_BAD_SYS_FILE)
@@ -70,10 +71,13 @@ readOrWriteBytes (tr_session       * session,
       /* it's not cached, so open/create it now */
       char * subpath;
       const char * base;
+      bool created = false;
 
       /* see if the file exists... */
       if (!tr_torrentFindFile2 (tor, fileIndex, &base, &subpath, NULL))
         {
+          created = doWrite;
+
           /* we can't read a file that doesn't exist... */
           if (!doWrite)
             err = ENOENT;
@@ -90,9 +94,16 @@ readOrWriteBytes (tr_session       * session,
         {
           /* open (and maybe create) the file */
           char * filename = tr_buildPath (base, subpath, NULL);
-          const int prealloc = file->dnd || !doWrite
-                             ? TR_PREALLOCATE_NONE
-                             : tor->session->preallocationMode;
+          int prealloc = file->dnd || !doWrite
+                       ? TR_PREALLOCATE_NONE
+                       : tor->session->preallocationMode;
+
+          /* full preallocation can be slow, so startPreallocation ()
+           * does it in a disk I/O thread instead of tr_fdFileCheckout () */
+          const bool preallocateLater = created && prealloc == TR_PREALLOCATE_FULL;
+          if (preallocateLater)
+            prealloc = TR_PREALLOCATE_NONE;
+
           if (((fd = tr_fdFileCheckout (session, tor->uniqueId, fileIndex,
                                         filename, doWrite,
                                         prealloc, file->length))) == TR_BAD_SYS_FILE)
@@ -105,6 +116,9 @@ readOrWriteBytes (tr_session       * session,
             {
               /* make a note that we just created a file */
               tr_statsFileCreated (tor->session);
+
+              if (preallocateLater)
+                startPreallocation (tor, fileIndex, filename);
             }
 
           tr_free (filename);
@@ -113,6 +127,86 @@ readOrWriteBytes (tr_session       * session,
       tr_free (subpath);
     }
 
+  *setme = fd;
+  return err;
+}
+
+/* returns true on success, or false and sets `error' on failure */
+static bool
+readOrWriteFd (tr_sys_file_t      fd,
+               int                ioMode,
+               uint64_t           fileOffset,
+               void             * buf,
+               size_t             buflen,
+               tr_error        ** error)
+{
+  bool ok = true;
+
+  if (ioMode == TR_IO_READ)
+    {
+      ok = tr_sys_file_read_at (fd, buf, buflen, fileOffset, NULL, error);
+    }
+  else if (ioMode == TR_IO_WRITE)
+    {
+      ok = tr_sys_file_write_at (fd, buf, buflen, fileOffset, NULL, error);
+    }
+  else if (ioMode == TR_IO_PREFETCH)
+    {
+      tr_sys_file_prefetch (fd, fileOffset, buflen, NULL);
+    }
+  else
+    {
+      abort ();
+    }
+
+  return ok;
+}
+
+static void
+logIoError (tr_torrent       * tor,
+            int                ioMode,
+            tr_file_index_t    fileIndex,
+            const tr_error   * error)
+{
+  tr_logAddTorErr (tor, "%s failed for \"%s\": %s",
+                   ioMode == TR_IO_WRITE ? "write" : "read",
+                   tor->info.files[fileIndex].name, error->message);
+}
+
+/* returns 0 on success, or an errno on failure */
+static int
+readOrWriteBytes (tr_session       * session,
+                  tr_torrent       * tor,
+                  int                ioMode,
+                  tr_file_index_t    fileIndex,
+                  uint64_t           fileOffset,
+                  void             * buf,
+                  size_t             buflen)
+{
+  tr_sys_file_t fd;
+  int err = 0;
+  const tr_info * const info = &tor->info;
+  const tr_file * const file = &info->files[fileIndex];
+
+  assert (fileIndex < info->fileCount);
+  assert (!file->length || (fileOffset < file->length));
+  assert (fileOffset + buflen <= file->length);
+
+  if (!file->length)
+    return 0;
+
+  /***
+  ****  Find the fd
+  ***/
+
+  err = getFileDescriptor (session, tor, ioMode, fileIndex, &fd);
+
+  /* the file is still being preallocated. Its new data is in the cache
+   * or held with the preallocation, and waiting for it here would stall
+   * the libtransmission thread, so let the caller try again later */
+  if (!err && findPreallocation (tor, fileIndex) != NULL)
+    err = EAGAIN;
+
   /***
   ****  Use the fd
   ***/
@@ -121,31 +215,15 @@ readOrWriteBytes (tr_session       * session,
     {
       tr_error * error = NULL;
 
-      if (ioMode == TR_IO_READ)
+      if (!readOrWriteFd (fd, ioMode, fileOffset, buf, buflen, &error))
         {
-          if (!tr_sys_file_read_at (fd, buf, buflen, fileOffset, NULL, &error))
-            {
-              err = error->code;
-              tr_logAddTorErr (tor, "read failed for \"%s\": %s", file->name, error->message);
-              tr_error_free (error);
-            }
+          err = error->code;
+          logIoError (tor, ioMode, fileIndex, error);
+          tr_error_free (error);
         }
       else if (ioMode == TR_IO_WRITE)
         {
-          if (!tr_sys_file_write_at (fd, buf, buflen, fileOffset, NULL, &error))
-            {
-              err = error->code;
-              tr_logAddTorErr (tor, "write failed for \"%s\": %s", file->name, error->message);
-              tr_error_free (error);
-            }
-        }
-      else if (ioMode == TR_IO_PREFETCH)
-        {
-          tr_sys_file_prefetch (fd, fileOffset, buflen, NULL);
-        }
-      else
-        {
-          abort ();
+          tr_relocateFileWritten (tor, fileIndex, fileOffset, buflen);
         }
     }
 
@@ -194,6 +272,32 @@ tr_ioFindFileLocation (const tr_torrent * tor,
   assert (tor->info.files[*fileIndex].offset + *fileOffset == offset);
 }
 
+static void
+setWriteError (tr_torrent * tor, const tr_file * file, int err)
+{
+  if (tor->error != TR_STAT_LOCAL_ERROR)
+    {
+      char * path = tr_buildPath (tor->downloadDir, file->name, NULL);
+      tr_torrentSetLocalError (tor, "%s (%s)", tr_strerror (err), path);
+      tr_free (path);
+    }
+}
+
+/* keep track of the disk time for tr_sessionGetCacheStats () */
+static void
+addDiskTime (tr_session * session, int ioMode, uint64_t bytes, uint64_t usec)
+{
+  if (ioMode == TR_IO_READ)
+    {
+      session->diskReadBytes += bytes;
+      session->diskReadUsec += usec;
+    }
+  else if (ioMode == TR_IO_WRITE)
+    {
+      session->diskWriteUsec += usec;
+    }
+}
+
 /* returns 0 on success, or an errno on failure */
 static int
 readOrWritePiece (tr_torrent       * tor,
@@ -207,6 +311,8 @@ readOrWritePiece (tr_torrent       * tor,
   tr_file_index_t fileIndex;
   uint64_t fileOffset;
   const tr_info * info = &tor->info;
+  const uint64_t bytes = buflen;
+  const uint64_t begin = tr_time_usec ();
 
   if (pieceIndex >= tor->info.pieceCount)
     return EINVAL;
@@ -225,14 +331,11 @@ readOrWritePiece (tr_torrent       * tor,
       fileIndex++;
       fileOffset = 0;
 
-      if ((err != 0) && (ioMode == TR_IO_WRITE) && (tor->error != TR_STAT_LOCAL_ERROR))
-        {
-          char * path = tr_buildPath (tor->downloadDir, file->name, NULL);
-          tr_torrentSetLocalError (tor, "%s (%s)", tr_strerror (err), path);
-          tr_free (path);
-        }
+      if ((err != 0) && (err != EAGAIN) && (ioMode == TR_IO_WRITE))
+        setWriteError (tor, file, err);
     }
 
+  addDiskTime (tor->session, ioMode, bytes, tr_time_usec () - begin);
   return err;
 }
 
@@ -266,52 +369,794 @@ tr_ioWrite (tr_torrent       * tor,
 }
 
 /****
-*****
+*****  Zero-copy IO
 ****/
 
+/* evbuffer_add_file () wants a POSIX file descriptor, and 2.1 is
+ * needed to hear when a file segment has been sent */
+#if !defined (_WIN32) && LIBEVENT_VERSION_NUMBER >= 0x02010000
+ #define HAVE_FILE_SEGMENTS
+#endif
+
+#ifdef HAVE_FILE_SEGMENTS
+
+/* how many segments a piece range is split into, one per nonempty file */
+static int
+countFileSegments (const tr_torrent * tor, tr_piece_index_t pieceIndex, uint32_t begin, uint32_t len)
+{
+  int n = 0;
+  tr_file_index_t fileIndex;
+  uint64_t fileOffset;
+  const tr_info * info = &tor->info;
+
+  tr_ioFindFileLocation (tor, pieceIndex, begin, &fileIndex, &fileOffset);
+
+  while (len)
+    {
+      const tr_file * file = &info->files[fileIndex];
+      const uint64_t bytesThisPass = MIN (len, file->length - fileOffset);
+
+      if (file->length != 0)
+        ++n;
+
+      len -= bytesThisPass;
+      fileIndex++;
+      fileOffset = 0;
+    }
+
+  return n;
+}
+
+/* called in whichever thread sent or dropped the segment */
+static void
+onFileSegmentFreed (struct evbuffer_file_segment const * segment UNUSED,
+                    int                                  flags UNUSED,
+                    void                               * vsession)
+{
+  tr_session * session = vsession;
+
+  tr_lockLock (session->fileSegmentLock);
+  --session->fileSegmentCount;
+  tr_lockUnlock (session->fileSegmentLock);
+}
+
+#endif
+
+bool
+tr_ioCanReadToBuffer (tr_torrent       * tor,
+                      tr_piece_index_t   pieceIndex,
+                      uint32_t           begin,
+                      uint32_t           len)
+{
+#ifdef HAVE_FILE_SEGMENTS
+
+  bool ok;
+  tr_session * session = tor->session;
+  const int n = countFileSegments (tor, pieceIndex, begin, len);
+
+  tr_lockLock (session->fileSegmentLock);
+  ok = session->fileSegmentCount + n <= TR_IO_MAX_FILE_SEGMENTS;
+  tr_lockUnlock (session->fileSegmentLock);
+
+  return ok;
+
+#else
+
+  (void) tor; (void) pieceIndex; (void) begin; (void) len;
+  return false;
+
+#endif
+}
+
+int
+tr_ioReadToBuffer (tr_torrent       * tor,
+                   tr_piece_index_t   pieceIndex,
+                   uint32_t           begin,
+                   uint32_t           len,
+                   struct evbuffer  * buf)
+{
+#ifndef HAVE_FILE_SEGMENTS
+
+  (void) tor; (void) pieceIndex; (void) begin; (void) len; (void) buf;
+  return ENOTSUP;
+
+#else
+
+  int err = 0;
+  tr_file_index_t fileIndex;
+  uint64_t fileOffset;
+  tr_session * session = tor->session;
+  const tr_info * info = &tor->info;
+
+  if (pieceIndex >= info->pieceCount)
+    return EINVAL;
+
+#ifdef EVBUFFER_FLAG_DRAINS_TO_FD
+  /* let libevent use sendfile () when buf gets written to a socket */
+  evbuffer_set_flags (buf, EVBUFFER_FLAG_DRAINS_TO_FD);
+#endif
+
+  tr_ioFindFileLocation (tor, pieceIndex, begin, &fileIndex, &fileOffset);
+
+  while (len && !err)
+    {
+      const tr_file * file = &info->files[fileIndex];
+      const uint64_t bytesThisPass = MIN (len, file->length - fileOffset);
+
+      if (file->length != 0)
+        {
+          tr_sys_file_t fd;
+          tr_error * error = NULL;
+          struct evbuffer_file_segment * segment;
+
+          /* libevent closes the file when it's done with it,
+           * so give it a copy of the one in the fd cache */
+          if (!(err = getFileDescriptor (session, tor, TR_IO_READ, fileIndex, &fd)))
+            {
+              if ((fd = tr_sys_file_dup (fd, &error)) == TR_BAD_SYS_FILE)
+                {
+                  err = error->code;
+                  logIoError (tor, TR_IO_READ, fileIndex, error);
+                  tr_error_free (error);
+                }
+              else if ((segment = evbuffer_file_segment_new (fd, fileOffset, bytesThisPass, EVBUF_FS_CLOSE_ON_FREE)) == NULL)
+                {
+                  err = ENOMEM;
+                  tr_sys_file_close (fd, NULL);
+                }
+              else
+                {
+                  tr_lockLock (session->fileSegmentLock);
+                  ++session->fileSegmentCount;
+                  tr_lockUnlock (session->fileSegmentLock);
+                  evbuffer_file_segment_add_cleanup_cb (segment, onFileSegmentFreed, session);
+
+                  if (evbuffer_add_file_segment (buf, segment, 0, bytesThisPass) != 0)
+                    err = ENOMEM;
+                  else /* the kernel does the reading later, so there's no time to add */
+                    addDiskTime (session, TR_IO_READ, bytesThisPass, 0);
+
+                  /* buf holds its own reference */
+                  evbuffer_file_segment_free (segment);
+                }
+            }
+        }
+
+      len -= bytesThisPass;
+      fileIndex++;
+      fileOffset = 0;
+    }
+
+  return err;
+
+#endif
+}
+
+/****
+*****  Asynchronous IO
+****/
+
+struct io_segment
+{
+  tr_file_index_t fileIndex;
+  tr_sys_file_t fd;
+  struct tr_cached_file * file; /* pinned in the fd cache while the job lives */
+  uint64_t fileOffset;
+  size_t buflen;
+
+  /* for vectored writes: this segment's regions in io_job.vecs */
+  size_t vecIndex;
+  size_t vecCount;
+};
+
+struct io_job
+{
+  tr_session * session;
+  tr_torrent * tor;
+  int ioMode;
+  uint8_t * buf;
+
+  /* for vectored writes, in place of buf */
+  tr_sys_iovec * vecs;
+  size_t vecCount;
+
+  size_t segmentCount;
+  struct io_segment * segments;
+
+  /* set by the worker thread */
+  int err;
+  tr_error * error;
+  tr_file_index_t errFileIndex;
+  uint64_t bytesDone;
+  uint64_t usec;
+
+  tr_io_start_func start_func;
+  tr_io_done_func done_func;
+  void * done_data;
+
+  const void * owner;
+
+  /* while the job waits for a preallocation to finish */
+  struct io_job * next;
+};
+
+/* called in the libtransmission thread */
+static void
+unpinJobFiles (struct io_job * job)
+{
+  size_t i;
+
+  for (i=0; i<job->segmentCount; ++i)
+    {
+      if (job->segments[i].file != NULL)
+        {
+          tr_fdFileUnpin (job->session, job->segments[i].file);
+          job->segments[i].file = NULL;
+          job->segments[i].fd = TR_BAD_SYS_FILE;
+        }
+    }
+}
+
+static void
+freeJob (struct io_job * job)
+{
+  unpinJobFiles (job);
+  tr_error_free (job->error);
+  tr_free (job->segments);
+  tr_free (job->vecs);
+  tr_free (job);
+}
+
+/* keep calling pwritev () until all of the regions are written */
 static bool
-recalculateHash (tr_torrent * tor, tr_piece_index_t pieceIndex, uint8_t * setme)
+writeVecFully (tr_sys_file_t    fd,
+               tr_sys_iovec   * vec,
+               size_t           vecCount,
+               uint64_t         fileOffset,
+               tr_error      ** error)
+{
+  while (vecCount > 0)
+    {
+      uint64_t n;
+
+      if (!tr_sys_file_write_vec_at (fd, vec, vecCount, fileOffset, &n, error))
+        return false;
+
+      if (n == 0)
+        {
+          tr_error_set_literal (error, EIO, tr_strerror (EIO));
+          return false;
+        }
+
+      fileOffset += n;
+
+      /* skip past what was written */
+      while (vecCount > 0 && n >= vec->length)
+        {
+          n -= vec->length;
+          ++vec;
+          --vecCount;
+        }
+
+      if (vecCount > 0)
+        {
+          vec->base = (uint8_t*)vec->base + n;
+          vec->length -= n;
+        }
+    }
+
+  return true;
+}
+
+/* called in a worker thread */
+static void
+ioJobWork (void * vjob)
 {
-  size_t   bytesLeft;
-  uint32_t offset = 0;
-  bool  success = true;
-  const size_t buflen = tor->blockSize;
-  void * buffer = tr_valloc (buflen);
-  tr_sha1_ctx_t sha;
+  size_t i;
+  struct io_job * job = vjob;
+  uint8_t * buf = job->buf;
+  const uint64_t begin = tr_time_usec ();
+
+  if (job->start_func != NULL)
+    job->start_func (job->done_data);
+
+  for (i=0; i<job->segmentCount; ++i)
+    {
+      const struct io_segment * seg = &job->segments[i];
+      const bool ok = job->vecs != NULL
+                    ? writeVecFully (seg->fd, job->vecs + seg->vecIndex, seg->vecCount, seg->fileOffset, &job->error)
+                    : readOrWriteFd (seg->fd, job->ioMode, seg->fileOffset, buf, seg->buflen, &job->error);
+
+      if (!ok)
+        {
+          job->err = job->error->code;
+          job->errFileIndex = seg->fileIndex;
+          break;
+        }
 
-  assert (tor != NULL);
-  assert (pieceIndex < tor->info.pieceCount);
-  assert (buffer != NULL);
-  assert (buflen > 0);
-  assert (setme != NULL);
+      if (job->ioMode == TR_IO_WRITE)
+        tr_relocateFileWritten (job->tor, seg->fileIndex, seg->fileOffset, seg->buflen);
 
-  sha = tr_sha1_init ();
-  bytesLeft = tr_torPieceCountBytes (tor, pieceIndex);
+      if (buf != NULL)
+        buf += seg->buflen;
 
-  tr_ioPrefetch (tor, pieceIndex, offset, bytesLeft);
+      job->bytesDone += seg->buflen;
+    }
+
+  job->usec = tr_time_usec () - begin;
+}
 
-  while (bytesLeft)
+/* called in the libtransmission thread */
+static void
+ioJobDone (void * vjob, bool cancelled)
+{
+  struct io_job * job = vjob;
+  int err = cancelled ? ECANCELED : job->err;
+
+  if (!cancelled)
+    addDiskTime (job->tor->session, job->ioMode, job->bytesDone, job->usec);
+
+  if (!cancelled && job->err != 0)
     {
-      const size_t len = MIN (bytesLeft, buflen);
-      success = !tr_cacheReadBlock (tor->session->cache, tor, pieceIndex, offset, len, buffer);
-      if (!success)
-        break;
-      tr_sha1_update (sha, buffer, len);
-      offset += len;
-      bytesLeft -= len;
+      logIoError (job->tor, job->ioMode, job->errFileIndex, job->error);
+
+      if (job->ioMode == TR_IO_WRITE)
+        setWriteError (job->tor, &job->tor->info.files[job->errFileIndex], job->err);
     }
 
-  tr_sha1_final (sha, success ? setme : NULL);
+  if (job->done_func != NULL)
+    job->done_func (job->tor, err, job->done_data);
 
-  tr_free (buffer);
-  return success;
+  freeJob (job);
+}
+
+/****
+*****  Preallocation
+****/
+
+/**
+ * Fully preallocating a file may mean writing zeroes over all of it,
+ * which can take minutes, so it's done by a disk I/O job. The torrent's
+ * reads and writes that touch the file wait here until it's finished and
+ * are then submitted in the order they came in. The file's new blocks
+ * stay in the cache meanwhile, so reading them doesn't have to wait, and
+ * rewriting one replaces it in the waiting job.
+ *
+ * The waiting writes hold on to their blocks, so once a torrent has
+ * PREALLOCATION_MAX_HELD_BYTES of them, tr_ioPieceIsHeldBack () stops
+ * the peers from requesting more blocks in the files being preallocated.
+ */
+enum
+{
+  PREALLOCATION_MAX_HELD_BYTES = 32 * 1024 * 1024
+};
+
+struct tr_preallocation
+{
+  tr_torrent * tor;
+  tr_file_index_t fileIndex;
+  char * filename;
+  uint64_t startedAt;
+
+  /* the jobs waiting for this preallocation */
+  struct io_job * head;
+  struct io_job * tail;
+  uint64_t heldBytes;
+
+  /* set by the worker thread */
+  volatile uint64_t bytesDone;
+  tr_error * error;
+
+  volatile bool stop;
+  struct tr_preallocation * next;
+};
+
+static struct tr_preallocation *
+findPreallocation (const tr_torrent * tor, tr_file_index_t fileIndex)
+{
+  struct tr_preallocation * p;
+
+  for (p=tor->preallocations; p!=NULL; p=p->next)
+    if (p->fileIndex == fileIndex)
+      return p;
+
+  return NULL;
+}
+
+/* the first preallocation that the job has to wait for, if any */
+static struct tr_preallocation *
+findJobPreallocation (const struct io_job * job)
+{
+  size_t i;
+  struct tr_preallocation * p = NULL;
+
+  /* only the torrent's own jobs are held back. Other owners can't be
+   * reading these files, since the torrent has none of their pieces yet */
+  if (job->tor->preallocations == NULL || job->owner != job->tor)
+    return NULL;
+
+  for (i=0; p==NULL && i<job->segmentCount; ++i)
+    p = findPreallocation (job->tor, job->segments[i].fileIndex);
+
+  return p;
+}
+
+static uint64_t
+getJobBytes (const struct io_job * job)
+{
+  size_t i;
+  uint64_t bytes = 0;
+
+  for (i=0; i<job->segmentCount; ++i)
+    bytes += job->segments[i].buflen;
+
+  return bytes;
+}
+
+static void
+submitOrHoldJob (struct io_job * job)
+{
+  struct tr_preallocation * p;
+
+  if ((p = findJobPreallocation (job)) == NULL)
+    {
+      tr_diskIoSubmit (job->tor->session->diskIo, job->owner, ioJobWork, ioJobDone, job);
+    }
+  else
+    {
+      job->next = NULL;
+      if (p->tail != NULL)
+        p->tail->next = job;
+      else
+        p->head = job;
+      p->tail = job;
+      p->heldBytes += getJobBytes (job);
+    }
+}
+
+/* called in a worker thread */
+static void
+preallocationWork (void * vp)
+{
+  struct tr_preallocation * p = vp;
+  const uint64_t length = p->tor->info.files[p->fileIndex].length;
+  tr_sys_file_t fd;
+
+  fd = tr_sys_file_open (p->filename, TR_SYS_FILE_WRITE, 0666, &p->error);
+
+  if (fd != TR_BAD_SYS_FILE)
+    {
+      tr_fdPreallocateFull (fd, length, &p->stop, &p->bytesDone, &p->error);
+      tr_sys_file_close (fd, p->error == NULL ? &p->error : NULL);
+    }
+}
+
+/* called in the libtransmission thread */
+static void
+preallocationDone (void * vp, bool cancelled)
+{
+  struct io_job * job;
+  struct tr_preallocation ** walk;
+  struct tr_preallocation * p = vp;
+  tr_torrent * tor = p->tor;
+  const tr_file * file = &tor->info.files[p->fileIndex];
+
+  for (walk=&tor->preallocations; *walk!=NULL; walk=&(*walk)->next)
+    {
+      if (*walk == p)
+        {
+          *walk = p->next;
+          break;
+        }
+    }
+
+  if (cancelled)
+    {
+      /* the torrent is being freed */
+    }
+  else if (p->error != NULL)
+    {
+      tr_logAddTorErr (tor, _("Couldn't preallocate file \"%1$s\" (%2$s, size: %3$"PRIu64"): %4$s"),
+                       p->filename, _("full"), file->length, p->error->message);
+      setWriteError (tor, file, p->error->code);
+    }
+  else
+    {
+      const uint64_t msec = tr_time_msec () - p->startedAt;
+
+      if (p->bytesDone < file->length)
+        tr_logAddTorDbg (tor, "Stopped preallocating \"%s\" after %"PRIu64" of %"PRIu64" bytes",
+                         p->filename, (uint64_t)p->bytesDone, file->length);
+      else if (msec >= 1000)
+        tr_logAddTorInfo (tor, "Preallocated \"%s\" (%"PRIu64" bytes) in %d seconds",
+                          p->filename, file->length, (int)(msec / 1000));
+    }
+
+  /* let the jobs that were waiting go ahead */
+  while ((job = p->head) != NULL)
+    {
+      p->head = job->next;
+      job->next = NULL;
+
+      if (cancelled)
+        ioJobDone (job, true);
+      else
+        submitOrHoldJob (job);
+    }
+
+  tr_error_free (p->error);
+  tr_free (p->filename);
+  tr_free (p);
+}
+
+static void
+startPreallocation (tr_torrent      * tor,
+                    tr_file_index_t   fileIndex,
+                    const char      * filename)
+{
+  struct tr_preallocation * p;
+
+  if (tor->info.files[fileIndex].length == 0 || findPreallocation (tor, fileIndex) != NULL)
+    return;
+
+  p = tr_new0 (struct tr_preallocation, 1);
+  p->tor = tor;
+  p->fileIndex = fileIndex;
+  p->filename = tr_strdup (filename);
+  p->startedAt = tr_time_msec ();
+  p->next = tor->preallocations;
+  tor->preallocations = p;
+
+  tr_diskIoSubmit (tor->session->diskIo, tor, preallocationWork, preallocationDone, p);
+}
+
+void
+tr_ioStopPreallocations (tr_torrent * tor)
+{
+  struct tr_preallocation * p;
+
+  for (p=tor->preallocations; p!=NULL; p=p->next)
+    p->stop = true;
 }
 
 bool
-tr_ioTestPiece (tr_torrent * tor, tr_piece_index_t piece)
+tr_ioPieceIsHeldBack (const tr_torrent * tor, tr_piece_index_t piece)
+{
+  const struct tr_preallocation * p;
+  uint64_t heldBytes = 0;
+
+  for (p=tor->preallocations; p!=NULL; p=p->next)
+    heldBytes += p->heldBytes;
+
+  if (heldBytes < PREALLOCATION_MAX_HELD_BYTES)
+    return false;
+
+  for (p=tor->preallocations; p!=NULL; p=p->next)
+    {
+      const tr_file * file = &tor->info.files[p->fileIndex];
+
+      if (file->firstPiece <= piece && piece <= file->lastPiece)
+        return true;
+    }
+
+  return false;
+}
+
+uint64_t
+tr_ioGetPreallocationBytesLeft (const tr_torrent * tor, tr_file_index_t fileIndex)
+{
+  const struct tr_preallocation * p = findPreallocation (tor, fileIndex);
+
+  if (p == NULL)
+    return 0;
+
+  return tor->info.files[fileIndex].length - MIN (p->bytesDone, tor->info.files[fileIndex].length);
+}
+
+/**
+ * Find and open the files that a piece range touches.
+ * The files are pinned in the fd cache until the job is freed, so the
+ * worker thread isn't affected if the cache closes them meanwhile.
+ *
+ * returns 0 on success, or an errno on failure.
+ */
+static int
+prepareJob (struct io_job    * job,
+            tr_piece_index_t   pieceIndex,
+            uint32_t           pieceOffset,
+            size_t             buflen)
+{
+  int err = 0;
+  tr_file_index_t fileIndex;
+  uint64_t fileOffset;
+  tr_torrent * tor = job->tor;
+  const tr_info * info = &tor->info;
+
+  if (pieceIndex >= info->pieceCount)
+    return EINVAL;
+
+  tr_ioFindFileLocation (tor, pieceIndex, pieceOffset, &fileIndex, &fileOffset);
+
+  job->segments = tr_new0 (struct io_segment, info->fileCount - fileIndex);
+
+  while (buflen && !err)
+    {
+      const tr_file * file = &info->files[fileIndex];
+      const uint64_t bytesThisPass = MIN (buflen, file->length - fileOffset);
+
+      if (file->length != 0)
+        {
+          tr_sys_file_t fd;
+          struct io_segment * seg = &job->segments[job->segmentCount];
+
+          seg->fileIndex = fileIndex;
+          seg->fileOffset = fileOffset;
+          seg->buflen = bytesThisPass;
+          seg->fd = TR_BAD_SYS_FILE;
+          ++job->segmentCount;
+
+          if (!(err = getFileDescriptor (tor->session, tor, job->ioMode, fileIndex, &fd)))
+            {
+              const bool writable = job->ioMode >= TR_IO_WRITE;
+
+              seg->file = tr_fdFilePin (tor->session, tr_torrentId (tor), fileIndex, writable, &seg->fd);
+              assert (seg->file != NULL);
+            }
+
+          if ((err != 0) && (job->ioMode == TR_IO_WRITE))
+            setWriteError (tor, file, err);
+        }
+
+      buflen -= bytesThisPass;
+      fileIndex++;
+      fileOffset = 0;
+    }
+
+  return err;
+}
+
+/**
+ * Copy the job's regions, splitting the ones that cross a file boundary,
+ * and tell each segment which of the regions are its own.
+ */
+static void
+splitJobVecs (struct io_job      * job,
+              const tr_sys_iovec * vec,
+              size_t               vecCount)
+{
+  size_t i;
+  size_t used = 0; /* how much of vec[0] earlier segments have taken */
+
+  /* each file boundary splits at most one region in two */
+  job->vecs = tr_new (tr_sys_iovec, vecCount + job->segmentCount);
+  job->vecCount = 0;
+
+  for (i=0; i<job->segmentCount; ++i)
+    {
+      struct io_segment * seg = &job->segments[i];
+      size_t left = seg->buflen;
+
+      seg->vecIndex = job->vecCount;
+
+      while (left > 0)
+        {
+          const size_t n = MIN (left, vec->length - used);
+          tr_sys_iovec * v = &job->vecs[job->vecCount++];
+
+          assert (vecCount > 0);
+
+          v->base = (uint8_t*)vec->base + used;
+          v->length = n;
+          left -= n;
+          used += n;
+
+          if (used == vec->length)
+            {
+              ++vec;
+              --vecCount;
+              used = 0;
+            }
+        }
+
+      seg->vecCount = job->vecCount - seg->vecIndex;
+    }
+}
+
+static int
+submitJob (tr_torrent       * tor,
+           int                ioMode,
+           tr_piece_index_t   pieceIndex,
+           uint32_t           pieceOffset,
+           uint8_t          * buf,
+           size_t             buflen,
+           const void       * owner,
+           tr_io_done_func    done_func,
+           void             * done_data)
+{
+  int err;
+  struct io_job * job;
+
+  assert (tr_isTorrent (tor));
+  assert (tr_amInEventThread (tor->session));
+
+  job = tr_new0 (struct io_job, 1);
+  job->session = tor->session;
+  job->tor = tor;
+  job->ioMode = ioMode;
+  job->buf = buf;
+  job->done_func = done_func;
+  job->done_data = done_data;
+  job->owner = owner;
+
+  if ((err = prepareJob (job, pieceIndex, pieceOffset, buflen)))
+    freeJob (job);
+  else
+    submitOrHoldJob (job);
+
+  return err;
+}
+
+int
+tr_ioReadAsync (tr_torrent       * tor,
+                tr_piece_index_t   pieceIndex,
+                uint32_t           begin,
+                uint32_t           len,
+                uint8_t          * setme,
+                const void       * owner,
+                tr_io_done_func    done_func,
+                void             * done_data)
+{
+  return submitJob (tor, TR_IO_READ, pieceIndex, begin, setme, len, owner, done_func, done_data);
+}
+
+int
+tr_ioPrefetchAsync (tr_torrent       * tor,
+                    tr_piece_index_t   pieceIndex,
+                    uint32_t           begin,
+                    uint32_t           len,
+                    const void       * owner,
+                    tr_io_done_func    done_func,
+                    void             * done_data)
 {
-  uint8_t hash[SHA_DIGEST_LENGTH];
+  return submitJob (tor, TR_IO_PREFETCH, pieceIndex, begin, NULL, len, owner, done_func, done_data);
+}
 
-  return recalculateHash (tor, piece, hash)
-      && memcmp (hash, tor->info.pieces[piece].hash, SHA_DIGEST_LENGTH) == 0;
+int
+tr_ioWriteVecAsync (tr_torrent          * tor,
+                    tr_piece_index_t      pieceIndex,
+                    uint32_t              begin,
+                    uint32_t              len,
+                    const tr_sys_iovec  * vec,
+                    size_t                vec_count,
+                    tr_io_start_func      start_func,
+                    tr_io_done_func       done_func,
+                    void                * done_data)
+{
+  int err;
+  struct io_job * job;
+
+  assert (tr_isTorrent (tor));
+  assert (tr_amInEventThread (tor->session));
+  assert (vec != NULL || vec_count == 0);
+
+  job = tr_new0 (struct io_job, 1);
+  job->session = tor->session;
+  job->tor = tor;
+  job->ioMode = TR_IO_WRITE;
+  job->start_func = start_func;
+  job->done_func = done_func;
+  job->done_data = done_data;
+  job->owner = tor;
+
+  if ((err = prepareJob (job, pieceIndex, begin, len)))
+    {
+      freeJob (job);
+    }
+  else
+    {
+      splitJobVecs (job, vec, vec_count);
+      submitOrHoldJob (job);
+    }
+
+  return err;
 }
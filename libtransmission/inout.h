@@ -13,6 +13,8 @@
 
 #pragma once
 
+struct evbuffer;
+struct tr_sys_iovec;
 struct tr_torrent;
 
 /**
@@ -23,6 +25,7 @@ struct tr_torrent;
 /**
  * Reads the block specified by the piece index, offset, and length.
  * @return 0 on success, or an errno value on failure.
+ *         EAGAIN if one of the block's files is still being preallocated.
  */
 int tr_ioRead (struct tr_torrent   * tor,
                tr_piece_index_t      pieceIndex,
@@ -38,6 +41,7 @@ int tr_ioPrefetch (tr_torrent       * tor,
 /**
  * Writes the block specified by the piece index, offset, and length.
  * @return 0 on success, or an errno value on failure.
+ *         EAGAIN if one of the block's files is still being preallocated.
  */
 int tr_ioWrite (struct tr_torrent  * tor,
                 tr_piece_index_t     pieceIndex,
@@ -45,12 +49,122 @@ int tr_ioWrite (struct tr_torrent  * tor,
                 uint32_t             len,
                 const uint8_t      * writeme);
 
+enum
+{
+  /* how many file segments tr_ioReadToBuffer () may have in peers'
+     output buffers at once. Each one keeps a file open until it's sent */
+  TR_IO_MAX_FILE_SEGMENTS = 128
+};
+
+/**
+ * Appends a block to `buf' as file segments instead of reading it.
+ * The data is read by the kernel when buf is written to a socket,
+ * e.g. with sendfile (). Not supported on Windows or with libevent
+ * older than 2.1.
+ *
+ * @return 0 on success, or an errno value on failure
+ * @see tr_ioCanReadToBuffer ()
+ */
+int tr_ioReadToBuffer (struct tr_torrent  * tor,
+                       tr_piece_index_t     pieceIndex,
+                       uint32_t             offset,
+                       uint32_t             len,
+                       struct evbuffer    * buf);
+
+/**
+ * True if tr_ioReadToBuffer () is supported and can add the block without
+ * going over TR_IO_MAX_FILE_SEGMENTS. Otherwise the caller should read
+ * the block itself.
+ */
+bool tr_ioCanReadToBuffer (struct tr_torrent  * tor,
+                           tr_piece_index_t     pieceIndex,
+                           uint32_t             offset,
+                           uint32_t             len);
+
+/**
+ * Called in the libtransmission thread when an asynchronous read or write
+ * is finished. `err' is 0 on success, ECANCELED if the request's owner was
+ * cancelled with tr_diskIoCancel (), or an errno value on failure.
+ */
+typedef void (* tr_io_done_func) (struct tr_torrent  * tor,
+                                  int                  err,
+                                  void               * user_data);
+
+/**
+ * Called in a disk I/O thread right before a queued write starts.
+ * Until then, the memory it writes from may still be changed.
+ */
+typedef void (* tr_io_start_func) (void * user_data);
+
+/**
+ * Queues a read of the block specified by the piece index, offset, and length
+ * on the session's disk I/O threads. `setme' must stay valid until done_func
+ * is called.
+ *
+ * @return 0 if the read was queued, in which case done_func will be called
+ *         exactly once; or an errno value if it couldn't be queued.
+ */
+int tr_ioReadAsync (struct tr_torrent   * tor,
+                    tr_piece_index_t      pieceIndex,
+                    uint32_t              offset,
+                    uint32_t              len,
+                    uint8_t             * setme,
+                    const void          * owner,
+                    tr_io_done_func       done_func,
+                    void                * user_data);
+
+/**
+ * Like tr_ioReadAsync (), but the torrent is the owner and the data
+ * comes from a list of memory regions that together are `len' bytes long.
+ * Each file that the range touches gets one vectored write, so the
+ * regions never need to be copied into one buffer first.
+ * The regions must stay untouched from when start_func is called until
+ * done_func is. start_func is optional and won't be called if the write
+ * is cancelled before it starts.
+ */
+int tr_ioWriteVecAsync (struct tr_torrent          * tor,
+                        tr_piece_index_t             pieceIndex,
+                        uint32_t                     offset,
+                        uint32_t                     len,
+                        const struct tr_sys_iovec  * vec,
+                        size_t                       vec_count,
+                        tr_io_start_func             start_func,
+                        tr_io_done_func              done_func,
+                        void                       * user_data);
+
+/**
+ * Asks the OS to start reading the block into its page cache.
+ * done_func is optional; it's called once the request has been made.
+ */
+int tr_ioPrefetchAsync (struct tr_torrent  * tor,
+                        tr_piece_index_t     pieceIndex,
+                        uint32_t             begin,
+                        uint32_t             len,
+                        const void         * owner,
+                        tr_io_done_func      done_func,
+                        void               * user_data);
+
+/**
+ * With TR_PREALLOCATE_FULL, new files are preallocated by disk I/O jobs
+ * and the torrent's asynchronous reads and writes to them wait until
+ * that's done.
+ * This makes any zero-filling end early, e.g. because the torrent is
+ * being stopped and we're about to wait for its jobs.
+ */
+void tr_ioStopPreallocations (tr_torrent * tor);
+
 /**
- * @brief Test to see if the piece matches its metainfo's SHA1 checksum.
+ * @return true if no more blocks of the piece should be requested for now,
+ *         because too much of the torrent's downloaded data is waiting for
+ *         preallocations to finish and one of them is of the piece's files
  */
-bool tr_ioTestPiece (tr_torrent       * tor,
-                     tr_piece_index_t   piece);
+bool tr_ioPieceIsHeldBack (const tr_torrent * tor,
+                           tr_piece_index_t   piece);
 
+/** @return how much of the file is still to be preallocated, or 0 if
+            it isn't being preallocated */
+uint64_t tr_ioGetPreallocationBytesLeft (const tr_torrent * tor,
+                                         tr_file_index_t    fileIndex);
 
 /**
  * Converts a piece index + offset into a file index + offset.
@@ -7,9 +7,20 @@
  * $Id: magnet-test.c 14241 2014-01-21 03:10:30Z jordan $
  */
 
+#include <string.h> /* memcmp () */
+
+#include <event2/buffer.h>
+
 #include "transmission.h"
+#include "crypto-utils.h" /* tr_sha1 () */
+#include "file.h" /* tr_sys_path_remove () */
 #include "magnet.h"
+#include "platform.h" /* tr_threadNew () */
+#include "session.h" /* tr_sessionLock () */
+#include "torrent.h"
+#include "torrent-magnet.h"
 #include "utils.h"
+#include "variant.h"
 
 #include "libtransmission-test.h"
 
@@ -64,5 +75,497 @@ test1 (void)
     return 0;
 }
 
-MAIN_SINGLE_TEST (test1)
+/***
+****
+***/
+
+/* the bencoded info dict of a torrent with a single file and `pieceCount'
+   pieces. It takes up about 20 bytes per piece. */
+static char *
+create_info_dict (const char * name, int pieceCount, size_t * setme_len)
+{
+  int i;
+  char * ret;
+  tr_variant info;
+  uint8_t * pieces = tr_new (uint8_t, SHA_DIGEST_LENGTH * pieceCount);
+
+  for (i=0; i<SHA_DIGEST_LENGTH * pieceCount; ++i)
+    pieces[i] = (uint8_t) (i * 31);
+
+  tr_variantInitDict (&info, 4);
+  tr_variantDictAddInt (&info, TR_KEY_length, (int64_t) pieceCount * 16384);
+  tr_variantDictAddStr (&info, TR_KEY_name, name);
+  tr_variantDictAddInt (&info, TR_KEY_piece_length, 16384);
+  tr_variantDictAddRaw (&info, TR_KEY_pieces, pieces, SHA_DIGEST_LENGTH * pieceCount);
+  ret = tr_variantToStr (&info, TR_VARIANT_FMT_BENC, setme_len);
+
+  tr_variantFree (&info);
+  tr_free (pieces);
+  return ret;
+}
+
+static tr_torrent *
+torrent_new (tr_ctor * ctor)
+{
+  tr_torrent * tor;
+
+  tr_ctorSetPaused (ctor, TR_FORCE, true);
+  tor = tr_torrentNew (ctor, NULL, NULL);
+
+  /* let the verify that new torrents start with finish,
+     so that it doesn't outlive the torrent */
+  if (tor != NULL)
+    libttest_blockingTorrentVerify (tor);
+
+  tr_ctorFree (ctor);
+  return tor;
+}
+
+static tr_torrent *
+torrent_init (tr_session * session, const char * info_dict, size_t info_dict_len)
+{
+  tr_torrent * tor;
+  tr_ctor * ctor = tr_ctorNew (session);
+  struct evbuffer * metainfo = evbuffer_new ();
+
+  evbuffer_add_printf (metainfo, "d4:info");
+  evbuffer_add (metainfo, info_dict, info_dict_len);
+  evbuffer_add_printf (metainfo, "e");
+  tr_ctorSetMetainfo (ctor, evbuffer_pullup (metainfo, -1), evbuffer_get_length (metainfo));
+  tor = torrent_new (ctor);
+
+  evbuffer_free (metainfo);
+  return tor;
+}
+
+/* a torrent added by a magnet link for that info dict,
+   that's ready to fetch the info dict from peers */
+static tr_torrent *
+magnet_torrent_init (tr_session * session, const char * info_dict, size_t info_dict_len)
+{
+  char * link;
+  tr_torrent * tor;
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  char hex[SHA_DIGEST_LENGTH * 2 + 1];
+  tr_ctor * ctor = tr_ctorNew (session);
+
+  tr_sha1 (hash, info_dict, (int) info_dict_len, NULL);
+  tr_sha1_to_hex (hex, hash);
+  link = tr_strdup_printf ("magnet:?xt=urn:btih:%s", hex);
+  tr_ctorSetMetainfoFromMagnetLink (ctor, link);
+  tor = torrent_new (ctor);
+
+  if (tor != NULL)
+    {
+      tr_sessionLock (session);
+      tr_torrentSetMetadataSizeHint (tor, info_dict_len);
+      tr_sessionUnlock (session);
+    }
+
+  tr_free (link);
+  return tor;
+}
+
+static uint64_t
+get_metadata_loads (tr_session * session)
+{
+  tr_session_cache_stats stats;
+
+  tr_sessionGetCacheStats (session, &stats);
+  return stats.metadataLoads;
+}
+
+/* ask for the first piece of the torrent's info dict,
+   as a peer would, and return how big it was */
+static size_t
+get_metadata_piece (tr_torrent * tor, struct evbuffer * buf)
+{
+  size_t len;
+
+  tr_sessionLock (tor->session);
+  len = tr_torrentGetMetadataPiece (tor, 0, buf);
+  tr_sessionUnlock (tor->session);
+
+  return len;
+}
+
+static void
+free_buffer_threadfunc (void * vbuf)
+{
+  struct evbuffer ** buf = vbuf;
+
+  evbuffer_free (*buf);
+  *buf = NULL;
+}
+
+static int
+test_metadata_cache_refcount (void)
+{
+  size_t len;
+  char * info_dict;
+  tr_torrent * tor;
+  struct evbuffer * buf = evbuffer_new ();
+  tr_session * session = libttest_session_init (NULL);
+
+  info_dict = create_info_dict ("refcount", 16, &len);
+  tor = torrent_init (session, info_dict, len);
+  check (tor != NULL);
+  check (len < METADATA_PIECE_SIZE);
+
+  /* the info dict is read from the .torrent file once */
+  check_uint_eq (len, get_metadata_piece (tor, buf));
+  check_uint_eq (len, get_metadata_piece (tor, buf));
+  check_uint_eq (1, get_metadata_loads (session));
+
+  /* the pieces that are still waiting to be sent keep it alive
+     after the torrent lets go of it... */
+  tr_sessionLock (session);
+  tr_torrentDropMetadataCache (tor);
+  tr_sessionUnlock (session);
+  check_uint_eq (2 * len, evbuffer_get_length (buf));
+  check (memcmp (evbuffer_pullup (buf, -1), info_dict, len) == 0);
+  check (memcmp (evbuffer_pullup (buf, -1) + len, info_dict, len) == 0);
+
+  /* ...until they've gone out, which can be in a peer I/O thread */
+  tr_threadNew (free_buffer_threadfunc, &buf);
+  while (buf != NULL)
+    tr_wait_msec (10);
+
+  /* and now it has to be read again */
+  buf = evbuffer_new ();
+  check_uint_eq (len, get_metadata_piece (tor, buf));
+  check_uint_eq (2, get_metadata_loads (session));
+
+  /* cleanup */
+  evbuffer_free (buf);
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  tr_free (info_dict);
+  return 0;
+}
+
+static int
+test_metadata_cache_lru (void)
+{
+  int i;
+  size_t len;
+  tr_torrent * tor[3];
+  struct evbuffer * buf = evbuffer_new ();
+  tr_session * session = libttest_session_init (NULL);
+
+  for (i=0; i<3; ++i)
+    {
+      char name[16];
+      char * info_dict;
+
+      tr_snprintf (name, sizeof (name), "lru-%d", i);
+      info_dict = create_info_dict (name, 400, &len);
+      tor[i] = torrent_init (session, info_dict, len);
+      check (tor[i] != NULL);
+      tr_free (info_dict);
+    }
+
+  /* room for two of the three info dicts */
+  tr_metadataCacheSetLimit (len * 5 / 2);
+
+  /* 0 and 1 get read; 0 is used again, so 1 is the least recently used */
+  check (get_metadata_piece (tor[0], buf) > 0);
+  check (get_metadata_piece (tor[1], buf) > 0);
+  check (get_metadata_piece (tor[0], buf) > 0);
+  check_uint_eq (2, get_metadata_loads (session));
+
+  /* so reading 2 pushes out 1, not 0 */
+  check (get_metadata_piece (tor[2], buf) > 0);
+  check_uint_eq (3, get_metadata_loads (session));
+  check (get_metadata_piece (tor[0], buf) > 0);
+  check (get_metadata_piece (tor[2], buf) > 0);
+  check_uint_eq (3, get_metadata_loads (session));
+  check (get_metadata_piece (tor[1], buf) > 0);
+  check_uint_eq (4, get_metadata_loads (session));
+
+  /* cleanup */
+  tr_metadataCacheSetLimit (1024 * 1024 * 16);
+  evbuffer_free (buf);
+  for (i=0; i<3; ++i)
+    tr_torrentRemove (tor[i], true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_metadata_cache_failure (void)
+{
+  size_t len;
+  char * info_dict;
+  tr_torrent * tor;
+  struct evbuffer * buf = evbuffer_new ();
+  tr_session * session = libttest_session_init (NULL);
+
+  info_dict = create_info_dict ("failure", 16, &len);
+  tor = torrent_init (session, info_dict, len);
+  check (tor != NULL);
+
+  /* without the .torrent file there's nothing to send... */
+  tr_sys_path_remove (tor->info.torrent, NULL);
+  check_uint_eq (0, get_metadata_piece (tor, buf));
+  check_uint_eq (1, get_metadata_loads (session));
+
+  /* ...and the next peers are turned away without looking for it again */
+  check_uint_eq (0, get_metadata_piece (tor, buf));
+  check_uint_eq (0, get_metadata_piece (tor, buf));
+  check_uint_eq (1, get_metadata_loads (session));
+  check_uint_eq (0, evbuffer_get_length (buf));
+
+  /* cleanup */
+  evbuffer_free (buf);
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  tr_free (info_dict);
+  return 0;
+}
+
+/***
+****  Fetching the info dict of a magnet link
+***/
+
+/* an info dict that takes up ten metadata pieces */
+#define MAGNET_PIECE_COUNT 10
+
+struct magnet_test
+{
+  tr_session * session;
+  tr_torrent * tor;
+  char * info_dict;
+  size_t info_dict_len;
+  time_t now;
+
+  /* they're only told apart by their addresses */
+  int peers[4];
+};
+
+static bool
+magnet_test_init (struct magnet_test * t)
+{
+  memset (t, 0, sizeof (struct magnet_test));
+  t->session = libttest_session_init (NULL);
+  t->info_dict = create_info_dict ("magnet", 7500, &t->info_dict_len);
+  t->tor = magnet_torrent_init (t->session, t->info_dict, t->info_dict_len);
+  t->now = tr_time ();
+
+  return t->tor != NULL
+      && !tr_torrentHasMetadata (t->tor)
+      && (t->info_dict_len + METADATA_PIECE_SIZE - 1) / METADATA_PIECE_SIZE == MAGNET_PIECE_COUNT;
+}
+
+static void
+magnet_test_free (struct magnet_test * t)
+{
+  tr_torrentRemove (t->tor, true, tr_sys_path_remove);
+  libttest_session_close (t->session);
+  tr_free (t->info_dict);
+}
+
+/* the next piece to ask peer `i' for, or -1 */
+static int
+next_request (struct magnet_test * t, int i, time_t now)
+{
+  int piece;
+  bool have;
+
+  tr_sessionLock (t->session);
+  have = tr_torrentGetNextMetadataRequest (t->tor, &t->peers[i], now, &piece);
+  tr_sessionUnlock (t->session);
+
+  return have ? piece : -1;
+}
+
+/* a peer answers with a piece, maybe with some of it garbled */
+static void
+got_piece (struct magnet_test * t, int piece, bool corrupt)
+{
+  const size_t offset = (size_t) piece * METADATA_PIECE_SIZE;
+  const size_t len = MIN (METADATA_PIECE_SIZE, t->info_dict_len - offset);
+  char * data = tr_memdup (t->info_dict + offset, len);
+
+  if (corrupt)
+    data[len / 2] ^= 0xff;
+
+  tr_sessionLock (t->session);
+  tr_torrentSetMetadataPiece (t->tor, piece, data, (int) len);
+  tr_sessionUnlock (t->session);
+
+  tr_free (data);
+}
+
+static int
+test_magnet_parallel (void)
+{
+  int i;
+  int piece;
+  struct magnet_test t;
+  bool asked[MAGNET_PIECE_COUNT];
+
+  check (magnet_test_init (&t));
+  memset (asked, 0, sizeof (asked));
+
+  /* each peer gets pieces nobody else has been asked for */
+  for (i=0; i<MAGNET_PIECE_COUNT; ++i)
+    {
+      piece = next_request (&t, i % 3, t.now);
+      check (piece >= 0 && piece < MAGNET_PIECE_COUNT);
+      check (!asked[piece]);
+      asked[piece] = true;
+    }
+
+  /* and while all of them are fresh, nobody gets more */
+  for (i=0; i<4; ++i)
+    check_int_eq (-1, next_request (&t, i, t.now));
+
+  magnet_test_free (&t);
+  return 0;
+}
+
+static int
+test_magnet_retry (void)
+{
+  int i;
+  struct magnet_test t;
+
+  check (magnet_test_init (&t));
+
+  for (i=0; i<MAGNET_PIECE_COUNT; ++i)
+    check_int_eq (i, next_request (&t, 0, t.now));
+
+  /* a second later it's too soon to give up on peer 0... */
+  check_int_eq (-1, next_request (&t, 1, t.now + 1));
+
+  /* ...but after that, another peer is asked for the oldest request */
+  check_int_eq (0, next_request (&t, 1, t.now + 2));
+  check_int_eq (1, next_request (&t, 2, t.now + 2));
+
+  /* the peer that sat on them isn't asked again yet */
+  check_int_eq (-1, next_request (&t, 0, t.now + 2));
+
+  magnet_test_free (&t);
+  return 0;
+}
+
+static int
+test_magnet_endgame (void)
+{
+  int i;
+  struct magnet_test t;
+
+  check (magnet_test_init (&t));
+
+  for (i=0; i<MAGNET_PIECE_COUNT; ++i)
+    check_int_eq (i, next_request (&t, 0, t.now));
+  for (i=0; i<MAGNET_PIECE_COUNT - 4; ++i)
+    got_piece (&t, i, false);
+
+  /* with only four pieces left, they're handed to other
+     peers without waiting for the usual retry */
+  check_int_eq (6, next_request (&t, 1, t.now + 1));
+  check_int_eq (7, next_request (&t, 2, t.now + 1));
+  check_int_eq (8, next_request (&t, 3, t.now + 1));
+
+  /* whoever answers first wins */
+  got_piece (&t, 6, false);
+  got_piece (&t, 7, false);
+  got_piece (&t, 8, false);
+  got_piece (&t, 9, false);
+  check (tr_torrentHasMetadata (t.tor));
+
+  magnet_test_free (&t);
+  return 0;
+}
+
+static int
+test_magnet_requeue (void)
+{
+  int i;
+  int piece;
+  struct magnet_test t;
+
+  check (magnet_test_init (&t));
+
+  for (i=0; i<MAGNET_PIECE_COUNT; ++i)
+    check_int_eq (i, next_request (&t, 0, t.now));
+
+  /* a rejected request goes to the front of the queue,
+     so that another peer is asked for it right away */
+  tr_sessionLock (t.session);
+  tr_torrentMetadataRequestFailed (t.tor, &t.peers[0], 7);
+  tr_sessionUnlock (t.session);
+  check_int_eq (7, next_request (&t, 1, t.now));
+  check_int_eq (-1, next_request (&t, 1, t.now));
+
+  /* only the peer that was asked can reject it */
+  tr_sessionLock (t.session);
+  tr_torrentMetadataRequestFailed (t.tor, &t.peers[0], 7);
+  tr_sessionUnlock (t.session);
+  check_int_eq (-1, next_request (&t, 2, t.now));
+
+  /* when a peer goes away, all of its requests are put back */
+  tr_sessionLock (t.session);
+  tr_torrentCancelMetadataRequests (t.tor, &t.peers[0]);
+  tr_sessionUnlock (t.session);
+  for (i=0; i<MAGNET_PIECE_COUNT - 1; ++i)
+    {
+      piece = next_request (&t, 2, t.now);
+      check (piece >= 0 && piece < MAGNET_PIECE_COUNT);
+      check (piece != 7);
+    }
+  check_int_eq (-1, next_request (&t, 2, t.now));
+
+  magnet_test_free (&t);
+  return 0;
+}
+
+static int
+test_magnet_out_of_order (void)
+{
+  int i;
+  struct magnet_test t;
+  const int order[MAGNET_PIECE_COUNT] = { 3, 9, 0, 5, 1, 8, 2, 7, 4, 6 };
+
+  check (magnet_test_init (&t));
+
+  /* the info dict is hashed as it comes in; a garbled piece
+     makes the check at the end fail, and it all starts over */
+  for (i=0; i<MAGNET_PIECE_COUNT; ++i)
+    got_piece (&t, order[i], order[i] == 5);
+  check (!tr_torrentHasMetadata (t.tor));
+  check_int_eq (0, next_request (&t, 0, t.now));
+
+  /* the same pieces in reverse order, with some repeats */
+  for (i=MAGNET_PIECE_COUNT-1; i>=0; --i)
+    {
+      got_piece (&t, order[i], false);
+      if (i % 3 == 0)
+        got_piece (&t, order[i], true);
+    }
+  check (tr_torrentHasMetadata (t.tor));
+  check_int_eq (7500, t.tor->info.pieceCount);
+  check_streq ("magnet", t.tor->info.name);
+
+  magnet_test_free (&t);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test1,
+                             test_metadata_cache_refcount,
+                             test_metadata_cache_lru,
+                             test_metadata_cache_failure,
+                             test_magnet_parallel,
+                             test_magnet_retry,
+                             test_magnet_endgame,
+                             test_magnet_requeue,
+                             test_magnet_out_of_order };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
 
@@ -15,7 +15,7 @@
 #include <event2/util.h> /* evutil_ascii_strcasecmp () */
 
 #include "transmission.h"
-#include "crypto-utils.h" /* tr_sha1 */
+#include "crypto-utils.h" /* tr_sha1_many */
 #include "error.h"
 #include "file.h"
 #include "log.h"
@@ -218,6 +218,15 @@ tr_metaInfoBuilderFree (tr_metainfo_builder * builder)
 *****
 ****/
 
+enum
+{
+  /* the most pieces hashed together by one tr_sha1_many () call */
+  MAKEMETA_HASH_BATCH = 8,
+
+  /* don't read more than this into memory at once */
+  MAKEMETA_HASH_BUFFER_SIZE = 32 * 1024 * 1024
+};
+
 static uint8_t*
 getHashInfo (tr_metainfo_builder * b)
 {
@@ -225,6 +234,7 @@ getHashInfo (tr_metainfo_builder * b)
   uint8_t *ret = tr_new0 (uint8_t, SHA_DIGEST_LENGTH * b->pieceCount);
   uint8_t *walk = ret;
   uint8_t *buf;
+  size_t batchSize;
   uint64_t totalRemain;
   uint64_t off = 0;
   tr_sys_file_t fd;
@@ -233,7 +243,9 @@ getHashInfo (tr_metainfo_builder * b)
   if (!b->totalSize)
     return ret;
 
-  buf = tr_valloc (b->pieceSize);
+  /* read several pieces at a time so that tr_sha1_many () can hash them together */
+  batchSize = MAX (1, MIN (MAKEMETA_HASH_BATCH, MAKEMETA_HASH_BUFFER_SIZE / b->pieceSize));
+  buf = tr_valloc (b->pieceSize * batchSize);
   b->pieceIndex = 0;
   totalRemain = b->totalSize;
   fd = tr_sys_file_open (b->files[fileIndex].filename, TR_SYS_FILE_READ |
@@ -253,58 +265,69 @@ getHashInfo (tr_metainfo_builder * b)
 
   while (totalRemain)
     {
-      uint8_t * bufptr = buf;
-      const uint32_t thisPieceSize = (uint32_t) MIN (b->pieceSize, totalRemain);
-      uint64_t leftInPiece = thisPieceSize;
-
-      assert (b->pieceIndex < b->pieceCount);
+      size_t n = 0;
+      const void * pieces[MAKEMETA_HASH_BATCH];
+      size_t pieceLengths[MAKEMETA_HASH_BATCH];
 
-      while (leftInPiece)
+      while (n < batchSize && totalRemain)
         {
-          const uint64_t n_this_pass = MIN (b->files[fileIndex].size - off, leftInPiece);
-          uint64_t n_read = 0;
-          tr_sys_file_read (fd, bufptr, n_this_pass, &n_read, NULL);
-          bufptr += n_read;
-          off += n_read;
-          leftInPiece -= n_read;
-          if (off == b->files[fileIndex].size)
+          uint8_t * bufptr = buf + n * b->pieceSize;
+          const uint32_t thisPieceSize = (uint32_t) MIN (b->pieceSize, totalRemain);
+          uint64_t leftInPiece = thisPieceSize;
+
+          assert (b->pieceIndex < b->pieceCount);
+
+          while (leftInPiece)
             {
-              off = 0;
-              tr_sys_file_close (fd, NULL);
-              fd = TR_BAD_SYS_FILE;
-              if (++fileIndex < b->fileCount)
+              const uint64_t n_this_pass = MIN (b->files[fileIndex].size - off, leftInPiece);
+              uint64_t n_read = 0;
+              tr_sys_file_read (fd, bufptr, n_this_pass, &n_read, NULL);
+              bufptr += n_read;
+              off += n_read;
+              leftInPiece -= n_read;
+              if (off == b->files[fileIndex].size)
                 {
-                  fd = tr_sys_file_open (b->files[fileIndex].filename, TR_SYS_FILE_READ |
-                                         TR_SYS_FILE_SEQUENTIAL, 0, &error);
-                  if (fd == TR_BAD_SYS_FILE)
+                  off = 0;
+                  tr_sys_file_close (fd, NULL);
+                  fd = TR_BAD_SYS_FILE;
+                  if (++fileIndex < b->fileCount)
                     {
-                      b->my_errno = error->code;
-                      tr_strlcpy (b->errfile,
-                                  b->files[fileIndex].filename,
-                                  sizeof (b->errfile));
-                      b->result = TR_MAKEMETA_IO_READ;
-                      tr_free (buf);
-                      tr_free (ret);
-                      tr_error_free (error);
-                      return NULL;
+                      fd = tr_sys_file_open (b->files[fileIndex].filename, TR_SYS_FILE_READ |
+                                             TR_SYS_FILE_SEQUENTIAL, 0, &error);
+                      if (fd == TR_BAD_SYS_FILE)
+                        {
+                          b->my_errno = error->code;
+                          tr_strlcpy (b->errfile,
+                                      b->files[fileIndex].filename,
+                                      sizeof (b->errfile));
+                          b->result = TR_MAKEMETA_IO_READ;
+                          tr_free (buf);
+                          tr_free (ret);
+                          tr_error_free (error);
+                          return NULL;
+                        }
                     }
                 }
             }
+
+          assert (bufptr - buf == (int)(n * b->pieceSize + thisPieceSize));
+          assert (leftInPiece == 0);
+          pieces[n] = buf + n * b->pieceSize;
+          pieceLengths[n] = thisPieceSize;
+          ++n;
+
+          totalRemain -= thisPieceSize;
+          ++b->pieceIndex;
         }
 
-      assert (bufptr - buf == (int)thisPieceSize);
-      assert (leftInPiece == 0);
-      tr_sha1 (walk, buf, thisPieceSize, NULL);
-      walk += SHA_DIGEST_LENGTH;
+      tr_sha1_many (n, pieces, pieceLengths, walk);
+      walk += n * SHA_DIGEST_LENGTH;
 
       if (b->abortFlag)
         {
           b->result = TR_MAKEMETA_CANCELLED;
           break;
         }
-
-      totalRemain -= thisPieceSize;
-      ++b->pieceIndex;
     }
 
   assert (b->abortFlag
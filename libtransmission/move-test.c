@@ -16,6 +16,7 @@
 #include "transmission.h"
 #include "cache.h"
 #include "file.h"
+#include "relocate.h" /* tr_relocateSetAlwaysCopy () */
 #include "resume.h"
 #include "trevent.h"
 #include "torrent.h" /* tr_isTorrent() */
@@ -192,6 +193,7 @@ test_set_location (void)
   while ((state==TR_LOC_MOVING) && (time(NULL)<=deadline))
     tr_wait_msec (50);
   check_int_eq (TR_LOC_DONE, state);
+  check (!tr_torrentStat(tor)->isRelocating);
 
   /* confirm the torrent is still complete after being moved */
   libttest_blockingTorrentVerify (tor);
@@ -209,6 +211,197 @@ test_set_location (void)
   return 0;
 }
 
+/* like test_set_location (), but the files are copied
+   as if the target were on another device */
+static int
+test_set_location_copy (void)
+{
+  tr_file_index_t file_index;
+  int state;
+  char * source_dir;
+  char * target_dir;
+  tr_torrent * tor;
+  tr_session * session;
+  const time_t deadline = time(NULL) + 300;
+
+  /* init the session */
+  session = libttest_session_init (NULL);
+  target_dir = tr_buildPath (tr_sessionGetConfigDir (session), "target", NULL);
+  tr_sys_dir_create (target_dir, TR_SYS_DIR_CREATE_PARENTS, 0777, NULL);
+  tr_relocateSetAlwaysCopy (true);
+
+  /* init a torrent. */
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  libttest_blockingTorrentVerify (tor);
+  check_uint_eq (0, tr_torrentStat(tor)->leftUntilDone);
+  source_dir = tr_strdup (tor->currentDir);
+
+  /* now copy it */
+  state = -1;
+  tr_torrentSetLocation (tor, target_dir, true, NULL, &state);
+  while ((state==TR_LOC_MOVING) && (time(NULL)<=deadline))
+    tr_wait_msec (50);
+  check_int_eq (TR_LOC_DONE, state);
+
+  /* confirm the copies are complete and the originals are gone */
+  libttest_blockingTorrentVerify (tor);
+  check_uint_eq (0, tr_torrentStat(tor)->leftUntilDone);
+  libttest_sync ();
+  for (file_index=0; file_index<tor->info.fileCount; ++file_index)
+    {
+      char * path = tr_buildPath (source_dir, tor->info.files[file_index].name, NULL);
+      check (!tr_sys_path_exists (path, NULL));
+      tr_free (path);
+      check_file_location (tor, file_index, tr_buildPath (target_dir, tor->info.files[file_index].name, NULL));
+    }
+
+  /* cleanup */
+  tr_relocateSetAlwaysCopy (false);
+  tr_free (source_dir);
+  tr_free (target_dir);
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+struct test_set_location_dirty_data
+{
+  tr_torrent * tor;
+  volatile double * progress;
+  bool done;
+};
+
+/* runs in the libtransmission thread, after the move has begun.
+ * once the first copy pass is done, write the torrent's missing piece */
+static void
+test_set_location_dirty_threadfunc (void * vdata)
+{
+  tr_block_index_t block, first, last;
+  struct test_set_location_dirty_data * data = vdata;
+  tr_torrent * tor = data->tor;
+  const time_t deadline = time(NULL) + 30;
+  struct evbuffer * buf = evbuffer_new ();
+  char * zero_block = tr_new0 (char, tor->blockSize);
+
+  while (*data->progress < 1 && time(NULL) <= deadline)
+    tr_wait_msec (10);
+
+  tr_torGetPieceBlockRange (tor, 0, &first, &last);
+  for (block=first; block<=last; ++block)
+    {
+      evbuffer_add (buf, zero_block, tor->blockSize);
+      tr_cacheWriteBlock (tor->session->cache, tor, 0, block * tor->blockSize, tor->blockSize, buf);
+      tr_torrentGotBlock (tor, block);
+    }
+
+  tr_free (zero_block);
+  evbuffer_free (buf);
+  data->done = true;
+}
+
+/* the missing piece is written after the first copy pass,
+   so only copying the changes again makes the torrent complete */
+static int
+test_set_location_dirty (void)
+{
+  tr_file_index_t file_index;
+  int state;
+  volatile double progress;
+  char * target_dir;
+  tr_torrent * tor;
+  tr_session * session;
+  struct test_set_location_dirty_data data;
+  const time_t deadline = time(NULL) + 300;
+
+  /* init the session */
+  session = libttest_session_init (NULL);
+  target_dir = tr_buildPath (tr_sessionGetConfigDir (session), "target", NULL);
+  tr_sys_dir_create (target_dir, TR_SYS_DIR_CREATE_PARENTS, 0777, NULL);
+  tr_relocateSetAlwaysCopy (true);
+
+  /* init an incomplete torrent. its first piece has the wrong data */
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, false);
+  check_uint_eq (tor->info.pieceSize, tr_torrentStat(tor)->leftUntilDone);
+
+  /* move it, and fix the first piece while it's being moved */
+  state = -1;
+  progress = 0;
+  data.tor = tor;
+  data.progress = &progress;
+  data.done = false;
+  tr_torrentSetLocation (tor, target_dir, true, &progress, &state);
+  tr_runInEventThread (session, test_set_location_dirty_threadfunc, &data);
+  while ((state==TR_LOC_MOVING) && (time(NULL)<=deadline))
+    tr_wait_msec (50);
+  check (data.done);
+  check_int_eq (TR_LOC_DONE, state);
+
+  /* confirm the fixed piece made it to the new location */
+  libttest_blockingTorrentVerify (tor);
+  check_uint_eq (0, tr_torrentStat(tor)->leftUntilDone);
+  libttest_sync ();
+  for (file_index=0; file_index<tor->info.fileCount; ++file_index)
+    check_file_location (tor, file_index, tr_buildPath (target_dir, tor->info.files[file_index].name, NULL));
+
+  /* cleanup */
+  tr_relocateSetAlwaysCopy (false);
+  tr_free (target_dir);
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_set_location_twice (void)
+{
+  tr_file_index_t file_index;
+  int state1;
+  int state2;
+  char * source_dir;
+  char * target_dir;
+  tr_torrent * tor;
+  tr_session * session;
+  const time_t deadline = time(NULL) + 300;
+
+  /* init the session */
+  session = libttest_session_init (NULL);
+  target_dir = tr_buildPath (tr_sessionGetConfigDir (session), "target", NULL);
+  tr_sys_dir_create (target_dir, TR_SYS_DIR_CREATE_PARENTS, 0777, NULL);
+
+  /* init a torrent. */
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  libttest_blockingTorrentVerify (tor);
+  check_uint_eq (0, tr_torrentStat(tor)->leftUntilDone);
+  source_dir = tr_strdup (tor->currentDir);
+
+  /* start moving it, then change our mind before it's done */
+  state1 = state2 = -1;
+  tr_torrentSetLocation (tor, target_dir, true, NULL, &state1);
+  tr_torrentSetLocation (tor, source_dir, true, NULL, &state2);
+  while ((state2==TR_LOC_MOVING) && (time(NULL)<=deadline))
+    tr_wait_msec (50);
+  check_int_eq (TR_LOC_DONE, state2);
+  check (state1 != TR_LOC_MOVING);
+  check (!tr_torrentStat(tor)->isRelocating);
+
+  /* confirm the torrent is still complete and back where it started */
+  libttest_blockingTorrentVerify (tor);
+  check_uint_eq (0, tr_torrentStat(tor)->leftUntilDone);
+  libttest_sync ();
+  for (file_index=0; file_index<tor->info.fileCount; ++file_index)
+    check_file_location (tor, file_index, tr_buildPath (source_dir, tor->info.files[file_index].name, NULL));
+
+  /* cleanup */
+  tr_free (source_dir);
+  tr_free (target_dir);
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
 /***
 ****
 ***/
@@ -217,7 +410,10 @@ int
 main (void)
 {
   const testFunc tests[] = { test_incomplete_dir,
-                             test_set_location };
+                             test_set_location,
+                             test_set_location_copy,
+                             test_set_location_dirty,
+                             test_set_location_twice };
 
   return runTests (tests, NUM_TESTS (tests));
 }
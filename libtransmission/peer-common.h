@@ -157,6 +157,8 @@ typedef struct tr_swarm_stats
   int activeWebseedCount;
   int peerCount;
   int peerFromCount[TR_PEER_FROM__MAX];
+  int knownPeerCount;
+  size_t knownPeerBytes;
 }
 tr_swarm_stats;
 
@@ -0,0 +1,631 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <string.h> /* memcmp (), memset () */
+
+#ifndef _WIN32
+ #include <sys/types.h>
+ #include <sys/socket.h>
+ #include <netinet/in.h>
+ #include <arpa/inet.h>
+#endif
+
+#include <event2/buffer.h>
+#include <event2/event.h> /* LIBEVENT_VERSION_NUMBER */
+#include <event2/util.h>
+
+#include "transmission.h"
+#include "crypto.h"
+#include "fdlimit.h" /* tr_fdSocketCreate (), tr_fdSocketAccept () */
+#include "file.h" /* tr_sys_path_remove () */
+#include "inout.h"
+#include "net.h"
+#include "peer-io.h"
+#include "platform.h" /* tr_lock */
+#include "session.h"
+#include "torrent.h"
+#include "trevent.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+#define MESSAGE_COUNT 200
+
+struct peer_io_test_data
+{
+  tr_session * session;
+  tr_peerIo * sender;
+  tr_peerIo * receiver;
+  bool senderUsesNetThread;
+  bool receiverUsesNetThread;
+  int netConnectionCount;
+
+  struct evbuffer * expected; /* what hasn't been received yet */
+  size_t totalBytes;
+  size_t bytesWritten;
+  size_t bytesRead;
+  bool sawPartialMessage;
+  bool sawBadMessage;
+  bool gotError;
+  bool ready;
+  bool closed;
+
+  /* for the piece data tests */
+  tr_torrent * tor;
+  bool encrypted;
+  int fileSegmentBlocks; /* how many blocks were sent as file segments */
+  int fileSegmentsLeft;  /* the session's count once everything's sent */
+};
+
+static size_t
+message_length (int i)
+{
+  /* a mix of empty messages, protocol-sized ones and big ones */
+  return (size_t)(i * 7919) % (70 * 1024);
+}
+
+static ReadState
+can_read_cb (tr_peerIo * io, void * vdata, size_t * piece)
+{
+  uint32_t len;
+  uint8_t * buf;
+  struct peer_io_test_data * data = vdata;
+  struct evbuffer * inbuf = tr_peerIoGetReadBuffer (io);
+  const size_t inlen = evbuffer_get_length (inbuf);
+
+  *piece = 0;
+
+  if (inlen < sizeof (len))
+    {
+      if (inlen > 0 && data->receiverUsesNetThread)
+        data->sawPartialMessage = true;
+      return READ_LATER;
+    }
+
+  evbuffer_copyout (inbuf, &len, sizeof (len));
+  len = ntohl (len);
+  if (inlen < sizeof (len) + len)
+    {
+      if (data->receiverUsesNetThread)
+        data->sawPartialMessage = true;
+      return READ_LATER;
+    }
+
+  buf = tr_new (uint8_t, sizeof (len) + len);
+  tr_peerIoReadBytes (io, inbuf, buf, sizeof (len) + len);
+  if (evbuffer_get_length (data->expected) < sizeof (len) + len
+      || memcmp (buf, evbuffer_pullup (data->expected, sizeof (len) + len), sizeof (len) + len) != 0)
+    data->sawBadMessage = true;
+  else
+    evbuffer_drain (data->expected, sizeof (len) + len);
+  tr_free (buf);
+
+  data->bytesRead += sizeof (len) + len;
+  return evbuffer_get_length (inbuf) > 0 ? READ_NOW : READ_LATER;
+}
+
+static void
+did_write_cb (tr_peerIo * io UNUSED, size_t bytesWritten, bool wasPieceData UNUSED, void * vdata)
+{
+  struct peer_io_test_data * data = vdata;
+
+  data->bytesWritten += bytesWritten;
+}
+
+static void
+got_error_cb (tr_peerIo * io UNUSED, short what UNUSED, void * vdata)
+{
+  struct peer_io_test_data * data = vdata;
+
+  data->gotError = true;
+}
+
+/* a loopback TCP connection, with both ends counted by fdlimit */
+static bool
+open_connection (tr_session * session, tr_socket_t * setme_client, tr_socket_t * setme_server, tr_address * setme_addr, tr_port * setme_port)
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof (sin);
+  tr_socket_t listener;
+
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  listener = socket (AF_INET, SOCK_STREAM, 0);
+  if (listener == TR_BAD_SOCKET)
+    return false;
+  if (bind (listener, (struct sockaddr *) &sin, sizeof (sin)) != 0
+      || listen (listener, 1) != 0
+      || getsockname (listener, (struct sockaddr *) &sin, &len) != 0)
+    {
+      tr_netCloseSocket (listener);
+      return false;
+    }
+
+  *setme_client = tr_fdSocketCreate (session, AF_INET, SOCK_STREAM);
+  if (*setme_client == TR_BAD_SOCKET)
+    {
+      tr_netCloseSocket (listener);
+      return false;
+    }
+
+  if (connect (*setme_client, (struct sockaddr *) &sin, sizeof (sin)) != 0)
+    *setme_server = TR_BAD_SOCKET;
+  else
+    *setme_server = tr_fdSocketAccept (session, listener, setme_addr, setme_port);
+  tr_netCloseSocket (listener);
+
+  if (*setme_server == TR_BAD_SOCKET)
+    {
+      tr_netClose (session, *setme_client);
+      return false;
+    }
+
+  evutil_make_socket_nonblocking (*setme_client);
+  evutil_make_socket_nonblocking (*setme_server);
+  return true;
+}
+
+static void
+start_threadfunc (void * vdata)
+{
+  int i;
+  tr_port port;
+  tr_address addr;
+  tr_socket_t client, server;
+  struct peer_io_test_data * data = vdata;
+  tr_session * session = data->session;
+  struct evbuffer * buf = evbuffer_new ();
+
+  if (!open_connection (session, &client, &server, &addr, &port))
+    {
+      data->gotError = true;
+      data->ready = true;
+      return;
+    }
+
+  data->sender = tr_peerIoNewIncoming (session, &session->bandwidth, &addr, port, client, NULL);
+  data->receiver = tr_peerIoNewIncoming (session, &session->bandwidth, &addr, port, server, NULL);
+  /* normally set by the handshake; RC4 is left to crypto-test */
+  tr_peerIoSetEncryption (data->sender, PEER_ENCRYPTION_NONE);
+  tr_peerIoSetEncryption (data->receiver, PEER_ENCRYPTION_NONE);
+  tr_peerIoSetIOFuncs (data->sender, NULL, did_write_cb, got_error_cb, data);
+  tr_peerIoSetIOFuncs (data->receiver, can_read_cb, NULL, got_error_cb, data);
+
+  /* queue some of the messages before moving to the network thread,
+     and some after, since both have to arrive in order */
+  for (i=0; i<MESSAGE_COUNT; ++i)
+    {
+      const size_t len = message_length (i);
+      uint8_t * payload = tr_new (uint8_t, len);
+
+      if (i == MESSAGE_COUNT / 4)
+        {
+          if (data->senderUsesNetThread)
+            tr_peerIoUseNetThread (data->sender);
+          if (data->receiverUsesNetThread)
+            tr_peerIoUseNetThread (data->receiver);
+          data->netConnectionCount = tr_peerIoGetNetConnectionCount (session);
+        }
+
+      memset (payload, i, len);
+      evbuffer_add_uint32 (buf, len);
+      evbuffer_add (buf, payload, len);
+      evbuffer_add_uint32 (data->expected, len);
+      evbuffer_add (data->expected, payload, len);
+      data->totalBytes += sizeof (uint32_t) + len;
+
+      if (i % 2)
+        {
+          tr_peerIoWriteBuf (data->sender, buf, false);
+        }
+      else
+        {
+          tr_peerIoWriteBytes (data->sender, evbuffer_pullup (buf, -1), evbuffer_get_length (buf), true);
+          evbuffer_drain (buf, evbuffer_get_length (buf));
+        }
+
+      tr_free (payload);
+    }
+
+  tr_peerIoSetEnabled (data->receiver, TR_DOWN, true);
+  tr_peerIoSetEnabled (data->sender, TR_UP, true);
+
+  evbuffer_free (buf);
+  data->ready = true;
+}
+
+static void
+poll_threadfunc (void * vdata)
+{
+  struct peer_io_test_data * data = vdata;
+
+  data->closed = data->bytesRead >= data->totalBytes
+              && data->bytesWritten >= data->totalBytes;
+}
+
+static void
+stop_threadfunc (void * vdata)
+{
+  struct peer_io_test_data * data = vdata;
+
+  if (data->sender != NULL)
+    {
+      tr_peerIoClear (data->sender);
+      tr_peerIoUnref (data->sender);
+    }
+
+  if (data->receiver != NULL)
+    {
+      tr_peerIoClear (data->receiver);
+      tr_peerIoUnref (data->receiver);
+    }
+}
+
+static int
+test_transfer_impl (int netThreads, bool senderUsesNetThread, bool receiverUsesNetThread)
+{
+  tr_session * session;
+  tr_variant settings;
+  struct peer_io_test_data data;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddInt (&settings, TR_KEY_network_threads, netThreads);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+  memset (&data, 0, sizeof (data));
+  data.session = session;
+  data.senderUsesNetThread = senderUsesNetThread && netThreads > 0;
+  data.receiverUsesNetThread = receiverUsesNetThread && netThreads > 0;
+  data.expected = evbuffer_new ();
+  tr_runInEventThread (session, start_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.ready);
+  check (!data.gotError);
+
+  while (!data.closed && !data.gotError && !data.sawBadMessage)
+    {
+      tr_wait_msec (50);
+      tr_runInEventThread (session, poll_threadfunc, &data);
+      tr_wait_msec (50);
+    }
+
+  /* everything arrived, in order, and was reported as written */
+  check (!data.gotError);
+  check (!data.sawBadMessage);
+  check_uint_eq (data.totalBytes, data.bytesRead);
+  check_uint_eq (data.totalBytes, data.bytesWritten);
+  check_uint_eq (0, evbuffer_get_length (data.expected));
+  check_int_eq ((data.senderUsesNetThread ? 1 : 0) + (data.receiverUsesNetThread ? 1 : 0),
+                data.netConnectionCount);
+
+  /* network threads only hand over whole messages */
+  check (!data.sawPartialMessage);
+
+  /* cleanup */
+  tr_runInEventThread (session, stop_threadfunc, &data);
+  libttest_session_close (session);
+  evbuffer_free (data.expected);
+  return 0;
+}
+
+/***
+****  Piece data, sent the way peer-msgs sends it
+***/
+
+static uint8_t
+piece_pattern (uint64_t pos)
+{
+  return (uint8_t)((pos * 31) ^ (pos >> 12));
+}
+
+/* BT_PIECE-like messages: a length, then the block */
+static ReadState
+block_can_read_cb (tr_peerIo * io, void * vdata, size_t * piece)
+{
+  uint8_t * buf;
+  size_t len;
+  struct peer_io_test_data * data = vdata;
+  struct evbuffer * inbuf = tr_peerIoGetReadBuffer (io);
+
+  *piece = 0;
+
+  if (evbuffer_get_length (data->expected) == 0)
+    return READ_LATER;
+
+  /* the receiver can't peek at encrypted data, so it reads
+     the messages by the lengths it knows they'll have */
+  evbuffer_copyout (data->expected, &len, sizeof (len));
+  if (evbuffer_get_length (inbuf) < len)
+    return READ_LATER;
+
+  buf = tr_new (uint8_t, len);
+  tr_peerIoReadBytes (io, inbuf, buf, len);
+  evbuffer_drain (data->expected, sizeof (len));
+  if (memcmp (buf, evbuffer_pullup (data->expected, len), len) != 0)
+    data->sawBadMessage = true;
+  evbuffer_drain (data->expected, len);
+  tr_free (buf);
+
+  data->bytesRead += len;
+  return evbuffer_get_length (inbuf) > 0 ? READ_NOW : READ_LATER;
+}
+
+/* give both ends the same RC4 keys, as the handshake would */
+static void
+set_up_encryption (tr_peerIo * sender, tr_peerIo * receiver, const uint8_t * hash)
+{
+  int len;
+  tr_crypto * a = tr_peerIoGetCrypto (sender);
+  tr_crypto * b = tr_peerIoGetCrypto (receiver);
+
+  tr_cryptoDestruct (a);
+  tr_cryptoDestruct (b);
+  tr_cryptoConstruct (a, hash, false);
+  tr_cryptoConstruct (b, hash, true);
+  tr_cryptoComputeSecret (a, tr_cryptoGetMyPublicKey (b, &len));
+  tr_cryptoComputeSecret (b, tr_cryptoGetMyPublicKey (a, &len));
+  tr_cryptoEncryptInit (a);
+  tr_cryptoDecryptInit (b);
+
+  tr_peerIoSetEncryption (sender, PEER_ENCRYPTION_RC4);
+  tr_peerIoSetEncryption (receiver, PEER_ENCRYPTION_RC4);
+}
+
+static void
+blocks_start_threadfunc (void * vdata)
+{
+  uint64_t pos;
+  tr_block_index_t i;
+  tr_port port;
+  tr_address addr;
+  tr_socket_t client, server;
+  struct peer_io_test_data * data = vdata;
+  tr_session * session = data->session;
+  tr_torrent * tor = data->tor;
+  uint8_t * contents = tr_new (uint8_t, tor->info.totalSize);
+
+  /* something more telling than the zeroes the files start with */
+  for (pos=0; pos<tor->info.totalSize; ++pos)
+    contents[pos] = piece_pattern (pos);
+  for (i=0; i<tor->info.pieceCount; ++i)
+    tr_ioWrite (tor, i, 0, tr_torPieceCountBytes (tor, i), contents + (size_t)i * tor->info.pieceSize);
+
+  if (!open_connection (session, &client, &server, &addr, &port))
+    {
+      tr_free (contents);
+      data->gotError = true;
+      data->ready = true;
+      return;
+    }
+
+  data->sender = tr_peerIoNewIncoming (session, &session->bandwidth, &addr, port, client, NULL);
+  data->receiver = tr_peerIoNewIncoming (session, &session->bandwidth, &addr, port, server, NULL);
+  if (data->encrypted)
+    {
+      set_up_encryption (data->sender, data->receiver, tor->info.hash);
+    }
+  else
+    {
+      tr_peerIoSetEncryption (data->sender, PEER_ENCRYPTION_NONE);
+      tr_peerIoSetEncryption (data->receiver, PEER_ENCRYPTION_NONE);
+    }
+  tr_peerIoSetIOFuncs (data->sender, NULL, did_write_cb, got_error_cb, data);
+  tr_peerIoSetIOFuncs (data->receiver, block_can_read_cb, NULL, got_error_cb, data);
+
+  if (data->senderUsesNetThread)
+    tr_peerIoUseNetThread (data->sender);
+  if (data->receiverUsesNetThread)
+    tr_peerIoUseNetThread (data->receiver);
+
+  for (i=0; i<tor->blockCount; ++i)
+    {
+      struct evbuffer * out = evbuffer_new ();
+      const uint32_t len = tr_torBlockCountBytes (tor, i);
+      const tr_piece_index_t piece = tr_torBlockPiece (tor, i);
+      const uint32_t offset = i * tor->blockSize - piece * tor->info.pieceSize;
+      const size_t msglen = sizeof (uint32_t) + len;
+
+      evbuffer_add_uint32 (out, len);
+
+      /* like peer-msgs: file segments when the connection allows it,
+         otherwise the block's read into memory */
+      if (tr_peerIoSupportsZeroCopy (data->sender)
+          && tr_ioCanReadToBuffer (tor, piece, offset, len)
+          && tr_ioReadToBuffer (tor, piece, offset, len, out) == 0)
+        {
+          ++data->fileSegmentBlocks;
+        }
+      else
+        {
+          struct evbuffer_iovec iovec[1];
+          evbuffer_reserve_space (out, len, iovec, 1);
+          tr_ioRead (tor, piece, offset, len, iovec[0].iov_base);
+          iovec[0].iov_len = len;
+          evbuffer_commit_space (out, iovec, 1);
+        }
+
+      if (evbuffer_get_length (out) != msglen)
+        data->sawBadMessage = true;
+      tr_peerIoWriteBuf (data->sender, out, true);
+      evbuffer_free (out);
+
+      evbuffer_add (data->expected, &msglen, sizeof (msglen));
+      evbuffer_add_uint32 (data->expected, len);
+      evbuffer_add (data->expected, contents + (size_t)i * tor->blockSize, len);
+      data->totalBytes += msglen;
+    }
+
+  tr_peerIoSetEnabled (data->receiver, TR_DOWN, true);
+  tr_peerIoSetEnabled (data->sender, TR_UP, true);
+
+  tr_free (contents);
+  data->ready = true;
+}
+
+static void
+blocks_poll_threadfunc (void * vdata)
+{
+  struct peer_io_test_data * data = vdata;
+  tr_session * session = data->session;
+
+  data->closed = data->bytesRead >= data->totalBytes
+              && data->bytesWritten >= data->totalBytes;
+
+  tr_lockLock (session->fileSegmentLock);
+  data->fileSegmentsLeft = session->fileSegmentCount;
+  tr_lockUnlock (session->fileSegmentLock);
+}
+
+static int
+test_blocks_impl (bool encrypted, int netThreads, unsigned int speedLimit_Bps)
+{
+  uint64_t begin;
+  uint64_t elapsed_msec;
+  tr_session * session;
+  tr_variant settings;
+  struct peer_io_test_data data;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddInt (&settings, TR_KEY_network_threads, netThreads);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+  if (speedLimit_Bps > 0)
+    {
+      tr_sessionSetSpeedLimit_Bps (session, TR_UP, speedLimit_Bps);
+      tr_sessionSetSpeedLimit_Bps (session, TR_DOWN, speedLimit_Bps);
+      tr_sessionLimitSpeed (session, TR_UP, true);
+      tr_sessionLimitSpeed (session, TR_DOWN, true);
+    }
+
+  memset (&data, 0, sizeof (data));
+  data.session = session;
+  data.tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (data.tor, true);
+  data.encrypted = encrypted;
+  data.senderUsesNetThread = netThreads > 0;
+  data.receiverUsesNetThread = netThreads > 0;
+  data.expected = evbuffer_new ();
+  begin = tr_time_msec ();
+  tr_runInEventThread (session, blocks_start_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.ready);
+  check (!data.gotError);
+
+  while (!data.closed && !data.gotError && !data.sawBadMessage)
+    {
+      tr_wait_msec (50);
+      tr_runInEventThread (session, blocks_poll_threadfunc, &data);
+      tr_wait_msec (50);
+    }
+  elapsed_msec = tr_time_msec () - begin;
+
+  /* every block arrived intact... */
+  check (!data.gotError);
+  check (!data.sawBadMessage);
+  check_uint_eq (data.totalBytes, data.bytesRead);
+  check_uint_eq (data.totalBytes, data.bytesWritten);
+  check_uint_eq (0, evbuffer_get_length (data.expected));
+
+  /* ...encrypted ones were read into memory first, the rest were
+     sent as file segments, and those were all let go once sent */
+#if !defined (_WIN32) && LIBEVENT_VERSION_NUMBER >= 0x02010000
+  check_int_eq (encrypted ? 0 : (int)data.tor->blockCount, data.fileSegmentBlocks);
+#endif
+  check_int_eq (0, data.fileSegmentsLeft);
+
+  /* the speed limit held, even with the network threads reading and
+     writing on their own; and it wasn't charged twice, either. Allow
+     for the first pulse's bandwidth, and for some slack at the end */
+  if (speedLimit_Bps > 0)
+    {
+      const uint64_t expected_msec = (uint64_t)data.totalBytes * 1000u / speedLimit_Bps;
+
+      check (elapsed_msec + 500 >= expected_msec);
+      check (elapsed_msec <= expected_msec * 3 / 2 + 1000);
+    }
+
+  /* cleanup */
+  tr_runInEventThread (session, stop_threadfunc, &data);
+  tr_torrentRemove (data.tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  evbuffer_free (data.expected);
+  return 0;
+}
+
+static int
+test_blocks (void)
+{
+  int rv;
+
+  if ((rv = test_blocks_impl (false, 0, 0)))
+    return rv;
+  if ((rv = test_blocks_impl (false, 1, 0)))
+    return rv;
+  if ((rv = test_blocks_impl (true, 0, 0)))
+    return rv;
+  if ((rv = test_blocks_impl (true, 1, 0)))
+    return rv;
+
+  return 0;
+}
+
+static int
+test_speed_limit (void)
+{
+  int rv;
+  const unsigned int limit_Bps = 512 * 1024;
+
+  /* no network threads, then each end on a network thread of its own */
+  if ((rv = test_blocks_impl (false, 0, limit_Bps)))
+    return rv;
+  if ((rv = test_blocks_impl (false, 2, limit_Bps)))
+    return rv;
+  if ((rv = test_blocks_impl (true, 2, limit_Bps)))
+    return rv;
+
+  return 0;
+}
+
+static int
+test_transfer (void)
+{
+  int rv;
+
+  /* no network threads: everything happens in the libtransmission thread */
+  if ((rv = test_transfer_impl (0, true, true)))
+    return rv;
+
+  /* both ends on network threads */
+  if ((rv = test_transfer_impl (2, true, true)))
+    return rv;
+
+  /* one end each */
+  if ((rv = test_transfer_impl (2, true, false)))
+    return rv;
+  if ((rv = test_transfer_impl (1, false, true)))
+    return rv;
+
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_transfer,
+                             test_blocks,
+                             test_speed_limit };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -24,7 +24,8 @@
 #include "net.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "peer-io.h"
-#include "trevent.h" /* tr_runInEventThread () */
+#include "platform.h" /* tr_lock */
+#include "trevent.h" /* tr_runInEventThread (), tr_runInNetThread () */
 #include "tr-utp.h"
 #include "utils.h"
 
@@ -148,6 +149,17 @@ peer_io_push_datatype (tr_peerIo * io, struct tr_datatype * datatype)
 ****
 ***/
 
+static void
+bandwidthUsed (tr_peerIo * io, tr_direction dir, size_t byteCount, bool isPieceData, uint64_t now)
+{
+    /* network threads take what they read and write
+       out of the bandwidth as they go, see netReserve () */
+    if (io->net != NULL)
+        tr_bandwidthUsedReserved (&io->bandwidth, dir, byteCount, isPieceData, now);
+    else
+        tr_bandwidthUsed (&io->bandwidth, dir, byteCount, isPieceData, now);
+}
+
 static void
 didWriteWrapper (tr_peerIo * io, unsigned int bytes_transferred)
 {
@@ -161,8 +173,9 @@ didWriteWrapper (tr_peerIo * io, unsigned int bytes_transferred)
             io->socket != TR_BAD_SOCKET ? guessPacketOverhead (payload) : 0;
         const uint64_t now = tr_time_msec ();
 
-        tr_bandwidthUsed (&io->bandwidth, TR_UP, payload, next->isPieceData, now);
+        bandwidthUsed (io, TR_UP, payload, next->isPieceData, now);
 
+        /* the overhead is only a guess, so it was never reserved */
         if (overhead > 0)
             tr_bandwidthUsed (&io->bandwidth, TR_UP, overhead, false, now);
 
@@ -210,10 +223,10 @@ canReadWrapper (tr_peerIo * io)
             if (piece || (piece!=used))
             {
                 if (piece)
-                    tr_bandwidthUsed (&io->bandwidth, TR_DOWN, piece, true, now);
+                    bandwidthUsed (io, TR_DOWN, piece, true, now);
 
                 if (used != piece)
-                    tr_bandwidthUsed (&io->bandwidth, TR_DOWN, used - piece, false, now);
+                    bandwidthUsed (io, TR_DOWN, used - piece, false, now);
             }
 
             if (overhead > 0)
@@ -701,6 +714,13 @@ tr_peerIoNewOutgoing (tr_session        * session,
 ****
 ***/
 
+/* see "Network threads" below */
+static void netSetEnabled (tr_peerIo * io, short event, bool isEnabled);
+static void netWrite (tr_peerIo * io, struct evbuffer * buf, const void * bytes, size_t byteCount);
+static void netClose (tr_peerIo * io);
+static size_t netGetQueued (const tr_peerIo * io);
+static int netFlush (tr_peerIo * io, tr_direction dir, size_t limit);
+
 static void
 event_enable (tr_peerIo * io, short event)
 {
@@ -773,7 +793,9 @@ tr_peerIoSetEnabled (tr_peerIo    * io,
     assert (tr_amInEventThread (io->session));
     assert (io->session->events != NULL);
 
-    if (isEnabled)
+    if (io->net != NULL)
+        netSetEnabled (io, event, isEnabled);
+    else if (isEnabled)
         event_enable (io, event);
     else
         event_disable (io, event);
@@ -813,16 +835,8 @@ io_close_socket (tr_peerIo * io)
 }
 
 static void
-io_dtor (void * vio)
+io_free (tr_peerIo * io)
 {
-    tr_peerIo * io = vio;
-
-    assert (tr_isPeerIo (io));
-    assert (tr_amInEventThread (io->session));
-    assert (io->session->events != NULL);
-
-    dbgmsg (io, "in tr_peerIo destructor");
-    event_disable (io, EV_READ | EV_WRITE);
     tr_bandwidthDestruct (&io->bandwidth);
     evbuffer_free (io->outbuf);
     evbuffer_free (io->inbuf);
@@ -836,6 +850,27 @@ io_dtor (void * vio)
     tr_free (io);
 }
 
+static void
+io_dtor (void * vio)
+{
+    tr_peerIo * io = vio;
+
+    assert (tr_isPeerIo (io));
+    assert (tr_amInEventThread (io->session));
+    assert (io->session->events != NULL);
+
+    dbgmsg (io, "in tr_peerIo destructor");
+
+    /* the network thread has to let go of the socket first */
+    if (io->net != NULL) {
+        netClose (io);
+        return;
+    }
+
+    event_disable (io, EV_READ | EV_WRITE);
+    io_free (io);
+}
+
 static void
 tr_peerIoFree (tr_peerIo * io)
 {
@@ -925,6 +960,7 @@ tr_peerIoReconnect (tr_peerIo * io)
 
     assert (tr_isPeerIo (io));
     assert (!tr_peerIoIsIncoming (io));
+    assert (io->net == NULL);
 
     session = tr_peerIoGetSession (io);
 
@@ -1010,11 +1046,22 @@ getDesiredOutputBufferSize (const tr_peerIo * io, uint64_t now)
     return MAX (ceiling, currentSpeed_Bps*period);
 }
 
+size_t
+tr_peerIoGetWriteBufferLength (const tr_peerIo * io)
+{
+    size_t len = evbuffer_get_length (io->outbuf);
+
+    if (io->net != NULL)
+        len += netGetQueued (io);
+
+    return len;
+}
+
 size_t
 tr_peerIoGetWriteBufferSpace (const tr_peerIo * io, uint64_t now)
 {
     const size_t desiredLen = getDesiredOutputBufferSize (io, now);
-    const size_t currentLen = evbuffer_get_length (io->outbuf);
+    const size_t currentLen = tr_peerIoGetWriteBufferLength (io);
     size_t freeSpace = 0;
 
     if (desiredLen > currentLen)
@@ -1033,6 +1080,7 @@ tr_peerIoSetEncryption (tr_peerIo * io, tr_encryption_type encryption_type)
     assert (tr_isPeerIo (io));
     assert (encryption_type == PEER_ENCRYPTION_NONE
          || encryption_type == PEER_ENCRYPTION_RC4);
+    assert (io->net == NULL);
 
     io->encryption_type = encryption_type;
 }
@@ -1092,8 +1140,14 @@ void
 tr_peerIoWriteBuf (tr_peerIo * io, struct evbuffer * buf, bool isPieceData)
 {
     const size_t byteCount = evbuffer_get_length (buf);
-    maybeEncryptBuffer (io, buf, 0, byteCount);
-    evbuffer_add_buffer (io->outbuf, buf);
+
+    if (io->net != NULL) {
+        netWrite (io, buf, NULL, byteCount);
+    } else {
+        maybeEncryptBuffer (io, buf, 0, byteCount);
+        evbuffer_add_buffer (io->outbuf, buf);
+    }
+
     addDatatype (io, byteCount, isPieceData);
 }
 
@@ -1101,6 +1155,13 @@ void
 tr_peerIoWriteBytes (tr_peerIo * io, const void * bytes, size_t byteCount, bool isPieceData)
 {
     struct evbuffer_iovec iovec;
+
+    if (io->net != NULL) {
+        netWrite (io, NULL, bytes, byteCount);
+        addDatatype (io, byteCount, isPieceData);
+        return;
+    }
+
     evbuffer_reserve_space (io->outbuf, byteCount, &iovec, 1);
 
     iovec.iov_len = byteCount;
@@ -1154,7 +1215,8 @@ maybeDecryptBuffer (tr_peerIo       * io,
                     size_t            offset,
                     size_t            size)
 {
-    if (io->encryption_type == PEER_ENCRYPTION_RC4)
+    /* network threads decrypt as they read */
+    if (io->encryption_type == PEER_ENCRYPTION_RC4 && io->net == NULL)
         processBuffer (&io->crypto, buf, offset, size, &tr_cryptoDecrypt);
 }
 
@@ -1190,7 +1252,8 @@ tr_peerIoReadBytes (tr_peerIo * io, struct evbuffer * inbuf, void * bytes, size_
 
         case PEER_ENCRYPTION_RC4:
             evbuffer_remove (inbuf, bytes, byteCount);
-            tr_cryptoDecrypt (&io->crypto, byteCount, bytes, bytes);
+            if (io->net == NULL)
+                tr_cryptoDecrypt (&io->crypto, byteCount, bytes, bytes);
             break;
 
         default:
@@ -1335,6 +1398,11 @@ tr_peerIoFlush (tr_peerIo  * io, tr_direction dir, size_t limit)
     assert (tr_isPeerIo (io));
     assert (tr_isDirection (dir));
 
+    /* network threads read and write on their own schedule,
+       so set the bandwidth aside for them instead */
+    if (io->net != NULL)
+        return netFlush (io, dir, limit);
+
     if (dir == TR_DOWN)
         bytesUsed = tr_peerIoTryRead (io, limit);
     else
@@ -1360,3 +1428,875 @@ tr_peerIoFlushOutgoingProtocolMsgs (tr_peerIo * io)
 
     return tr_peerIoFlush (io, TR_UP, byteCount);
 }
+
+/***
+****  Network threads
+***/
+
+/* When the session has network threads, TCP connections that are done
+ * with their handshake have their sockets polled, read and written by
+ * one of them. The network thread decrypts what it reads and holds on to
+ * it until it has whole messages, which it then hands over to be parsed
+ * by io->canRead () in the libtransmission thread as before. Going the
+ * other way, it encrypts and sends what the libtransmission thread has
+ * queued up, and reports back how much went out so that didWrite () and
+ * the bandwidth accounting also stay in the libtransmission thread.
+ *
+ * Each thread has two lists, guarded by its lock: the connections that
+ * the network thread needs to look at again ("kicked"), and the ones that
+ * have news for the libtransmission thread ("ready"). The other thread is
+ * only woken up when a list goes from empty to non-empty. */
+
+enum
+{
+    /* like event_read_cb (), don't let the input buffer grow past 256K */
+    NET_MAX_INPUT = 256 * 1024
+};
+
+struct tr_peerIoThread
+{
+    int index;
+    int ioCount; /* the connections using this thread */
+    tr_session * session;
+    tr_lock * lock;
+
+    struct tr_peerIoNet * kicked;
+    int kickedCount;
+    struct tr_peerIoNet * ready;
+    int readyCount;
+
+    bool isDone; /* see tr_peerIoCloseNetThreads () */
+};
+
+struct tr_peerIoNet
+{
+    tr_peerIo * io;
+    struct tr_peerIoThread * thread;
+
+    /* guarded by thread->lock */
+    struct evbuffer * in;    /* read and decrypted, but not handed over yet */
+    size_t inComplete;       /* how many bytes of `in' are whole messages */
+    bool inFull;             /* reading stopped because `in' is full */
+    struct evbuffer * out;   /* queued by the libtransmission thread */
+    size_t written;          /* sent, but not reported yet */
+    size_t allowance[2];     /* bandwidth set aside by netFlush () */
+    bool waiting[2];         /* stopped because there wasn't enough bandwidth */
+    short error;             /* BEV_EVENT_* flags */
+    int errcode;
+    short wanted;            /* EV_READ | EV_WRITE, from tr_peerIoSetEnabled () */
+    bool closing;
+    bool isKicked;
+    bool isReady;
+    struct tr_peerIoNet * nextKicked;
+    struct tr_peerIoNet * nextReady;
+
+    /* only touched by the network thread */
+    short added;             /* the events that are in the event loop */
+    bool failed;
+    struct event * event_read;
+    struct event * event_write;
+    struct evbuffer * readbuf;
+    struct evbuffer * writebuf; /* encrypted and ready for the socket */
+    uint32_t frameLeft;      /* bytes left in the current message */
+    uint8_t frameHeader[4];
+    uint8_t frameHeaderLen;
+
+    /* only touched by the libtransmission thread */
+    size_t queued;           /* handed over, but not written yet */
+    bool closed;             /* io_dtor () has been called */
+};
+
+static void netThreadKicked (void * vthread);
+static void netThreadReady (void * vthread);
+
+/* call these with the thread's lock held. They return true if
+   the other thread needs to be woken up once it's been released */
+
+static bool
+netKick (struct tr_peerIoNet * net)
+{
+    struct tr_peerIoThread * t = net->thread;
+
+    if (net->isKicked)
+        return false;
+
+    net->isKicked = true;
+    net->nextKicked = t->kicked;
+    t->kicked = net;
+    return ++t->kickedCount == 1;
+}
+
+static bool
+netMarkReady (struct tr_peerIoNet * net)
+{
+    struct tr_peerIoThread * t = net->thread;
+
+    if (net->isReady)
+        return false;
+
+    net->isReady = true;
+    net->nextReady = t->ready;
+    t->ready = net;
+    return ++t->readyCount == 1;
+}
+
+static void
+netUnlink (struct tr_peerIoNet * net)
+{
+    struct tr_peerIoNet ** it;
+    struct tr_peerIoThread * t = net->thread;
+
+    if (net->isKicked)
+    {
+        for (it=&t->kicked; *it!=net; it=&(*it)->nextKicked)
+            ;
+        *it = net->nextKicked;
+        --t->kickedCount;
+        net->isKicked = false;
+    }
+
+    if (net->isReady)
+    {
+        for (it=&t->ready; *it!=net; it=&(*it)->nextReady)
+            ;
+        *it = net->nextReady;
+        --t->readyCount;
+        net->isReady = false;
+    }
+}
+
+static void
+netWakeNetThread (struct tr_peerIoThread * t)
+{
+    tr_runInNetThread (t->session, t->index, netThreadKicked, t);
+}
+
+static void
+netWakeEventThread (struct tr_peerIoThread * t)
+{
+    tr_runInEventThread (t->session, netThreadReady, t);
+}
+
+/* Follows the peer wire protocol's framing -- a 4-byte length, then the
+ * message -- over the bytes in `buf'. Returns how many of them, counting
+ * from the front, make up whole messages. */
+static size_t
+netScanMessages (struct tr_peerIoNet * net, struct evbuffer * buf)
+{
+    size_t pos = 0;
+    size_t complete = 0;
+    struct evbuffer_ptr ptr;
+    struct evbuffer_iovec iovec;
+
+    if (evbuffer_ptr_set (buf, &ptr, 0, EVBUFFER_PTR_SET) != 0)
+        return 0;
+
+    while (evbuffer_peek (buf, -1, &ptr, &iovec, 1) > 0 && iovec.iov_len > 0)
+    {
+        const uint8_t * const begin = iovec.iov_base;
+        const uint8_t * const end = begin + iovec.iov_len;
+        const uint8_t * walk = begin;
+
+        while (walk < end)
+        {
+            if (net->frameLeft > 0)
+            {
+                const size_t n = MIN ((size_t)(end - walk), net->frameLeft);
+                net->frameLeft -= n;
+                walk += n;
+            }
+            else
+            {
+                uint32_t len;
+
+                net->frameHeader[net->frameHeaderLen++] = *walk++;
+                if (net->frameHeaderLen < sizeof (net->frameHeader))
+                    continue;
+
+                memcpy (&len, net->frameHeader, sizeof (len));
+                net->frameLeft = ntohl (len);
+                net->frameHeaderLen = 0;
+            }
+
+            if (net->frameLeft == 0)
+                complete = pos + (size_t)(walk - begin);
+        }
+
+        pos += iovec.iov_len;
+        if (evbuffer_ptr_set (buf, &ptr, iovec.iov_len, EVBUFFER_PTR_ADD) != 0)
+            break;
+    }
+
+    return complete;
+}
+
+/**
+***  The network thread's side
+**/
+
+static void
+netUpdateEvents (struct tr_peerIoNet * net)
+{
+    short wanted;
+    bool inFull;
+    short events = 0;
+
+    /* bandwidth that's been set aside for us
+       can be used even when it's run out */
+    tr_lockLock (net->thread->lock);
+    wanted = net->wanted;
+    if (net->allowance[TR_DOWN] > 0)
+        wanted |= EV_READ;
+    if (net->allowance[TR_UP] > 0)
+        wanted |= EV_WRITE;
+    inFull = net->inFull;
+    tr_lockUnlock (net->thread->lock);
+
+    if (!net->failed)
+    {
+        if ((wanted & EV_READ) && !inFull)
+            events |= EV_READ;
+        if ((wanted & EV_WRITE) && evbuffer_get_length (net->writebuf) > 0)
+            events |= EV_WRITE;
+    }
+
+    if ((events & EV_READ) && !(net->added & EV_READ))
+        event_add (net->event_read, NULL);
+    else if (!(events & EV_READ) && (net->added & EV_READ))
+        event_del (net->event_read);
+
+    if ((events & EV_WRITE) && !(net->added & EV_WRITE))
+        event_add (net->event_write, NULL);
+    else if (!(events & EV_WRITE) && (net->added & EV_WRITE))
+        event_del (net->event_write);
+
+    net->added = events;
+}
+
+/* move what the libtransmission thread has queued into writebuf */
+static void
+netPullOutput (struct tr_peerIoNet * net)
+{
+    size_t n;
+    const size_t oldLen = evbuffer_get_length (net->writebuf);
+
+    tr_lockLock (net->thread->lock);
+    evbuffer_add_buffer (net->writebuf, net->out);
+    tr_lockUnlock (net->thread->lock);
+
+    n = evbuffer_get_length (net->writebuf) - oldLen;
+    if (n > 0 && net->io->encryption_type == PEER_ENCRYPTION_RC4)
+        processBuffer (&net->io->crypto, net->writebuf, oldLen, n, &tr_cryptoEncrypt);
+}
+
+static void
+netFail (struct tr_peerIoNet * net, short what, int errcode)
+{
+    bool wake;
+
+    net->failed = true;
+
+    tr_lockLock (net->thread->lock);
+    net->error = what;
+    net->errcode = errcode;
+    wake = netMarkReady (net);
+    tr_lockUnlock (net->thread->lock);
+
+    if (wake)
+        netWakeEventThread (net->thread);
+
+    netUpdateEvents (net);
+}
+
+/* take up to byteCount bytes of bandwidth, starting with what netFlush ()
+   has set aside. Unlike a clamp, nobody else can spend them after this */
+static unsigned int
+netReserve (struct tr_peerIoNet * net, tr_direction dir, size_t byteCount)
+{
+    size_t n;
+
+    tr_lockLock (net->thread->lock);
+    n = MIN (byteCount, net->allowance[dir]);
+    net->allowance[dir] -= n;
+    tr_lockUnlock (net->thread->lock);
+
+    return n + tr_bandwidthReserve (&net->io->bandwidth, dir, byteCount - n);
+}
+
+/* give back the bandwidth that wasn't used, and note
+   whether there wasn't enough of it for what we wanted */
+static void
+netRelease (struct tr_peerIoNet * net, tr_direction dir, size_t wanted, size_t reserved, size_t used)
+{
+    if (used < reserved)
+        tr_bandwidthRelease (&net->io->bandwidth, dir, reserved - used);
+
+    tr_lockLock (net->thread->lock);
+    net->waiting[dir] = used == reserved && reserved < wanted;
+    tr_lockUnlock (net->thread->lock);
+}
+
+static void
+net_read_cb (evutil_socket_t fd, short event UNUSED, void * vnet)
+{
+    int res;
+    int e;
+    size_t inLen;
+    size_t wanted;
+    unsigned int howmuch;
+    struct tr_peerIoNet * net = vnet;
+    tr_peerIo * io = net->io;
+    struct tr_peerIoThread * t = net->thread;
+
+    net->added &= ~EV_READ;
+
+    tr_lockLock (t->lock);
+    inLen = evbuffer_get_length (net->in);
+    tr_lockUnlock (t->lock);
+
+    wanted = inLen >= NET_MAX_INPUT ? 0 : NET_MAX_INPUT - inLen;
+    howmuch = netReserve (net, TR_DOWN, wanted);
+
+    /* if we don't have any bandwidth left, wait for
+       tr_peerIoSetEnabled () or netFlush () to give us some more */
+    if (howmuch < 1)
+    {
+        netRelease (net, TR_DOWN, wanted, 0, 0);
+        return;
+    }
+
+    EVUTIL_SET_SOCKET_ERROR (0);
+    res = evbuffer_read (net->readbuf, fd, (int)howmuch);
+    e = EVUTIL_SOCKET_ERROR ();
+    netRelease (net, TR_DOWN, wanted, howmuch, res > 0 ? (size_t)res : 0);
+
+    if (res > 0)
+    {
+        bool wake;
+        size_t complete;
+
+        if (io->encryption_type == PEER_ENCRYPTION_RC4)
+            processBuffer (&io->crypto, net->readbuf, 0, res, &tr_cryptoDecrypt);
+        complete = netScanMessages (net, net->readbuf);
+
+        tr_lockLock (t->lock);
+        if (complete > 0)
+            net->inComplete = evbuffer_get_length (net->in) + complete;
+        evbuffer_add_buffer (net->in, net->readbuf);
+        if (evbuffer_get_length (net->in) >= NET_MAX_INPUT)
+            net->inFull = true;
+        wake = (complete > 0 || net->inFull) && netMarkReady (net);
+        tr_lockUnlock (t->lock);
+
+        if (wake)
+            netWakeEventThread (t);
+
+        netUpdateEvents (net);
+    }
+    else if (res == -1 && (e == EAGAIN || e == EINTR))
+    {
+        netUpdateEvents (net);
+    }
+    else
+    {
+        netFail (net, BEV_EVENT_READING | (res == 0 ? BEV_EVENT_EOF : BEV_EVENT_ERROR), e);
+    }
+}
+
+static void
+net_write_cb (evutil_socket_t fd, short event UNUSED, void * vnet)
+{
+    int n;
+    int e;
+    size_t wanted;
+    size_t howmuch;
+    struct tr_peerIoNet * net = vnet;
+    struct tr_peerIoThread * t = net->thread;
+
+    net->added &= ~EV_WRITE;
+
+    netPullOutput (net);
+    wanted = evbuffer_get_length (net->writebuf);
+    howmuch = netReserve (net, TR_UP, wanted);
+
+    /* if we don't have any bandwidth left, wait for
+       tr_peerIoSetEnabled () or netFlush () to give us some more */
+    if (howmuch < 1)
+    {
+        netRelease (net, TR_UP, wanted, 0, 0);
+        return;
+    }
+
+    EVUTIL_SET_SOCKET_ERROR (0);
+    n = evbuffer_write_atmost (net->writebuf, fd, howmuch);
+    e = EVUTIL_SOCKET_ERROR ();
+    netRelease (net, TR_UP, wanted, howmuch, n > 0 ? (size_t)n : 0);
+
+    if (n > 0)
+    {
+        bool wake;
+
+        tr_lockLock (t->lock);
+        net->written += n;
+        wake = netMarkReady (net);
+        tr_lockUnlock (t->lock);
+
+        if (wake)
+            netWakeEventThread (t);
+
+        netUpdateEvents (net);
+    }
+    else if (n == -1 && (!e || e == EAGAIN || e == EINTR || e == EINPROGRESS))
+    {
+        netUpdateEvents (net);
+    }
+    else
+    {
+        netFail (net, BEV_EVENT_WRITING | (n == 0 ? BEV_EVENT_EOF : BEV_EVENT_ERROR), e);
+    }
+}
+
+static void
+netFree (void * vnet);
+
+static void
+netUpdate (struct tr_peerIoNet * net)
+{
+    bool closing;
+    tr_peerIo * io = net->io;
+    struct tr_peerIoThread * t = net->thread;
+
+    tr_lockLock (t->lock);
+    if ((closing = net->closing))
+        netUnlink (net);
+    tr_lockUnlock (t->lock);
+
+    if (closing)
+    {
+        if (net->event_read != NULL)
+        {
+            event_free (net->event_read);
+            event_free (net->event_write);
+        }
+
+        /* this is the last we hear of it */
+        tr_runInEventThread (t->session, netFree, net);
+        return;
+    }
+
+    if (net->event_read == NULL)
+    {
+        struct event_base * base = tr_eventGetNetBase (t->session, t->index);
+
+        net->event_read = event_new (base, io->socket, EV_READ, net_read_cb, net);
+        net->event_write = event_new (base, io->socket, EV_WRITE, net_write_cb, net);
+    }
+
+    netPullOutput (net);
+    netUpdateEvents (net);
+}
+
+static void
+netThreadKicked (void * vthread)
+{
+    int i;
+    int n;
+    struct tr_peerIoNet * net;
+    struct tr_peerIoNet ** nets;
+    struct tr_peerIoThread * t = vthread;
+
+    tr_lockLock (t->lock);
+    n = t->kickedCount;
+    nets = tr_new (struct tr_peerIoNet *, n);
+    for (i=0, net=t->kicked; net!=NULL; net=net->nextKicked)
+    {
+        net->isKicked = false;
+        nets[i++] = net;
+    }
+    t->kicked = NULL;
+    t->kickedCount = 0;
+    tr_lockUnlock (t->lock);
+
+    for (i=0; i<n; ++i)
+        netUpdate (nets[i]);
+
+    tr_free (nets);
+}
+
+/**
+***  The libtransmission thread's side
+**/
+
+static void
+netDeliver (struct tr_peerIoNet * net)
+{
+    size_t n;
+    size_t written;
+    short error;
+    int errcode;
+    bool wake;
+    tr_peerIo * io = net->io;
+    struct tr_peerIoThread * t = net->thread;
+
+    /* hand over whole messages, unless there's one too big to fit
+       in the input buffer or nothing else is coming */
+    tr_lockLock (t->lock);
+    n = net->inComplete;
+    if (net->error || (n == 0 && net->inFull))
+        n = evbuffer_get_length (net->in);
+    evbuffer_remove_buffer (net->in, io->inbuf, n);
+    net->inComplete = net->inComplete > n ? net->inComplete - n : 0;
+    wake = net->inFull && netKick (net);
+    net->inFull = false;
+    written = net->written;
+    net->written = 0;
+    error = net->error;
+    errcode = net->errcode;
+    net->error = 0;
+    tr_lockUnlock (t->lock);
+
+    if (wake)
+        netWakeNetThread (t);
+
+    tr_peerIoRef (io);
+
+    if (written > 0)
+    {
+        net->queued -= written;
+        didWriteWrapper (io, written);
+    }
+
+    if (n > 0 && !net->closed)
+        canReadWrapper (io);
+
+    if (error && !net->closed && io->gotError != NULL)
+    {
+        EVUTIL_SET_SOCKET_ERROR (errcode);
+        io->gotError (io, error, io->userData);
+    }
+
+    tr_peerIoUnref (io);
+}
+
+static void
+netThreadReady (void * vthread)
+{
+    int i;
+    int n;
+    struct tr_peerIoNet * net;
+    struct tr_peerIoNet ** nets;
+    struct tr_peerIoThread * t = vthread;
+
+    tr_lockLock (t->lock);
+    n = t->readyCount;
+    nets = tr_new (struct tr_peerIoNet *, n);
+    for (i=0, net=t->ready; net!=NULL; net=net->nextReady)
+    {
+        net->isReady = false;
+        nets[i++] = net;
+    }
+    t->ready = NULL;
+    t->readyCount = 0;
+    tr_lockUnlock (t->lock);
+
+    /* connections that were closed after being marked ready are
+       still around: they're freed by netFree (), which comes later */
+    for (i=0; i<n; ++i)
+        if (!nets[i]->closed)
+            netDeliver (nets[i]);
+
+    tr_free (nets);
+}
+
+static void
+netFree (void * vnet)
+{
+    struct tr_peerIoNet * net = vnet;
+    tr_peerIo * io = net->io;
+
+    assert (net->closed);
+
+    --net->thread->ioCount;
+    evbuffer_free (net->writebuf);
+    evbuffer_free (net->readbuf);
+    evbuffer_free (net->out);
+    evbuffer_free (net->in);
+    tr_free (net);
+
+    io->net = NULL;
+    io->pendingEvents = 0;
+    io_free (io);
+}
+
+static void
+netClose (tr_peerIo * io)
+{
+    bool wake;
+    struct tr_peerIoNet * net = io->net;
+
+    net->closed = true;
+
+    /* the network thread may clamp to io->bandwidth until it's done,
+       so just take it out of the tree for now */
+    tr_bandwidthSetParent (&io->bandwidth, NULL);
+
+    tr_lockLock (net->thread->lock);
+    net->closing = true;
+    wake = netKick (net);
+    tr_lockUnlock (net->thread->lock);
+
+    if (wake)
+        netWakeNetThread (net->thread);
+}
+
+static void
+netSetEnabled (tr_peerIo * io, short event, bool isEnabled)
+{
+    bool wake;
+    struct tr_peerIoNet * net = io->net;
+    const short oldEvents = io->pendingEvents;
+
+    if (isEnabled)
+        io->pendingEvents |= event;
+    else
+        io->pendingEvents &= ~event;
+
+    /* enabling is always passed on, since the network thread stops
+       polling by itself when the connection runs out of bandwidth */
+    if (!isEnabled && io->pendingEvents == oldEvents)
+        return;
+
+    tr_lockLock (net->thread->lock);
+    net->wanted = io->pendingEvents;
+    wake = netKick (net);
+    tr_lockUnlock (net->thread->lock);
+
+    if (wake)
+        netWakeNetThread (net->thread);
+}
+
+/* the round-robin in tr_bandwidthAllocate () calls this through
+   tr_peerIoFlush (). The network thread can't be asked to do the I/O
+   right here, so set aside the connection's share of the bandwidth
+   for it instead -- but only if it's waiting for some, and no more
+   than it has room for, or an idle connection would keep on taking */
+static int
+netFlush (tr_peerIo * io, tr_direction dir, size_t limit)
+{
+    size_t room;
+    bool wake = false;
+    unsigned int granted = 0;
+    struct tr_peerIoNet * net = io->net;
+
+    tr_lockLock (net->thread->lock);
+
+    if (net->waiting[dir] && !net->closed)
+    {
+        if (dir == TR_UP)
+            room = net->queued - net->written;
+        else
+            room = NET_MAX_INPUT - MIN (NET_MAX_INPUT, evbuffer_get_length (net->in));
+        room -= MIN (room, net->allowance[dir]);
+
+        granted = tr_bandwidthReserve (&io->bandwidth, dir, MIN (limit, room));
+        net->allowance[dir] += granted;
+        wake = granted > 0 && netKick (net);
+    }
+
+    tr_lockUnlock (net->thread->lock);
+
+    if (wake)
+        netWakeNetThread (net->thread);
+
+    dbgmsg (io, "set aside %u bytes for direction %d, limit %zu", granted, (int)dir, limit);
+    return granted;
+}
+
+static size_t
+netGetQueued (const tr_peerIo * io)
+{
+    return io->net->queued;
+}
+
+static void
+netWrite (tr_peerIo * io, struct evbuffer * buf, const void * bytes, size_t byteCount)
+{
+    bool wake = false;
+    struct tr_peerIoNet * net = io->net;
+
+    tr_lockLock (net->thread->lock);
+    if (buf != NULL)
+        evbuffer_add_buffer (net->out, buf);
+    else
+        evbuffer_add (net->out, bytes, byteCount);
+    if (io->pendingEvents & EV_WRITE)
+        wake = netKick (net);
+    tr_lockUnlock (net->thread->lock);
+
+    net->queued += byteCount;
+
+    if (wake)
+        netWakeNetThread (net->thread);
+}
+
+void
+tr_peerIoUseNetThread (tr_peerIo * io)
+{
+    int i;
+    bool wake;
+    tr_session * session;
+    struct tr_peerIoNet * net;
+    struct tr_peerIoThread * t = NULL;
+
+    assert (tr_isPeerIo (io));
+    assert (tr_amInEventThread (io->session));
+
+    /* uTP is driven by the session's UDP socket, so it stays here */
+    if (io->net != NULL || io->socket == TR_BAD_SOCKET)
+        return;
+
+    /* pick the thread with the fewest connections */
+    session = io->session;
+    for (i=0; i<session->peerIoThreadCount; ++i)
+        if (t == NULL || session->peerIoThreads[i]->ioCount < t->ioCount)
+            t = session->peerIoThreads[i];
+    if (t == NULL)
+        return;
+
+    dbgmsg (io, "moving to network thread %d", t->index);
+
+    net = tr_new0 (struct tr_peerIoNet, 1);
+    net->io = io;
+    net->thread = t;
+    net->in = evbuffer_new ();
+    net->out = evbuffer_new ();
+    net->readbuf = evbuffer_new ();
+    net->writebuf = evbuffer_new ();
+    net->wanted = io->pendingEvents;
+    ++t->ioCount;
+
+    /* stop polling the socket in this thread */
+    event_disable (io, EV_READ | EV_WRITE);
+    io->pendingEvents = net->wanted;
+    event_free (io->event_read);
+    event_free (io->event_write);
+    io->event_read = NULL;
+    io->event_write = NULL;
+
+    /* whatever arrived after the handshake stays in io->inbuf until the
+       next delivery, but it's decrypted now and counts towards framing */
+    maybeDecryptBuffer (io, io->inbuf, 0, evbuffer_get_length (io->inbuf));
+    netScanMessages (net, io->inbuf);
+
+    /* what's in io->outbuf has already been encrypted */
+    net->queued = evbuffer_get_length (io->outbuf);
+    evbuffer_add_buffer (net->writebuf, io->outbuf);
+
+    io->net = net;
+
+    tr_lockLock (t->lock);
+    wake = netKick (net);
+    tr_lockUnlock (t->lock);
+
+    if (wake)
+        netWakeNetThread (t);
+}
+
+void
+tr_peerIoSetNetThreadCount (tr_session * session, int count)
+{
+    int i;
+    const int oldCount = tr_eventGetNetThreadCount (session);
+
+    assert (tr_amInEventThread (session));
+
+    count = MAX (0, count);
+    tr_eventSetNetThreadCount (session, count);
+
+    if (count > oldCount)
+    {
+        session->peerIoThreads = tr_renew (struct tr_peerIoThread *, session->peerIoThreads, count);
+
+        for (i=oldCount; i<count; ++i)
+        {
+            struct tr_peerIoThread * t = tr_new0 (struct tr_peerIoThread, 1);
+            t->index = i;
+            t->session = session;
+            t->lock = tr_lockNew ();
+            session->peerIoThreads[i] = t;
+        }
+    }
+
+    /* lowering the count only keeps new connections off the extra
+       threads; the ones that are already there stay until closed */
+    session->peerIoThreadCount = count;
+}
+
+int
+tr_peerIoGetNetThreadCount (const tr_session * session)
+{
+    return session->peerIoThreadCount;
+}
+
+int
+tr_peerIoGetNetConnectionCount (const tr_session * session)
+{
+    int i;
+    int n = 0;
+
+    if (session->peerIoThreads != NULL)
+        for (i=0; i<tr_eventGetNetThreadCount (session); ++i)
+            n += session->peerIoThreads[i]->ioCount;
+
+    return n;
+}
+
+static void
+netThreadDone (void * vthread)
+{
+    struct tr_peerIoThread * t = vthread;
+
+    tr_lockLock (t->lock);
+    t->isDone = true;
+    tr_lockUnlock (t->lock);
+}
+
+void
+tr_peerIoCloseNetThreads (tr_session * session)
+{
+    int i;
+    const int n = session->peerIoThreads != NULL ? tr_eventGetNetThreadCount (session) : 0;
+
+    assert (tr_amInEventThread (session));
+    assert (tr_peerIoGetNetConnectionCount (session) == 0);
+
+    /* the threads may still have a wakeup queued up from the last
+       connections, so wait for them to get past it */
+    for (i=0; i<n; ++i)
+        tr_runInNetThread (session, i, netThreadDone, session->peerIoThreads[i]);
+
+    for (i=0; i<n; ++i)
+    {
+        bool isDone;
+        struct tr_peerIoThread * t = session->peerIoThreads[i];
+
+        for (;;)
+        {
+            tr_lockLock (t->lock);
+            isDone = t->isDone;
+            tr_lockUnlock (t->lock);
+
+            if (isDone)
+                break;
+
+            tr_wait_msec (10);
+        }
+
+        tr_lockFree (t->lock);
+        tr_free (t);
+    }
+
+    tr_free (session->peerIoThreads);
+    session->peerIoThreads = NULL;
+    session->peerIoThreadCount = 0;
+}
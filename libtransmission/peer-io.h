@@ -29,6 +29,7 @@ struct evbuffer;
 struct tr_bandwidth;
 struct tr_datatype;
 struct tr_peerIo;
+struct tr_peerIoNet;
 
 /**
  * @addtogroup networked_io Networked IO
@@ -111,6 +112,9 @@ typedef struct tr_peerIo
 
     struct event        * event_read;
     struct event        * event_write;
+
+    /* set while a network thread does this connection's socket I/O */
+    struct tr_peerIoNet * net;
 }
 tr_peerIo;
 
@@ -291,6 +295,24 @@ tr_peerIoIsEncrypted (const tr_peerIo * io)
     return (io != NULL) && (io->encryption_type == PEER_ENCRYPTION_RC4);
 }
 
+/**
+ * @brief true if piece data can be sent straight from the file to the socket.
+ *
+ * That needs a plaintext TCP connection: encrypted data has to be copied
+ * in order to be encrypted, and uTP packets are assembled in user space.
+ */
+static inline bool
+tr_peerIoSupportsZeroCopy (const tr_peerIo * io)
+{
+#ifdef _WIN32
+    return false;
+#else
+    return (io->utp_socket == NULL)
+        && (io->socket != TR_BAD_SOCKET)
+        && (io->encryption_type == PEER_ENCRYPTION_NONE);
+#endif
+}
+
 void evbuffer_add_uint8 (struct evbuffer * outbuf, uint8_t byte);
 void evbuffer_add_uint16 (struct evbuffer * outbuf, uint16_t hs);
 void evbuffer_add_uint32 (struct evbuffer * outbuf, uint32_t hl);
@@ -347,6 +369,9 @@ void      tr_peerIoDrain (tr_peerIo        * io,
 
 size_t    tr_peerIoGetWriteBufferSpace (const tr_peerIo * io, uint64_t now);
 
+/** @brief how many bytes have been queued for writing but not sent yet */
+size_t    tr_peerIoGetWriteBufferLength (const tr_peerIo * io);
+
 static inline void tr_peerIoSetParent (tr_peerIo            * io,
                                           struct tr_bandwidth  * parent)
 {
@@ -386,6 +411,30 @@ int       tr_peerIoFlush (tr_peerIo     * io,
 
 int       tr_peerIoFlushOutgoingProtocolMsgs (tr_peerIo * io);
 
+/**
+***  Network threads
+**/
+
+/**
+ * @brief Hand the connection's socket over to one of the network threads,
+ *        if the session has any.
+ *
+ * The network thread then does the reading, writing and RC4, and only
+ * hands whole messages back to io->canRead () in the libtransmission
+ * thread. This is for TCP connections that are done with their handshake;
+ * uTP connections stay where they are.
+ */
+void      tr_peerIoUseNetThread (tr_peerIo * io);
+
+void      tr_peerIoSetNetThreadCount (tr_session * session, int count);
+
+int       tr_peerIoGetNetThreadCount (const tr_session * session);
+
+/** @brief the number of connections that network threads still hold on to */
+int       tr_peerIoGetNetConnectionCount (const tr_session * session);
+
+void      tr_peerIoCloseNetThreads (tr_session * session);
+
 /**
 ***
 **/
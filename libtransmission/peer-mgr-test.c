@@ -0,0 +1,435 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <string.h> /* memset () */
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "file.h" /* tr_sys_path_remove () */
+#include "net.h" /* tr_address_from_string () */
+#include "peer-common.h"
+#include "peer-mgr.h"
+#include "session.h"
+#include "torrent.h"
+#include "trevent.h"
+#include "utils.h" /* tr_snprintf () */
+
+#include "libtransmission-test.h"
+
+/***
+****  Piece buckets
+***/
+
+#define BUCKET_TEST_MAX_PIECES 64
+
+/* the piece order is copied after each of these steps */
+enum
+{
+  BUCKET_STEP_REQUESTED,
+  BUCKET_STEP_ALL_REQUESTED,
+  BUCKET_STEP_REJECTED,
+  BUCKET_STEP_ARRIVED,
+  BUCKET_STEP_HAVE,
+  BUCKET_STEPS
+};
+
+struct bucket_test_data
+{
+  tr_torrent * tor;
+  int got[3];
+  tr_block_index_t blocks[3];
+  bool rejectedIsRequested;
+  bool arrivedIsRequested;
+  int orderCount[BUCKET_STEPS];
+  tr_piece_index_t order[BUCKET_STEPS][BUCKET_TEST_MAX_PIECES];
+  bool done;
+};
+
+static void
+send_peer_event (tr_peer * peer, int type, tr_piece_index_t piece, uint32_t offset)
+{
+  tr_peer_event e = TR_PEER_EVENT_INIT;
+
+  e.eventType = type;
+  e.pieceIndex = piece;
+  e.offset = offset;
+  tr_peerMgrPeerEvent (peer, &e);
+}
+
+static void
+bucket_test_threadfunc (void * vdata)
+{
+  tr_peer peer;
+  struct bucket_test_data * data = vdata;
+  tr_torrent * tor = data->tor;
+
+  /* a peer that only has piece 0, so that's the one we request from */
+  tr_peerConstruct (&peer, tor);
+  tr_bitfieldAdd (&peer.have, 0);
+
+  /* requesting the first block makes piece 0 partial, so it goes first... */
+  tr_peerMgrGetNextRequests (tor, &peer, 1, &data->blocks[0], &data->got[0], false);
+  data->orderCount[BUCKET_STEP_REQUESTED] = tr_peerMgrGetPieceOrder (tor, data->order[BUCKET_STEP_REQUESTED]);
+
+  /* ...and once all its blocks are requested, it goes last */
+  tr_peerMgrGetNextRequests (tor, &peer, 1, &data->blocks[1], &data->got[1], false);
+  data->orderCount[BUCKET_STEP_ALL_REQUESTED] = tr_peerMgrGetPieceOrder (tor, data->order[BUCKET_STEP_ALL_REQUESTED]);
+  tr_peerMgrGetNextRequests (tor, &peer, 1, &data->blocks[2], &data->got[2], false);
+
+  /* a rejected block has to be requested again, so the piece goes back to the front */
+  send_peer_event (&peer, TR_PEER_CLIENT_GOT_REJ, 0, tor->blockSize);
+  data->rejectedIsRequested = tr_peerMgrDidPeerRequest (tor, &peer, 1);
+  data->orderCount[BUCKET_STEP_REJECTED] = tr_peerMgrGetPieceOrder (tor, data->order[BUCKET_STEP_REJECTED]);
+
+  /* a block that we didn't ask for makes an empty piece partial... */
+  send_peer_event (&peer, TR_PEER_CLIENT_GOT_BLOCK, 2, 0);
+  data->orderCount[BUCKET_STEP_ARRIVED] = tr_peerMgrGetPieceOrder (tor, data->order[BUCKET_STEP_ARRIVED]);
+
+  /* ...and one that we did isn't requested anymore */
+  send_peer_event (&peer, TR_PEER_CLIENT_GOT_BLOCK, 0, 0);
+  data->arrivedIsRequested = tr_peerMgrDidPeerRequest (tor, &peer, 0);
+
+  /* a piece that's less rare than the other empty ones goes after them */
+  send_peer_event (&peer, TR_PEER_CLIENT_GOT_HAVE, 3, 0);
+  data->orderCount[BUCKET_STEP_HAVE] = tr_peerMgrGetPieceOrder (tor, data->order[BUCKET_STEP_HAVE]);
+
+  tr_peerDestruct (&peer);
+  data->done = true;
+}
+
+static int
+test_piece_buckets (void)
+{
+  int n;
+  tr_session * session;
+  tr_torrent * tor;
+  struct bucket_test_data data;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  libttest_blockingTorrentVerify (tor);
+  check_uint_eq (2, tor->blockCountInPiece);
+  check (tor->info.pieceCount < BUCKET_TEST_MAX_PIECES);
+
+  memset (&data, 0, sizeof (data));
+  data.tor = tor;
+  tr_runInEventThread (session, bucket_test_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+
+  /* we want every piece, and asked for piece 0's blocks one at a time */
+  n = tor->info.pieceCount;
+  check_int_eq (1, data.got[0]);
+  check_uint_eq (0, data.blocks[0]);
+  check_int_eq (1, data.got[1]);
+  check_uint_eq (1, data.blocks[1]);
+  check_int_eq (0, data.got[2]);
+  check_int_eq (n, data.orderCount[BUCKET_STEP_REQUESTED]);
+  check_uint_eq (0, data.order[BUCKET_STEP_REQUESTED][0]);
+
+  /* all requested */
+  check_int_eq (n, data.orderCount[BUCKET_STEP_ALL_REQUESTED]);
+  check_uint_eq (0, data.order[BUCKET_STEP_ALL_REQUESTED][n-1]);
+
+  /* rejected */
+  check (!data.rejectedIsRequested);
+  check_int_eq (n, data.orderCount[BUCKET_STEP_REJECTED]);
+  check_uint_eq (0, data.order[BUCKET_STEP_REJECTED][0]);
+
+  /* arrived */
+  check_int_eq (n, data.orderCount[BUCKET_STEP_ARRIVED]);
+  check_uint_eq (0, data.order[BUCKET_STEP_ARRIVED][0]);
+  check_uint_eq (2, data.order[BUCKET_STEP_ARRIVED][1]);
+  check (!data.arrivedIsRequested);
+  check (tr_torrentBlockIsComplete (tor, 0));
+
+  /* less rare */
+  check_int_eq (n, data.orderCount[BUCKET_STEP_HAVE]);
+  check_uint_eq (3, data.order[BUCKET_STEP_HAVE][n-1]);
+
+  /* cleanup */
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****  Request table
+***/
+
+/* REQUEST_TABLE_MIN_SLOTS in peer-mgr.c */
+#define REQUEST_TABLE_SLOTS 64
+
+/* the slot a block lands in when the table has nothing else in it */
+static int
+get_home_slot (tr_torrent * tor, tr_peer * peer, tr_block_index_t block)
+{
+  int slot;
+
+  tr_peerMgrAddRequest (tor, peer, block);
+  slot = tr_peerMgrGetRequestSlot (tor, block);
+  tr_peerMgrRemoveRequest (tor, peer, block);
+
+  return slot;
+}
+
+/* find the first block after `block' whose home is `slot' */
+static tr_block_index_t
+find_block_at_home (tr_torrent * tor, tr_peer * peer, tr_block_index_t block, int slot)
+{
+  do
+    ++block;
+  while (get_home_slot (tor, peer, block) != slot);
+
+  return block;
+}
+
+static int
+test_request_table (void)
+{
+  tr_block_index_t i;
+  tr_block_index_t b1, b2, b3;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_peer peer;
+  const tr_block_index_t many = REQUEST_TABLE_SLOTS * 4;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  libttest_blockingTorrentVerify (tor);
+  tr_peerConstruct (&peer, tor);
+
+  /* two blocks that want the table's last slot, so the second one
+     wraps around to the first slot, and one that wants the first slot */
+  b1 = find_block_at_home (tor, &peer, 0, REQUEST_TABLE_SLOTS - 1);
+  b2 = find_block_at_home (tor, &peer, b1, REQUEST_TABLE_SLOTS - 1);
+  b3 = find_block_at_home (tor, &peer, 0, 0);
+  tr_peerMgrAddRequest (tor, &peer, b1);
+  tr_peerMgrAddRequest (tor, &peer, b2);
+  tr_peerMgrAddRequest (tor, &peer, b3);
+  check_int_eq (REQUEST_TABLE_SLOTS - 1, tr_peerMgrGetRequestSlot (tor, b1));
+  check_int_eq (0, tr_peerMgrGetRequestSlot (tor, b2));
+  check_int_eq (1, tr_peerMgrGetRequestSlot (tor, b3));
+  check_int_eq (3, peer.pendingReqsToPeer);
+
+  /* deleting the first one moves the others back across the wrap... */
+  tr_peerMgrRemoveRequest (tor, &peer, b1);
+  check_int_eq (-1, tr_peerMgrGetRequestSlot (tor, b1));
+  check_int_eq (REQUEST_TABLE_SLOTS - 1, tr_peerMgrGetRequestSlot (tor, b2));
+  check_int_eq (0, tr_peerMgrGetRequestSlot (tor, b3));
+  check (!tr_peerMgrDidPeerRequest (tor, &peer, b1));
+  check (tr_peerMgrDidPeerRequest (tor, &peer, b2));
+  check (tr_peerMgrDidPeerRequest (tor, &peer, b3));
+
+  /* ...but not past their home */
+  tr_peerMgrRemoveRequest (tor, &peer, b2);
+  check_int_eq (-1, tr_peerMgrGetRequestSlot (tor, b2));
+  check_int_eq (0, tr_peerMgrGetRequestSlot (tor, b3));
+  tr_peerMgrRemoveRequest (tor, &peer, b3);
+  check_int_eq (0, peer.pendingReqsToPeer);
+
+  /* the table grows, and deletes leave no holes that hide the rest */
+  for (i=0; i<many; ++i)
+    tr_peerMgrAddRequest (tor, &peer, i);
+  for (i=0; i<many; i+=2)
+    tr_peerMgrRemoveRequest (tor, &peer, i);
+  for (i=0; i<many; ++i)
+    check (tr_peerMgrDidPeerRequest (tor, &peer, i) == ((i % 2) != 0));
+  for (i=1; i<many; i+=2)
+    tr_peerMgrRemoveRequest (tor, &peer, i);
+  check_int_eq (0, peer.pendingReqsToPeer);
+
+  /* cleanup */
+  tr_peerDestruct (&peer);
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****  Peer candidates
+***/
+
+/* tell the torrent about a peer at a public address. The addresses differ
+   in two bytes, so that some of them share a slot in the atom pool's index */
+static void
+add_pex (tr_torrent * tor, int i)
+{
+  tr_pex pex;
+  char str[32];
+
+  assert (i < 256);
+
+  memset (&pex, 0, sizeof (pex));
+  tr_snprintf (str, sizeof (str), "80.4.%d.%d", (i * 37) % 256, i);
+  tr_address_from_string (&pex.addr, str);
+  pex.port = htons (51413);
+  tr_peerMgrAddPex (tor, TR_PEER_FROM_PEX, &pex, -1);
+}
+
+static int
+test_peer_candidates (void)
+{
+  int i;
+  int parked;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_peerMgr * manager;
+  const int n = 10;
+
+  session = libttest_session_init (NULL);
+  manager = session->peerMgr;
+  tor = libttest_zero_torrent_init (session);
+  libttest_blockingTorrentVerify (tor);
+
+  /* every new atom is waiting to be tried... */
+  for (i=0; i<n; ++i)
+    add_pex (tor, i);
+  check_int_eq (n, tr_peerMgrGetCandidateCount (manager, NULL));
+
+  /* ...and since the torrent is paused, the reconnect pulse parks them */
+  for (i=0; i<100 && (tr_peerMgrGetCandidateCount (manager, &parked), parked != n); ++i)
+    tr_wait_msec (50);
+  check_int_eq (n, parked);
+  check_int_eq (n, tr_peerMgrGetCandidateCount (manager, NULL));
+
+  /* a removed torrent's swarm takes its parked atoms with it */
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  for (i=0; i<100 && tr_peerMgrGetCandidateCount (manager, NULL) != 0; ++i)
+    tr_wait_msec (50);
+  check_int_eq (0, tr_peerMgrGetCandidateCount (manager, &parked));
+  check_int_eq (0, parked);
+
+  /* cleanup */
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****  Atom pool
+***/
+
+/* with a peer limit of 5, a swarm keeps 15 atoms
+   and prunes back to them when it has 30 */
+#define POOL_TEST_PEER_LIMIT 5
+#define POOL_TEST_KEEP 15
+#define POOL_TEST_MAX 30
+
+struct pool_test_data
+{
+  tr_torrent * tor;
+  tr_swarm_stats full;
+  tr_swarm_stats readded;
+  tr_swarm_stats pruned;
+  tr_swarm_stats refilled;
+  int fullCandidates;
+  int prunedCandidates;
+  int keptCount;
+  int keptReaddedCount;
+  bool done;
+};
+
+static void
+pool_test_threadfunc (void * vdata)
+{
+  int i;
+  tr_pex * kept;
+  tr_swarm_stats stats;
+  struct pool_test_data * data = vdata;
+  tr_torrent * tor = data->tor;
+  tr_peerMgr * manager = tor->session->peerMgr;
+
+  /* fill the pool... */
+  for (i=0; i<POOL_TEST_MAX; ++i)
+    add_pex (tor, i);
+  tr_swarmGetStats (tor->swarm, &data->full);
+  data->fullCandidates = tr_peerMgrGetCandidateCount (manager, NULL);
+
+  /* ...the atoms it already has are found instead of added... */
+  for (i=0; i<POOL_TEST_MAX; ++i)
+    add_pex (tor, i);
+  tr_swarmGetStats (tor->swarm, &data->readded);
+
+  /* ...and one more prunes it, taking the culled atoms out of the candidates */
+  add_pex (tor, POOL_TEST_MAX);
+  tr_swarmGetStats (tor->swarm, &data->pruned);
+  data->prunedCandidates = tr_peerMgrGetCandidateCount (manager, NULL);
+
+  /* the ones that were kept are still found after the others were removed */
+  data->keptCount = tr_peerMgrGetPeers (tor, &kept, TR_AF_INET, TR_PEERS_INTERESTING, POOL_TEST_MAX * 2);
+  for (i=0; i<data->keptCount; ++i)
+    tr_peerMgrAddPex (tor, TR_PEER_FROM_PEX, &kept[i], -1);
+  tr_swarmGetStats (tor->swarm, &stats);
+  data->keptReaddedCount = stats.knownPeerCount;
+  tr_free (kept);
+
+  /* new atoms reuse the memory of the culled ones */
+  for (i=POOL_TEST_MAX+1; stats.knownPeerCount<POOL_TEST_MAX; ++i)
+    {
+      add_pex (tor, i);
+      tr_swarmGetStats (tor->swarm, &stats);
+    }
+  data->refilled = stats;
+
+  data->done = true;
+}
+
+static int
+test_atom_pool (void)
+{
+  tr_session * session;
+  tr_torrent * tor;
+  struct pool_test_data data;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  libttest_blockingTorrentVerify (tor);
+  tr_torrentSetPeerLimit (tor, POOL_TEST_PEER_LIMIT);
+
+  memset (&data, 0, sizeof (data));
+  data.tor = tor;
+  tr_runInEventThread (session, pool_test_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+
+  /* insert */
+  check_uint_eq (POOL_TEST_MAX, data.full.knownPeerCount);
+  check_int_eq (POOL_TEST_MAX, data.fullCandidates);
+  check_uint_eq (POOL_TEST_MAX, data.readded.knownPeerCount);
+  check_uint_eq (data.full.knownPeerBytes, data.readded.knownPeerBytes);
+
+  /* prune */
+  check_uint_eq (POOL_TEST_KEEP + 1, data.pruned.knownPeerCount);
+  check_int_eq (POOL_TEST_KEEP + 1, data.prunedCandidates);
+
+  /* remove */
+  check_int_eq (POOL_TEST_KEEP + 1, data.keptCount);
+  check_int_eq (POOL_TEST_KEEP + 1, data.keptReaddedCount);
+  check_uint_eq (POOL_TEST_MAX, data.refilled.knownPeerCount);
+  check_uint_eq (data.full.knownPeerBytes, data.refilled.knownPeerBytes);
+
+  /* cleanup */
+  tr_torrentRemove (tor, true, tr_sys_path_remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_piece_buckets,
+                             test_request_table,
+                             test_peer_candidates,
+                             test_atom_pool };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
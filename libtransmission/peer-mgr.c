@@ -26,6 +26,7 @@
 #include "completion.h"
 #include "crypto-utils.h"
 #include "handshake.h"
+#include "inout.h" /* tr_ioPieceIsHeldBack () */
 #include "log.h"
 #include "net.h"
 #include "peer-io.h"
@@ -35,6 +36,7 @@
 #include "session.h"
 #include "stats.h" /* tr_statsAddUploaded, tr_statsAddDownloaded */
 #include "torrent.h"
+#include "tr-udp.h"
 #include "tr-utp.h"
 #include "utils.h"
 #include "webseed.h"
@@ -90,9 +92,19 @@ enum
   /* the minimum we'll wait before attempting to reconnect to a peer */
   MINIMUM_RECONNECT_INTERVAL_SECS = 5,
 
+  /* how often to look again at an atom that isn't a connection candidate
+   * for a reason that doesn't tell us when it will be, e.g. it's in use */
+  CANDIDATE_RECHECK_SECS = 60,
+
   /** how long we'll let requests we've made linger before we cancel them */
   REQUEST_TTL_SECS = 90,
 
+  /** how many peers we'll ask for the same block in the endgame */
+  MAX_REQUESTS_PER_BLOCK = 2,
+
+  /** the smallest size of tr_swarm::requests, which is a power of two */
+  REQUEST_TABLE_MIN_SLOTS = 64,
+
   NO_BLOCKS_CANCEL_HISTORY = 120,
 
   CANCEL_HISTORY_SEC = 60
@@ -100,7 +112,7 @@ enum
 
 const tr_peer_event TR_PEER_EVENT_INIT = { 0, 0, NULL, 0, 0, 0, 0 };
 
-const tr_swarm_stats TR_SWARM_STATS_INIT = { { 0, 0 }, 0, 0, { 0, 0, 0, 0, 0, 0, 0 } };
+const tr_swarm_stats TR_SWARM_STATS_INIT = { { 0, 0 }, 0, 0, { 0, 0, 0, 0, 0, 0, 0 }, 0, 0 };
 
 /**
 ***
@@ -138,6 +150,55 @@ struct peer_atom
   time_t      shelf_date;
   tr_peer   * peer;               /* will be NULL if not connected */
   tr_address  addr;
+
+  /* where this atom is in the connection candidate queues.
+   * see tr_peerMgr::waitingAtoms */
+  struct tr_swarm  * swarm;
+  struct atom_heap * heap;        /* NULL if it's in none of them */
+  int                heapPos;
+  uint64_t           candidateKey;
+
+  int                poolPos;     /* where it is in atom_pool::atoms */
+};
+
+/* a binary min-heap of atoms, ordered by peer_atom::candidateKey */
+struct atom_heap
+{
+  struct peer_atom ** atoms;
+  int                 count;
+  int                 alloc;
+};
+
+enum
+{
+  ATOM_SLAB_SIZE = 32,
+
+  /* the smallest size of atom_pool::index, which is a power of two */
+  ATOM_INDEX_MIN_SLOTS = 16
+};
+
+struct atom_slab
+{
+  struct atom_slab * next;
+  struct peer_atom   atoms[ATOM_SLAB_SIZE];
+};
+
+/* A swarm's peer_atoms. They're carved out of slabs so that they don't
+ * move while peers and the candidate heaps point at them, and they're
+ * found by address through an open-addressing hash table. */
+struct atom_pool
+{
+  struct peer_atom ** atoms;      /* in no particular order */
+  int                 count;
+  int                 alloc;
+
+  struct peer_atom ** index;      /* NULL if count is 0 */
+  int                 indexSlots; /* 0, or a power of two */
+
+  struct atom_slab  * slabs;
+  int                 slabCount;
+  struct peer_atom ** freeAtoms;  /* the unused atoms in the slabs */
+  int                 freeCount;
 };
 
 #ifdef NDEBUG
@@ -166,18 +227,43 @@ struct block_request
   time_t sentAt;
 };
 
+/* the requests we've sent for one block. Until the endgame there's one,
+ * and in the endgame there can be one more */
+struct block_requests
+{
+  tr_block_index_t block;
+  int peerCount; /* 0 if this slot of tr_swarm::requests is empty */
+  tr_peer * peers[MAX_REQUESTS_PER_BLOCK];
+  time_t sentAt[MAX_REQUESTS_PER_BLOCK];
+};
+
+/* a piece we want, in one of tr_swarm's piece buckets */
 struct weighted_piece
 {
-  tr_piece_index_t index;
-  int16_t salt;
+  tr_piece_index_t prev; /* the previous piece in its bucket, or PIECE_NONE */
+  tr_piece_index_t next; /* the next piece in its bucket, or PIECE_NONE */
+  uint16_t bucket; /* PIECE_BUCKET_NONE if we don't want this piece */
   int16_t requestCount;
 };
 
-enum piece_sort_state
+struct piece_bucket
 {
-  PIECES_UNSORTED,
-  PIECES_SORTED_BY_INDEX,
-  PIECES_SORTED_BY_WEIGHT
+  tr_piece_index_t first;
+  tr_piece_index_t last;
+};
+
+#define PIECE_NONE ((tr_piece_index_t)~0)
+
+enum
+{
+  /* pieces that more peers than this have are all equally common */
+  PIECE_RARITY_BUCKETS = 64,
+
+  /* a tier per state: partially-complete, empty, and all blocks requested */
+  PIECE_BUCKETS_PER_TIER = 3 * PIECE_RARITY_BUCKETS, /* one set per priority */
+  PIECE_BUCKET_COUNT = 3 * PIECE_BUCKETS_PER_TIER,
+
+  PIECE_BUCKET_NONE = UINT16_MAX
 };
 
 /** @brief Opaque, per-torrent data structure for peer connection information */
@@ -186,10 +272,15 @@ typedef struct tr_swarm
   tr_swarm_stats             stats;
 
   tr_ptrArray                outgoingHandshakes; /* tr_handshake */
-  tr_ptrArray                pool; /* struct peer_atom */
+  struct atom_pool           pool;
   tr_ptrArray                peers; /* tr_peerMsgs */
   tr_ptrArray                webseeds; /* tr_webseed */
 
+  /* candidates that were passed over because the swarm didn't want
+   * any more peers. They go back in tr_peerMgr::readyAtoms once it does */
+  struct atom_heap           parkedAtoms;
+  bool                       isParked; /* in tr_peerMgr::parkedSwarms */
+
   tr_torrent               * tor;
   struct tr_peerMgr        * manager;
 
@@ -199,13 +290,17 @@ typedef struct tr_swarm
   bool                       isRunning;
   bool                       needsCompletenessCheck;
 
-  struct block_request     * requests;
-  int                        requestCount;
-  int                        requestAlloc;
+  /* an open-addressing hash table of the blocks we've requested */
+  struct block_requests    * requests;
+  int                        requestSlots; /* 0, or a power of two */
+  int                        requestBlockCount; /* how many slots are used */
+  int                        requestCount; /* how many requests in all */
 
+  /* indexed by piece. pieceCount is how many of them we want */
   struct weighted_piece    * pieces;
+  tr_piece_index_t           piecesSize;
   int                        pieceCount;
-  enum piece_sort_state      pieceSortState;
+  struct piece_bucket      * pieceBuckets; /* PIECE_BUCKET_COUNT of them */
 
   /* An array of pieceCount items stating how many peers have each piece.
      This is used to help us for downloading pieces "rarest first."
@@ -234,6 +329,16 @@ struct tr_peerMgr
   struct event  * rechokeTimer;
   struct event  * refillUpkeepTimer;
   struct event  * atomTimer;
+
+  /* The atoms we might connect to. Each one that isn't banned is in one
+   * of these or in its swarm's parkedAtoms. waitingAtoms is keyed by when
+   * the atom may next be tried, readyAtoms by getPeerCandidateScore (). */
+  struct atom_heap waitingAtoms;
+  struct atom_heap readyAtoms;
+
+  /* the swarms that have parked atoms, sorted by address. Only these
+   * are looked at to see if they have room for their atoms again */
+  tr_ptrArray parkedSwarms;
 };
 
 #define tordbg(t, ...) \
@@ -252,6 +357,320 @@ struct tr_peerMgr
     } \
   while (0)
 
+/**
+*** struct atom_heap
+**/
+
+static inline bool
+atomHeapLess (const struct atom_heap * h, int a, int b)
+{
+  return h->atoms[a]->candidateKey < h->atoms[b]->candidateKey;
+}
+
+static inline void
+atomHeapSet (struct atom_heap * h, int pos, struct peer_atom * atom)
+{
+  h->atoms[pos] = atom;
+  atom->heapPos = pos;
+}
+
+static void
+atomHeapSwap (struct atom_heap * h, int a, int b)
+{
+  struct peer_atom * tmp = h->atoms[a];
+  atomHeapSet (h, a, h->atoms[b]);
+  atomHeapSet (h, b, tmp);
+}
+
+static void
+atomHeapSiftUp (struct atom_heap * h, int pos)
+{
+  while (pos > 0)
+    {
+      const int parent = (pos - 1) / 2;
+
+      if (!atomHeapLess (h, pos, parent))
+        break;
+
+      atomHeapSwap (h, pos, parent);
+      pos = parent;
+    }
+}
+
+static void
+atomHeapSiftDown (struct atom_heap * h, int pos)
+{
+  for (;;)
+    {
+      int best = pos;
+      const int left = pos * 2 + 1;
+      const int right = left + 1;
+
+      if (left < h->count && atomHeapLess (h, left, best))
+        best = left;
+      if (right < h->count && atomHeapLess (h, right, best))
+        best = right;
+      if (best == pos)
+        break;
+
+      atomHeapSwap (h, pos, best);
+      pos = best;
+    }
+}
+
+static void
+atomHeapRemove (struct peer_atom * atom)
+{
+  struct atom_heap * h = atom->heap;
+
+  if (h != NULL)
+    {
+      const int pos = atom->heapPos;
+
+      assert (h->atoms[pos] == atom);
+
+      atom->heap = NULL;
+      if (pos != --h->count)
+        {
+          atomHeapSet (h, pos, h->atoms[h->count]);
+          atomHeapSiftDown (h, pos);
+          atomHeapSiftUp (h, pos);
+        }
+    }
+}
+
+static void
+atomHeapPush (struct atom_heap * h, struct peer_atom * atom, uint64_t key)
+{
+  atomHeapRemove (atom);
+
+  if (h->count == h->alloc)
+    {
+      h->alloc = h->alloc ? h->alloc * 2 : 64;
+      h->atoms = tr_renew (struct peer_atom *, h->atoms, h->alloc);
+    }
+
+  atom->heap = h;
+  atom->candidateKey = key;
+  atomHeapSet (h, h->count++, atom);
+  atomHeapSiftUp (h, atom->heapPos);
+}
+
+static inline struct peer_atom *
+atomHeapPeek (const struct atom_heap * h)
+{
+  return h->count > 0 ? h->atoms[0] : NULL;
+}
+
+static struct peer_atom *
+atomHeapPop (struct atom_heap * h)
+{
+  struct peer_atom * atom = atomHeapPeek (h);
+
+  if (atom != NULL)
+    atomHeapRemove (atom);
+
+  return atom;
+}
+
+/**
+*** struct atom_pool
+**/
+
+static uint32_t
+atomPoolHash (const tr_address * addr)
+{
+  size_t i, len;
+  const uint8_t * bytes;
+  uint32_t h = 2166136261u; /* FNV-1a */
+
+  if (addr->type == TR_AF_INET)
+    {
+      bytes = (const uint8_t *) &addr->addr.addr4;
+      len = sizeof (addr->addr.addr4);
+    }
+  else
+    {
+      bytes = (const uint8_t *) &addr->addr.addr6;
+      len = sizeof (addr->addr.addr6);
+    }
+
+  for (i=0; i<len; ++i)
+    h = (h ^ bytes[i]) * 16777619u;
+
+  return h;
+}
+
+static struct peer_atom *
+atomPoolFind (const struct atom_pool * pool, const tr_address * addr)
+{
+  if (pool->indexSlots > 0)
+    {
+      struct peer_atom * atom;
+      const uint32_t mask = pool->indexSlots - 1;
+      uint32_t i = atomPoolHash (addr) & mask;
+
+      while ((atom = pool->index[i]) != NULL)
+        {
+          if (tr_address_compare (&atom->addr, addr) == 0)
+            return atom;
+
+          i = (i + 1) & mask;
+        }
+    }
+
+  return NULL;
+}
+
+static void
+atomPoolIndexAdd (struct atom_pool * pool, struct peer_atom * atom)
+{
+  const uint32_t mask = pool->indexSlots - 1;
+  uint32_t i = atomPoolHash (&atom->addr) & mask;
+
+  while (pool->index[i] != NULL)
+    i = (i + 1) & mask;
+
+  pool->index[i] = atom;
+}
+
+static void
+atomPoolIndexResize (struct atom_pool * pool, int slots)
+{
+  int i;
+
+  tr_free (pool->index);
+  pool->indexSlots = slots;
+  pool->index = slots > 0 ? tr_new0 (struct peer_atom *, slots) : NULL;
+
+  if (slots > 0)
+    for (i=0; i<pool->count; ++i)
+      atomPoolIndexAdd (pool, pool->atoms[i]);
+}
+
+/* take an atom out of the index, moving later ones back
+ * so that lookups never have to skip over holes */
+static void
+atomPoolIndexRemove (struct atom_pool * pool, const struct peer_atom * atom)
+{
+  const uint32_t mask = pool->indexSlots - 1;
+  uint32_t i = atomPoolHash (&atom->addr) & mask;
+  uint32_t j;
+
+  while (pool->index[i] != atom)
+    i = (i + 1) & mask;
+
+  for (j=i;;)
+    {
+      uint32_t home;
+
+      pool->index[i] = NULL;
+
+      do
+        {
+          j = (j + 1) & mask;
+
+          if (pool->index[j] == NULL)
+            return;
+
+          home = atomPoolHash (&pool->index[j]->addr) & mask;
+        }
+      while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+
+      pool->index[i] = pool->index[j];
+      i = j;
+    }
+}
+
+/* returns a zeroed atom for `addr', which mustn't be in the pool yet */
+static struct peer_atom *
+atomPoolAdd (struct atom_pool * pool, const tr_address * addr)
+{
+  struct peer_atom * atom;
+
+  assert (atomPoolFind (pool, addr) == NULL);
+
+  if (pool->freeCount == 0)
+    {
+      int i;
+      struct atom_slab * slab = tr_new (struct atom_slab, 1);
+
+      slab->next = pool->slabs;
+      pool->slabs = slab;
+      ++pool->slabCount;
+
+      pool->freeAtoms = tr_renew (struct peer_atom *, pool->freeAtoms, pool->slabCount * ATOM_SLAB_SIZE);
+      for (i=ATOM_SLAB_SIZE-1; i>=0; --i)
+        pool->freeAtoms[pool->freeCount++] = &slab->atoms[i];
+    }
+
+  atom = pool->freeAtoms[--pool->freeCount];
+  memset (atom, 0, sizeof (struct peer_atom));
+  atom->addr = *addr;
+
+  if (pool->count == pool->alloc)
+    {
+      pool->alloc = pool->alloc ? pool->alloc * 2 : ATOM_SLAB_SIZE;
+      pool->atoms = tr_renew (struct peer_atom *, pool->atoms, pool->alloc);
+    }
+  atom->poolPos = pool->count;
+  pool->atoms[pool->count++] = atom;
+
+  /* keep the index no more than half full */
+  if (2 * pool->count > pool->indexSlots)
+    atomPoolIndexResize (pool, MAX (ATOM_INDEX_MIN_SLOTS, 2 * pool->indexSlots));
+  else
+    atomPoolIndexAdd (pool, atom);
+
+  return atom;
+}
+
+static void
+atomPoolRemove (struct atom_pool * pool, struct peer_atom * atom)
+{
+  const int pos = atom->poolPos;
+
+  assert (pool->atoms[pos] == atom);
+
+  atomPoolIndexRemove (pool, atom);
+
+  if (pos != --pool->count)
+    {
+      pool->atoms[pos] = pool->atoms[pool->count];
+      pool->atoms[pos]->poolPos = pos;
+    }
+
+  pool->freeAtoms[pool->freeCount++] = atom;
+
+  if (pool->count == 0)
+    atomPoolIndexResize (pool, 0);
+}
+
+static void
+atomPoolDestruct (struct atom_pool * pool)
+{
+  while (pool->slabs != NULL)
+    {
+      struct atom_slab * next = pool->slabs->next;
+      tr_free (pool->slabs);
+      pool->slabs = next;
+    }
+
+  tr_free (pool->freeAtoms);
+  tr_free (pool->index);
+  tr_free (pool->atoms);
+  memset (pool, 0, sizeof (struct atom_pool));
+}
+
+/* how much memory the pool is using */
+static size_t
+atomPoolBytes (const struct atom_pool * pool)
+{
+  return pool->slabCount * (sizeof (struct atom_slab) + ATOM_SLAB_SIZE * sizeof (struct peer_atom *))
+       + pool->alloc * sizeof (struct peer_atom *)
+       + pool->indexSlots * sizeof (struct peer_atom *);
+}
+
 /**
 *** tr_peer virtual functions
 **/
@@ -376,31 +795,22 @@ handshakeCompare (const void * a, const void * b)
   return handshakeCompareToAddr (a, tr_handshakeGetAddr (b, NULL));
 }
 
-static inline tr_handshake*
-getExistingHandshake (tr_ptrArray * handshakes, const tr_address * addr)
-{
-  if (tr_ptrArrayEmpty (handshakes))
-    return NULL;
-
-  return tr_ptrArrayFindSorted (handshakes, addr, handshakeCompareToAddr);
-}
-
 static int
-comparePeerAtomToAddress (const void * va, const void * vb)
+swarmCompare (const void * a, const void * b)
 {
-  const struct peer_atom * a = va;
+  if (a != b)
+    return a < b ? -1 : 1;
 
-  return tr_address_compare (&a->addr, vb);
+  return 0;
 }
 
-static int
-compareAtomsByAddress (const void * va, const void * vb)
+static inline tr_handshake*
+getExistingHandshake (tr_ptrArray * handshakes, const tr_address * addr)
 {
-  const struct peer_atom * b = vb;
-
-  assert (tr_isAtom (b));
+  if (tr_ptrArrayEmpty (handshakes))
+    return NULL;
 
-  return comparePeerAtomToAddress (va, &b->addr);
+  return tr_ptrArrayFindSorted (handshakes, addr, handshakeCompareToAddr);
 }
 
 /**
@@ -429,11 +839,10 @@ peerCompare (const void * a, const void * b)
 }
 
 static struct peer_atom*
-getExistingAtom (const tr_swarm   * cswarm,
+getExistingAtom (const tr_swarm   * swarm,
                  const tr_address * addr)
 {
-  tr_swarm * swarm = (tr_swarm*) cswarm;
-  return tr_ptrArrayFindSorted (&swarm->pool, addr, comparePeerAtomToAddress);
+  return atomPoolFind (&swarm->pool, addr);
 }
 
 static bool
@@ -493,6 +902,7 @@ replicationNew (tr_swarm * s)
 static void
 swarmFree (void * vs)
 {
+  int i;
   tr_swarm * s = vs;
 
   assert (s);
@@ -502,7 +912,12 @@ swarmFree (void * vs)
   assert (tr_ptrArrayEmpty (&s->peers));
 
   tr_ptrArrayDestruct (&s->webseeds, (PtrArrayForeachFunc)tr_peerFree);
-  tr_ptrArrayDestruct (&s->pool, (PtrArrayForeachFunc)tr_free);
+  for (i=0; i<s->pool.count; ++i)
+    atomHeapRemove (s->pool.atoms[i]);
+  atomPoolDestruct (&s->pool);
+  tr_free (s->parkedAtoms.atoms);
+  if (s->isParked)
+    tr_ptrArrayRemoveSortedPointer (&s->manager->parkedSwarms, s, swarmCompare);
   tr_ptrArrayDestruct (&s->outgoingHandshakes, NULL);
   tr_ptrArrayDestruct (&s->peers, NULL);
   s->stats = TR_SWARM_STATS_INIT;
@@ -510,6 +925,7 @@ swarmFree (void * vs)
   replicationFree (s);
 
   tr_free (s->requests);
+  tr_free (s->pieceBuckets);
   tr_free (s->pieces);
   tr_free (s);
 }
@@ -543,7 +959,6 @@ swarmNew (tr_peerMgr * manager, tr_torrent * tor)
   s = tr_new0 (tr_swarm, 1);
   s->manager = manager;
   s->tor = tor;
-  s->pool = TR_PTR_ARRAY_INIT;
   s->peers = TR_PTR_ARRAY_INIT;
   s->webseeds = TR_PTR_ARRAY_INIT;
   s->outgoingHandshakes = TR_PTR_ARRAY_INIT;
@@ -561,6 +976,7 @@ tr_peerMgrNew (tr_session * session)
   tr_peerMgr * m = tr_new0 (tr_peerMgr, 1);
   m->session = session;
   m->incomingHandshakes = TR_PTR_ARRAY_INIT;
+  m->parkedSwarms = TR_PTR_ARRAY_INIT;
   ensureMgrTimersExist (m);
   return m;
 }
@@ -598,6 +1014,10 @@ tr_peerMgrFree (tr_peerMgr * manager)
 
   tr_ptrArrayDestruct (&manager->incomingHandshakes, NULL);
 
+  tr_free (manager->waitingAtoms.atoms);
+  tr_free (manager->readyAtoms.atoms);
+  tr_ptrArrayDestruct (&manager->parkedSwarms, NULL);
+
   managerUnlock (manager);
   tr_free (manager);
 }
@@ -618,12 +1038,8 @@ tr_peerMgrOnBlocklistChanged (tr_peerMgr * mgr)
     {
       int i;
       tr_swarm * s = tor->swarm;
-      const int n = tr_ptrArraySize (&s->pool);
-      for (i=0; i<n; ++i)
-        {
-          struct peer_atom * atom = tr_ptrArrayNth (&s->pool, i);
-          atom->blocklisted = -1;
-        }
+      for (i=0; i<s->pool.count; ++i)
+        s->pool.atoms[i]->blocklisted = -1;
     }
 }
 
@@ -712,68 +1128,153 @@ tr_peerMgrSetUtpFailed (tr_torrent *tor, const tr_address *addr, bool failed)
 ***
 *** There are two data structures associated with managing block requests:
 ***
-*** 1. tr_swarm::requests, an array of "struct block_request" which keeps
+*** 1. tr_swarm::requests, a hash table of "struct block_requests" which keeps
 ***    track of which blocks have been requested, and when, and by which peers.
-***    This is list is used for (a) cancelling requests that have been pending
+***    This is used for (a) cancelling requests that have been pending
 ***    for too long and (b) avoiding duplicate requests before endgame.
 ***
-*** 2. tr_swarm::pieces, an array of "struct weighted_piece" which lists the
-***    pieces that we want to request. It's used to decide which blocks to
-***    return next when tr_peerMgrGetBlockRequests () is called.
+*** 2. tr_swarm::pieceBuckets, lists of "struct weighted_piece" which hold the
+***    pieces that we want to request, sorted into buckets by priority and
+***    rarity. It's used to decide which blocks to return next when
+***    tr_peerMgrGetNextRequests () is called.
 **/
 
 /**
-*** struct block_request
+*** struct block_requests
 **/
 
-static int
-compareReqByBlock (const void * va, const void * vb)
+static inline uint32_t
+requestHash (tr_block_index_t block)
 {
-  const struct block_request * a = va;
-  const struct block_request * b = vb;
+  uint32_t h = block;
 
-  /* primary key: block */
-  if (a->block < b->block) return -1;
-  if (a->block > b->block) return 1;
+  /* blocks are requested in runs, so spread them out */
+  h ^= h >> 16;
+  h *= 0x45d9f3bu;
+  h ^= h >> 16;
+  return h;
+}
 
-  /* secondary key: peer */
-  if (a->peer < b->peer) return -1;
-  if (a->peer > b->peer) return 1;
+static struct block_requests *
+requestTableFind (const tr_swarm * s, tr_block_index_t block)
+{
+  if (s->requestSlots > 0)
+    {
+      const uint32_t mask = s->requestSlots - 1;
+      uint32_t i = requestHash (block) & mask;
 
-  return 0;
+      while (s->requests[i].peerCount != 0)
+        {
+          if (s->requests[i].block == block)
+            return &s->requests[i];
+
+          i = (i + 1) & mask;
+        }
+    }
+
+  return NULL;
 }
 
 static void
-requestListAdd (tr_swarm * s, tr_block_index_t block, tr_peer * peer)
+requestTableResize (tr_swarm * s, int slots)
 {
-  struct block_request key;
+  int i;
+  const int oldSlots = s->requestSlots;
+  struct block_requests * old = s->requests;
+
+  s->requestSlots = slots;
+  s->requests = slots > 0 ? tr_new0 (struct block_requests, slots) : NULL;
 
-  /* ensure enough room is available... */
-  if (s->requestCount + 1 >= s->requestAlloc)
+  for (i=0; i<oldSlots; ++i)
     {
-      const int CHUNK_SIZE = 128;
-      s->requestAlloc += CHUNK_SIZE;
-      s->requests = tr_renew (struct block_request,
-                              s->requests, s->requestAlloc);
+      if (old[i].peerCount != 0)
+        {
+          const uint32_t mask = slots - 1;
+          uint32_t j = requestHash (old[i].block) & mask;
+
+          while (s->requests[j].peerCount != 0)
+            j = (j + 1) & mask;
+
+          s->requests[j] = old[i];
+        }
     }
 
-  /* populate the record we're inserting */
-  key.block = block;
-  key.peer = peer;
-  key.sentAt = tr_time ();
+  tr_free (old);
+}
 
-  /* insert the request to our array... */
-  {
-    bool exact;
-    const int pos = tr_lowerBound (&key, s->requests, s->requestCount,
-                                   sizeof (struct block_request),
-                                   compareReqByBlock, &exact);
-    assert (!exact);
-    memmove (s->requests + pos + 1,
-             s->requests + pos,
-             sizeof (struct block_request) * (s->requestCount++ - pos));
-    s->requests[pos] = key;
-  }
+/* the caller must add a request to the new slot right away,
+ * since a slot without any is empty */
+static struct block_requests *
+requestTableInsert (tr_swarm * s, tr_block_index_t block)
+{
+  uint32_t i, mask;
+
+  /* keep the table no more than half full */
+  if (2 * (s->requestBlockCount + 1) > s->requestSlots)
+    requestTableResize (s, MAX (REQUEST_TABLE_MIN_SLOTS, 2 * s->requestSlots));
+
+  mask = s->requestSlots - 1;
+  i = requestHash (block) & mask;
+  while (s->requests[i].peerCount != 0)
+    i = (i + 1) & mask;
+
+  s->requests[i].block = block;
+  ++s->requestBlockCount;
+  return &s->requests[i];
+}
+
+/* empty a slot, moving later slots back into it as needed
+ * so that lookups never have to skip over holes */
+static void
+requestTableDelete (tr_swarm * s, struct block_requests * r)
+{
+  const uint32_t mask = s->requestSlots - 1;
+  uint32_t i = r - s->requests;
+  uint32_t j = i;
+
+  for (;;)
+    {
+      uint32_t home;
+
+      s->requests[i].peerCount = 0;
+
+      do
+        {
+          j = (j + 1) & mask;
+
+          if (s->requests[j].peerCount == 0)
+            {
+              --s->requestBlockCount;
+
+              if (s->requestBlockCount == 0 && s->requestSlots > REQUEST_TABLE_MIN_SLOTS)
+                requestTableResize (s, 0);
+
+              return;
+            }
+
+          home = requestHash (s->requests[j].block) & mask;
+        }
+      while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+
+      s->requests[i] = s->requests[j];
+      i = j;
+    }
+}
+
+static void
+requestListAdd (tr_swarm * s, tr_block_index_t block, tr_peer * peer)
+{
+  struct block_requests * r = requestTableFind (s, block);
+
+  if (r == NULL)
+    r = requestTableInsert (s, block);
+
+  assert (r->peerCount < MAX_REQUESTS_PER_BLOCK);
+
+  r->peers[r->peerCount] = peer;
+  r->sentAt[r->peerCount] = tr_time ();
+  ++r->peerCount;
+  ++s->requestCount;
 
   if (peer != NULL)
     {
@@ -786,74 +1287,69 @@ requestListAdd (tr_swarm * s, tr_block_index_t block, tr_peer * peer)
                      (unsigned long)block, tr_atomAddrStr (peer->atom), s->requestCount);*/
 }
 
-static struct block_request *
-requestListLookup (tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
+static bool
+requestListHas (const tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
 {
-  struct block_request key;
-  key.block = block;
-  key.peer = (tr_peer*) peer;
+  int i;
+  const struct block_requests * r = requestTableFind (s, block);
 
-  return bsearch (&key, s->requests, s->requestCount,
-                  sizeof (struct block_request),
-                  compareReqByBlock);
+  if (r != NULL)
+    for (i=0; i<r->peerCount; ++i)
+      if (r->peers[i] == peer)
+        return true;
+
+  return false;
 }
 
 /**
  * Find the peers are we currently requesting the block
- * with index @a block from and append them to @a peerArr.
+ * with index @a block from, or NULL if there aren't any.
  */
-static void
-getBlockRequestPeers (tr_swarm * s, tr_block_index_t block,
-                      tr_ptrArray * peerArr)
+static const struct block_requests *
+getBlockRequestPeers (const tr_swarm * s, tr_block_index_t block)
 {
-  bool exact;
-  int i, pos;
-  struct block_request key;
-
-  key.block = block;
-  key.peer = NULL;
-  pos = tr_lowerBound (&key, s->requests, s->requestCount,
-                       sizeof (struct block_request),
-                       compareReqByBlock, &exact);
-
-  assert (!exact); /* shouldn't have a request with .peer == NULL */
-
-  for (i=pos; i<s->requestCount; ++i)
-    {
-      if (s->requests[i].block != block)
-        break;
-      tr_ptrArrayAppend (peerArr, s->requests[i].peer);
-    }
+  return requestTableFind (s, block);
 }
 
 static void
-decrementPendingReqCount (const struct block_request * b)
+decrementPendingReqCount (tr_peer * peer)
 {
-  if (b->peer != NULL)
-    if (b->peer->pendingReqsToPeer > 0)
-      --b->peer->pendingReqsToPeer;
+  if (peer != NULL)
+    if (peer->pendingReqsToPeer > 0)
+      --peer->pendingReqsToPeer;
 }
 
 static void
 requestListRemove (tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
 {
-  const struct block_request * b = requestListLookup (s, block, peer);
+  int i;
+  struct block_requests * r = requestTableFind (s, block);
+
+  if (r == NULL)
+    return;
 
-  if (b != NULL)
+  for (i=0; i<r->peerCount; ++i)
     {
-      const int pos = b - s->requests;
-      assert (pos < s->requestCount);
+      if (r->peers[i] == peer)
+        {
+          decrementPendingReqCount (r->peers[i]);
 
-      decrementPendingReqCount (b);
+          --r->peerCount;
+          --s->requestCount;
+          for (; i<r->peerCount; ++i)
+            {
+              r->peers[i] = r->peers[i+1];
+              r->sentAt[i] = r->sentAt[i+1];
+            }
 
-      tr_removeElementFromArray (s->requests,
-                                 pos,
-                                 sizeof (struct block_request),
-                                 s->requestCount--);
+          if (r->peerCount == 0)
+            requestTableDelete (s, r);
 
-      /*fprintf (stderr, "removing request of block %lu from peer %s... "
-                         "there are now %d block requests left\n",
-                         (unsigned long)block, tr_atomAddrStr (peer->atom), t->requestCount);*/
+          /*fprintf (stderr, "removing request of block %lu from peer %s... "
+                             "there are now %d block requests left\n",
+                             (unsigned long)block, tr_atomAddrStr (peer->atom), t->requestCount);*/
+          break;
+        }
     }
 }
 
@@ -924,94 +1420,134 @@ updateEndgame (tr_swarm * s)
 *****
 ****/
 
-static inline void
-invalidatePieceSorting (tr_swarm * s)
+/* Each piece we want is in one of the buckets, which are kept in the
+ * order we want to request from them:
+ *
+ * 1. partially-complete pieces come before empty ones, and pieces whose
+ *    blocks have all been requested come last;
+ * 2. then higher priorities go first;
+ * 3. then rarest first.
+ *
+ * Within a bucket the pieces are in the order they arrived in it, and new
+ * pieces are added in random order so that peers don't all want the same
+ * ones. Moving a piece to another bucket when its weight changes is O(1). */
+
+static inline int
+pieceBucketRarity (const tr_swarm * s, tr_piece_index_t index)
 {
-  s->pieceSortState = PIECES_UNSORTED;
+  if (!replicationExists (s))
+    return 0;
+
+  return MIN (s->pieceReplication[index], PIECE_RARITY_BUCKETS - 1);
 }
 
-static const tr_torrent * weightTorrent;
+static uint16_t
+pieceBucket (const tr_swarm * s, tr_piece_index_t index)
+{
+  int tier;
+  tr_block_index_t first, last;
+  const tr_torrent * tor = s->tor;
+  const int missing = tr_torrentMissingBlocksInPiece (tor, index);
+  const int pending = s->pieces[index].requestCount;
+
+  tr_torGetPieceBlockRange (tor, index, &first, &last);
 
-static const uint16_t * weightReplication;
+  if (missing <= pending)
+    tier = 2;
+  else if ((pending > 0) || (missing < (int)(last + 1 - first)))
+    tier = 0;
+  else
+    tier = 1;
+
+  return tier * PIECE_BUCKETS_PER_TIER
+       + (TR_PRI_HIGH - tor->info.pieces[index].priority) * PIECE_RARITY_BUCKETS
+       + pieceBucketRarity (s, index);
+}
 
 static void
-setComparePieceByWeightTorrent (tr_swarm * s)
+pieceListAppend (tr_swarm * s, tr_piece_index_t index, uint16_t bucket)
 {
-  if (!replicationExists (s))
-    replicationNew (s);
+  struct weighted_piece * p = &s->pieces[index];
+  struct piece_bucket * b = &s->pieceBuckets[bucket];
+
+  assert (p->bucket == PIECE_BUCKET_NONE);
+
+  p->bucket = bucket;
+  p->prev = b->last;
+  p->next = PIECE_NONE;
 
-  weightTorrent = s->tor;
-  weightReplication = s->pieceReplication;
+  if (b->last != PIECE_NONE)
+    s->pieces[b->last].next = index;
+  else
+    b->first = index;
+  b->last = index;
+
+  ++s->pieceCount;
 }
 
-/* we try to create a "weight" s.t. high-priority pieces come before others,
- * and that partially-complete pieces come before empty ones. */
-static int
-comparePieceByWeight (const void * va, const void * vb)
-{
-  const struct weighted_piece * a = va;
-  const struct weighted_piece * b = vb;
-  int ia, ib, missing, pending;
-  const tr_torrent * tor = weightTorrent;
-  const uint16_t * rep = weightReplication;
-
-  /* primary key: weight */
-  missing = tr_torrentMissingBlocksInPiece (tor, a->index);
-  pending = a->requestCount;
-  ia = missing > pending ? missing - pending : (tor->blockCountInPiece + pending);
-  missing = tr_torrentMissingBlocksInPiece (tor, b->index);
-  pending = b->requestCount;
-  ib = missing > pending ? missing - pending : (tor->blockCountInPiece + pending);
-  if (ia < ib) return -1;
-  if (ia > ib) return 1;
-
-  /* secondary key: higher priorities go first */
-  ia = tor->info.pieces[a->index].priority;
-  ib = tor->info.pieces[b->index].priority;
-  if (ia > ib) return -1;
-  if (ia < ib) return 1;
-
-  /* tertiary key: rarest first. */
-  ia = rep[a->index];
-  ib = rep[b->index];
-  if (ia < ib) return -1;
-  if (ia > ib) return 1;
-
-  /* quaternary key: random */
-  if (a->salt < b->salt) return -1;
-  if (a->salt > b->salt) return 1;
-
-  /* okay, they're equal */
-  return 0;
+static void
+pieceListUnlink (tr_swarm * s, tr_piece_index_t index)
+{
+  struct weighted_piece * p = &s->pieces[index];
+  struct piece_bucket * b = &s->pieceBuckets[p->bucket];
+
+  assert (p->bucket != PIECE_BUCKET_NONE);
+
+  if (p->prev != PIECE_NONE)
+    s->pieces[p->prev].next = p->next;
+  else
+    b->first = p->next;
+
+  if (p->next != PIECE_NONE)
+    s->pieces[p->next].prev = p->prev;
+  else
+    b->last = p->prev;
+
+  p->bucket = PIECE_BUCKET_NONE;
+  --s->pieceCount;
 }
 
+/* copy the pieces we want, in the order we want them, into setme */
 static int
-comparePieceByIndex (const void * va, const void * vb)
+pieceListGetOrder (const tr_swarm * s, tr_piece_index_t * setme)
 {
-  const struct weighted_piece * a = va;
-  const struct weighted_piece * b = vb;
-  if (a->index < b->index) return -1;
-  if (a->index > b->index) return 1;
-  return 0;
+  int i, n = 0;
+  tr_piece_index_t index;
+
+  if (s->pieceBuckets != NULL)
+    for (i=0; i<PIECE_BUCKET_COUNT; ++i)
+      for (index=s->pieceBuckets[i].first; index!=PIECE_NONE; index=s->pieces[index].next)
+        setme[n++] = index;
+
+  assert (n == s->pieceCount);
+  return n;
 }
 
+/* put the pieces into their buckets, keeping the order that pieces
+ * landing in the same bucket were in before. Used when every piece's
+ * weight changes at once, i.e. when the replication counts are rebuilt */
 static void
-pieceListSort (tr_swarm * s, enum piece_sort_state state)
+pieceListRebucket (tr_swarm * s)
 {
-  assert (state==PIECES_SORTED_BY_INDEX
-       || state==PIECES_SORTED_BY_WEIGHT);
+  int i, n;
+  tr_piece_index_t * order;
 
-  if (state == PIECES_SORTED_BY_WEIGHT)
-    {
-      setComparePieceByWeightTorrent (s);
-      qsort (s->pieces, s->pieceCount, sizeof (struct weighted_piece), comparePieceByWeight);
-    }
-  else
-    {
-      qsort (s->pieces, s->pieceCount, sizeof (struct weighted_piece), comparePieceByIndex);
-    }
+  if (s->pieceCount == 0)
+    return;
 
-  s->pieceSortState = state;
+  order = tr_new (tr_piece_index_t, s->pieceCount);
+  n = pieceListGetOrder (s, order);
+
+  for (i=0; i<PIECE_BUCKET_COUNT; ++i)
+    s->pieceBuckets[i].first = s->pieceBuckets[i].last = PIECE_NONE;
+  for (i=0; i<n; ++i)
+    s->pieces[order[i]].bucket = PIECE_BUCKET_NONE;
+  s->pieceCount = 0;
+
+  for (i=0; i<n; ++i)
+    pieceListAppend (s, order[i], pieceBucket (s, order[i]));
+
+  tr_free (order);
 }
 
 /**
@@ -1019,21 +1555,9 @@ pieceListSort (tr_swarm * s, enum piece_sort_state state)
  * let's leave it disabled but add an easy hook to compile it back in
  */
 #if 1
-#define assertWeightedPiecesAreSorted(t)
 #define assertReplicationCountIsExact(t)
 #else
 static void
-assertWeightedPiecesAreSorted (Torrent * t)
-{
-    if (!t->endgame)
-    {
-        int i;
-        setComparePieceByWeightTorrent (t);
-        for (i=0; i<t->pieceCount-1; ++i)
-            assert (comparePieceByWeight (&t->pieces[i], &t->pieces[i+1]) <= 0);
-    }
-}
-static void
 assertReplicationCountIsExact (Torrent * t)
 {
     /* This assert might fail due to errors of implementations in other
@@ -1066,72 +1590,72 @@ assertReplicationCountIsExact (Torrent * t)
 static struct weighted_piece *
 pieceListLookup (tr_swarm * s, tr_piece_index_t index)
 {
-  int i;
-
-  for (i=0; i<s->pieceCount; ++i)
-    if (s->pieces[i].index == index)
-      return &s->pieces[i];
+  if ((index < s->piecesSize) && (s->pieces[index].bucket != PIECE_BUCKET_NONE))
+    return &s->pieces[index];
 
   return NULL;
 }
 
+static bool
+pieceIsWanted (const tr_torrent * tor, tr_piece_index_t index)
+{
+  return !tor->info.pieces[index].dnd && !tr_torrentPieceIsComplete (tor, index);
+}
+
 static void
 pieceListRebuild (tr_swarm * s)
 {
   if (!tr_torrentIsSeed (s->tor))
     {
-      tr_piece_index_t i;
+      int i;
+      tr_piece_index_t index;
       tr_piece_index_t * pool;
-      tr_piece_index_t poolCount = 0;
+      int poolCount, oldCount;
       const tr_torrent * tor = s->tor;
       const tr_info * inf = tr_torrentInfo (tor);
-      struct weighted_piece * pieces;
-      int pieceCount;
 
-      /* build the new list */
-      pool = tr_new (tr_piece_index_t, inf->pieceCount);
-      for (i=0; i<inf->pieceCount; ++i)
-        if (!inf->pieces[i].dnd)
-          if (!tr_torrentPieceIsComplete (tor, i))
-            pool[poolCount++] = i;
-      pieceCount = poolCount;
-      pieces = tr_new0 (struct weighted_piece, pieceCount);
-      for (i=0; i<poolCount; ++i)
+      if (s->piecesSize != inf->pieceCount)
         {
-          struct weighted_piece * piece = pieces + i;
-          piece->index = pool[i];
-          piece->requestCount = 0;
-          piece->salt = tr_rand_int_weak (4096);
+          tr_free (s->pieces);
+          s->piecesSize = inf->pieceCount;
+          s->pieces = tr_new0 (struct weighted_piece, s->piecesSize);
+          for (index=0; index<s->piecesSize; ++index)
+            s->pieces[index].bucket = PIECE_BUCKET_NONE;
+          s->pieceCount = 0;
+
+          if (s->pieceBuckets == NULL)
+            s->pieceBuckets = tr_new (struct piece_bucket, PIECE_BUCKET_COUNT);
+          for (i=0; i<PIECE_BUCKET_COUNT; ++i)
+            s->pieceBuckets[i].first = s->pieceBuckets[i].last = PIECE_NONE;
         }
 
-      /* if we already had a list of pieces, merge it into
-       * the new list so we don't lose its requestCounts */
-      if (s->pieces != NULL)
-        {
-          struct weighted_piece * o = s->pieces;
-          struct weighted_piece * oend = o + s->pieceCount;
-          struct weighted_piece * n = pieces;
-          struct weighted_piece * nend = n + pieceCount;
-
-          pieceListSort (s, PIECES_SORTED_BY_INDEX);
-
-          while (o!=oend && n!=nend)
-            {
-              if (o->index < n->index)
-                ++o;
-              else if (o->index > n->index)
-                ++n;
-              else
-                *n++ = *o++;
-            }
+      /* the pieces we already had keep their place and their requestCounts.
+       * the new ones go after them, in random order */
+      pool = tr_new (tr_piece_index_t, inf->pieceCount);
+      poolCount = oldCount = pieceListGetOrder (s, pool);
+      for (index=0; index<inf->pieceCount; ++index)
+        if (s->pieces[index].bucket == PIECE_BUCKET_NONE && pieceIsWanted (tor, index))
+          pool[poolCount++] = index;
 
-          tr_free (s->pieces);
+      for (i=poolCount-1; i>oldCount; --i)
+        {
+          const int j = oldCount + tr_rand_int_weak (i - oldCount + 1);
+          const tr_piece_index_t tmp = pool[i];
+          pool[i] = pool[j];
+          pool[j] = tmp;
         }
 
-      s->pieces = pieces;
-      s->pieceCount = pieceCount;
+      /* forget the ones we don't want anymore */
+      for (i=0; i<oldCount; ++i)
+        {
+          pieceListUnlink (s, pool[i]);
+          if (!pieceIsWanted (tor, pool[i]))
+            s->pieces[pool[i]].requestCount = 0;
+        }
 
-      pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
+      for (i=0; i<poolCount; ++i)
+        if (pieceIsWanted (tor, pool[i]))
+          pieceListAppend (s, pool[i], pieceBucket (s, pool[i]));
 
       /* cleanup */
       tr_free (pool);
@@ -1145,67 +1669,26 @@ pieceListRemovePiece (tr_swarm * s, tr_piece_index_t piece)
 
   if ((p = pieceListLookup (s, piece)))
     {
-      const int pos = p - s->pieces;
-
-      tr_removeElementFromArray (s->pieces,
-                                 pos,
-                                 sizeof (struct weighted_piece),
-                                 s->pieceCount--);
-
-      if (s->pieceCount == 0)
-        {
-          tr_free (s->pieces);
-          s->pieces = NULL;
-        }
+      pieceListUnlink (s, piece);
+      p->requestCount = 0;
     }
 }
 
+/* move the piece to its bucket, if its weight has changed */
 static void
-pieceListResortPiece (tr_swarm * s, struct weighted_piece * p)
+pieceListUpdatePiece (tr_swarm * s, tr_piece_index_t index)
 {
-  int pos;
-  bool isSorted = true;
+  uint16_t bucket;
 
-  if (p == NULL)
+  if (pieceListLookup (s, index) == NULL)
     return;
 
-  /* is the torrent already sorted? */
-  pos = p - s->pieces;
-  setComparePieceByWeightTorrent (s);
-  if (isSorted && (pos > 0) && (comparePieceByWeight (p-1, p) > 0))
-    isSorted = false;
-  if (isSorted && (pos < s->pieceCount - 1) && (comparePieceByWeight (p, p+1) > 0))
-    isSorted = false;
-
-  if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
+  bucket = pieceBucket (s, index);
+  if (bucket != s->pieces[index].bucket)
     {
-      pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
-      isSorted = true;
-    }
-
-  /* if it's not sorted, move it around */
-  if (!isSorted)
-    {
-      bool exact;
-      const struct weighted_piece tmp = *p;
-
-      tr_removeElementFromArray (s->pieces,
-                                 pos,
-                                 sizeof (struct weighted_piece),
-                                 s->pieceCount--);
-
-      pos = tr_lowerBound (&tmp, s->pieces, s->pieceCount,
-                           sizeof (struct weighted_piece),
-                           comparePieceByWeight, &exact);
-
-      memmove (&s->pieces[pos + 1],
-               &s->pieces[pos],
-               sizeof (struct weighted_piece) * (s->pieceCount++ - pos));
-
-      s->pieces[pos] = tmp;
+      pieceListUnlink (s, index);
+      pieceListAppend (s, index, bucket);
     }
-
-  assertWeightedPiecesAreSorted (s);
 }
 
 static void
@@ -1217,7 +1700,7 @@ pieceListRemoveRequest (tr_swarm * s, tr_block_index_t block)
   if (((p = pieceListLookup (s, index))) && (p->requestCount > 0))
     {
       --p->requestCount;
-      pieceListResortPiece (s, p);
+      pieceListUpdatePiece (s, index);
     }
 }
 
@@ -1229,8 +1712,20 @@ pieceListRemoveRequest (tr_swarm * s, tr_block_index_t block)
 ****/
 
 /**
- * Increase the replication count of this piece and sort it if the
- * piece list is already sorted
+ * Move a piece whose replication count was `old' to its new bucket.
+ * Pieces that were and still are in the most common rarity bucket stay put
+ */
+static inline void
+pieceListReplicationChanged (tr_swarm * s, tr_piece_index_t index, uint16_t old)
+{
+  if ((old >= PIECE_RARITY_BUCKETS - 1) && (s->pieceReplication[index] >= PIECE_RARITY_BUCKETS - 1))
+    return;
+
+  pieceListUpdatePiece (s, index);
+}
+
+/**
+ * Increase the replication count of this piece and move it to its new bucket
  */
 static void
 tr_incrReplicationOfPiece (tr_swarm * s, const size_t index)
@@ -1239,11 +1734,7 @@ tr_incrReplicationOfPiece (tr_swarm * s, const size_t index)
   assert (s->pieceReplicationSize == s->tor->info.pieceCount);
 
   /* One more replication of this piece is present in the swarm */
-  ++s->pieceReplication[index];
-
-  /* we only resort the piece if the list is already sorted */
-  if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-    pieceListResortPiece (s, pieceListLookup (s, index));
+  pieceListReplicationChanged (s, index, s->pieceReplication[index]++);
 }
 
 /**
@@ -1260,10 +1751,7 @@ tr_incrReplicationFromBitfield (tr_swarm * s, const tr_bitfield * b)
 
   for (i=0; i<n; ++i)
     if (tr_bitfieldHas (b, i))
-      ++rep[i];
-
-  if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-    invalidatePieceSorting (s);
+      pieceListReplicationChanged (s, i, rep[i]++);
 }
 
 /**
@@ -1279,7 +1767,7 @@ tr_incrReplication (tr_swarm * s)
   assert (s->pieceReplicationSize == s->tor->info.pieceCount);
 
   for (i=0; i<n; ++i)
-    ++s->pieceReplication[i];
+    pieceListReplicationChanged (s, i, s->pieceReplication[i]++);
 }
 
 /**
@@ -1297,29 +1785,134 @@ tr_decrReplicationFromBitfield (tr_swarm * s, const tr_bitfield * b)
   if (tr_bitfieldHasAll (b))
     {
       for (i=0; i<n; ++i)
-        --s->pieceReplication[i];
+        pieceListReplicationChanged (s, i, s->pieceReplication[i]--);
     }
   else if (!tr_bitfieldHasNone (b))
     {
       for (i=0; i<n; ++i)
         if (tr_bitfieldHas (b, i))
-          --s->pieceReplication[i];
+          pieceListReplicationChanged (s, i, s->pieceReplication[i]--);
+    }
+}
+
+/**
+***
+**/
+
+void
+tr_peerMgrRebuildRequests (tr_torrent * tor)
+{
+  assert (tr_isTorrent (tor));
+
+  pieceListRebuild (tor->swarm);
+}
+
+int
+tr_peerMgrGetPieceOrder (const tr_torrent * tor, tr_piece_index_t * setme)
+{
+  assert (tr_isTorrent (tor));
+
+  return pieceListGetOrder (tor->swarm, setme);
+}
+
+/* get the swarm's piece list ready for choosing requests from */
+static void
+prepareNextRequests (tr_swarm * s)
+{
+  /* prep the pieces list */
+  if (s->pieceCount == 0)
+    pieceListRebuild (s);
+
+  if (!replicationExists (s))
+    {
+      replicationNew (s);
+      pieceListRebucket (s);
+    }
+
+  assertReplicationCountIsExact (s);
+
+  updateEndgame (s);
+}
+
+/* add the blocks in piece `index' that we can request from the peer */
+static void
+getPieceRequests (tr_swarm         * s,
+                  tr_peer          * peer,
+                  tr_piece_index_t   index,
+                  int                numwant,
+                  tr_block_index_t * setme,
+                  int              * setmeGot,
+                  bool               get_intervals)
+{
+  tr_block_index_t b;
+  tr_block_index_t first;
+  tr_block_index_t last;
+  int got = *setmeGot;
+  tr_torrent * tor = s->tor;
+  struct weighted_piece * p = &s->pieces[index];
+
+  /* too many of the blocks we already have are waiting to be written */
+  if (tr_ioPieceIsHeldBack (tor, index) || tr_cacheIsHoldingBack (tor->session->cache, tor))
+    return;
+
+  tr_torGetPieceBlockRange (tor, index, &first, &last);
+
+  for (b=first; b<=last && (got<numwant || (get_intervals && setme[2*got-1] == b-1)); ++b)
+    {
+      const struct block_requests * r;
+
+      /* don't request blocks we've already got */
+      if (tr_torrentBlockIsComplete (tor, b))
+        continue;
 
-      if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-        invalidatePieceSorting (s);
-    }
-}
+      /* always add peer if this block has no peers yet */
+      r = getBlockRequestPeers (s, b);
+      if (r != NULL)
+        {
+          /* don't make a second block request until the endgame */
+          if (!s->endgame)
+            continue;
+
+          /* don't have more than two peers requesting this block */
+          if (r->peerCount >= MAX_REQUESTS_PER_BLOCK)
+            continue;
+
+          /* don't send the same request to the same peer twice */
+          if (peer == r->peers[0])
+            continue;
+
+          /* in the endgame allow an additional peer to download a
+             block but only if the peer seems to be handling requests
+             relatively fast */
+          if (peer->pendingReqsToPeer + numwant - got < s->endgame)
+            continue;
+        }
 
-/**
-***
-**/
+      /* update the caller's table */
+      if (!get_intervals)
+        {
+          setme[got++] = b;
+        }
+      /* if intervals are requested two array entries are necessarry:
+         one for the interval's starting block and one for its end block */
+      else if (got && setme[2 * got - 1] == b - 1 && b != first)
+        {
+          /* expand the last interval */
+          ++setme[2 * got - 1];
+        }
+      else
+        {
+          /* begin a new interval */
+          setme[2 * got] = setme[2 * got + 1] = b;
+          ++got;
+        }
 
-void
-tr_peerMgrRebuildRequests (tr_torrent * tor)
-{
-  assert (tr_isTorrent (tor));
+      /* update our own tables */
+      requestListAdd (s, b, peer);
+      ++p->requestCount;
+    }
 
-  pieceListRebuild (tor->swarm);
+  *setmeGot = got;
 }
 
 void
@@ -1332,8 +1925,12 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
 {
   int i;
   int got;
+  int bucket;
+  int bucketCount;
+  int touchedCount;
   tr_swarm * s;
-  struct weighted_piece * pieces;
+  tr_piece_index_t index;
+  tr_piece_index_t * touched;
   const tr_bitfield * const have = &peer->have;
 
   /* sanity clause */
@@ -1344,125 +1941,71 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
   got = 0;
   s = tor->swarm;
 
-  /* prep the pieces list */
-  if (s->pieces == NULL)
-    pieceListRebuild (s);
-
-  if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
-    pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
+  prepareNextRequests (s);
 
-  assertReplicationCountIsExact (s);
-  assertWeightedPiecesAreSorted (s);
+  /* until the endgame, there's nothing left to request
+   * in the pieces whose blocks have all been requested */
+  bucketCount = s->endgame ? PIECE_BUCKET_COUNT : 2 * PIECE_BUCKETS_PER_TIER;
+  touched = tr_new (tr_piece_index_t, numwant);
+  touchedCount = 0;
 
-  updateEndgame (s);
-  pieces = s->pieces;
-  for (i=0; i<s->pieceCount && got<numwant; ++i)
+  for (bucket=0; bucket<bucketCount && got<numwant && s->pieceBuckets!=NULL; ++bucket)
     {
-      struct weighted_piece * p = pieces + i;
-
-      /* if the peer has this piece that we want... */
-      if (tr_bitfieldHas (have, p->index))
+      for (index=s->pieceBuckets[bucket].first; index!=PIECE_NONE && got<numwant; index=s->pieces[index].next)
         {
-          tr_block_index_t b;
-          tr_block_index_t first;
-          tr_block_index_t last;
-          tr_ptrArray peerArr = TR_PTR_ARRAY_INIT;
+          const int oldGot = got;
 
-          tr_torGetPieceBlockRange (tor, p->index, &first, &last);
+          /* if the peer has this piece that we want... */
+          if (tr_bitfieldHas (have, index))
+            getPieceRequests (s, peer, index, numwant, setme, &got, get_intervals);
 
-          for (b=first; b<=last && (got<numwant || (get_intervals && setme[2*got-1] == b-1)); ++b)
-            {
-              int peerCount;
-              tr_peer ** peers;
-
-              /* don't request blocks we've already got */
-              if (tr_torrentBlockIsComplete (tor, b))
-                continue;
-
-              /* always add peer if this block has no peers yet */
-              tr_ptrArrayClear (&peerArr);
-              getBlockRequestPeers (s, b, &peerArr);
-              peers = (tr_peer **) tr_ptrArrayPeek (&peerArr, &peerCount);
-              if (peerCount != 0)
-                {
-                  /* don't make a second block request until the endgame */
-                  if (!s->endgame)
-                    continue;
-
-                  /* don't have more than two peers requesting this block */
-                  if (peerCount > 1)
-                    continue;
-
-                  /* don't send the same request to the same peer twice */
-                  if (peer == peers[0])
-                    continue;
-
-                  /* in the endgame allow an additional peer to download a
-                     block but only if the peer seems to be handling requests
-                     relatively fast */
-                  if (peer->pendingReqsToPeer + numwant - got < s->endgame)
-                    continue;
-                }
+          /* each piece we request from starts at least one more
+           * block or interval, so there's room for it here */
+          if (got != oldGot)
+            touched[touchedCount++] = index;
+        }
+    }
 
-              /* update the caller's table */
-              if (!get_intervals)
-                {
-                  setme[got++] = b;
-                }
-              /* if intervals are requested two array entries are necessarry:
-                 one for the interval's starting block and one for its end block */
-              else if (got && setme[2 * got - 1] == b - 1 && b != first)
-                {
-                  /* expand the last interval */
-                  ++setme[2 * got - 1];
-                }
-              else
-                {
-                  /* begin a new interval */
-                  setme[2 * got] = setme[2 * got + 1] = b;
-                  ++got;
-                }
+  /* The pieces we've just requested blocks from probably belong in other
+   * buckets now. They're moved afterwards so that we don't visit them twice. */
+  for (i=0; i<touchedCount; ++i)
+    pieceListUpdatePiece (s, touched[i]);
 
-              /* update our own tables */
-              requestListAdd (s, b, peer);
-              ++p->requestCount;
-            }
+  tr_free (touched);
+  *numgot = got;
+}
 
-          tr_ptrArrayDestruct (&peerArr, NULL);
-        }
-    }
+void
+tr_peerMgrGetNextFastRequests (tr_torrent             * tor,
+                               tr_peer                * peer,
+                               const tr_piece_index_t * pieces,
+                               int                      pieceCount,
+                               int                      numwant,
+                               tr_block_index_t       * setme,
+                               int                    * numgot)
+{
+  int i;
+  int got = 0;
+  tr_swarm * s = tor->swarm;
+
+  assert (tr_isTorrent (tor));
+  assert (numwant > 0);
+
+  prepareNextRequests (s);
 
-  /* In most cases we've just changed the weights of a small number of pieces.
-   * So rather than qsort ()ing the entire array, it's faster to apply an
-   * adaptive insertion sort algorithm. */
-  if (got > 0)
+  for (i=0; i<pieceCount && got<numwant; ++i)
     {
-      /* not enough requests || last piece modified */
-      if (i == s->pieceCount)
-        --i;
+      const tr_piece_index_t index = pieces[i];
+      const int oldGot = got;
 
-      setComparePieceByWeightTorrent (s);
-      while (--i >= 0)
-        {
-          bool exact;
-
-          /* relative position! */
-          const int newpos = tr_lowerBound (&s->pieces[i], &s->pieces[i + 1],
-                                            s->pieceCount - (i + 1),
-                                            sizeof (struct weighted_piece),
-                                            comparePieceByWeight, &exact);
-          if (newpos > 0)
-            {
-              const struct weighted_piece piece = s->pieces[i];
-              memmove (&s->pieces[i],
-                       &s->pieces[i + 1],
-                       sizeof (struct weighted_piece) * (newpos));
-              s->pieces[i + newpos] = piece;
-            }
-        }
+      /* if the peer has this piece that we want... */
+      if (pieceListLookup (s, index) != NULL && tr_bitfieldHas (&peer->have, index))
+        getPieceRequests (s, peer, index, numwant, setme, &got, false);
+
+      if (got != oldGot)
+        pieceListUpdatePiece (s, index);
     }
 
-  assertWeightedPiecesAreSorted (t);
   *numgot = got;
 }
 
@@ -1471,7 +2014,33 @@ tr_peerMgrDidPeerRequest (const tr_torrent  * tor,
                           const tr_peer     * peer,
                           tr_block_index_t    block)
 {
-  return requestListLookup ((tr_swarm*)tor->swarm, block, peer) != NULL;
+  return requestListHas (tor->swarm, block, peer);
+}
+
+void
+tr_peerMgrAddRequest (tr_torrent * tor, tr_peer * peer, tr_block_index_t block)
+{
+  assert (tr_isTorrent (tor));
+  assert (!requestListHas (tor->swarm, block, peer));
+
+  requestListAdd (tor->swarm, block, peer);
+}
+
+void
+tr_peerMgrRemoveRequest (tr_torrent * tor, const tr_peer * peer, tr_block_index_t block)
+{
+  assert (tr_isTorrent (tor));
+
+  requestListRemove (tor->swarm, block, peer);
+}
+
+int
+tr_peerMgrGetRequestSlot (const tr_torrent * tor, tr_block_index_t block)
+{
+  const tr_swarm * s = tor->swarm;
+  const struct block_requests * r = requestTableFind (s, block);
+
+  return r != NULL ? (int)(r - s->requests) : -1;
 }
 
 /* cancel requests that are too old */
@@ -1501,42 +2070,37 @@ refillUpkeep (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
     while ((tor = tr_torrentNext (mgr->session, tor)))
     {
         tr_swarm * s = tor->swarm;
-        const int n = s->requestCount;
-        if (n > 0)
+        if (s->requestCount > 0)
         {
-            int keepCount = 0;
+            int i, j;
             int cancelCount = 0;
             const struct block_request * it;
             const struct block_request * end;
 
-            for (it=s->requests, end=it+n; it!=end; ++it)
+            for (i=0; i<s->requestSlots; ++i)
             {
-                tr_peerMsgs * msgs = PEER_MSGS(it->peer);
+                const struct block_requests * r = &s->requests[i];
 
-                if ((msgs !=NULL) && (it->sentAt <= too_old) && !tr_peerMsgsIsReadingBlock (msgs, it->block))
-                    cancel[cancelCount++] = *it;
-                else
+                for (j=0; j<r->peerCount; ++j)
                 {
-                    if (it != &s->requests[keepCount])
-                        s->requests[keepCount] = *it;
-                    keepCount++;
+                    tr_peerMsgs * msgs = PEER_MSGS(r->peers[j]);
+
+                    if ((msgs !=NULL) && (r->sentAt[j] <= too_old) && !tr_peerMsgsIsReadingBlock (msgs, r->block))
+                    {
+                        cancel[cancelCount].block = r->block;
+                        cancel[cancelCount].peer = r->peers[j];
+                        cancel[cancelCount].sentAt = r->sentAt[j];
+                        ++cancelCount;
+                    }
                 }
             }
 
-            /* prune out the ones we aren't keeping */
-            s->requestCount = keepCount;
-
-            /* send cancel messages for all the "cancel" ones */
+            /* prune them out and send cancel messages */
             for (it=cancel, end=it+cancelCount; it!=end; ++it)
             {
-              tr_peerMsgs * msgs = PEER_MSGS(it->peer);
-
-              if (msgs != NULL)
-                {
-                  tr_historyAdd (&it->peer->cancelsSentToPeer, now, 1);
-                  tr_peerMsgsCancel (msgs, it->block);
-                  decrementPendingReqCount (it);
-                }
+              requestListRemove (s, it->block, it->peer);
+              tr_historyAdd (&it->peer->cancelsSentToPeer, now, 1);
+              tr_peerMsgsCancel (PEER_MSGS(it->peer), it->block);
             }
 
             /* decrement the pending request counts for the timed-out blocks */
@@ -1568,8 +2132,7 @@ addStrike (tr_swarm * s, tr_peer * peer)
 static void
 peerSuggestedPiece (tr_swarm           * s UNUSED,
                     tr_peer            * peer UNUSED,
-                    tr_piece_index_t     pieceIndex UNUSED,
-                    int                  isFastAllowed UNUSED)
+                    tr_piece_index_t     pieceIndex UNUSED)
 {
 #if 0
     assert (t);
@@ -1588,8 +2151,8 @@ peerSuggestedPiece (tr_swarm           * s UNUSED,
     if (!tr_bitfieldHas (peer->have, pieceIndex))
         return;
 
-    /* don't ask for it if we're choked and it's not fast */
-    if (!isFastAllowed && peer->clientIsChoked)
+    /* don't ask for it if we're choked */
+    if (peer->clientIsChoked)
         return;
 
     /* request the blocks that we don't have in this piece */
@@ -1627,12 +2190,13 @@ removeRequestFromTables (tr_swarm * s, tr_block_index_t block, const tr_peer * p
 static void
 peerDeclinedAllRequests (tr_swarm * s, const tr_peer * peer)
 {
-  int i, n;
+  int i, j, n;
   tr_block_index_t * blocks = tr_new (tr_block_index_t, s->requestCount);
 
-  for (i=n=0; i<s->requestCount; ++i)
-    if (peer == s->requests[i].peer)
-      blocks[n++] = s->requests[i].block;
+  for (i=n=0; i<s->requestSlots; ++i)
+    for (j=0; j<s->requests[i].peerCount; ++j)
+      if (peer == s->requests[i].peers[j])
+        blocks[n++] = s->requests[i].block;
 
   for (i=0; i<n; ++i)
     removeRequestFromTables (s, blocks[i], peer);
@@ -1646,13 +2210,15 @@ cancelAllRequestsForBlock (tr_swarm          * s,
                            tr_peer           * no_notify)
 {
   int i;
-  int peerCount;
-  tr_peer ** peers;
-  tr_ptrArray peerArr;
+  int peerCount = 0;
+  tr_peer * peers[MAX_REQUESTS_PER_BLOCK];
+  const struct block_requests * r = getBlockRequestPeers (s, block);
+
+  /* copy them, since removing the requests changes the table */
+  if (r != NULL)
+    for (peerCount=0; peerCount<r->peerCount; ++peerCount)
+      peers[peerCount] = r->peers[peerCount];
 
-  peerArr = TR_PTR_ARRAY_INIT;
-  getBlockRequestPeers (s, block, &peerArr);
-  peers = (tr_peer **) tr_ptrArrayPeek (&peerArr, &peerCount);
   for (i=0; i<peerCount; ++i)
     {
       tr_peer * p = peers[i];
@@ -1665,8 +2231,6 @@ cancelAllRequestsForBlock (tr_swarm          * s,
 
       removeRequestFromTables (s, block, p);
     }
-
-  tr_ptrArrayDestruct (&peerArr, NULL);
 }
 
 void
@@ -1792,11 +2356,12 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vs)
         break;
 
       case TR_PEER_CLIENT_GOT_SUGGEST:
-        peerSuggestedPiece (s, peer, e->pieceIndex, false);
+        peerSuggestedPiece (s, peer, e->pieceIndex);
         break;
 
       case TR_PEER_CLIENT_GOT_ALLOWED_FAST:
-        peerSuggestedPiece (s, peer, e->pieceIndex, true);
+        /* peer-msgs keeps track of these itself, and asks
+           tr_peerMgrGetNextFastRequests () for them while choked */
         break;
 
       case TR_PEER_CLIENT_GOT_BLOCK:
@@ -1806,8 +2371,11 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vs)
           const tr_block_index_t block = _tr_block (tor, p, e->offset);
           cancelAllRequestsForBlock (s, block, peer);
           tr_historyAdd (&peer->blocksSentToClient, tr_time(), 1);
-          pieceListResortPiece (s, pieceListLookup (s, p));
           tr_torrentGotBlock (tor, block);
+
+          /* the piece's weight depends on its missing blocks,
+           * so it's moved after the block has been counted */
+          pieceListUpdatePiece (s, p);
           break;
         }
 
@@ -1832,6 +2400,15 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vs)
   swarmUnlock (s);
 }
 
+void
+tr_peerMgrPeerEvent (tr_peer * peer, const tr_peer_event * event)
+{
+  assert (peer != NULL);
+  assert (peer->swarm != NULL);
+
+  peerCallbackFunc (peer, event, peer->swarm);
+}
+
 static int
 getDefaultShelfLife (uint8_t from)
 {
@@ -1850,6 +2427,10 @@ getDefaultShelfLife (uint8_t from)
     }
 }
 
+static void atomScheduleNextTry (struct peer_atom * atom, const time_t now);
+static int getMaxAtomPoolSize (const tr_swarm * s);
+static void pruneAtomPool (tr_swarm * s);
+
 static void
 ensureAtomExists (tr_swarm          * s,
                   const tr_address  * addr,
@@ -1868,16 +2449,22 @@ ensureAtomExists (tr_swarm          * s,
   if (a == NULL)
     {
       const int jitter = tr_rand_int_weak (60*10);
-      a = tr_new0 (struct peer_atom, 1);
-      a->addr = *addr;
+
+      /* if a lot of peers are coming in, prune now
+         instead of waiting for atomPulse () to do it */
+      if (s->pool.count >= getMaxAtomPoolSize (s))
+        pruneAtomPool (s);
+
+      a = atomPoolAdd (&s->pool, addr);
       a->port = port;
       a->flags = flags;
       a->fromFirst = from;
       a->fromBest = from;
       a->shelf_date = tr_time () + getDefaultShelfLife (from) + jitter;
       a->blocklisted = -1;
+      a->swarm = s;
       atomSetSeedProbability (a, seedProbability);
-      tr_ptrArrayInsertSorted (&s->pool, a, compareAtomsByAddress);
+      atomScheduleNextTry (a, tr_time ());
 
       tordbg (s, "got a new atom: %s", tr_atomAddrStr (a));
     }
@@ -1989,6 +2576,8 @@ myHandshakeDoneCB (tr_handshake  * handshake,
                   tordbg (s, "marking peer %s as unreachable... numFails is %d", tr_atomAddrStr (atom), (int)atom->numFails);
                   atom->flags2 |= MYFLAG_UNREACHABLE;
                 }
+
+              atomScheduleNextTry (atom, tr_time ());
             }
         }
     }
@@ -2128,13 +2717,11 @@ tr_peerMgrAddPex (tr_torrent * tor, uint8_t from,
 void
 tr_peerMgrMarkAllAsSeeds (tr_torrent * tor)
 {
+  int i;
   tr_swarm * s = tor->swarm;
-  const int n = tr_ptrArraySize (&s->pool);
-  struct peer_atom ** it = (struct peer_atom**) tr_ptrArrayBase (&s->pool);
-  struct peer_atom ** end = it + n;
 
-  while (it != end)
-    atomSetSeed (s, *it++);
+  for (i=0; i<s->pool.count; ++i)
+    atomSetSeed (s, s->pool.atoms[i]);
 }
 
 tr_pex *
@@ -2233,6 +2820,8 @@ tr_peerMgrGotBadPiece (tr_torrent * tor, tr_piece_index_t pieceIndex)
         }
     }
 
+  /* its blocks are missing again, so it's no longer in the last tier */
+  pieceListUpdatePiece (s, pieceIndex);
 
   tr_announcerAddBytes (tor, TR_ANN_CORRUPT, byteCount);
 }
@@ -2333,8 +2922,8 @@ tr_peerMgrGetPeers (tr_torrent   * tor,
   else /* TR_PEERS_INTERESTING */
     {
       int i;
-      struct peer_atom ** atomBase = (struct peer_atom**) tr_ptrArrayBase (&s->pool);
-      n = tr_ptrArraySize (&s->pool);
+      struct peer_atom ** atomBase = s->pool.atoms;
+      n = s->pool.count;
       atoms = tr_new (struct peer_atom *, n);
       for (i=0; i<n; ++i)
         if (isAtomInteresting (tor, atomBase[i]))
@@ -2417,7 +3006,6 @@ tr_peerMgrStartTorrent (tr_torrent * tor)
 
   s->isRunning = true;
   s->maxPeers = tor->maxConnectedPeers;
-  s->pieceSortState = PIECES_UNSORTED;
 
   rechokePulse (0, 0, s->manager);
 }
@@ -2430,7 +3018,6 @@ stopSwarm (tr_swarm * swarm)
   swarm->isRunning = false;
 
   replicationFree (swarm);
-  invalidatePieceSorting (swarm);
 
   removeAllPeers (swarm);
 
@@ -2576,6 +3163,8 @@ tr_swarmGetStats (const tr_swarm * swarm, tr_swarm_stats * setme)
   assert (setme != NULL);
 
   *setme = swarm->stats;
+  setme->knownPeerCount = swarm->pool.count;
+  setme->knownPeerBytes = atomPoolBytes (&swarm->pool);
 }
 
 void
@@ -3300,6 +3889,16 @@ getReconnectIntervalSecs (const struct peer_atom * atom, const time_t now)
   return sec;
 }
 
+/* wait until the atom's reconnect interval has passed
+ * before looking at it as a connection candidate again */
+static void
+atomScheduleNextTry (struct peer_atom * atom, const time_t now)
+{
+  const time_t when = atom->time + getReconnectIntervalSecs (atom, now);
+
+  atomHeapPush (&atom->swarm->manager->waitingAtoms, atom, (uint64_t) MAX (when, 0));
+}
+
 static void
 removePeer (tr_swarm * s, tr_peer * peer)
 {
@@ -3309,6 +3908,7 @@ removePeer (tr_swarm * s, tr_peer * peer)
   assert (atom);
 
   atom->time = tr_time ();
+  atomScheduleNextTry (atom, atom->time);
 
   tr_ptrArrayRemoveSortedPointer (&s->peers, peer, peerCompare);
   --s->stats.peerCount;
@@ -3619,9 +4219,12 @@ bandwidthPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
   /* FIXME: this next line probably isn't necessary... */
   pumpAllPeers (mgr);
 
-  /* allocate bandwidth to the peers */
-  tr_bandwidthAllocate (&session->bandwidth, TR_UP, BANDWIDTH_PERIOD_MSEC);
-  tr_bandwidthAllocate (&session->bandwidth, TR_DOWN, BANDWIDTH_PERIOD_MSEC);
+  /* allocate bandwidth to the peers, sending the uTP packets
+     that it lets out together */
+  tr_udpBeginBatch (session);
+  tr_bandwidthAllocate (&session->bandwidth, TR_UP, BANDWIDTH_PERIOD_MSEC, session->bandwidthQuantum);
+  tr_bandwidthAllocate (&session->bandwidth, TR_DOWN, BANDWIDTH_PERIOD_MSEC, session->bandwidthQuantum);
+  tr_udpEndBatch (session);
 
   /* torrent upkeep */
   tor = NULL;
@@ -3660,18 +4263,6 @@ bandwidthPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
 ****
 ***/
 
-static int
-compareAtomPtrsByAddress (const void * va, const void *vb)
-{
-  const struct peer_atom * a = * (const struct peer_atom* const *) va;
-  const struct peer_atom * b = * (const struct peer_atom* const *) vb;
-
-  assert (tr_isAtom (a));
-  assert (tr_isAtom (b));
-
-  return tr_address_compare (&a->addr, &b->addr);
-}
-
 /* best come first, worst go last */
 static int
 compareAtomPtrsByShelfDate (const void * va, const void *vb)
@@ -3705,65 +4296,71 @@ getMaxAtomCount (const tr_torrent * tor)
   return MIN (50, tor->maxConnectedPeers * 3);
 }
 
+/* how big the pool may grow between atomPulse ()s. The atoms in use
+ * are never pruned, so leave room for them on top of getMaxAtomCount () */
+static int
+getMaxAtomPoolSize (const tr_swarm * s)
+{
+  return getMaxAtomCount (s->tor) * 2
+       + tr_ptrArraySize (&s->peers)
+       + tr_ptrArraySize (&s->outgoingHandshakes);
+}
+
 static void
-atomPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
+pruneAtomPool (tr_swarm * s)
 {
-  tr_torrent * tor = NULL;
-  tr_peerMgr * mgr = vmgr;
-  managerLock (mgr);
+  const int atomCount = s->pool.count;
+  const int maxAtomCount = getMaxAtomCount (s->tor);
 
-  while ((tor = tr_torrentNext (mgr->session, tor)))
+  if (atomCount > maxAtomCount) /* we've got too many atoms... time to prune */
     {
-      int atomCount;
-      tr_swarm * s = tor->swarm;
-      const int maxAtomCount = getMaxAtomCount (tor);
-      struct peer_atom ** atoms = (struct peer_atom**) tr_ptrArrayPeek (&s->pool, &atomCount);
+      int i;
+      int keepCount = 0;
+      int testCount = 0;
+      struct peer_atom ** test = tr_new (struct peer_atom*, atomCount);
 
-      if (atomCount > maxAtomCount) /* we've got too many atoms... time to prune */
+      /* keep the ones that are in use */
+      for (i=0; i<atomCount; ++i)
         {
-          int i;
-          int keepCount = 0;
-          int testCount = 0;
-          struct peer_atom ** keep = tr_new (struct peer_atom*, atomCount);
-          struct peer_atom ** test = tr_new (struct peer_atom*, atomCount);
+          struct peer_atom * atom = s->pool.atoms[i];
+          if (peerIsInUse (s, atom))
+            ++keepCount;
+          else
+            test[testCount++] = atom;
+        }
 
-          /* keep the ones that are in use */
-          for (i=0; i<atomCount; ++i)
-            {
-              struct peer_atom * atom = atoms[i];
-              if (peerIsInUse (s, atom))
-                keep[keepCount++] = atom;
-              else
-                test[testCount++] = atom;
-            }
+      /* if there's room, keep the best of what's left */
+      i = 0;
+      if (keepCount < maxAtomCount)
+        {
+          qsort (test, testCount, sizeof (struct peer_atom *), compareAtomPtrsByShelfDate);
+          i = MIN (testCount, maxAtomCount - keepCount);
+          keepCount += i;
+        }
 
-          /* if there's room, keep the best of what's left */
-          i = 0;
-          if (keepCount < maxAtomCount)
-            {
-              qsort (test, testCount, sizeof (struct peer_atom *), compareAtomPtrsByShelfDate);
-              while (i<testCount && keepCount<maxAtomCount)
-                keep[keepCount++] = test[i++];
-            }
+      /* free the culled atoms */
+      while (i<testCount)
+        {
+          atomHeapRemove (test[i]);
+          atomPoolRemove (&s->pool, test[i++]);
+        }
 
-          /* free the culled atoms */
-          while (i<testCount)
-            tr_free (test[i++]);
+      tordbg (s, "max atom count is %d... pruned from %d to %d\n", maxAtomCount, atomCount, keepCount);
 
-          /* rebuild Torrent.pool with what's left */
-          tr_ptrArrayDestruct (&s->pool, NULL);
-          s->pool = TR_PTR_ARRAY_INIT;
-          qsort (keep, keepCount, sizeof (struct peer_atom *), compareAtomPtrsByAddress);
-          for (i=0; i<keepCount; ++i)
-            tr_ptrArrayAppend (&s->pool, keep[i]);
+      /* cleanup */
+      tr_free (test);
+    }
+}
 
-          tordbg (s, "max atom count is %d... pruned from %d to %d\n", maxAtomCount, atomCount, keepCount);
+static void
+atomPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
+{
+  tr_torrent * tor = NULL;
+  tr_peerMgr * mgr = vmgr;
+  managerLock (mgr);
 
-          /* cleanup */
-          tr_free (test);
-          tr_free (keep);
-        }
-    }
+  while ((tor = tr_torrentNext (mgr->session, tor)))
+    pruneAtomPool (tor->swarm);
 
   tr_timerAddMsec (mgr->atomTimer, ATOM_PERIOD_MSEC);
   managerUnlock (mgr);
@@ -3802,13 +4399,6 @@ isPeerCandidate (const tr_torrent * tor, struct peer_atom * atom, const time_t n
   return true;
 }
 
-struct peer_candidate
-{
-  uint64_t score;
-  tr_torrent * tor;
-  struct peer_atom * atom;
-};
-
 static bool
 torrentWasRecentlyStarted (const tr_torrent * tor)
 {
@@ -3877,131 +4467,114 @@ getPeerCandidateScore (const tr_torrent * tor, const struct peer_atom * atom, ui
   return score;
 }
 
-static int
-comparePeerCandidates (const void * va, const void * vb)
+/* does this swarm want any more outgoing connections? */
+static bool
+swarmWantsCandidates (const tr_swarm * s, const uint64_t now_msec)
 {
-  int ret;
-  const struct peer_candidate * a = va;
-  const struct peer_candidate * b = vb;
+  const tr_torrent * tor = s->tor;
 
-  if (a->score < b->score)
-    ret = -1;
-  else if (a->score > b->score)
-    ret = 1;
-  else
-    ret = 0;
+  if (!s->isRunning)
+    return false;
 
-  return ret;
-}
+  /* if we've already got enough peers in this torrent... */
+  if (tr_torrentGetPeerLimit (tor) <= tr_ptrArraySize (&s->peers))
+    return false;
 
-/* Partial sorting -- selecting the k best candidates
-   Adapted from http://en.wikipedia.org/wiki/Selection_algorithm */
-static void
-selectPeerCandidates (struct peer_candidate * candidates, int candidate_count, int select_count)
-{
-  tr_quickfindFirstK (candidates,
-                      candidate_count,
-                      sizeof(struct peer_candidate),
-                      comparePeerCandidates,
-                      select_count);
+  /* if we've already got enough speed in this torrent... */
+  if (tr_torrentIsSeed (tor) && isBandwidthMaxedOut (&tor->bandwidth, now_msec, TR_UP))
+    return false;
+
+  return true;
 }
 
-#ifndef NDEBUG
-static bool
-checkBestScoresComeFirst (const struct peer_candidate * candidates, int n, int k)
+/**
+ * Pop the best atom we might want to connect to,
+ * or NULL if there aren't any.
+ *
+ * Atoms aren't rescored when their torrent's state changes, so the ones
+ * that come out of readyAtoms are checked again here and put back where
+ * they belong if they've changed.
+ */
+static struct peer_atom *
+popPeerCandidate (tr_peerMgr * mgr, const time_t now, const uint64_t now_msec)
 {
-  int i;
-  uint64_t worstFirstScore = 0;
-  const int x = MIN (n, k) - 1;
+  struct peer_atom * atom;
+
+  while ((atom = atomHeapPop (&mgr->readyAtoms)))
+    {
+      tr_swarm * s = atom->swarm;
+      const uint8_t salt = atom->candidateKey & 0xff;
+      uint64_t score;
 
-  for (i=0; i<x; i++)
-    if (worstFirstScore < candidates[i].score)
-      worstFirstScore = candidates[i].score;
+      if (!swarmWantsCandidates (s, now_msec))
+        {
+          atomHeapPush (&s->parkedAtoms, atom, atom->candidateKey);
+          if (!s->isParked)
+            {
+              s->isParked = true;
+              tr_ptrArrayInsertSorted (&mgr->parkedSwarms, s, swarmCompare);
+            }
+          continue;
+        }
 
-  for (i=0; i<x; i++)
-    assert (candidates[i].score <= worstFirstScore);
+      if (!isPeerCandidate (s->tor, atom, now))
+        {
+          /* banned atoms aren't candidates ever again */
+          if ((atom->flags2 & MYFLAG_BANNED) == 0)
+            {
+              if ((now - atom->time) < getReconnectIntervalSecs (atom, now))
+                atomScheduleNextTry (atom, now);
+              else
+                atomHeapPush (&mgr->waitingAtoms, atom, (uint64_t) (now + CANDIDATE_RECHECK_SECS));
+            }
+          continue;
+        }
 
-  for (i=x+1; i<n; i++)
-    assert (candidates[i].score >= worstFirstScore);
+      score = getPeerCandidateScore (s->tor, atom, salt);
+      if (score != atom->candidateKey)
+        {
+          atomHeapPush (&mgr->readyAtoms, atom, score);
+          continue;
+        }
 
-  return true;
+      break;
+    }
+
+  return atom;
 }
-#endif /* NDEBUG */
 
-/** @return an array of all the atoms we might want to connect to */
-static struct peer_candidate*
-getPeerCandidates (tr_session * session, int * candidateCount, int max)
+static void
+updatePeerCandidates (tr_peerMgr * mgr, const time_t now, const uint64_t now_msec)
 {
-  int atomCount;
-  int peerCount;
-  tr_torrent * tor;
-  struct peer_candidate * candidates;
-  struct peer_candidate * walk;
-  const time_t now = tr_time ();
-  const uint64_t now_msec = tr_time_msec ();
-  /* leave 5% of connection slots for incoming connections -- ticket #2609 */
-  const int maxCandidates = tr_sessionGetPeerLimit (session) * 0.95;
-
-  /* count how many peers and atoms we've got */
-  tor= NULL;
-  atomCount = 0;
-  peerCount = 0;
-  while ((tor = tr_torrentNext (session, tor)))
-    {
-      atomCount += tr_ptrArraySize (&tor->swarm->pool);
-      peerCount += tr_ptrArraySize (&tor->swarm->peers);
-    }
+  int i;
+  struct peer_atom * atom;
 
-  /* don't start any new handshakes if we're full up */
-  if (maxCandidates <= peerCount)
+  /* the atoms whose reconnect interval has passed are ready to be scored */
+  while ((atom = atomHeapPeek (&mgr->waitingAtoms)) && atom->candidateKey <= (uint64_t) now)
     {
-      *candidateCount = 0;
-      return NULL;
+      const uint8_t salt = tr_rand_int_weak (256);
+      atomHeapPush (&mgr->readyAtoms, atom, getPeerCandidateScore (atom->swarm->tor, atom, salt));
     }
 
-  /* allocate an array of candidates */
-  walk = candidates = tr_new (struct peer_candidate, atomCount);
-
-  /* populate the candidate array */
-  tor = NULL;
-  while ((tor = tr_torrentNext (session, tor)))
+  /* bring back the atoms of swarms that have room for them again.
+   * A seed's room depends on its upload speed, so this can't wait
+   * for the swarm to say it has some */
+  for (i=0; i<tr_ptrArraySize (&mgr->parkedSwarms); )
     {
-      int i, nAtoms;
-      struct peer_atom ** atoms;
-
-      if (!tor->swarm->isRunning)
-        continue;
-
-      /* if we've already got enough peers in this torrent... */
-      if (tr_torrentGetPeerLimit (tor) <= tr_ptrArraySize (&tor->swarm->peers))
-        continue;
-
-      /* if we've already got enough speed in this torrent... */
-      if (tr_torrentIsSeed (tor) && isBandwidthMaxedOut (&tor->bandwidth, now_msec, TR_UP))
-        continue;
+      tr_swarm * s = tr_ptrArrayNth (&mgr->parkedSwarms, i);
 
-      atoms = (struct peer_atom**) tr_ptrArrayPeek (&tor->swarm->pool, &nAtoms);
-      for (i=0; i<nAtoms; ++i)
+      if (s->parkedAtoms.count > 0 && !swarmWantsCandidates (s, now_msec))
         {
-          struct peer_atom * atom = atoms[i];
-
-          if (isPeerCandidate (tor, atom, now))
-            {
-              const uint8_t salt = tr_rand_int_weak (1024);
-              walk->tor = tor;
-              walk->atom = atom;
-              walk->score = getPeerCandidateScore (tor, atom, salt);
-              ++walk;
-            }
+          ++i;
+          continue;
         }
-    }
 
-  *candidateCount = walk - candidates;
-  if (walk != candidates)
-    selectPeerCandidates (candidates, walk-candidates, max);
+      while ((atom = atomHeapPop (&s->parkedAtoms)))
+        atomHeapPush (&mgr->readyAtoms, atom, atom->candidateKey);
 
-  assert (checkBestScoresComeFirst (candidates, *candidateCount, max));
-  return candidates;
+      s->isParked = false;
+      tr_ptrArrayRemove (&mgr->parkedSwarms, i);
+    }
 }
 
 static void
@@ -4052,33 +4625,73 @@ initiateConnection (tr_peerMgr * mgr, tr_swarm * s, struct peer_atom * atom)
 
   atom->lastConnectionAttemptAt = now;
   atom->time = now;
+  atomScheduleNextTry (atom, now);
 }
 
 static void
-initiateCandidateConnection (tr_peerMgr * mgr, struct peer_candidate * c)
+initiateCandidateConnection (tr_peerMgr * mgr, struct peer_atom * atom)
 {
 #if 0
   fprintf (stderr, "Starting an OUTGOING connection with %s - [%s] seedProbability==%d; %s, %s\n",
-           tr_atomAddrStr (c->atom),
-           tr_torrentName (c->tor),
-           (int)c->atom->seedProbability,
-           tr_torrentIsPrivate (c->tor) ? "private" : "public",
-           tr_torrentIsSeed (c->tor) ? "seed" : "downloader");
+           tr_atomAddrStr (atom),
+           tr_torrentName (atom->swarm->tor),
+           (int)atom->seedProbability,
+           tr_torrentIsPrivate (atom->swarm->tor) ? "private" : "public",
+           tr_torrentIsSeed (atom->swarm->tor) ? "seed" : "downloader");
 #endif
 
-  initiateConnection (mgr, c->tor->swarm, c->atom);
+  initiateConnection (mgr, atom->swarm, atom);
 }
 
 static void
 makeNewPeerConnections (struct tr_peerMgr * mgr, const int max)
 {
-  int i, n;
-  struct peer_candidate * candidates;
+  int i;
+  int peerCount;
+  tr_torrent * tor;
+  struct peer_atom * atom;
+  const time_t now = tr_time ();
+  const uint64_t now_msec = tr_time_msec ();
+  /* leave 5% of connection slots for incoming connections -- ticket #2609 */
+  const int maxCandidates = tr_sessionGetPeerLimit (mgr->session) * 0.95;
+
+  /* count how many peers we've got */
+  tor = NULL;
+  peerCount = 0;
+  while ((tor = tr_torrentNext (mgr->session, tor)))
+    peerCount += tr_ptrArraySize (&tor->swarm->peers);
+
+  /* don't start any new handshakes if we're full up */
+  if (maxCandidates <= peerCount)
+    return;
+
+  updatePeerCandidates (mgr, now, now_msec);
+
+  for (i=0; i<max && (atom = popPeerCandidate (mgr, now, now_msec)); ++i)
+    initiateCandidateConnection (mgr, atom);
+}
+
+int
+tr_peerMgrGetCandidateCount (tr_peerMgr * manager, int * setme_parked)
+{
+  int i;
+  int parked = 0;
+  int count;
 
-  candidates = getPeerCandidates (mgr->session, &n, max);
+  managerLock (manager);
+
+  for (i=0; i<tr_ptrArraySize (&manager->parkedSwarms); ++i)
+    {
+      const tr_swarm * s = tr_ptrArrayNth (&manager->parkedSwarms, i);
+      parked += s->parkedAtoms.count;
+    }
 
-  for (i=0; i<n && i<max; ++i)
-    initiateCandidateConnection (mgr, &candidates[i]);
+  count = manager->waitingAtoms.count + manager->readyAtoms.count + parked;
 
-  tr_free (candidates);
+  managerUnlock (manager);
+
+  if (setme_parked != NULL)
+    *setme_parked = parked;
+
+  return count;
 }
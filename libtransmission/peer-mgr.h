@@ -97,6 +97,15 @@ void         tr_peerMgrGetNextRequests      (tr_torrent          * torrent,
                                              int                 * numgot,
                                              bool                  get_intervals);
 
+/* like tr_peerMgrGetNextRequests (), but only from the given pieces */
+void         tr_peerMgrGetNextFastRequests  (tr_torrent             * torrent,
+                                             tr_peer                * peer,
+                                             const tr_piece_index_t * pieces,
+                                             int                      pieceCount,
+                                             int                      numwant,
+                                             tr_block_index_t       * setme,
+                                             int                    * numgot);
+
 bool         tr_peerMgrDidPeerRequest       (const tr_torrent    * torrent,
                                              const tr_peer       * peer,
                                              tr_block_index_t      block);
@@ -183,6 +192,32 @@ void         tr_peerMgrGotBadPiece          (tr_torrent         * tor,
 void         tr_peerMgrPieceCompleted       (tr_torrent         * tor,
                                              tr_piece_index_t     pieceIndex);
 
+/** @brief hand the peer manager an event as if `peer' had sent it (for tests) */
+void         tr_peerMgrPeerEvent            (tr_peer            * peer,
+                                             const tr_peer_event * event);
+
+/** @brief copy the pieces we want, in the order we'd request them (for tests) */
+int          tr_peerMgrGetPieceOrder        (const tr_torrent   * tor,
+                                             tr_piece_index_t   * setme);
+
+/** @brief add a request to the request table, but not to its piece's count (for tests) */
+void         tr_peerMgrAddRequest           (tr_torrent         * tor,
+                                             tr_peer            * peer,
+                                             tr_block_index_t     block);
+
+/** @brief remove a request added by tr_peerMgrAddRequest () (for tests) */
+void         tr_peerMgrRemoveRequest        (tr_torrent         * tor,
+                                             const tr_peer      * peer,
+                                             tr_block_index_t     block);
+
+/** @brief the request table slot that a block is in, or -1 (for tests) */
+int          tr_peerMgrGetRequestSlot       (const tr_torrent   * tor,
+                                             tr_block_index_t     block);
+
+/** @brief how many atoms are waiting, ready or parked as connection candidates (for tests) */
+int          tr_peerMgrGetCandidateCount    (tr_peerMgr         * manager,
+                                             int                * setme_parked);
+
 
 
 /* @} */
@@ -9,15 +9,15 @@
 
 #include <stdio.h>
 #include "transmission.h"
+#include "net.h" /* tr_address_from_string () */
 #include "peer-msgs.h"
 #include "utils.h"
 
 #include "libtransmission-test.h"
 
-int
-main (void)
+static int
+test_allowed_set (void)
 {
-#if 0
     uint32_t           i;
     uint8_t            infohash[SHA_DIGEST_LENGTH];
     struct tr_address  addr;
@@ -27,23 +27,42 @@ main (void)
     tr_piece_index_t pieces[] = { 1059, 431, 808, 1217, 287, 376, 1188, 353, 508 };
     tr_piece_index_t buf[16];
 
+    /* the example from BEP 6 */
     for (i = 0; i < SHA_DIGEST_LENGTH; ++i)
         infohash[i] = 0xaa;
     tr_address_from_string (&addr, "80.4.4.200");
 
     numwant = 7;
     numgot = tr_generateAllowedSet (buf, numwant, pieceCount, infohash, &addr);
-    check (numgot == numwant);
+    check_uint_eq (numwant, numgot);
     for (i=0; i<numgot; ++i)
-        check (buf[i] == pieces[i]);
+        check_uint_eq (pieces[i], buf[i]);
 
     numwant = 9;
     numgot = tr_generateAllowedSet (buf, numwant, pieceCount, infohash, &addr);
-    check (numgot == numwant);
+    check_uint_eq (numwant, numgot);
+    for (i=0; i<numgot; ++i)
+        check_uint_eq (pieces[i], buf[i]);
+
+    /* only the first three octets of the address matter */
+    tr_address_from_string (&addr, "80.4.4.1");
+    numgot = tr_generateAllowedSet (buf, numwant, pieceCount, infohash, &addr);
+    check_uint_eq (numwant, numgot);
     for (i=0; i<numgot; ++i)
-        check (buf[i] == pieces[i]);
-#endif
+        check_uint_eq (pieces[i], buf[i]);
+
+    /* there's no allowed fast set for IPv6 peers */
+    tr_address_from_string (&addr, "2001:db8::1");
+    numgot = tr_generateAllowedSet (buf, numwant, pieceCount, infohash, &addr);
+    check_uint_eq (0, numgot);
 
     return 0;
 }
 
+int
+main (void)
+{
+    const testFunc tests[] = { test_allowed_set };
+
+    return runTests (tests, NUM_TESTS (tests));
+}
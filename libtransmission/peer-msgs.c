@@ -20,7 +20,9 @@
 #include "transmission.h"
 #include "cache.h"
 #include "completion.h"
+#include "disk-io.h"
 #include "file.h"
+#include "inout.h" /* tr_ioCanReadToBuffer () */
 #include "log.h"
 #include "peer-io.h"
 #include "peer-mgr.h"
@@ -80,6 +82,12 @@ enum
 
   METADATA_REQQ           = 64,
 
+  /* how many metadata pieces to keep requested from a peer */
+  METADATA_PIPELINE_SIZE  = 16,
+
+  /* how long to wait for a metadata piece before giving up on it */
+  METADATA_REQUEST_TIMEOUT_SECS = 5,
+
   MAGIC_NUMBER            = 21549,
 
   /* used in lowering the outMessages queue period */
@@ -90,9 +98,33 @@ enum
   /* number of pieces we'll allow in our fast set */
   MAX_FAST_SET_SIZE = 3,
 
+  /* number of pieces we'll remember from a peer's fast set */
+  MAX_CLIENT_FAST_SET_SIZE = 16,
+
+  /* how many blocks to keep requested from a peer's fast set while choked */
+  FAST_REQUEST_COUNT = 4,
+
   /* how many blocks to keep prefetched per peer */
   PREFETCH_SIZE = 18,
 
+  /* how far down a peer's requests to look for a block that's in the cache */
+  CACHED_REQUEST_WINDOW = 16,
+
+  /* number of pieces in the cache we'll remember suggesting to a peer */
+  MAX_SUGGEST_SET_SIZE = 16,
+
+  /* how many pieces to suggest to a peer at a time, and how often */
+  SUGGEST_BATCH_SIZE = 4,
+  SUGGEST_INTERVAL_SECS = 10,
+
+  /* how many blocks we'll read from disk for a peer at the same time */
+  MAX_PENDING_BLOCK_READS = 8,
+
+  /* blocks are only sent as file segments while less than this many
+     blocks are waiting in the peer's output, so that a fast peer's
+     big output buffer can't hold hundreds of files open */
+  MAX_FILE_SEGMENT_BLOCKS = 4,
+
   /* when we're making requests from another peer,
      batch them together to send enough requests to
      meet our bandwidth goals for the next N seconds */
@@ -193,12 +225,24 @@ struct tr_peerMsgs
   bool clientSentLtepHandshake;
   bool peerSentLtepHandshake;
 
-  /*bool haveFastSet;*/
+  bool haveFastSet;
+
+  /* for the time-to-first-byte stats */
+  bool clientGotPieceData;
+  bool clientSentPieceData;
 
   int desiredRequestCount;
 
   int prefetchCount;
 
+  /* requests whose prefetch has finished. Their blocks are probably in
+     the page cache, so sending them as file segments won't block */
+  struct peer_request warmRequests[PREFETCH_SIZE];
+  int warmRequestCount;
+
+  /* blocks being read from disk to be sent to this peer */
+  int pendingBlockReads;
+
   int is_active[2];
 
   /* how long the outMessages batch should be allowed to grow before
@@ -217,10 +261,18 @@ struct tr_peerMsgs
   encryption_preference_t  encryption_preference;
 
   size_t                   metadata_size_hint;
-#if 0
+  /* the pieces the peer may ask for even while we're choking it */
   size_t                 fastsetSize;
   tr_piece_index_t       fastset[MAX_FAST_SET_SIZE];
-#endif
+
+  /* the pieces we may ask for even while the peer is choking us */
+  int                    clientFastSetSize;
+  tr_piece_index_t       clientFastSet[MAX_CLIENT_FAST_SET_SIZE];
+
+  /* the pieces in the cache we've suggested to the peer, oldest first */
+  int                    suggestedCount;
+  tr_piece_index_t       suggested[MAX_SUGGEST_SET_SIZE];
+  time_t                 suggestedAt;
 
   tr_torrent *           torrent;
 
@@ -234,6 +286,15 @@ struct tr_peerMsgs
   int peerAskedForMetadata[METADATA_REQQ];
   int peerAskedForMetadataCount;
 
+  /* the metadata pieces we've asked the peer for, oldest first */
+  int clientAskedForMetadata[METADATA_PIPELINE_SIZE];
+  time_t clientAskedForMetadataAt[METADATA_PIPELINE_SIZE];
+  int clientAskedForMetadataCount;
+
+  /* the peer let a metadata request time out or rejected one,
+     so only keep one in flight until it sends us a piece */
+  bool metadataIsSlow;
+
   tr_pex * pex;
   tr_pex * pex6;
 
@@ -242,6 +303,9 @@ struct tr_peerMsgs
 
   time_t chokeChangedAt;
 
+  /* when the connection was handed to us by the handshake */
+  uint64_t connectedAt;
+
   /* when we started batching the outMessages */
   time_t outMessagesBatchedAt;
 
@@ -411,23 +475,37 @@ protocolSendHave (tr_peerMsgs * msgs, uint32_t index)
   pokeBatchPeriod (msgs, LOW_PRIORITY_INTERVAL_SECS);
 }
 
-#if 0
 static void
 protocolSendAllowedFast (tr_peerMsgs * msgs, uint32_t pieceIndex)
 {
-  tr_peerIo       * io  = msgs->io;
   struct evbuffer * out = msgs->outMessages;
 
   assert (tr_peerIoSupportsFEXT (msgs->io));
 
-  evbuffer_add_uint32 (io, out, sizeof (uint8_t) + sizeof (uint32_t));
-  evbuffer_add_uint8 (io, out, BT_FEXT_ALLOWED_FAST);
-  evbuffer_add_uint32 (io, out, pieceIndex);
+  evbuffer_add_uint32 (out, sizeof (uint8_t) + sizeof (uint32_t));
+  evbuffer_add_uint8 (out, BT_FEXT_ALLOWED_FAST);
+  evbuffer_add_uint32 (out, pieceIndex);
 
   dbgmsg (msgs, "sending Allowed Fast %u...", pieceIndex);
   dbgOutMessageLen (msgs);
+  pokeBatchPeriod (msgs, HIGH_PRIORITY_INTERVAL_SECS);
+}
+
+static void
+protocolSendSuggest (tr_peerMsgs * msgs, uint32_t pieceIndex)
+{
+  struct evbuffer * out = msgs->outMessages;
+
+  assert (tr_peerIoSupportsFEXT (msgs->io));
+
+  evbuffer_add_uint32 (out, sizeof (uint8_t) + sizeof (uint32_t));
+  evbuffer_add_uint8 (out, BT_FEXT_SUGGEST);
+  evbuffer_add_uint32 (out, pieceIndex);
+
+  dbgmsg (msgs, "sending Suggest %u...", pieceIndex);
+  dbgOutMessageLen (msgs);
+  pokeBatchPeriod (msgs, LOW_PRIORITY_INTERVAL_SECS);
 }
-#endif
 
 static void
 protocolSendChoke (tr_peerMsgs * msgs, int choke)
@@ -607,7 +685,6 @@ fireClientGotHave (tr_peerMsgs * msgs, tr_piece_index_t index)
 ***  For explanation, see http://www.bittorrent.org/beps/bep_0006.html
 **/
 
-#if 0
 size_t
 tr_generateAllowedSet (tr_piece_index_t * setmePieces,
                        size_t             desiredSetSize,
@@ -662,13 +739,15 @@ tr_generateAllowedSet (tr_piece_index_t * setmePieces,
     return setSize;
 }
 
+/* give a peer that's just starting out something to download
+ * before our rechoke timer gets around to unchoking it */
 static void
-updateFastSet (tr_peerMsgs * msgs UNUSED)
+updateFastSet (tr_peerMsgs * msgs)
 {
     const bool fext = tr_peerIoSupportsFEXT (msgs->io);
-    const int peerIsNeedy = msgs->peer->progress < 0.10;
+    const bool peerIsNeedy = msgs->peer.progress < 0.10;
 
-    if (fext && peerIsNeedy && !msgs->haveFastSet)
+    if (fext && peerIsNeedy && !msgs->haveFastSet && tr_torrentHasMetadata (msgs->torrent))
     {
         size_t i;
         const struct tr_address * addr = tr_peerIoGetAddress (msgs->io, NULL);
@@ -684,7 +763,111 @@ updateFastSet (tr_peerMsgs * msgs UNUSED)
             protocolSendAllowedFast (msgs, msgs->fastset[i]);
     }
 }
-#endif
+
+/* may the peer ask for this piece while we're choking it? */
+static bool
+peerIsAllowedFast (const tr_peerMsgs * msgs, tr_piece_index_t piece)
+{
+    size_t i;
+
+    for (i=0; i<msgs->fastsetSize; ++i)
+        if (msgs->fastset[i] == piece)
+            return true;
+
+    return false;
+}
+
+static void
+addClientFastPiece (tr_peerMsgs * msgs, tr_piece_index_t piece)
+{
+    int i;
+
+    if (tr_torrentHasMetadata (msgs->torrent) && (piece >= msgs->torrent->info.pieceCount))
+        return;
+
+    for (i=0; i<msgs->clientFastSetSize; ++i)
+        if (msgs->clientFastSet[i] == piece)
+            return;
+
+    if (msgs->clientFastSetSize < MAX_CLIENT_FAST_SET_SIZE)
+        msgs->clientFastSet[msgs->clientFastSetSize++] = piece;
+}
+
+/* the peer may turn down requests from its fast set after all,
+ * so we stop asking for those pieces until it unchokes us */
+static void
+removeClientFastPiece (tr_peerMsgs * msgs, tr_piece_index_t piece)
+{
+    int i;
+
+    for (i=0; i<msgs->clientFastSetSize; ++i)
+    {
+        if (msgs->clientFastSet[i] == piece)
+        {
+            tr_removeElementFromArray (msgs->clientFastSet, i, sizeof (tr_piece_index_t),
+                                       msgs->clientFastSetSize--);
+            break;
+        }
+    }
+}
+
+/***
+****  SUGGEST
+***/
+
+static bool
+peerWasSuggested (const tr_peerMsgs * msgs, tr_piece_index_t piece)
+{
+    int i;
+
+    for (i=0; i<msgs->suggestedCount; ++i)
+        if (msgs->suggested[i] == piece)
+            return true;
+
+    return false;
+}
+
+/* point the peer at pieces that we can send from memory, so that
+ * it asks for those instead of ones we'd have to read from disk */
+static void
+updateSuggestions (tr_peerMsgs * msgs, time_t now)
+{
+    int i;
+    int n;
+    int sent = 0;
+    tr_torrent * tor = msgs->torrent;
+    tr_piece_index_t pieces[MAX_SUGGEST_SET_SIZE];
+
+    if (!tr_peerIoSupportsFEXT (msgs->io) || !tr_torrentHasMetadata (tor)
+                                          || msgs->peer_is_choked
+                                          || !msgs->peer_is_interested
+                                          || (now - msgs->suggestedAt < SUGGEST_INTERVAL_SECS))
+        return;
+
+    msgs->suggestedAt = now;
+    n = tr_cacheGetCachedPieces (getSession (msgs)->cache, tor, pieces, MAX_SUGGEST_SET_SIZE);
+
+    for (i=0; i<n && sent<SUGGEST_BATCH_SIZE; ++i)
+    {
+        const tr_piece_index_t piece = pieces[i];
+
+        if (!tr_torrentPieceIsComplete (tor, piece)
+            || tr_torrentPieceNeedsCheck (tor, piece)
+            || tr_bitfieldHas (&msgs->peer.have, piece)
+            || peerWasSuggested (msgs, piece))
+            continue;
+
+        /* forget the oldest suggestion to make room */
+        if (msgs->suggestedCount == MAX_SUGGEST_SET_SIZE)
+            tr_removeElementFromArray (msgs->suggested, 0, sizeof (tr_piece_index_t),
+                                       msgs->suggestedCount--);
+
+        msgs->suggested[msgs->suggestedCount++] = piece;
+        protocolSendSuggest (msgs, piece);
+        ++getSession (msgs)->suggestCount;
+        ++sent;
+    }
+}
 
 /***
 ****  ACTIVE
@@ -819,31 +1002,91 @@ popNextMetadataRequest (tr_peerMsgs * msgs, int * piece)
   return true;
 }
 
+/* the peer's requests are served in order, except that a block
+ * that's in the cache can jump ahead of the few before it that
+ * would have to be read from disk */
 static bool
 popNextRequest (tr_peerMsgs * msgs, struct peer_request * setme)
 {
+  int i;
+  int pos = 0;
+  bool isCached = false;
+  tr_session * session = getSession (msgs);
+  const int n = MIN (msgs->peer.pendingReqsToClient, CACHED_REQUEST_WINDOW);
+
   if (msgs->peer.pendingReqsToClient == 0)
     return false;
 
-  *setme = msgs->peerAskedFor[0];
+  for (i=0; i<n && !isCached; ++i)
+    {
+      const struct peer_request * req = &msgs->peerAskedFor[i];
+
+      if (tr_cacheHasBlock (session->cache, msgs->torrent, req->index, req->offset))
+        {
+          pos = i;
+          isCached = true;
+        }
+    }
+
+  *setme = msgs->peerAskedFor[pos];
+
+  if (isCached && pos > 0)
+    ++session->reorderHits;
+  if (isCached && peerWasSuggested (msgs, setme->index))
+    ++session->suggestHits;
 
   tr_removeElementFromArray (msgs->peerAskedFor,
-                             0,
+                             pos,
                              sizeof (struct peer_request),
                              msgs->peer.pendingReqsToClient--);
 
+  /* prefetchCount counts the requests at the front of the queue
+     that have been prefetched. A cached request can be taken from
+     further back, and then it isn't one of them */
+  if (pos < msgs->prefetchCount)
+    --msgs->prefetchCount;
+
   return true;
 }
 
+/* put a request that couldn't be served yet back at the end of the queue.
+ * It's not one of the prefetched requests at the front anymore, even if
+ * every request before it is */
+static void
+requeueRequestToClient (tr_peerMsgs * msgs, const struct peer_request * req)
+{
+  msgs->peerAskedFor[msgs->peer.pendingReqsToClient++] = *req;
+  msgs->prefetchCount = MIN (msgs->prefetchCount, msgs->peer.pendingReqsToClient - 1);
+}
+
+/* the peer's been choked: turn down all its requests
+ * except the ones in its allowed fast set */
 static void
 cancelAllRequestsToClient (tr_peerMsgs * msgs)
 {
-  struct peer_request req;
+  int i;
+  int keepCount = 0;
+  int keepPrefetched = 0;
   const int mustSendCancel = tr_peerIoSupportsFEXT (msgs->io);
 
-  while (popNextRequest (msgs, &req))
-    if (mustSendCancel)
-      protocolSendReject (msgs, &req);
+  for (i=0; i<msgs->peer.pendingReqsToClient; ++i)
+    {
+      const struct peer_request * req = &msgs->peerAskedFor[i];
+
+      if (peerIsAllowedFast (msgs, req->index))
+        {
+          msgs->peerAskedFor[keepCount++] = *req;
+          if (i < msgs->prefetchCount)
+            ++keepPrefetched;
+        }
+      else if (mustSendCancel)
+        {
+          protocolSendReject (msgs, req);
+        }
+    }
+
+  msgs->peer.pendingReqsToClient = keepCount;
+  msgs->prefetchCount = keepPrefetched;
 }
 
 void
@@ -1086,6 +1329,30 @@ parseLtepHandshake (tr_peerMsgs * msgs, uint32_t len, struct evbuffer * inbuf)
     tr_free (tmp);
 }
 
+static void updateMetadataRequests (tr_peerMsgs * msgs, time_t now);
+
+/* the peer answered our request for a metadata piece.
+   returns false if we weren't waiting on that piece from it */
+static bool
+clientGotMetadataAnswer (tr_peerMsgs * msgs, int64_t piece)
+{
+    int i;
+
+    for (i=0; i<msgs->clientAskedForMetadataCount; ++i)
+        if (msgs->clientAskedForMetadata[i] == piece)
+            break;
+
+    if (i == msgs->clientAskedForMetadataCount)
+        return false;
+
+    --msgs->clientAskedForMetadataCount;
+    memmove (msgs->clientAskedForMetadata + i, msgs->clientAskedForMetadata + i + 1,
+             sizeof (int) * (msgs->clientAskedForMetadataCount - i));
+    memmove (msgs->clientAskedForMetadataAt + i, msgs->clientAskedForMetadataAt + i + 1,
+             sizeof (time_t) * (msgs->clientAskedForMetadataCount - i));
+    return true;
+}
+
 static void
 parseUtMetadata (tr_peerMsgs * msgs, uint32_t msglen, struct evbuffer * inbuf)
 {
@@ -1113,7 +1380,11 @@ parseUtMetadata (tr_peerMsgs * msgs, uint32_t msglen, struct evbuffer * inbuf)
 
     if (msg_type == METADATA_MSG_TYPE_REJECT)
     {
-        /* NOOP */
+        if (clientGotMetadataAnswer (msgs, piece))
+        {
+            msgs->metadataIsSlow = true;
+            tr_torrentMetadataRequestFailed (msgs->torrent, msgs, piece);
+        }
     }
 
     if ((msg_type == METADATA_MSG_TYPE_DATA)
@@ -1122,7 +1393,15 @@ parseUtMetadata (tr_peerMsgs * msgs, uint32_t msglen, struct evbuffer * inbuf)
         && (piece * METADATA_PIECE_SIZE + (msg_end - benc_end) <= total_size))
     {
         const int pieceLen = msg_end - benc_end;
+
+        if (clientGotMetadataAnswer (msgs, piece))
+            msgs->metadataIsSlow = false;
+
         tr_torrentSetMetadataPiece (msgs->torrent, piece, benc_end, pieceLen);
+
+        /* keep the peer's pipeline full */
+        if (!tr_torrentHasMetadata (msgs->torrent))
+            updateMetadataRequests (msgs, tr_time ());
     }
 
     if (msg_type == METADATA_MSG_TYPE_REQUEST)
@@ -1151,7 +1430,7 @@ parseUtMetadata (tr_peerMsgs * msgs, uint32_t msglen, struct evbuffer * inbuf)
             evbuffer_add_uint8 (out, BT_LTEP);
             evbuffer_add_uint8 (out, msgs->ut_metadata_id);
             evbuffer_add_buffer (out, payload);
-            pokeBatchPeriod (msgs, HIGH_PRIORITY_INTERVAL_SECS);
+            pokeBatchPeriod (msgs, IMMEDIATE_PRIORITY_INTERVAL_SECS);
             dbgOutMessageLen (msgs);
 
             /* cleanup */
@@ -1320,16 +1599,65 @@ updatePeerProgress (tr_peerMsgs * msgs)
 {
   tr_peerUpdateProgress (msgs->torrent, &msgs->peer);
 
-  /*updateFastSet (msgs);*/
+  updateFastSet (msgs);
   updateInterest (msgs);
 }
 
+struct peer_prefetch
+{
+  tr_peerMsgs * msgs;
+  struct peer_request req;
+};
+
+static void
+onPrefetchDone (tr_torrent * tor UNUSED, int err, void * vp)
+{
+  struct peer_prefetch * p = vp;
+
+  /* if it was cancelled, p->msgs is being freed */
+  if (err == 0)
+    {
+      tr_peerMsgs * msgs = p->msgs;
+
+      if (msgs->warmRequestCount == PREFETCH_SIZE)
+        tr_removeElementFromArray (msgs->warmRequests, 0, sizeof (struct peer_request),
+                                   msgs->warmRequestCount--);
+
+      msgs->warmRequests[msgs->warmRequestCount++] = p->req;
+    }
+
+  tr_free (p);
+}
+
+/* true if the request's prefetch has finished */
+static bool
+takeWarmRequest (tr_peerMsgs * msgs, const struct peer_request * req)
+{
+  int i;
+
+  for (i=0; i<msgs->warmRequestCount; ++i)
+    {
+      const struct peer_request * r = msgs->warmRequests + i;
+
+      if ((req->index == r->index) && (req->offset == r->offset) && (req->length == r->length))
+        {
+          tr_removeElementFromArray (msgs->warmRequests, i, sizeof (struct peer_request),
+                                     msgs->warmRequestCount--);
+          return true;
+        }
+    }
+
+  return false;
+}
+
 static void
 prefetchPieces (tr_peerMsgs *msgs)
 {
   int i;
+  tr_session * session = getSession (msgs);
+  const bool zeroCopy = tr_peerIoSupportsZeroCopy (msgs->io);
 
-  if (!getSession (msgs)->isPrefetchEnabled)
+  if (!session->isPrefetchEnabled)
     return;
 
   for (i=msgs->prefetchCount; i<msgs->peer.pendingReqsToClient && i<PREFETCH_SIZE; ++i)
@@ -1337,7 +1665,21 @@ prefetchPieces (tr_peerMsgs *msgs)
       const struct peer_request * req = msgs->peerAskedFor + i;
       if (requestIsValid (msgs, req))
         {
-          tr_cachePrefetchBlock (getSession (msgs)->cache, msgs->torrent, req->index, req->offset, req->length);
+          /* only the blocks that will be sent as file segments
+             need to know when they've been prefetched */
+          struct peer_prefetch * p = NULL;
+
+          if (zeroCopy)
+            {
+              p = tr_new (struct peer_prefetch, 1);
+              p->msgs = msgs;
+              p->req = *req;
+            }
+
+          if (tr_cachePrefetchBlock (session->cache, msgs->torrent, req->index, req->offset, req->length,
+                                     msgs, p != NULL ? onPrefetchDone : NULL, p))
+            tr_free (p);
+
           ++msgs->prefetchCount;
         }
     }
@@ -1357,7 +1699,7 @@ peerMadeRequest (tr_peerMsgs * msgs, const struct peer_request * req)
         dbgmsg (msgs, "rejecting an invalid request.");
     else if (!clientHasPiece)
         dbgmsg (msgs, "rejecting request for a piece we don't have.");
-    else if (peerIsChoked)
+    else if (peerIsChoked && !peerIsAllowedFast (msgs, req->index))
         dbgmsg (msgs, "rejecting request from choked peer");
     else if (msgs->peer.pendingReqsToClient + 1 >= REQQ)
         dbgmsg (msgs, "rejecting request ... reqq is full");
@@ -1463,6 +1805,14 @@ readBtPiece (tr_peerMsgs      * msgs,
 
         fireClientGotPieceData (msgs, n);
         *setme_piece_bytes_read += n;
+
+        if (!msgs->clientGotPieceData)
+        {
+            msgs->clientGotPieceData = true;
+            tr_sessionAddFirstByteTime (getSession (msgs), TR_PEER_TO_CLIENT,
+                                        tr_time_msec () - msgs->connectedAt,
+                                        msgs->client_is_choked);
+        }
         dbgmsg (msgs, "got %zu bytes for block %u:%u->%u ... %d remain",
                n, req->index, req->offset, req->length,
              (int)(req->length - evbuffer_get_length (block_buffer)));
@@ -1594,9 +1944,12 @@ readBtMessage (tr_peerMsgs * msgs, struct evbuffer * inbuf, size_t inlen)
                     break;
             }
 
-            if (i < msgs->peer.pendingReqsToClient)
+            if (i < msgs->peer.pendingReqsToClient) {
                 tr_removeElementFromArray (msgs->peerAskedFor, i, sizeof (struct peer_request),
                                            msgs->peer.pendingReqsToClient--);
+                if (i < msgs->prefetchCount)
+                    --msgs->prefetchCount;
+            }
             break;
         }
 
@@ -1627,9 +1980,11 @@ readBtMessage (tr_peerMsgs * msgs, struct evbuffer * inbuf, size_t inlen)
         case BT_FEXT_ALLOWED_FAST:
             dbgmsg (msgs, "Got a BT_FEXT_ALLOWED_FAST");
             tr_peerIoReadUint32 (msgs->io, inbuf, &ui32);
-            if (fext)
+            if (fext) {
+                addClientFastPiece (msgs, ui32);
                 fireClientGotAllowedFast (msgs, ui32);
-            else {
+                updateDesiredRequestCount (msgs);
+            } else {
                 fireError (msgs, EMSGSIZE);
                 return READ_ERR;
             }
@@ -1667,9 +2022,11 @@ assert (tr_bitfieldHasAll (&msgs->peer.have));
             tr_peerIoReadUint32 (msgs->io, inbuf, &r.index);
             tr_peerIoReadUint32 (msgs->io, inbuf, &r.offset);
             tr_peerIoReadUint32 (msgs->io, inbuf, &r.length);
-            if (fext)
+            if (fext) {
+                if (msgs->client_is_choked)
+                    removeClientFastPiece (msgs, r.index);
                 fireGotRej (msgs, &r);
-            else {
+            } else {
                 fireError (msgs, EMSGSIZE);
                 return READ_ERR;
             }
@@ -1816,9 +2173,16 @@ updateDesiredRequestCount (tr_peerMsgs * msgs)
     tr_torrent * const torrent = msgs->torrent;
 
     /* there are lots of reasons we might not want to request any blocks... */
-    if (tr_torrentIsSeed (torrent) || !tr_torrentHasMetadata (torrent)
-                                    || msgs->client_is_choked
-                                    || !msgs->client_is_interested)
+    if (tr_torrentIsSeed (torrent) || !tr_torrentHasMetadata (torrent))
+    {
+        msgs->desiredRequestCount = 0;
+    }
+    else if (msgs->client_is_choked)
+    {
+        /* ...but the peer may have let us have a few pieces anyway */
+        msgs->desiredRequestCount = msgs->clientFastSetSize > 0 ? FAST_REQUEST_COUNT : 0;
+    }
+    else if (!msgs->client_is_interested)
     {
         msgs->desiredRequestCount = 0;
     }
@@ -1858,10 +2222,27 @@ static void
 updateMetadataRequests (tr_peerMsgs * msgs, time_t now)
 {
     int piece;
+    int depth;
+
+    if (!msgs->peerSupportsMetadataXfer)
+        return;
 
-    if (msgs->peerSupportsMetadataXfer
-        && tr_torrentGetNextMetadataRequest (msgs->torrent, now, &piece))
+    /* forget the requests the peer has sat on for too long.
+       the torrent will have asked other peers for those pieces by now */
+    while ((msgs->clientAskedForMetadataCount > 0)
+        && (msgs->clientAskedForMetadataAt[0] + METADATA_REQUEST_TIMEOUT_SECS <= now))
     {
+        dbgmsg (msgs, "metadata request for piece #%d timed out", msgs->clientAskedForMetadata[0]);
+        clientGotMetadataAnswer (msgs, msgs->clientAskedForMetadata[0]);
+        msgs->metadataIsSlow = true;
+    }
+
+    depth = msgs->metadataIsSlow ? 1 : METADATA_PIPELINE_SIZE;
+
+    while ((msgs->clientAskedForMetadataCount < depth)
+        && tr_torrentGetNextMetadataRequest (msgs->torrent, msgs, now, &piece))
+    {
+        const int n = msgs->clientAskedForMetadataCount++;
         tr_variant tmp;
         struct evbuffer * payload;
         struct evbuffer * out = msgs->outMessages;
@@ -1879,9 +2260,12 @@ updateMetadataRequests (tr_peerMsgs * msgs, time_t now)
         evbuffer_add_uint8 (out, BT_LTEP);
         evbuffer_add_uint8 (out, msgs->ut_metadata_id);
         evbuffer_add_buffer (out, payload);
-        pokeBatchPeriod (msgs, HIGH_PRIORITY_INTERVAL_SECS);
+        pokeBatchPeriod (msgs, IMMEDIATE_PRIORITY_INTERVAL_SECS);
         dbgOutMessageLen (msgs);
 
+        msgs->clientAskedForMetadata[n] = piece;
+        msgs->clientAskedForMetadataAt[n] = now;
+
         /* cleanup */
         evbuffer_free (payload);
         tr_variantFree (&tmp);
@@ -1900,11 +2284,22 @@ updateBlockRequests (tr_peerMsgs * msgs)
         tr_block_index_t * blocks;
         const int numwant = msgs->desiredRequestCount - msgs->peer.pendingReqsToPeer;
 
-        assert (tr_peerMsgsIsClientInterested (msgs));
-        assert (!tr_peerMsgsIsClientChoked (msgs));
-
         blocks = tr_new (tr_block_index_t, numwant);
-        tr_peerMgrGetNextRequests (msgs->torrent, &msgs->peer, numwant, blocks, &n, false);
+
+        if (tr_peerMsgsIsClientChoked (msgs))
+        {
+            assert (msgs->clientFastSetSize > 0);
+
+            tr_peerMgrGetNextFastRequests (msgs->torrent, &msgs->peer,
+                                           msgs->clientFastSet, msgs->clientFastSetSize,
+                                           numwant, blocks, &n);
+        }
+        else
+        {
+            assert (tr_peerMsgsIsClientInterested (msgs));
+
+            tr_peerMgrGetNextRequests (msgs->torrent, &msgs->peer, numwant, blocks, &n, false);
+        }
 
         for (i=0; i<n; ++i)
         {
@@ -1917,6 +2312,74 @@ updateBlockRequests (tr_peerMsgs * msgs)
     }
 }
 
+struct peer_block_read
+{
+    tr_peerMsgs * msgs;
+    struct peer_request req;
+    struct evbuffer * out;
+    struct evbuffer_iovec iovec[1];
+};
+
+/* note that a block went out to the peer */
+static void
+clientSentBlock (tr_peerMsgs * msgs, time_t now)
+{
+    msgs->clientSentAnythingAt = now;
+    tr_historyAdd (&msgs->peer.blocksSentToPeer, now, 1);
+
+    if (!msgs->clientSentPieceData)
+    {
+        msgs->clientSentPieceData = true;
+        tr_sessionAddFirstByteTime (getSession (msgs), TR_CLIENT_TO_PEER,
+                                    tr_time_msec () - msgs->connectedAt,
+                                    msgs->peer_is_choked);
+    }
+}
+
+static void
+onBlockRead (tr_torrent * tor, int err, void * vr)
+{
+    struct peer_block_read * r = vr;
+
+    /* if cancelled, the peer is being destroyed and msgs is gone */
+    if (err != ECANCELED)
+    {
+        tr_peerMsgs * msgs = r->msgs;
+        const struct peer_request * req = &r->req;
+
+        --msgs->pendingBlockReads;
+
+        r->iovec[0].iov_len = req->length;
+        evbuffer_commit_space (r->out, r->iovec, 1);
+
+        /* the file may have changed while we were reading it... */
+        if (!err && tr_torrentPieceNeedsCheck (tor, req->index))
+        {
+            tr_torrentCheckPieceAsync (tor, req->index);
+            err = EAGAIN;
+        }
+
+        if (err || (msgs->peer_is_choked && !peerIsAllowedFast (msgs, req->index)))
+        {
+            if (tr_peerIoSupportsFEXT (msgs->io))
+                protocolSendReject (msgs, req);
+            else if ((err == EAGAIN) && !msgs->peer_is_choked && (msgs->peer.pendingReqsToClient < REQQ))
+                requeueRequestToClient (msgs, req);
+        }
+        else
+        {
+            const size_t n = evbuffer_get_length (r->out);
+            dbgmsg (msgs, "sending block %u:%u->%u", req->index, req->offset, req->length);
+            assert (n == 4 + 1 + 4 + 4 + req->length);
+            tr_peerIoWriteBuf (msgs->io, r->out, true);
+            clientSentBlock (msgs, tr_time ());
+        }
+    }
+
+    evbuffer_free (r->out);
+    tr_free (r);
+}
+
 static size_t
 fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
 {
@@ -1935,7 +2398,9 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
         dbgmsg (msgs, "started an outMessages batch (length is %zu)", evbuffer_get_length (msgs->outMessages));
         msgs->outMessagesBatchedAt = now;
     }
-    else if (haveMessages && ((now - msgs->outMessagesBatchedAt) >= msgs->outMessagesBatchPeriod))
+
+    /* a fresh batch of immediate messages goes out right away */
+    if (haveMessages && ((now - msgs->outMessagesBatchedAt) >= msgs->outMessagesBatchPeriod))
     {
         const size_t len = evbuffer_get_length (msgs->outMessages);
         /* flush the protocol messages */
@@ -1954,12 +2419,11 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
     if ((tr_peerIoGetWriteBufferSpace (msgs->io, now) >= METADATA_PIECE_SIZE)
         && popNextMetadataRequest (msgs, &piece))
     {
-        char * data;
-        size_t dataLen;
         bool ok = false;
+        struct evbuffer * data = evbuffer_new ();
+        const size_t dataLen = tr_torrentGetMetadataPiece (msgs->torrent, piece, data);
 
-        data = tr_torrentGetMetadataPiece (msgs->torrent, piece, &dataLen);
-        if (data != NULL)
+        if (dataLen > 0)
         {
             tr_variant tmp;
             struct evbuffer * payload;
@@ -1977,17 +2441,25 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
             evbuffer_add_uint8 (out, BT_LTEP);
             evbuffer_add_uint8 (out, msgs->ut_metadata_id);
             evbuffer_add_buffer (out, payload);
-            evbuffer_add     (out, data, dataLen);
-            pokeBatchPeriod (msgs, HIGH_PRIORITY_INTERVAL_SECS);
+
+            /* the info dict is shared, so an encrypted connection,
+               which encrypts in place, has to get a copy of it */
+            if (tr_peerIoIsEncrypted (msgs->io))
+                evbuffer_add (out, evbuffer_pullup (data, -1), dataLen);
+            else
+                evbuffer_add_buffer (out, data);
+
+            pokeBatchPeriod (msgs, IMMEDIATE_PRIORITY_INTERVAL_SECS);
             dbgOutMessageLen (msgs);
 
             evbuffer_free (payload);
             tr_variantFree (&tmp);
-            tr_free (data);
 
             ok = true;
         }
 
+        evbuffer_free (data);
+
         if (!ok) /* send a rejection message */
         {
             tr_variant tmp;
@@ -2017,64 +2489,102 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
     ***  Data Blocks
     **/
 
-    if ((tr_peerIoGetWriteBufferSpace (msgs->io, now) >= msgs->torrent->blockSize)
+    if ((msgs->pendingBlockReads < MAX_PENDING_BLOCK_READS)
+        && (tr_peerIoGetWriteBufferSpace (msgs->io, now) >= msgs->torrent->blockSize * (1 + msgs->pendingBlockReads))
         && popNextRequest (msgs, &req))
     {
-        --msgs->prefetchCount;
+        if (!requestIsValid (msgs, &req)
+            || !tr_torrentPieceIsComplete (msgs->torrent, req.index))
+        {
+            if (fext) /* peer needs a reject message */
+                protocolSendReject (msgs, &req);
+        }
+        else if (tr_torrentPieceNeedsCheck (msgs->torrent, req.index))
+        {
+            /* hashing the piece here would stall the event loop,
+               so check it in the background and make the peer wait */
+            tr_torrentCheckPieceAsync (msgs->torrent, req.index);
 
-        if (requestIsValid (msgs, &req)
-            && tr_torrentPieceIsComplete (msgs->torrent, req.index))
+            if (fext)
+                protocolSendReject (msgs, &req);
+            else
+                requeueRequestToClient (msgs, &req);
+        }
+        else if (tr_peerIoSupportsZeroCopy (msgs->io)
+                 && (tr_peerIoGetWriteBufferLength (msgs->io) < MAX_FILE_SEGMENT_BLOCKS * msgs->torrent->blockSize)
+                 && tr_ioCanReadToBuffer (msgs->torrent, req.index, req.offset, req.length)
+                 && takeWarmRequest (msgs, &req))
         {
-            int err;
+            /* plaintext TCP: let the kernel copy the block from the file
+               straight to the socket instead of reading it ourselves.
+               That's only done for blocks that have been prefetched,
+               which makes it likely that sending them won't wait for
+               the disk. It isn't certain, though: a prefetch is only
+               a read-ahead hint (see tr_sys_file_prefetch ()), so the
+               pages may be gone again, and without network threads the
+               sendfile () that reads them back in blocks this thread.
+               takeWarmRequest () comes last so that the prefetch isn't
+               forgotten if the block ends up being read instead */
             const uint32_t msglen = 4 + 1 + 4 + 4 + req.length;
-            struct evbuffer * out;
-            struct evbuffer_iovec iovec[1];
-
-            out = evbuffer_new ();
-            evbuffer_expand (out, msglen);
+            struct evbuffer * out = evbuffer_new ();
 
             evbuffer_add_uint32 (out, sizeof (uint8_t) + 2 * sizeof (uint32_t) + req.length);
             evbuffer_add_uint8 (out, BT_PIECE);
             evbuffer_add_uint32 (out, req.index);
             evbuffer_add_uint32 (out, req.offset);
 
-            evbuffer_reserve_space (out, req.length, iovec, 1);
-            err = tr_cacheReadBlock (getSession (msgs)->cache, msgs->torrent, req.index, req.offset, req.length, iovec[0].iov_base);
-            iovec[0].iov_len = req.length;
-            evbuffer_commit_space (out, iovec, 1);
-
-            /* check the piece if it needs checking... */
-            if (!err && tr_torrentPieceNeedsCheck (msgs->torrent, req.index))
-                if ((err = !tr_torrentCheckPiece (msgs->torrent, req.index)))
-                    tr_torrentSetLocalError (msgs->torrent, _("Please Verify Local Data! Piece #%zu is corrupt."), (size_t)req.index);
-
-            if (err)
+            if (tr_cacheReadBlockToBuffer (getSession (msgs)->cache, msgs->torrent, req.index, req.offset, req.length, out))
             {
                 if (fext)
                     protocolSendReject (msgs, &req);
+
+                msgs = NULL;
             }
             else
             {
-                const size_t n = evbuffer_get_length (out);
                 dbgmsg (msgs, "sending block %u:%u->%u", req.index, req.offset, req.length);
-                assert (n == msglen);
+                assert (evbuffer_get_length (out) == msglen);
                 tr_peerIoWriteBuf (msgs->io, out, true);
-                bytesWritten += n;
-                msgs->clientSentAnythingAt = now;
-                tr_historyAdd (&msgs->peer.blocksSentToPeer, tr_time (), 1);
+                bytesWritten += msglen;
+                clientSentBlock (msgs, now);
             }
 
             evbuffer_free (out);
-
-            if (err)
+        }
+        else
+        {
+            const uint32_t msglen = 4 + 1 + 4 + 4 + req.length;
+            struct peer_block_read * r = tr_new0 (struct peer_block_read, 1);
+
+            r->msgs = msgs;
+            r->req = req;
+            r->out = evbuffer_new ();
+            evbuffer_expand (r->out, msglen);
+
+            evbuffer_add_uint32 (r->out, sizeof (uint8_t) + 2 * sizeof (uint32_t) + req.length);
+            evbuffer_add_uint8 (r->out, BT_PIECE);
+            evbuffer_add_uint32 (r->out, req.index);
+            evbuffer_add_uint32 (r->out, req.offset);
+            evbuffer_reserve_space (r->out, req.length, r->iovec, 1);
+
+            /* the block is sent from onBlockRead () once it's been read */
+            ++msgs->pendingBlockReads;
+            if (tr_cacheReadBlockAsync (getSession (msgs)->cache, msgs->torrent, req.index, req.offset, req.length,
+                                        r->iovec[0].iov_base, msgs, onBlockRead, r))
             {
-                bytesWritten = 0;
+                --msgs->pendingBlockReads;
+                evbuffer_free (r->out);
+                tr_free (r);
+
+                if (fext)
+                    protocolSendReject (msgs, &req);
+
                 msgs = NULL;
             }
-        }
-        else if (fext) /* peer needs a reject message */
-        {
-            protocolSendReject (msgs, &req);
+            else
+            {
+                bytesWritten += msglen;
+            }
         }
 
         if (msgs != NULL)
@@ -2107,6 +2617,7 @@ peerPulse (void * vmsgs)
         updateDesiredRequestCount (msgs);
         updateBlockRequests (msgs);
         updateMetadataRequests (msgs, now);
+        updateSuggestions (msgs, now);
     }
 
     for (;;)
@@ -2503,6 +3014,13 @@ peermsgs_destruct (tr_peer * peer)
 
   assert (msgs != NULL);
 
+  /* drop the blocks we were still reading for this peer */
+  tr_diskIoCancel (getSession (msgs)->diskIo, msgs);
+
+  /* and let other peers have the metadata pieces we asked it for */
+  if (!tr_torrentHasMetadata (msgs->torrent))
+    tr_torrentCancelMetadataRequests (msgs->torrent, msgs);
+
   tr_peerMsgsSetActive (msgs, TR_UP, false);
   tr_peerMsgsSetActive (msgs, TR_DOWN, false);
 
@@ -2639,6 +3157,7 @@ tr_peerMsgsNew (struct tr_torrent    * torrent,
   m->peer_is_choked = true;
   m->client_is_interested = false;
   m->peer_is_interested = false;
+  m->connectedAt = tr_time_msec ();
   m->is_active[TR_UP] = false;
   m->is_active[TR_DOWN] = false;
   m->callback = callback;
@@ -2677,6 +3196,7 @@ tr_peerMsgsNew (struct tr_torrent    * torrent,
     }
 
   tr_peerIoSetIOFuncs (m->io, canRead, didWrite, gotError, m);
+  tr_peerIoUseNetThread (m->io);
   updateDesiredRequestCount (m);
 
   return m;
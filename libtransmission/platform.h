@@ -76,5 +76,27 @@ void tr_lockUnlock (tr_lock *);
 /** @brief return nonzero if the specified lock is locked */
 bool tr_lockHave (const tr_lock *);
 
+/***
+****
+***/
+
+typedef struct tr_cond tr_cond;
+
+/** @brief Create a new condition variable object */
+tr_cond * tr_condNew (void);
+
+/** @brief Destroy a condition variable object */
+void tr_condFree (tr_cond *);
+
+/** @brief Atomically release `lock' and wait until the condition is signalled.
+    @param lock a lock held exactly once by the calling thread */
+void tr_condWait (tr_cond *, tr_lock * lock);
+
+/** @brief Wake up one thread waiting on the condition */
+void tr_condSignal (tr_cond *);
+
+/** @brief Wake up all threads waiting on the condition */
+void tr_condBroadcast (tr_cond *);
+
 /* @} */
 
@@ -46,11 +46,15 @@ static const struct tr_key_struct my_static[] =
   { "announce-list", 13 },
   { "announceState", 13 },
   { "arguments", 9 },
+  { "averageRunLength", 16 },
   { "bandwidth-priority", 18 },
+  { "bandwidth-quantum", 17 },
   { "bandwidthPriority", 17 },
   { "bind-address-ipv4", 17 },
   { "bind-address-ipv6", 17 },
   { "bitfield",  8 },
+  { "blockWriteBytes", 15 },
+  { "blockWrites", 11 },
   { "blocklist-date", 14 },
   { "blocklist-enabled", 17 },
   { "blocklist-size", 14 },
@@ -58,7 +62,9 @@ static const struct tr_key_struct my_static[] =
   { "blocklist-url", 13 },
   { "blocks", 6 },
   { "bytesCompleted", 14 },
+  { "bytesPerFlush", 13 },
   { "cache-size-mb", 13 },
+  { "cache-stats", 11 },
   { "clientIsChoked", 14 },
   { "clientIsInterested", 18 },
   { "clientName", 10 },
@@ -82,6 +88,7 @@ static const struct tr_key_struct my_static[] =
   { "desiredAvailable", 16 },
   { "destination", 11 },
   { "dht-enabled", 11 },
+  { "disk-io-threads", 15 },
   { "display-name", 12 },
   { "dnd", 3 },
   { "done-date", 9 },
@@ -92,8 +99,10 @@ static const struct tr_key_struct my_static[] =
   { "download-queue-size", 19 },
   { "downloadCount", 13 },
   { "downloadDir", 11 },
+  { "downloadFastCount", 17 },
   { "downloadLimit", 13 },
   { "downloadLimited", 15 },
+  { "downloadMsec", 12 },
   { "downloadSpeed", 13 },
   { "downloaded", 10 },
   { "downloaded-bytes", 16 },
@@ -124,6 +133,10 @@ static const struct tr_key_struct my_static[] =
   { "filter-trackers", 15 },
   { "flagStr", 7 },
   { "flags", 5 },
+  { "flushBlocks", 11 },
+  { "flushBytes", 10 },
+  { "flushCount", 10 },
+  { "flushMsec", 9 },
   { "fromCache", 9 },
   { "fromDht", 7 },
   { "fromIncoming", 12 },
@@ -134,6 +147,7 @@ static const struct tr_key_struct my_static[] =
   { "hasAnnounced", 12 },
   { "hasScraped", 10 },
   { "hashString", 10 },
+  { "hashedPieces", 12 },
   { "have", 4 },
   { "haveUnchecked", 13 },
   { "haveValid", 9 },
@@ -161,9 +175,12 @@ static const struct tr_key_struct my_static[] =
   { "isFinished", 10 },
   { "isIncoming", 10 },
   { "isPrivate", 9 },
+  { "isRelocating", 12 },
   { "isStalled", 9 },
   { "isUTP", 5 },
   { "isUploadingTo", 13 },
+  { "knownPeerBytes", 14 },
+  { "knownPeerCount", 14 },
   { "lastAnnouncePeerCount", 21 },
   { "lastAnnounceResult", 18 },
   { "lastAnnounceStartTime", 21 },
@@ -195,6 +212,8 @@ static const struct tr_key_struct my_static[] =
   { "memory-bytes", 12 },
   { "memory-units", 12 },
   { "message-level", 13 },
+  { "metadataBytesSent", 17 },
+  { "metadataLoads", 13 },
   { "metadataPercentComplete", 23 },
   { "metadata_size", 13 },
   { "metainfo", 8 },
@@ -206,12 +225,18 @@ static const struct tr_key_struct my_static[] =
   { "mtimes", 6 },
   { "name", 4 },
   { "name.utf-8", 10 },
+  { "network-threads", 15 },
   { "nextAnnounceTime", 16 },
   { "nextScrapeTime", 14 },
   { "nodes", 5 },
   { "nodes6", 6 },
   { "open-dialog-dir", 15 },
+  { "open_file_limit", 15 },
   { "p", 1 },
+  { "packetsPerSend", 14 },
+  { "packetsPerWakeup", 16 },
+  { "packetsReceived", 15 },
+  { "packetsSent", 11 },
   { "path", 4 },
   { "path.utf-8", 10 },
   { "paused", 6 },
@@ -271,11 +296,19 @@ static const struct tr_key_struct my_static[] =
   { "ratio-limit", 11 },
   { "ratio-limit-enabled", 19 },
   { "ratio-mode", 10 },
+  { "read-cache-size-mb", 18 },
+  { "readBytes", 9 },
+  { "readHits", 8 },
+  { "readMisses", 10 },
+  { "readMsec", 8 },
   { "recent-download-dir-1", 21 },
   { "recent-download-dir-2", 21 },
   { "recent-download-dir-3", 21 },
   { "recent-download-dir-4", 21 },
   { "recheckProgress", 15 },
+  { "recheckSpeed", 12 },
+  { "rehashedPieces", 14 },
+  { "relocateProgress", 16 },
   { "remote-session-enabled", 22 },
   { "remote-session-host", 19 },
   { "remote-session-password", 23 },
@@ -284,6 +317,7 @@ static const struct tr_key_struct my_static[] =
   { "remote-session-username", 23 },
   { "removed", 7 },
   { "rename-partial-files", 20 },
+  { "reorderHits", 11 },
   { "reqq", 4 },
   { "result", 6 },
   { "rpc-authentication-required", 27 },
@@ -315,6 +349,7 @@ static const struct tr_key_struct my_static[] =
   { "seedRatioMode", 13 },
   { "seederCount", 11 },
   { "seeding-time-seconds", 20 },
+  { "sendCalls", 9 },
   { "session-count", 13 },
   { "sessionCount", 12 },
   { "show-backup-trackers", 20 },
@@ -343,6 +378,8 @@ static const struct tr_key_struct my_static[] =
   { "startDate", 9 },
   { "status", 6 },
   { "statusbar-stats", 15 },
+  { "suggestCount", 12 },
+  { "suggestHits", 11 },
   { "tag", 3 },
   { "tier", 4 },
   { "time-checked", 12 },
@@ -370,11 +407,16 @@ static const struct tr_key_struct my_static[] =
   { "trackers", 8 },
   { "trash-can-enabled", 17 },
   { "trash-original-torrent-files", 28 },
+  { "ttfb-stats", 10 },
+  { "udp-stats", 9 },
   { "umask", 5 },
   { "units", 5 },
   { "upload-slots-per-torrent", 24 },
+  { "uploadCount", 11 },
+  { "uploadFastCount", 15 },
   { "uploadLimit", 11 },
   { "uploadLimited", 13 },
+  { "uploadMsec", 10 },
   { "uploadRatio", 11 },
   { "uploadSpeed", 11 },
   { "upload_only", 11 },
@@ -393,13 +435,17 @@ static const struct tr_key_struct my_static[] =
   { "ut_recommend", 12 },
   { "utp-enabled", 11 },
   { "v", 1 },
+  { "verify-read-size-kb", 19 },
+  { "verify-threads", 14 },
   { "version", 7 },
+  { "wakeups", 7 },
   { "wanted", 6 },
   { "warning message", 15 },
   { "watch-dir", 9 },
   { "watch-dir-enabled", 17 },
   { "webseeds", 8 },
-  { "webseedsSendingToUs", 19 }
+  { "webseedsSendingToUs", 19 },
+  { "writeMsec", 9 }
 };
 
 static int
@@ -47,11 +47,15 @@ enum
   TR_KEY_announce_list, /* metainfo */
   TR_KEY_announceState, /* rpc */
   TR_KEY_arguments, /* rpc */
+  TR_KEY_averageRunLength,
   TR_KEY_bandwidth_priority,
+  TR_KEY_bandwidth_quantum,
   TR_KEY_bandwidthPriority,
   TR_KEY_bind_address_ipv4,
   TR_KEY_bind_address_ipv6,
   TR_KEY_bitfield,
+  TR_KEY_blockWriteBytes,
+  TR_KEY_blockWrites,
   TR_KEY_blocklist_date,
   TR_KEY_blocklist_enabled,
   TR_KEY_blocklist_size,
@@ -59,7 +63,9 @@ enum
   TR_KEY_blocklist_url,
   TR_KEY_blocks,
   TR_KEY_bytesCompleted,
+  TR_KEY_bytesPerFlush,
   TR_KEY_cache_size_mb,
+  TR_KEY_cache_stats,
   TR_KEY_clientIsChoked,
   TR_KEY_clientIsInterested,
   TR_KEY_clientName,
@@ -83,6 +89,7 @@ enum
   TR_KEY_desiredAvailable,
   TR_KEY_destination,
   TR_KEY_dht_enabled,
+  TR_KEY_disk_io_threads,
   TR_KEY_display_name,
   TR_KEY_dnd,
   TR_KEY_done_date,
@@ -93,8 +100,10 @@ enum
   TR_KEY_download_queue_size,
   TR_KEY_downloadCount,
   TR_KEY_downloadDir,
+  TR_KEY_downloadFastCount,
   TR_KEY_downloadLimit,
   TR_KEY_downloadLimited,
+  TR_KEY_downloadMsec,
   TR_KEY_downloadSpeed,
   TR_KEY_downloaded,
   TR_KEY_downloaded_bytes,
@@ -125,6 +134,10 @@ enum
   TR_KEY_filter_trackers,
   TR_KEY_flagStr,
   TR_KEY_flags,
+  TR_KEY_flushBlocks,
+  TR_KEY_flushBytes,
+  TR_KEY_flushCount,
+  TR_KEY_flushMsec,
   TR_KEY_fromCache,
   TR_KEY_fromDht,
   TR_KEY_fromIncoming,
@@ -135,6 +148,7 @@ enum
   TR_KEY_hasAnnounced,
   TR_KEY_hasScraped,
   TR_KEY_hashString,
+  TR_KEY_hashedPieces,
   TR_KEY_have,
   TR_KEY_haveUnchecked,
   TR_KEY_haveValid,
@@ -162,9 +176,12 @@ enum
   TR_KEY_isFinished,
   TR_KEY_isIncoming,
   TR_KEY_isPrivate,
+  TR_KEY_isRelocating,
   TR_KEY_isStalled,
   TR_KEY_isUTP,
   TR_KEY_isUploadingTo,
+  TR_KEY_knownPeerBytes,
+  TR_KEY_knownPeerCount,
   TR_KEY_lastAnnouncePeerCount,
   TR_KEY_lastAnnounceResult,
   TR_KEY_lastAnnounceStartTime,
@@ -196,6 +213,8 @@ enum
   TR_KEY_memory_bytes,
   TR_KEY_memory_units,
   TR_KEY_message_level,
+  TR_KEY_metadataBytesSent,
+  TR_KEY_metadataLoads,
   TR_KEY_metadataPercentComplete,
   TR_KEY_metadata_size,
   TR_KEY_metainfo,
@@ -207,12 +226,18 @@ enum
   TR_KEY_mtimes,
   TR_KEY_name,
   TR_KEY_name_utf_8,
+  TR_KEY_network_threads,
   TR_KEY_nextAnnounceTime,
   TR_KEY_nextScrapeTime,
   TR_KEY_nodes,
   TR_KEY_nodes6,
   TR_KEY_open_dialog_dir,
+  TR_KEY_open_file_limit,
   TR_KEY_p,
+  TR_KEY_packetsPerSend,
+  TR_KEY_packetsPerWakeup,
+  TR_KEY_packetsReceived,
+  TR_KEY_packetsSent,
   TR_KEY_path,
   TR_KEY_path_utf_8,
   TR_KEY_paused,
@@ -272,11 +297,19 @@ enum
   TR_KEY_ratio_limit,
   TR_KEY_ratio_limit_enabled,
   TR_KEY_ratio_mode,
+  TR_KEY_read_cache_size_mb,
+  TR_KEY_readBytes,
+  TR_KEY_readHits,
+  TR_KEY_readMisses,
+  TR_KEY_readMsec,
   TR_KEY_recent_download_dir_1,
   TR_KEY_recent_download_dir_2,
   TR_KEY_recent_download_dir_3,
   TR_KEY_recent_download_dir_4,
   TR_KEY_recheckProgress,
+  TR_KEY_recheckSpeed,
+  TR_KEY_rehashedPieces,
+  TR_KEY_relocateProgress,
   TR_KEY_remote_session_enabled,
   TR_KEY_remote_session_host,
   TR_KEY_remote_session_password,
@@ -285,6 +318,7 @@ enum
   TR_KEY_remote_session_username,
   TR_KEY_removed,
   TR_KEY_rename_partial_files,
+  TR_KEY_reorderHits,
   TR_KEY_reqq,
   TR_KEY_result,
   TR_KEY_rpc_authentication_required,
@@ -316,6 +350,7 @@ enum
   TR_KEY_seedRatioMode,
   TR_KEY_seederCount,
   TR_KEY_seeding_time_seconds,
+  TR_KEY_sendCalls,
   TR_KEY_session_count,
   TR_KEY_sessionCount,
   TR_KEY_show_backup_trackers,
@@ -344,6 +379,8 @@ enum
   TR_KEY_startDate,
   TR_KEY_status,
   TR_KEY_statusbar_stats,
+  TR_KEY_suggestCount,
+  TR_KEY_suggestHits,
   TR_KEY_tag,
   TR_KEY_tier,
   TR_KEY_time_checked,
@@ -371,11 +408,16 @@ enum
   TR_KEY_trackers,
   TR_KEY_trash_can_enabled,
   TR_KEY_trash_original_torrent_files,
+  TR_KEY_ttfb_stats,
+  TR_KEY_udp_stats,
   TR_KEY_umask,
   TR_KEY_units,
   TR_KEY_upload_slots_per_torrent,
+  TR_KEY_uploadCount,
+  TR_KEY_uploadFastCount,
   TR_KEY_uploadLimit,
   TR_KEY_uploadLimited,
+  TR_KEY_uploadMsec,
   TR_KEY_uploadRatio,
   TR_KEY_uploadSpeed,
   TR_KEY_upload_only,
@@ -394,13 +436,17 @@ enum
   TR_KEY_ut_recommend,
   TR_KEY_utp_enabled,
   TR_KEY_v,
+  TR_KEY_verify_read_size_kb,
+  TR_KEY_verify_threads,
   TR_KEY_version,
+  TR_KEY_wakeups,
   TR_KEY_wanted,
   TR_KEY_warning_message,
   TR_KEY_watch_dir,
   TR_KEY_watch_dir_enabled,
   TR_KEY_webseeds,
   TR_KEY_webseedsSendingToUs,
+  TR_KEY_writeMsec,
   TR_N_KEYS
 };
 
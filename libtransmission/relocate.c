@@ -0,0 +1,912 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <errno.h> /* EIO */
+#include <inttypes.h> /* PRIu64 */
+#include <string.h> /* strcmp () */
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "cache.h" /* tr_cacheHoldTorrent () */
+#include "error.h"
+#include "fdlimit.h" /* tr_fdTorrentClose () */
+#include "file.h"
+#include "list.h"
+#include "log.h"
+#include "platform.h" /* tr_lock, tr_threadNew () */
+#include "relocate.h"
+#include "session.h"
+#include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread () */
+#include "utils.h"
+#include "verify.h" /* tr_verifyRemove () */
+
+enum
+{
+  /* how much to copy between checks for cancellation and progress updates */
+  RELOCATE_CHUNK_SIZE = 8 * 1024 * 1024,
+
+  /* the buffer for when the system can't copy the data for us */
+  RELOCATE_BUFFER_SIZE = 4 * 1024 * 1024,
+
+  /* files that keep being written to have their changes copied again in
+   * the background this many times before the torrent's writes are held
+   * and they're copied one last time */
+  RELOCATE_MAX_PASSES = 3,
+
+  /* writes during a move are tracked in ranges of this size, so that
+   * only the ranges that changed need to be copied again */
+  RELOCATE_DIRTY_RANGE_SIZE = 1024 * 1024
+};
+
+struct relocate_file
+{
+  char * oldpath;
+  char * newpath;
+  uint64_t length;
+
+  bool needsCopy; /* to be copied in the next pass */
+  bool whole;     /* the next copy has to be of the whole file */
+  bool checked;   /* we know whether it's on the new folder's device */
+  bool rename;    /* on the same device: renamed at the switch-over */
+  bool copied;    /* there's a copy at newpath */
+
+  /* the ranges written to since their last copy began.
+   * protected by the relocate lock */
+  tr_bitfield dirty;
+};
+
+struct tr_relocation
+{
+  tr_session * session;
+  tr_torrent * tor;
+  char * location;
+  tr_relocate_done_func done_func;
+
+  volatile double * setme_progress;
+  volatile int * setme_state;
+
+  tr_file_index_t fileCount;
+  struct relocate_file * files;
+
+  uint64_t bytesDone;
+  uint64_t bytesTotal;
+  int passes;
+
+  bool isHolding;   /* waiting for the torrent's running writes to finish */
+  bool isFinalPass; /* the torrent's writes stay in the cache until it's done */
+
+  bool stop;
+  bool failed;
+};
+
+/***
+****
+***/
+
+static tr_lock *
+getRelocateLock (void)
+{
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
+/* signalled when the worker is done with a job */
+static tr_cond *
+getRelocateCond (void)
+{
+  static tr_cond * cond = NULL;
+
+  if (cond == NULL)
+    cond = tr_condNew ();
+
+  return cond;
+}
+
+/* copy files even if they could be renamed (for tests) */
+static bool alwaysCopy = false;
+
+/* these are protected by the relocate lock */
+static tr_list * queue = NULL;
+static struct tr_relocation * current = NULL;
+static bool hasWorker = false;
+
+static void relocateThreadFunc (void * unused);
+
+/* must be called with the relocate lock held */
+static void
+startWorker (void)
+{
+  if (!hasWorker && queue != NULL)
+    {
+      hasWorker = true;
+      tr_threadNew (relocateThreadFunc, NULL);
+    }
+}
+
+static void
+freeRelocation (struct tr_relocation * job)
+{
+  tr_file_index_t i;
+
+  for (i=0; i<job->fileCount; ++i)
+    {
+      tr_bitfieldDestruct (&job->files[i].dirty);
+      tr_free (job->files[i].newpath);
+      tr_free (job->files[i].oldpath);
+    }
+
+  tr_free (job->files);
+  tr_free (job->location);
+  tr_free (job);
+}
+
+/* undo a move that's not going to happen */
+static void
+removeCopies (struct tr_relocation * job)
+{
+  tr_file_index_t i;
+
+  for (i=0; i<job->fileCount; ++i)
+    {
+      struct relocate_file * file = &job->files[i];
+
+      if (file->copied)
+        {
+          tr_sys_path_remove (file->newpath, NULL);
+          file->copied = false;
+        }
+    }
+}
+
+static void
+addProgress (struct tr_relocation * job, uint64_t bytes)
+{
+  tr_lockLock (getRelocateLock ());
+
+  job->bytesDone = MIN (job->bytesDone + bytes, job->bytesTotal);
+
+  if (job->setme_progress != NULL && job->bytesTotal > 0)
+    *job->setme_progress = (double)job->bytesDone / job->bytesTotal;
+
+  tr_lockUnlock (getRelocateLock ());
+}
+
+/***
+****  Copying
+***/
+
+static bool
+copyBuffered (tr_sys_file_t    in,
+              tr_sys_file_t    out,
+              uint64_t         offset,
+              uint64_t         size,
+              uint8_t        * buf,
+              uint64_t       * bytes_copied,
+              tr_error      ** error)
+{
+  uint64_t bytesRead;
+
+  size = MIN (size, RELOCATE_BUFFER_SIZE);
+
+  if (!tr_sys_file_read_at (in, buf, size, offset, &bytesRead, error))
+    return false;
+
+  if (bytesRead > 0 && !tr_sys_file_write_at (out, buf, bytesRead, offset, NULL, error))
+    return false;
+
+  *bytes_copied = bytesRead;
+  return true;
+}
+
+/* Copy `size' bytes at `offset', by copy_file_range () if it works and
+ * by a plain read and write if it doesn't. `bytes_copied' falls short
+ * only if the file is shorter than that or the move is cancelled. */
+static bool
+copyRange (struct tr_relocation  * job,
+           tr_sys_file_t           in,
+           tr_sys_file_t           out,
+           uint64_t                offset,
+           uint64_t                size,
+           bool                    reportProgress,
+           bool                  * useCopyRange,
+           uint8_t              ** buf,
+           uint64_t              * bytes_copied,
+           tr_error             ** error)
+{
+  bool ok = true;
+  uint64_t done = 0;
+
+  while (ok && done < size && !job->stop)
+    {
+      uint64_t chunkDone = 0;
+      const uint64_t chunkSize = MIN (size - done, RELOCATE_CHUNK_SIZE);
+
+      while (ok && chunkDone < chunkSize)
+        {
+          uint64_t n = 0;
+
+          /* copy_file_range () may copy nothing without failing,
+           * e.g. across some filesystems, so read and write instead */
+          if (*useCopyRange && (!tr_sys_file_copy_range (in, out, offset + done + chunkDone,
+                                                         chunkSize - chunkDone, &n, NULL) || n == 0))
+            *useCopyRange = false;
+
+          if (!*useCopyRange)
+            {
+              if (*buf == NULL)
+                *buf = tr_valloc (RELOCATE_BUFFER_SIZE);
+              ok = copyBuffered (in, out, offset + done + chunkDone, chunkSize - chunkDone, *buf, &n, error);
+            }
+
+          /* the file is shorter than we were told */
+          if (ok && n == 0)
+            break;
+
+          chunkDone += n;
+        }
+
+      done += chunkDone;
+
+      if (reportProgress)
+        addProgress (job, chunkDone);
+
+      if (chunkDone < chunkSize)
+        break;
+    }
+
+  *bytes_copied = done;
+  return ok;
+}
+
+static bool
+checkCopied (const struct relocate_file * file, uint64_t expected, uint64_t copied, tr_error ** error)
+{
+  if (copied == expected)
+    return true;
+
+  tr_error_set (error, EIO, "copied %" PRIu64 " of %" PRIu64 " bytes of \"%s\"",
+                copied, expected, file->oldpath);
+  return false;
+}
+
+/* Copy a file's data to its new path: all of it, or only the ranges set
+ * in `ranges'. The quickest way the system supports is used: a reflink,
+ * then copy_file_range (), then a plain read and write. */
+static bool
+copyFile (struct tr_relocation       * job,
+          struct relocate_file       * file,
+          const tr_bitfield          * ranges,
+          tr_error                  ** error)
+{
+  char * dir;
+  bool ok = true;
+  tr_sys_file_t in;
+  tr_sys_file_t out;
+  tr_sys_path_info info;
+  uint8_t * buf = NULL;
+  bool useCopyRange = true;
+  const bool reportProgress = job->passes == 0 && ranges == NULL;
+
+  if ((dir = tr_sys_path_dirname (file->newpath, error)) == NULL)
+    return false;
+
+  ok = tr_sys_dir_create (dir, TR_SYS_DIR_CREATE_PARENTS, 0777, error);
+  tr_free (dir);
+  if (!ok)
+    return false;
+
+  in = tr_sys_file_open (file->oldpath, TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, error);
+  if (in == TR_BAD_SYS_FILE)
+    return false;
+
+  if (!tr_sys_file_get_info (in, &info, error))
+    {
+      tr_sys_file_close (in, NULL);
+      return false;
+    }
+
+  out = tr_sys_file_open (file->newpath, TR_SYS_FILE_WRITE | TR_SYS_FILE_CREATE
+                                         | (ranges == NULL ? TR_SYS_FILE_TRUNCATE : 0), 0666, error);
+  if (out == TR_BAD_SYS_FILE)
+    {
+      tr_sys_file_close (in, NULL);
+      return false;
+    }
+
+  file->copied = true;
+
+  if (ranges == NULL)
+    {
+      uint64_t copied = info.size;
+
+      if (tr_sys_file_clone (in, out, NULL))
+        {
+          if (reportProgress)
+            addProgress (job, info.size);
+        }
+      else
+        {
+          ok = copyRange (job, in, out, 0, info.size, reportProgress, &useCopyRange, &buf, &copied, error);
+        }
+
+      if (ok && !job->stop)
+        ok = checkCopied (file, info.size, copied, error);
+    }
+  else
+    {
+      size_t i;
+      tr_sys_path_info outInfo;
+
+      for (i=0; ok && i<ranges->bit_count && !job->stop; ++i)
+        {
+          size_t end;
+          uint64_t offset, size, copied;
+
+          if (!tr_bitfieldHas (ranges, i))
+            continue;
+
+          for (end=i+1; end<ranges->bit_count && tr_bitfieldHas (ranges, end); ++end)
+            ;
+
+          offset = (uint64_t) i * RELOCATE_DIRTY_RANGE_SIZE;
+          if (offset >= info.size)
+            break;
+
+          size = MIN ((uint64_t) end * RELOCATE_DIRTY_RANGE_SIZE, info.size) - offset;
+          ok = copyRange (job, in, out, offset, size, false, &useCopyRange, &buf, &copied, error)
+               && (job->stop || checkCopied (file, size, copied, error));
+          i = end;
+        }
+
+      /* space that was reserved but not written to reads as zeroes */
+      if (ok && !job->stop && tr_sys_file_get_info (out, &outInfo, NULL) && outInfo.size < info.size)
+        ok = tr_sys_file_truncate (out, info.size, error);
+    }
+
+  tr_free (buf);
+  tr_sys_file_close (in, NULL);
+
+  if (!tr_sys_file_close (out, ok ? error : NULL))
+    ok = false;
+
+  return ok;
+}
+
+/* copy the files that need it. returns false if one of them failed */
+static bool
+copyFiles (struct tr_relocation * job)
+{
+  tr_file_index_t i;
+  uint64_t locationDevice = 0;
+
+  tr_sys_path_get_device (job->location, &locationDevice, NULL);
+
+  for (i=0; i<job->fileCount && !job->stop; ++i)
+    {
+      bool ok;
+      uint64_t device;
+      tr_bitfield ranges;
+      tr_error * error = NULL;
+      struct relocate_file * file = &job->files[i];
+
+      if (!file->needsCopy)
+        continue;
+
+      file->needsCopy = false;
+
+      if (!file->checked)
+        {
+          file->checked = true;
+
+          if (!alwaysCopy
+                && locationDevice != 0
+                && tr_sys_path_get_device (file->oldpath, &device, NULL)
+                && device == locationDevice)
+            {
+              file->rename = true;
+              addProgress (job, file->length);
+              continue;
+            }
+        }
+
+      /* take the ranges written to so far; later writes will be copied next time */
+      tr_lockLock (getRelocateLock ());
+      ranges = file->dirty;
+      tr_bitfieldConstruct (&file->dirty, ranges.bit_count);
+      tr_lockUnlock (getRelocateLock ());
+
+      tr_logAddTorDbg (job->tor, "copying %s\"%s\" to \"%s\"", file->whole ? "" : "the changes to ",
+                       file->oldpath, file->newpath);
+
+      ok = copyFile (job, file, file->whole ? NULL : &ranges, &error);
+      tr_bitfieldDestruct (&ranges);
+
+      if (!ok)
+        {
+          if (!job->stop)
+            tr_logAddTorErr (job->tor, "error moving \"%s\" to \"%s\": %s",
+                             file->oldpath, file->newpath, error->message);
+          tr_error_free (error);
+          return false;
+        }
+
+      file->whole = false;
+    }
+
+  return true;
+}
+
+/***
+****  Switching over
+***/
+
+/* Check on the files again, since the torrent has kept on running:
+ * files may have been created, written to, or renamed from ".part" */
+static int
+refreshFiles (struct tr_relocation * job)
+{
+  int n = 0;
+  tr_file_index_t i;
+  tr_torrent * tor = job->tor;
+
+  for (i=0; i<job->fileCount; ++i)
+    {
+      char * sub;
+      const char * base;
+      struct relocate_file * file = &job->files[i];
+
+      if (tr_torrentFindFile2 (tor, i, &base, &sub, NULL))
+        {
+          char * oldpath = tr_buildPath (base, sub, NULL);
+
+          if (file->oldpath == NULL || strcmp (oldpath, file->oldpath) != 0)
+            {
+              char * newpath = tr_buildPath (job->location, sub, NULL);
+
+              /* a copied file that's just been renamed can keep its copy */
+              if (file->copied && !tr_moveFile (file->newpath, newpath, NULL))
+                {
+                  tr_sys_path_remove (file->newpath, NULL);
+                  file->copied = false;
+                }
+
+              /* a file that's appeared since the move began was only
+               * ever written to since, so copying its changes will do */
+              if (!file->copied)
+                {
+                  file->needsCopy = true;
+                  file->whole = file->oldpath != NULL;
+                  file->checked = false;
+                  file->rename = false;
+                }
+
+              tr_free (file->oldpath);
+              tr_free (file->newpath);
+              file->oldpath = oldpath;
+              file->newpath = newpath;
+            }
+          else
+            {
+              tr_free (oldpath);
+            }
+
+          tr_free (sub);
+        }
+
+      tr_lockLock (getRelocateLock ());
+      if (file->copied && !tr_bitfieldHasNone (&file->dirty))
+        file->needsCopy = true;
+      tr_lockUnlock (getRelocateLock ());
+
+      if (file->needsCopy)
+        ++n;
+    }
+
+  return n;
+}
+
+static bool
+renameFiles (struct tr_relocation * job)
+{
+  tr_file_index_t i;
+
+  for (i=0; i<job->fileCount; ++i)
+    {
+      tr_error * error = NULL;
+      struct relocate_file * file = &job->files[i];
+
+      if (!file->rename || tr_sys_path_is_same (file->oldpath, file->newpath, NULL))
+        continue;
+
+      tr_logAddTorDbg (job->tor, "renaming \"%s\" to \"%s\"", file->oldpath, file->newpath);
+
+      if (!tr_moveFile (file->oldpath, file->newpath, &error))
+        {
+          tr_logAddTorErr (job->tor, "error moving \"%s\" to \"%s\": %s",
+                           file->oldpath, file->newpath, error->message);
+          tr_error_free (error);
+          return false;
+        }
+    }
+
+  return true;
+}
+
+/* put back the files renameFiles () already moved */
+static void
+unrenameFiles (struct tr_relocation * job)
+{
+  tr_file_index_t i;
+
+  for (i=0; i<job->fileCount; ++i)
+    {
+      struct relocate_file * file = &job->files[i];
+
+      if (file->rename && !tr_sys_path_exists (file->oldpath, NULL))
+        tr_moveFile (file->newpath, file->oldpath, NULL);
+    }
+}
+
+static void
+setState (struct tr_relocation * job, int state)
+{
+  if (job->setme_state != NULL)
+    *job->setme_state = state;
+}
+
+/* must be called with the relocate lock held */
+static void
+queueJob (struct tr_relocation * job)
+{
+  tr_list_prepend (&queue, job);
+  startWorker ();
+}
+
+/* called in the libtransmission thread once the last pass is done.
+ * The files are all on the new device, so this only has to rename them */
+static void
+switchFiles (struct tr_relocation * job)
+{
+  tr_torrent * tor = job->tor;
+  tr_session * session = job->session;
+
+  tr_fdTorrentClose (session, tor->uniqueId);
+
+  if (!job->failed && !renameFiles (job))
+    {
+      unrenameFiles (job);
+      job->failed = true;
+    }
+
+  tr_lockLock (getRelocateLock ());
+  tor->relocation = NULL;
+  tr_lockUnlock (getRelocateLock ());
+
+  if (job->failed)
+    {
+      removeCopies (job);
+      setState (job, TR_LOC_ERROR);
+    }
+  else
+    {
+      (*job->done_func)(tor, job->location);
+
+      if (job->setme_progress != NULL)
+        *job->setme_progress = 1;
+      setState (job, TR_LOC_DONE);
+
+      tr_logAddTorInfo (tor, "Moved to \"%s\"", job->location);
+    }
+
+  /* the blocks that were held back are written to the new location */
+  tr_cacheReleaseTorrent (session->cache, tor);
+  freeRelocation (job);
+}
+
+/* called in the libtransmission thread once the torrent's
+ * writes are held and the ones that were running are done */
+static void
+onTorrentHeld (tr_torrent * tor, int err, void * vjob)
+{
+  struct tr_relocation * job = vjob;
+
+  job->isHolding = false;
+
+  /* released by tr_relocateRemove () */
+  if (err == ECANCELED || job->stop)
+    {
+      removeCopies (job);
+      freeRelocation (job);
+      return;
+    }
+
+  tr_torrentLock (tor);
+
+  /* the files can only change on disk by being renamed now */
+  tr_verifyRemove (tor);
+  refreshFiles (job);
+
+  tr_logAddTorDbg (tor, "%s", "copying the files one last time");
+  job->isFinalPass = true;
+  ++job->passes;
+  tr_lockLock (getRelocateLock ());
+  queueJob (job);
+  tr_lockUnlock (getRelocateLock ());
+
+  tr_torrentUnlock (tor);
+}
+
+/* called in the libtransmission thread when a copy pass is done */
+static void
+finishRelocation (void * vjob)
+{
+  int n;
+  tr_torrent * tor;
+  struct tr_relocation * job = vjob;
+
+  /* cancelled while this call was in the event queue */
+  if (job->stop)
+    {
+      removeCopies (job);
+      freeRelocation (job);
+      return;
+    }
+
+  tor = job->tor;
+  tr_torrentLock (tor);
+
+  if (job->isFinalPass)
+    {
+      switchFiles (job);
+    }
+  else if ((n = job->failed ? 0 : refreshFiles (job)) > 0 && job->passes < RELOCATE_MAX_PASSES)
+    {
+      tr_logAddTorDbg (tor, "%d files changed while they were being moved; copying them again", n);
+      ++job->passes;
+      tr_lockLock (getRelocateLock ());
+      queueJob (job);
+      tr_lockUnlock (getRelocateLock ());
+    }
+  else if (job->failed)
+    {
+      switchFiles (job);
+    }
+  else
+    {
+      /* keep the torrent's new blocks in the cache, so that the files
+       * stay put while the worker copies their last changes */
+      job->isHolding = true;
+      tr_cacheHoldTorrent (job->session->cache, tor, onTorrentHeld, job);
+    }
+
+  tr_torrentUnlock (tor);
+}
+
+static void
+relocateThreadFunc (void * unused UNUSED)
+{
+  tr_lockLock (getRelocateLock ());
+
+  while ((current = tr_list_pop_front (&queue)) != NULL)
+    {
+      struct tr_relocation * job = current;
+
+      tr_lockUnlock (getRelocateLock ());
+      if (!copyFiles (job))
+        job->failed = true;
+      tr_lockLock (getRelocateLock ());
+
+      current = NULL;
+      tr_condBroadcast (getRelocateCond ());
+
+      if (job->stop)
+        {
+          tr_lockUnlock (getRelocateLock ());
+          removeCopies (job);
+          freeRelocation (job);
+          tr_lockLock (getRelocateLock ());
+        }
+      else
+        {
+          tr_lockUnlock (getRelocateLock ());
+          tr_runInEventThread (job->session, finishRelocation, job);
+          tr_lockLock (getRelocateLock ());
+        }
+    }
+
+  hasWorker = false;
+  tr_lockUnlock (getRelocateLock ());
+}
+
+/***
+****
+***/
+
+void
+tr_relocateAdd (tr_torrent             * tor,
+                const char             * location,
+                tr_relocate_done_func    done_func,
+                volatile double        * setme_progress,
+                volatile int           * setme_state)
+{
+  tr_file_index_t i;
+  struct tr_relocation * job;
+
+  assert (tr_isTorrent (tor));
+  assert (tr_amInEventThread (tor->session));
+
+  tr_relocateRemove (tor);
+
+  job = tr_new0 (struct tr_relocation, 1);
+  job->session = tor->session;
+  job->tor = tor;
+  job->location = tr_strdup (location);
+  job->done_func = done_func;
+  job->setme_progress = setme_progress;
+  job->setme_state = setme_state;
+  job->fileCount = tor->info.fileCount;
+  job->files = tr_new0 (struct relocate_file, job->fileCount);
+  job->bytesTotal = tor->info.totalSize;
+
+  for (i=0; i<job->fileCount; ++i)
+    {
+      char * sub;
+      const char * oldbase;
+      struct relocate_file * file = &job->files[i];
+
+      file->length = tor->info.files[i].length;
+      tr_bitfieldConstruct (&file->dirty, (file->length + RELOCATE_DIRTY_RANGE_SIZE - 1) / RELOCATE_DIRTY_RANGE_SIZE);
+
+      if (tr_torrentFindFile2 (tor, i, &oldbase, &sub, NULL))
+        {
+          file->oldpath = tr_buildPath (oldbase, sub, NULL);
+          file->newpath = tr_buildPath (location, sub, NULL);
+          file->needsCopy = !tr_sys_path_is_same (file->oldpath, file->newpath, NULL);
+          file->whole = true;
+          tr_free (sub);
+        }
+
+      /* nothing to move */
+      if (!file->needsCopy)
+        job->bytesDone += file->length;
+    }
+
+  tr_logAddTorInfo (tor, "Moving to \"%s\"", location);
+
+  tr_lockLock (getRelocateLock ());
+  tor->relocation = job;
+  tr_list_append (&queue, job);
+  startWorker ();
+  tr_lockUnlock (getRelocateLock ());
+}
+
+void
+tr_relocateRemove (tr_torrent * tor)
+{
+  struct tr_relocation * job;
+  tr_lock * lock = getRelocateLock ();
+
+  assert (tr_isTorrent (tor));
+
+  tr_lockLock (lock);
+
+  if ((job = tor->relocation) != NULL)
+    {
+      tor->relocation = NULL;
+      job->stop = true;
+      setState (job, TR_LOC_ERROR);
+
+      if (tr_list_remove_data (&queue, job) != NULL)
+        {
+          tr_lockUnlock (lock);
+          removeCopies (job);
+          freeRelocation (job);
+          tr_lockLock (lock);
+        }
+      else while (current == job)
+        {
+          /* the worker frees it once it notices */
+          tr_condWait (getRelocateCond (), lock);
+        }
+
+      /* otherwise finishRelocation () is in the event queue and will
+         free the job when it sees that it's been stopped, or it's
+         waiting for the hold and onTorrentHeld () frees it below */
+    }
+
+  tr_lockUnlock (lock);
+
+  if (job != NULL)
+    tr_cacheReleaseTorrent (tor->session->cache, tor);
+}
+
+void
+tr_relocateClose (tr_session * session UNUSED)
+{
+  tr_list * l;
+  tr_lock * lock = getRelocateLock ();
+
+  tr_lockLock (lock);
+
+  /* the torrents are about to be freed, so stop working on their moves.
+   * the worker cleans up after the jobs it still has */
+  for (l=queue; l!=NULL; l=l->next)
+    {
+      struct tr_relocation * job = l->data;
+      job->tor->relocation = NULL;
+      job->stop = true;
+    }
+
+  if (current != NULL)
+    {
+      current->tor->relocation = NULL;
+      current->stop = true;
+    }
+
+  while (current != NULL)
+    tr_condWait (getRelocateCond (), lock);
+
+  tr_lockUnlock (lock);
+}
+
+void
+tr_relocateSetAlwaysCopy (bool copy)
+{
+  alwaysCopy = copy;
+}
+
+void
+tr_relocateFileWritten (tr_torrent      * tor,
+                        tr_file_index_t   fileIndex,
+                        uint64_t          offset,
+                        uint64_t          length)
+{
+  if (tor->relocation == NULL || length == 0)
+    return;
+
+  tr_lockLock (getRelocateLock ());
+
+  if (tor->relocation != NULL)
+    tr_bitfieldAddRange (&tor->relocation->files[fileIndex].dirty,
+                         offset / RELOCATE_DIRTY_RANGE_SIZE,
+                         (offset + length - 1) / RELOCATE_DIRTY_RANGE_SIZE + 1);
+
+  tr_lockUnlock (getRelocateLock ());
+}
+
+bool
+tr_relocateGetProgress (const tr_torrent * tor, float * setme_progress)
+{
+  bool isRelocating = false;
+
+  if (tor->relocation == NULL)
+    return false;
+
+  tr_lockLock (getRelocateLock ());
+
+  if (tor->relocation != NULL)
+    {
+      const struct tr_relocation * job = tor->relocation;
+
+      isRelocating = true;
+
+      if (setme_progress != NULL)
+        *setme_progress = job->bytesTotal > 0 ? (float)job->bytesDone / job->bytesTotal : 0;
+    }
+
+  tr_lockUnlock (getRelocateLock ());
+
+  return isRelocating;
+}
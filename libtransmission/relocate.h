@@ -0,0 +1,65 @@
+/*
+ * This file Copyright (C) 2016 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#pragma once
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/** @brief called in the libtransmission thread once the files are all in
+           their new location, to point the torrent at it */
+typedef void (* tr_relocate_done_func) (tr_torrent * tor, const char * location);
+
+/**
+ * Moves a torrent's files to another folder in a background thread.
+ *
+ * Files on the same device as the new folder are simply renamed. The rest
+ * are copied (by reflink or copy_file_range () where the platform has them)
+ * while the torrent keeps seeding and downloading from its old location.
+ * The parts of files written to during the copy are copied again, and once
+ * everything is in place the torrent is switched over to the new folder
+ * in the libtransmission thread by done_func.
+ *
+ * Called in the libtransmission thread with the torrent locked.
+ */
+void tr_relocateAdd (tr_torrent             * tor,
+                     const char             * location,
+                     tr_relocate_done_func    done_func,
+                     volatile double        * setme_progress,
+                     volatile int           * setme_state);
+
+/** @brief cancel the torrent's move, if any, and remove whatever has
+           been copied so far. The torrent stays where it was. */
+void tr_relocateRemove (tr_torrent * tor);
+
+void tr_relocateClose (tr_session * session);
+
+/** @brief copy files to the new folder even if they're on its device,
+           to test the copying on a single filesystem */
+void tr_relocateSetAlwaysCopy (bool alwaysCopy);
+
+/** @brief note that part of a file has been written to, so that the part
+           gets copied again if the file's move has already started.
+           This may be called from any thread. */
+void tr_relocateFileWritten (tr_torrent      * tor,
+                             tr_file_index_t   fileIndex,
+                             uint64_t          offset,
+                             uint64_t          length);
+
+/** @return true if the torrent's files are being moved.
+            If so, setme_progress is set to how much has been moved [0..1] */
+bool tr_relocateGetProgress (const tr_torrent * tor, float * setme_progress);
+
+/* @} */
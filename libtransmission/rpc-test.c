@@ -130,6 +130,7 @@ test_session_get_and_set (void)
   check (tr_variantDictFind (args, TR_KEY_port_forwarding_enabled) != NULL);
   check (tr_variantDictFind (args, TR_KEY_queue_stalled_enabled) != NULL);
   check (tr_variantDictFind (args, TR_KEY_queue_stalled_minutes) != NULL);
+  check (tr_variantDictFind (args, TR_KEY_read_cache_size_mb) != NULL);
   check (tr_variantDictFind (args, TR_KEY_rename_partial_files) != NULL);
   check (tr_variantDictFind (args, TR_KEY_rpc_version) != NULL);
   check (tr_variantDictFind (args, TR_KEY_rpc_version_minimum) != NULL);
@@ -33,7 +33,7 @@
 #include "version.h"
 #include "web.h"
 
-#define RPC_VERSION     15
+#define RPC_VERSION     16
 #define RPC_VERSION_MIN 1
 
 #define RECENTLY_ACTIVE_SECONDS 60
@@ -680,10 +680,22 @@ addField (tr_torrent       * const tor,
         tr_variantDictAddBool (d, key, tr_torrentIsPrivate (tor));
         break;
 
+      case TR_KEY_isRelocating:
+        tr_variantDictAddBool (d, key, st->isRelocating);
+        break;
+
       case TR_KEY_isStalled:
         tr_variantDictAddBool (d, key, st->isStalled);
         break;
 
+      case TR_KEY_knownPeerBytes:
+        tr_variantDictAddInt (d, key, st->knownPeerBytes);
+        break;
+
+      case TR_KEY_knownPeerCount:
+        tr_variantDictAddInt (d, key, st->knownPeerCount);
+        break;
+
       case TR_KEY_leftUntilDone:
         tr_variantDictAddInt (d, key, st->leftUntilDone);
         break;
@@ -801,6 +813,14 @@ addField (tr_torrent       * const tor,
         tr_variantDictAddReal (d, key, st->recheckProgress);
         break;
 
+      case TR_KEY_relocateProgress:
+        tr_variantDictAddReal (d, key, st->relocateProgress);
+        break;
+
+      case TR_KEY_recheckSpeed:
+        tr_variantDictAddInt (d, key, toSpeedBytes (st->recheckSpeed_KBps));
+        break;
+
       case TR_KEY_seedIdleLimit:
         tr_variantDictAddInt (d, key, tr_torrentGetIdleLimit (tor));
         break;
@@ -1855,6 +1875,8 @@ sessionSet (tr_session               * session,
 
   if (tr_variantDictFindInt (args_in, TR_KEY_cache_size_mb, &i))
     tr_sessionSetCacheLimit_MB (session, i);
+  if (tr_variantDictFindInt (args_in, TR_KEY_read_cache_size_mb, &i))
+    tr_sessionSetReadCacheLimit_MB (session, i);
 
   if (tr_variantDictFindInt (args_in, TR_KEY_alt_speed_up, &i))
     tr_sessionSetAltSpeed_KBps (session, TR_UP, i);
@@ -2002,6 +2024,9 @@ sessionStats (tr_session               * session,
   tr_variant * d;
   tr_session_stats currentStats = { 0.0f, 0, 0, 0, 0, 0 };
   tr_session_stats cumulativeStats = { 0.0f, 0, 0, 0, 0, 0 };
+  tr_session_cache_stats cacheStats;
+  tr_session_udp_stats udpStats;
+  tr_session_ttfb_stats ttfbStats;
   tr_torrent * tor = NULL;
 
   assert (idle_data == NULL);
@@ -2016,6 +2041,9 @@ sessionStats (tr_session               * session,
 
   tr_sessionGetStats (session, &currentStats);
   tr_sessionGetCumulativeStats (session, &cumulativeStats);
+  tr_sessionGetCacheStats (session, &cacheStats);
+  tr_sessionGetUdpStats (session, &udpStats);
+  tr_sessionGetTtfbStats (session, &ttfbStats);
 
   tr_variantDictAddInt  (args_out, TR_KEY_activeTorrentCount, running);
   tr_variantDictAddReal (args_out, TR_KEY_downloadSpeed, tr_sessionGetPieceSpeed_Bps (session, TR_DOWN));
@@ -2037,6 +2065,44 @@ sessionStats (tr_session               * session,
   tr_variantDictAddInt (d, TR_KEY_sessionCount, currentStats.sessionCount);
   tr_variantDictAddInt (d, TR_KEY_uploadedBytes, currentStats.uploadedBytes);
 
+  d = tr_variantDictAddDict (args_out, TR_KEY_cache_stats, 21);
+  tr_variantDictAddReal (d, TR_KEY_averageRunLength, cacheStats.averageRunLength);
+  tr_variantDictAddInt  (d, TR_KEY_blockWriteBytes, cacheStats.blockWriteBytes);
+  tr_variantDictAddInt  (d, TR_KEY_blockWrites, cacheStats.blockWrites);
+  tr_variantDictAddReal (d, TR_KEY_bytesPerFlush, cacheStats.bytesPerFlush);
+  tr_variantDictAddInt  (d, TR_KEY_flushBlocks, cacheStats.flushBlocks);
+  tr_variantDictAddInt  (d, TR_KEY_flushBytes, cacheStats.flushBytes);
+  tr_variantDictAddInt  (d, TR_KEY_flushCount, cacheStats.flushCount);
+  tr_variantDictAddInt  (d, TR_KEY_flushMsec, cacheStats.flushMsec);
+  tr_variantDictAddInt  (d, TR_KEY_hashedPieces, cacheStats.hashedPieces);
+  tr_variantDictAddInt  (d, TR_KEY_metadataBytesSent, cacheStats.metadataBytesSent);
+  tr_variantDictAddInt  (d, TR_KEY_metadataLoads, cacheStats.metadataLoads);
+  tr_variantDictAddInt  (d, TR_KEY_readBytes, cacheStats.readBytes);
+  tr_variantDictAddInt  (d, TR_KEY_readHits, cacheStats.readHits);
+  tr_variantDictAddInt  (d, TR_KEY_readMisses, cacheStats.readMisses);
+  tr_variantDictAddInt  (d, TR_KEY_readMsec, cacheStats.readMsec);
+  tr_variantDictAddInt  (d, TR_KEY_rehashedPieces, cacheStats.rehashedPieces);
+  tr_variantDictAddInt  (d, TR_KEY_reorderHits, cacheStats.reorderHits);
+  tr_variantDictAddInt  (d, TR_KEY_suggestCount, cacheStats.suggestCount);
+  tr_variantDictAddInt  (d, TR_KEY_suggestHits, cacheStats.suggestHits);
+  tr_variantDictAddInt  (d, TR_KEY_writeMsec, cacheStats.writeMsec);
+
+  d = tr_variantDictAddDict (args_out, TR_KEY_udp_stats, 6);
+  tr_variantDictAddReal (d, TR_KEY_packetsPerSend, udpStats.packetsPerSend);
+  tr_variantDictAddReal (d, TR_KEY_packetsPerWakeup, udpStats.packetsPerWakeup);
+  tr_variantDictAddInt  (d, TR_KEY_packetsReceived, udpStats.packetsReceived);
+  tr_variantDictAddInt  (d, TR_KEY_packetsSent, udpStats.packetsSent);
+  tr_variantDictAddInt  (d, TR_KEY_sendCalls, udpStats.sendCalls);
+  tr_variantDictAddInt  (d, TR_KEY_wakeups, udpStats.wakeups);
+
+  d = tr_variantDictAddDict (args_out, TR_KEY_ttfb_stats, 6);
+  tr_variantDictAddInt  (d, TR_KEY_downloadCount, ttfbStats.downloadCount);
+  tr_variantDictAddInt  (d, TR_KEY_downloadFastCount, ttfbStats.downloadFastCount);
+  tr_variantDictAddReal (d, TR_KEY_downloadMsec, ttfbStats.downloadMsec);
+  tr_variantDictAddInt  (d, TR_KEY_uploadCount, ttfbStats.uploadCount);
+  tr_variantDictAddInt  (d, TR_KEY_uploadFastCount, ttfbStats.uploadFastCount);
+  tr_variantDictAddReal (d, TR_KEY_uploadMsec, ttfbStats.uploadMsec);
+
   return NULL;
 }
 
@@ -2060,6 +2126,7 @@ sessionGet (tr_session               * s,
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled, tr_blocklistIsEnabled (s));
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url, tr_blocklistGetURL (s));
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb, tr_sessionGetCacheLimit_MB (s));
+  tr_variantDictAddInt  (d, TR_KEY_read_cache_size_mb, tr_sessionGetReadCacheLimit_MB (s));
   tr_variantDictAddInt  (d, TR_KEY_blocklist_size, tr_blocklistGetRuleCount (s));
   tr_variantDictAddStr  (d, TR_KEY_config_dir, tr_sessionGetConfigDir (s));
   tr_variantDictAddStr  (d, TR_KEY_download_dir, tr_sessionGetDownloadDir (s));
@@ -11,7 +11,7 @@
 #include <errno.h> /* ENOENT */
 #include <limits.h> /* INT_MAX */
 #include <stdlib.h>
-#include <string.h> /* memcpy */
+#include <string.h> /* memcpy (), memset () */
 
 #include <signal.h>
 
@@ -32,6 +32,7 @@
 #include "blocklist.h"
 #include "cache.h"
 #include "crypto-utils.h"
+#include "disk-io.h"
 #include "error.h"
 #include "error-types.h"
 #include "fdlimit.h"
@@ -44,6 +45,7 @@
 #include "platform.h" /* tr_lock, tr_getTorrentDir () */
 #include "platform-quota.h" /* tr_device_info_free() */
 #include "port-forwarding.h"
+#include "relocate.h"
 #include "rpc-server.h"
 #include "session.h"
 #include "stats.h"
@@ -63,11 +65,27 @@ enum
 {
 #ifdef TR_LIGHTWEIGHT
   DEFAULT_CACHE_SIZE_MB = 2,
+  DEFAULT_READ_CACHE_SIZE_MB = 0,
+  DEFAULT_DISK_IO_THREADS = 0,
+  DEFAULT_NETWORK_THREADS = 0,
+  DEFAULT_OPEN_FILE_LIMIT = 32,
   DEFAULT_PREFETCH_ENABLED = false,
+  DEFAULT_VERIFY_THREADS = 1,
+  DEFAULT_VERIFY_READ_SIZE_KB = 128,
 #else
   DEFAULT_CACHE_SIZE_MB = 512,
+  DEFAULT_READ_CACHE_SIZE_MB = 128,
+  DEFAULT_DISK_IO_THREADS = 2,
+  DEFAULT_NETWORK_THREADS = 0,
+  DEFAULT_OPEN_FILE_LIMIT = 256,
   DEFAULT_PREFETCH_ENABLED = true,
+  DEFAULT_VERIFY_THREADS = 4,
+  DEFAULT_VERIFY_READ_SIZE_KB = 1024,
 #endif
+  /* chosen so that when using uTP we'll send a full-size frame right away
+   * and leave enough buffered data for the next frame to go out in a
+   * timely manner. */
+  DEFAULT_BANDWIDTH_QUANTUM = 3000,
   SAVE_INTERVAL_SECS = 360
 };
 
@@ -317,11 +335,14 @@ tr_sessionGetDefaultSettings (tr_variant * d)
 {
   assert (tr_variantIsDict (d));
 
-  tr_variantDictReserve (d, 63);
+  tr_variantDictReserve (d, 70);
+  tr_variantDictAddInt  (d, TR_KEY_bandwidth_quantum,               DEFAULT_BANDWIDTH_QUANTUM);
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled,               false);
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url,                   "http://www.example.com/blocklist");
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb,                   DEFAULT_CACHE_SIZE_MB);
   tr_variantDictAddBool (d, TR_KEY_dht_enabled,                     true);
+  tr_variantDictAddInt  (d, TR_KEY_disk_io_threads,                 DEFAULT_DISK_IO_THREADS);
+  tr_variantDictAddInt  (d, TR_KEY_open_file_limit,                 DEFAULT_OPEN_FILE_LIMIT);
   tr_variantDictAddBool (d, TR_KEY_utp_enabled,                     true);
   tr_variantDictAddBool (d, TR_KEY_lpd_enabled,                     false);
   tr_variantDictAddStr  (d, TR_KEY_download_dir,                    tr_getDefaultDownloadDir ());
@@ -333,6 +354,7 @@ tr_sessionGetDefaultSettings (tr_variant * d)
   tr_variantDictAddStr  (d, TR_KEY_incomplete_dir,                  tr_getDefaultDownloadDir ());
   tr_variantDictAddBool (d, TR_KEY_incomplete_dir_enabled,          false);
   tr_variantDictAddInt  (d, TR_KEY_message_level,                   TR_LOG_INFO);
+  tr_variantDictAddInt  (d, TR_KEY_network_threads,                 DEFAULT_NETWORK_THREADS);
   tr_variantDictAddInt  (d, TR_KEY_download_queue_size,             5);
   tr_variantDictAddBool (d, TR_KEY_download_queue_enabled,          true);
   tr_variantDictAddInt  (d, TR_KEY_peer_limit_global,               atoi (TR_DEFAULT_PEER_LIMIT_GLOBAL_STR));
@@ -351,6 +373,7 @@ tr_sessionGetDefaultSettings (tr_variant * d)
   tr_variantDictAddInt  (d, TR_KEY_queue_stalled_minutes,           30);
   tr_variantDictAddReal (d, TR_KEY_ratio_limit,                     2.0);
   tr_variantDictAddBool (d, TR_KEY_ratio_limit_enabled,             false);
+  tr_variantDictAddInt  (d, TR_KEY_read_cache_size_mb,              DEFAULT_READ_CACHE_SIZE_MB);
   tr_variantDictAddBool (d, TR_KEY_rename_partial_files,            true);
   tr_variantDictAddBool (d, TR_KEY_rpc_authentication_required,     false);
   tr_variantDictAddStr  (d, TR_KEY_rpc_bind_address,                "0.0.0.0");
@@ -377,6 +400,8 @@ tr_sessionGetDefaultSettings (tr_variant * d)
   tr_variantDictAddBool (d, TR_KEY_speed_limit_up_enabled,          false);
   tr_variantDictAddInt  (d, TR_KEY_umask,                           022);
   tr_variantDictAddInt  (d, TR_KEY_upload_slots_per_torrent,        14);
+  tr_variantDictAddInt  (d, TR_KEY_verify_read_size_kb,             DEFAULT_VERIFY_READ_SIZE_KB);
+  tr_variantDictAddInt  (d, TR_KEY_verify_threads,                  DEFAULT_VERIFY_THREADS);
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv4,               TR_DEFAULT_BIND_ADDRESS_IPV4);
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv6,               TR_DEFAULT_BIND_ADDRESS_IPV6);
   tr_variantDictAddBool (d, TR_KEY_start_added_torrents,            true);
@@ -388,11 +413,14 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
 {
   assert (tr_variantIsDict (d));
 
-  tr_variantDictReserve (d, 63);
+  tr_variantDictReserve (d, 70);
+  tr_variantDictAddInt  (d, TR_KEY_bandwidth_quantum,            s->bandwidthQuantum);
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled,            tr_blocklistIsEnabled (s));
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url,                tr_blocklistGetURL (s));
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb,                tr_sessionGetCacheLimit_MB (s));
   tr_variantDictAddBool (d, TR_KEY_dht_enabled,                  s->isDHTEnabled);
+  tr_variantDictAddInt  (d, TR_KEY_disk_io_threads,              tr_diskIoGetThreadCount (s->diskIo));
+  tr_variantDictAddInt  (d, TR_KEY_open_file_limit,              tr_fdGetFileLimit (s));
   tr_variantDictAddBool (d, TR_KEY_utp_enabled,                  s->isUTPEnabled);
   tr_variantDictAddBool (d, TR_KEY_lpd_enabled,                  s->isLPDEnabled);
   tr_variantDictAddStr  (d, TR_KEY_download_dir,                 tr_sessionGetDownloadDir (s));
@@ -406,6 +434,7 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
   tr_variantDictAddStr  (d, TR_KEY_incomplete_dir,               tr_sessionGetIncompleteDir (s));
   tr_variantDictAddBool (d, TR_KEY_incomplete_dir_enabled,       tr_sessionIsIncompleteDirEnabled (s));
   tr_variantDictAddInt  (d, TR_KEY_message_level,                tr_logGetLevel ());
+  tr_variantDictAddInt  (d, TR_KEY_network_threads,              tr_peerIoGetNetThreadCount (s));
   tr_variantDictAddInt  (d, TR_KEY_peer_limit_global,            s->peerLimit);
   tr_variantDictAddInt  (d, TR_KEY_peer_limit_per_torrent,       s->peerLimitPerTorrent);
   tr_variantDictAddInt  (d, TR_KEY_peer_port,                    tr_sessionGetPeerPort (s));
@@ -423,6 +452,7 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
   tr_variantDictAddInt  (d, TR_KEY_queue_stalled_minutes,        tr_sessionGetQueueStalledMinutes (s));
   tr_variantDictAddReal (d, TR_KEY_ratio_limit,                  s->desiredRatio);
   tr_variantDictAddBool (d, TR_KEY_ratio_limit_enabled,          s->isRatioLimited);
+  tr_variantDictAddInt  (d, TR_KEY_read_cache_size_mb,           tr_sessionGetReadCacheLimit_MB (s));
   tr_variantDictAddBool (d, TR_KEY_rename_partial_files,         tr_sessionIsIncompleteFileNamingEnabled (s));
   tr_variantDictAddBool (d, TR_KEY_rpc_authentication_required,  tr_sessionIsRPCPasswordEnabled (s));
   tr_variantDictAddStr  (d, TR_KEY_rpc_bind_address,             tr_sessionGetRPCBindAddress (s));
@@ -449,6 +479,8 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
   tr_variantDictAddBool (d, TR_KEY_speed_limit_up_enabled,       tr_sessionIsSpeedLimited (s, TR_UP));
   tr_variantDictAddInt  (d, TR_KEY_umask,                        s->umask);
   tr_variantDictAddInt  (d, TR_KEY_upload_slots_per_torrent,     s->uploadSlotsPerTorrent);
+  tr_variantDictAddInt  (d, TR_KEY_verify_read_size_kb,          tr_verifyGetReadSize () / 1024);
+  tr_variantDictAddInt  (d, TR_KEY_verify_threads,               tr_verifyGetThreadCount ());
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv4,            tr_address_to_string (&s->public_ipv4->addr));
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv6,            tr_address_to_string (&s->public_ipv6->addr));
   tr_variantDictAddBool (d, TR_KEY_start_added_torrents,         !tr_sessionGetPaused (s));
@@ -597,8 +629,11 @@ tr_sessionInit (const char * configDir,
   session = tr_new0 (tr_session, 1);
   session->udp_socket = TR_BAD_SOCKET;
   session->udp6_socket = TR_BAD_SOCKET;
+  session->bandwidthQuantum = DEFAULT_BANDWIDTH_QUANTUM;
   session->lock = tr_lockNew ();
+  session->fileSegmentLock = tr_lockNew ();
   session->cache = tr_cacheNew (1024*1024*2);
+  session->diskIo = tr_diskIoNew (session, 0);
   session->magicNumber = SESSION_MAGIC_NUMBER;
   tr_bandwidthConstruct (&session->bandwidth, session, NULL);
   tr_variantInitList (&session->removedTorrents, 0);
@@ -785,6 +820,18 @@ sessionSetImpl (void * vdata)
   /* misc features */
   if (tr_variantDictFindInt (settings, TR_KEY_cache_size_mb, &i))
     tr_sessionSetCacheLimit_MB (session, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_read_cache_size_mb, &i))
+    tr_sessionSetReadCacheLimit_MB (session, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_disk_io_threads, &i))
+    tr_diskIoSetThreadCount (session->diskIo, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_network_threads, &i))
+    tr_peerIoSetNetThreadCount (session, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_open_file_limit, &i))
+    tr_fdSetFileLimit (session, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_verify_read_size_kb, &i))
+    tr_verifySetReadSize (i * 1024);
+  if (tr_variantDictFindInt (settings, TR_KEY_verify_threads, &i))
+    tr_verifySetThreadCount (i);
   if (tr_variantDictFindInt (settings, TR_KEY_peer_limit_per_torrent, &i))
     tr_sessionSetPeerLimitPerTorrent (session, i);
   if (tr_variantDictFindBool (settings, TR_KEY_pex_enabled, &boolVal))
@@ -877,13 +924,18 @@ sessionSetImpl (void * vdata)
     tr_sessionSetPortForwardingEnabled (session, boolVal);
 
   if (tr_variantDictFindInt (settings, TR_KEY_peer_limit_global, &i))
-    session->peerLimit = i;
+    {
+      session->peerLimit = i;
+      tr_fdSetFileLimit (session, tr_fdGetFileLimit (session));
+    }
 
   /**
   **/
 
   if (tr_variantDictFindInt (settings, TR_KEY_upload_slots_per_torrent, &i))
     session->uploadSlotsPerTorrent = i;
+  if (tr_variantDictFindInt (settings, TR_KEY_bandwidth_quantum, &i))
+    session->bandwidthQuantum = MAX (i, 1);
 
   if (tr_variantDictFindInt (settings, TR_KEY_speed_limit_up, &i))
     tr_sessionSetSpeedLimit_KBps (session, TR_UP, i);
@@ -1652,6 +1704,9 @@ tr_sessionSetPeerLimit (tr_session * session, uint16_t n)
   assert (tr_isSession (session));
 
   session->peerLimit = n;
+
+  /* the open files share the descriptors with the peers */
+  tr_fdSetFileLimit (session, tr_fdGetFileLimit (session));
 }
 
 uint16_t
@@ -1808,6 +1863,7 @@ sessionCloseImplStart (tr_session * session)
   session->nowTimer = NULL;
 
   tr_verifyClose (session);
+  tr_relocateClose (session);
   tr_sharedClose (session);
   tr_rpcClose (&session->rpcServer);
 
@@ -1829,6 +1885,10 @@ sessionCloseImplStart (tr_session * session)
      it won't be idle until the announce events are sent... */
   tr_webClose (session, TR_WEB_CLOSE_WHEN_IDLE);
 
+  /* no more disk jobs will be submitted now that the torrents are gone */
+  tr_diskIoFree (session->diskIo);
+  session->diskIo = NULL;
+
   tr_cacheFree (session->cache);
   session->cache = NULL;
 
@@ -1859,6 +1919,13 @@ sessionCloseImplWaitForIdleUdp (evutil_socket_t   foo UNUSED,
       return;
     }
 
+  /* the network threads hand their connections back asynchronously */
+  if (tr_peerIoGetNetConnectionCount (session) > 0)
+    {
+      tr_timerAdd (session->saveTimer, 0, 100000);
+      return;
+    }
+
   sessionCloseImplFinish (session);
 }
 
@@ -1873,6 +1940,7 @@ sessionCloseImplFinish (tr_session * session)
 
   tr_statsClose (session);
   tr_peerMgrFree (session->peerMgr);
+  tr_peerIoCloseNetThreads (session);
 
   closeBlocklists (session);
 
@@ -1956,6 +2024,7 @@ tr_sessionClose (tr_session * session)
   tr_variantFree (&session->removedTorrents);
   tr_bandwidthDestruct (&session->bandwidth);
   tr_bitfieldDestruct (&session->turtle.minutes);
+  tr_lockFree (session->fileSegmentLock);
   tr_lockFree (session->lock);
   if (session->metainfoLookup)
     {
@@ -2217,6 +2286,97 @@ tr_sessionGetCacheLimit_MB (const tr_session * session)
   return toMemMB (tr_cacheGetLimit (session->cache));
 }
 
+void
+tr_sessionSetReadCacheLimit_MB (tr_session * session, int max_bytes)
+{
+  assert (tr_isSession (session));
+
+  tr_cacheSetReadLimit (session->cache, toMemBytes (max_bytes));
+}
+
+int
+tr_sessionGetReadCacheLimit_MB (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return toMemMB (tr_cacheGetReadLimit (session->cache));
+}
+
+void
+tr_sessionGetCacheStats (const tr_session * session, tr_session_cache_stats * setme)
+{
+  assert (tr_isSession (session));
+  assert (setme != NULL);
+
+  memset (setme, 0, sizeof (tr_session_cache_stats));
+  tr_cacheGetStats (session->cache, setme);
+
+  setme->readBytes = session->diskReadBytes;
+  setme->readMsec = session->diskReadUsec / 1000;
+  setme->writeMsec = session->diskWriteUsec / 1000;
+  setme->suggestCount = session->suggestCount;
+  setme->suggestHits = session->suggestHits;
+  setme->reorderHits = session->reorderHits;
+  setme->metadataBytesSent = session->metadataBytesSent;
+  setme->metadataLoads = session->metadataCacheLoads;
+
+  if (setme->flushCount > 0)
+    {
+      setme->bytesPerFlush = (double) setme->flushBytes / setme->flushCount;
+      setme->averageRunLength = (double) setme->flushBlocks / setme->flushCount;
+    }
+}
+
+void
+tr_sessionGetUdpStats (const tr_session * session, tr_session_udp_stats * setme)
+{
+  assert (tr_isSession (session));
+  assert (setme != NULL);
+
+  memset (setme, 0, sizeof (tr_session_udp_stats));
+
+  setme->wakeups = session->udpWakeups;
+  setme->packetsReceived = session->udpPacketsReceived;
+  setme->sendCalls = session->udpSendCalls;
+  setme->packetsSent = session->udpPacketsSent;
+
+  if (setme->wakeups > 0)
+    setme->packetsPerWakeup = (double) setme->packetsReceived / setme->wakeups;
+  if (setme->sendCalls > 0)
+    setme->packetsPerSend = (double) setme->packetsSent / setme->sendCalls;
+}
+
+void
+tr_sessionAddFirstByteTime (tr_session * session, tr_direction dir, uint64_t msec, bool fast)
+{
+  assert (tr_isSession (session));
+  assert (tr_isDirection (dir));
+
+  ++session->firstBlockCount[dir];
+  session->firstBlockMsec[dir] += msec;
+  if (fast)
+    ++session->firstBlockFastCount[dir];
+}
+
+void
+tr_sessionGetTtfbStats (const tr_session * session, tr_session_ttfb_stats * setme)
+{
+  assert (tr_isSession (session));
+  assert (setme != NULL);
+
+  memset (setme, 0, sizeof (tr_session_ttfb_stats));
+
+  setme->downloadCount = session->firstBlockCount[TR_PEER_TO_CLIENT];
+  setme->downloadFastCount = session->firstBlockFastCount[TR_PEER_TO_CLIENT];
+  setme->uploadCount = session->firstBlockCount[TR_CLIENT_TO_PEER];
+  setme->uploadFastCount = session->firstBlockFastCount[TR_CLIENT_TO_PEER];
+
+  if (setme->downloadCount > 0)
+    setme->downloadMsec = (double) session->firstBlockMsec[TR_PEER_TO_CLIENT] / setme->downloadCount;
+  if (setme->uploadCount > 0)
+    setme->uploadMsec = (double) session->firstBlockMsec[TR_CLIENT_TO_PEER] / setme->uploadCount;
+}
+
 /***
 ****
 ***/
@@ -52,8 +52,10 @@ struct tr_announcer;
 struct tr_announcer_udp;
 struct tr_bindsockets;
 struct tr_cache;
+struct tr_diskIo;
 struct tr_fdInfo;
 struct tr_device_info;
+struct tr_peerIoThread;
 
 struct tr_turtle_info
 {
@@ -142,12 +144,21 @@ struct tr_session
     struct event_base          * event_base;
     struct evdns_base          * evdns_base;
     struct tr_event_handle     * events;
+    struct tr_event_handle    ** netEvents;
+    int                          netEventCount;
+
+    /* the network threads' peer I/O state; see peer-io.c */
+    struct tr_peerIoThread    ** peerIoThreads;
+    int                          peerIoThreadCount;
 
     uint16_t                     peerLimit;
     uint16_t                     peerLimitPerTorrent;
 
     int                          uploadSlotsPerTorrent;
 
+    /* bytes per peer per round of tr_bandwidthAllocate () */
+    size_t                       bandwidthQuantum;
+
     /* The UDP sockets used for the DHT and uTP. */
     tr_port                      udp_port;
     tr_socket_t                  udp_socket;
@@ -155,6 +166,19 @@ struct tr_session
     unsigned char *              udp6_bound;
     struct event                 *udp_event;
     struct event                 *udp6_event;
+    struct tr_udp_batch          *udp_batch;
+
+    /* UDP traffic, for tr_sessionGetUdpStats () */
+    uint64_t                     udpWakeups;
+    uint64_t                     udpPacketsReceived;
+    uint64_t                     udpSendCalls;
+    uint64_t                     udpPacketsSent;
+
+    /* time to the first block of new peer connections, indexed by
+       tr_direction, for tr_sessionGetTtfbStats () */
+    uint64_t                     firstBlockCount[2];
+    uint64_t                     firstBlockFastCount[2];
+    uint64_t                     firstBlockMsec[2];
 
     /* The open port on the local machine for incoming peer requests */
     tr_port                      private_peer_port;
@@ -192,6 +216,30 @@ struct tr_session
     struct tr_shared *           shared;
 
     struct tr_cache *            cache;
+    struct tr_diskIo *           diskIo;
+
+    /* disk time spent on torrent data, for tr_sessionGetCacheStats () */
+    uint64_t                     diskReadBytes;
+    uint64_t                     diskReadUsec;
+    uint64_t                     diskWriteUsec;
+
+    /* disk reads saved by peer-msgs' SUGGEST messages and request
+       ordering, for tr_sessionGetCacheStats () */
+    uint64_t                     suggestCount;
+    uint64_t                     suggestHits;
+    uint64_t                     reorderHits;
+
+    /* the torrents' info dicts kept in memory for ut_metadata requests,
+       and what's been sent from them; see tr_torrentGetMetadataPiece () */
+    size_t                       metadataCacheBytes;
+    uint64_t                     metadataCacheLoads;
+    uint64_t                     metadataBytesSent;
+
+    /* file segments that tr_ioReadToBuffer () has put in peers' output
+       buffers and that haven't been sent yet. They're freed on whichever
+       thread sends them, so this has its own lock */
+    int                          fileSegmentCount;
+    struct tr_lock *             fileSegmentLock;
 
     struct tr_lock *             lock;
 
@@ -326,3 +374,10 @@ void tr_sessionGetNextQueuedTorrents (tr_session   * session,
 
 int tr_sessionCountQueueFreeSlots (tr_session * session, tr_direction);
 
+/* a new peer connection moved its first block of piece data `msec' after
+   it was made. `fast' is whether the block was from an allowed fast set */
+void tr_sessionAddFirstByteTime (tr_session * session,
+                                 tr_direction dir,
+                                 uint64_t     msec,
+                                 bool         fast);
+
@@ -13,12 +13,15 @@
 #include <event2/buffer.h>
 
 #include "transmission.h"
+#include "bitfield.h"
 #include "crypto-utils.h" /* tr_sha1 () */
 #include "file.h"
 #include "log.h"
 #include "magnet.h"
 #include "metainfo.h"
+#include "platform.h" /* tr_lock */
 #include "resume.h"
+#include "session.h"
 #include "torrent.h"
 #include "torrent-magnet.h"
 #include "utils.h"
@@ -39,14 +42,50 @@
 
 enum
 {
-  /* don't ask for the same metadata piece more than this often */
-  MIN_REPEAT_INTERVAL_SECS = 3
+  /* don't ask the same peer for the same metadata piece more than this often */
+  MIN_REPEAT_INTERVAL_SECS = 3,
+
+  /* a piece that's been asked for but not received for this long
+     is asked for again from a different peer */
+  METADATA_RETRY_SECS = 1,
+
+  /* when this few pieces are left, a piece that's been asked for
+     can be asked from another peer right away */
+  METADATA_ENDGAME_PIECES = 4,
+
+  /* how much memory the session's torrents can keep their info dicts in.
+     The least recently used ones are dropped to make room for more. */
+  MAX_METADATA_CACHE_BYTES = (1024 * 1024 * 16),
+
+  /* after failing to read a torrent's info dict, wait this long
+     before trying again, instead of reading it for every request */
+  METADATA_CACHE_RETRY_SECS = 60
+};
+
+static size_t metadataCacheLimit = MAX_METADATA_CACHE_BYTES;
+
+/* bumped each time an info dict is used, to find the least recently used one */
+static uint64_t metadataCacheClock = 0;
+
+/* a torrent's bencoded info dict. The pieces that are being sent to peers
+ * refer to it from their evbuffers, so it's freed once the torrent and all
+ * of those have let go of it. Those can be in a peer I/O thread. */
+struct tr_metadata_cache
+{
+  tr_lock * lock;
+  int refCount;
+  uint64_t usedAt;
+  size_t len;
+  uint8_t * data;
 };
 
 struct metadata_node
 {
   time_t requestedAt;
   int piece;
+
+  /* the peer it was last asked from, or NULL */
+  const void * peer;
 };
 
 struct tr_incomplete_metadata
@@ -58,11 +97,38 @@ struct tr_incomplete_metadata
   /** sorted from least to most recently requested */
   struct metadata_node * piecesNeeded;
   int piecesNeededCount;
+
+  /* the info dict is hashed as its pieces arrive: pieces [0..hashedCount)
+     have been fed to `sha', the ones after that wait in piecesReceived */
+  tr_bitfield piecesReceived;
+  tr_sha1_ctx_t sha;
+  int hashedCount;
 };
 
+static void
+incompleteMetadataReset (struct tr_incomplete_metadata * m)
+{
+  for (int i = 0; i < m->pieceCount; ++i)
+    {
+      m->piecesNeeded[i].piece = i;
+      m->piecesNeeded[i].requestedAt = 0;
+      m->piecesNeeded[i].peer = NULL;
+    }
+  m->piecesNeededCount = m->pieceCount;
+
+  if (m->sha != NULL)
+    tr_sha1_final (m->sha, NULL);
+  m->sha = tr_sha1_init ();
+  m->hashedCount = 0;
+  tr_bitfieldSetHasNone (&m->piecesReceived);
+}
+
 static void
 incompleteMetadataFree (struct tr_incomplete_metadata * m)
 {
+  if (m->sha != NULL)
+    tr_sha1_final (m->sha, NULL);
+  tr_bitfieldDestruct (&m->piecesReceived);
   tr_free (m->metadata);
   tr_free (m->piecesNeeded);
   tr_free (m);
@@ -85,15 +151,15 @@ tr_torrentSetMetadataSizeHint (tr_torrent * tor, int64_t size)
   if (n <= 0)
     return false;
 
-  struct tr_incomplete_metadata * m = tr_new (struct tr_incomplete_metadata, 1);
+  struct tr_incomplete_metadata * m = tr_new0 (struct tr_incomplete_metadata, 1);
   if (m == NULL)
     return false;
 
   m->pieceCount = n;
   m->metadata = tr_new (uint8_t, size);
   m->metadata_size = size;
-  m->piecesNeededCount = n;
   m->piecesNeeded = tr_new (struct metadata_node, n);
+  tr_bitfieldConstruct (&m->piecesReceived, n);
 
   if (m->metadata == NULL || m->piecesNeeded == NULL)
     {
@@ -101,11 +167,7 @@ tr_torrentSetMetadataSizeHint (tr_torrent * tor, int64_t size)
       return false;
     }
 
-  for (int i = 0; i < n; ++i)
-    {
-      m->piecesNeeded[i].piece = i;
-      m->piecesNeeded[i].requestedAt = 0;
-    }
+  incompleteMetadataReset (m);
 
   tor->incompleteMetadata = m;
   return true;
@@ -157,56 +219,179 @@ ensureInfoDictOffsetIsCached (tr_torrent * tor)
     }
 }
 
-void*
-tr_torrentGetMetadataPiece (tr_torrent * tor, int piece, size_t * len)
+static void
+metadataCacheRef (struct tr_metadata_cache * mc)
 {
-  char * ret = NULL;
+  tr_lockLock (mc->lock);
+  ++mc->refCount;
+  tr_lockUnlock (mc->lock);
+}
 
-  assert (tr_isTorrent (tor));
-  assert (piece >= 0);
-  assert (len != NULL);
+static void
+metadataCacheUnref (struct tr_metadata_cache * mc)
+{
+  int refCount;
 
-  if (tr_torrentHasMetadata (tor))
+  tr_lockLock (mc->lock);
+  refCount = --mc->refCount;
+  tr_lockUnlock (mc->lock);
+
+  if (refCount == 0)
+    {
+      tr_lockFree (mc->lock);
+      tr_free (mc->data);
+      tr_free (mc);
+    }
+}
+
+/* evbuffer_ref_cleanup_cb */
+static void
+onMetadataPieceSent (const void * data UNUSED, size_t len UNUSED, void * vmc)
+{
+  metadataCacheUnref (vmc);
+}
+
+void
+tr_torrentDropMetadataCache (tr_torrent * tor)
+{
+  struct tr_metadata_cache * mc = tor->metadataCache;
+
+  if (mc != NULL)
+    {
+      tor->session->metadataCacheBytes -= mc->len;
+      tor->metadataCache = NULL;
+      metadataCacheUnref (mc);
+    }
+}
+
+static void
+setMetadataCache (tr_torrent * tor, uint8_t * data, size_t len)
+{
+  struct tr_metadata_cache * mc;
+  tr_session * session = tor->session;
+
+  tr_torrentDropMetadataCache (tor);
+
+  /* make room by dropping the info dicts that were used least recently */
+  while (session->metadataCacheBytes > 0
+         && session->metadataCacheBytes + len > metadataCacheLimit)
+    {
+      tr_torrent * t = NULL;
+      tr_torrent * oldest = NULL;
+
+      while ((t = tr_torrentNext (session, t)))
+        if (t->metadataCache != NULL)
+          if (oldest == NULL || t->metadataCache->usedAt < oldest->metadataCache->usedAt)
+            oldest = t;
+
+      if (oldest == NULL)
+        break;
+
+      tr_torrentDropMetadataCache (oldest);
+    }
+
+  mc = tr_new0 (struct tr_metadata_cache, 1);
+  mc->lock = tr_lockNew ();
+  mc->refCount = 1;
+  mc->usedAt = ++metadataCacheClock;
+  mc->len = len;
+  mc->data = data;
+
+  tor->metadataCache = mc;
+  tor->metadataCacheFailedAt = 0;
+  session->metadataCacheBytes += len;
+}
+
+void
+tr_metadataCacheSetLimit (size_t maxBytes)
+{
+  metadataCacheLimit = maxBytes;
+}
+
+/* read the info dict from the .torrent file, making sure it's the
+ * right one, since the offset is found by searching the file for it.
+ * If that fails, peers asking for it are turned away for a while
+ * without looking at the file again */
+static struct tr_metadata_cache *
+getMetadataCache (tr_torrent * tor)
+{
+  if (tor->metadataCache == NULL
+      && (tor->metadataCacheFailedAt == 0
+          || tor->metadataCacheFailedAt + METADATA_CACHE_RETRY_SECS <= tr_time ()))
     {
       tr_sys_file_t fd;
+      uint8_t * data = NULL;
+      const size_t len = tor->infoDictLength;
 
       ensureInfoDictOffsetIsCached (tor);
 
-      assert (tor->infoDictLength > 0);
+      assert (len > 0);
+
+      ++tor->session->metadataCacheLoads;
 
       fd = tr_sys_file_open (tor->info.torrent, TR_SYS_FILE_READ, 0, NULL);
       if (fd != TR_BAD_SYS_FILE)
         {
-          const size_t o = piece * METADATA_PIECE_SIZE;
+          uint64_t n;
+          uint8_t sha1[SHA_DIGEST_LENGTH];
 
-          if (tr_sys_file_seek (fd, tor->infoDictOffset + o, TR_SEEK_SET, NULL, NULL))
-            {
-              const size_t l = o + METADATA_PIECE_SIZE <= tor->infoDictLength
-                             ? METADATA_PIECE_SIZE
-                             : tor->infoDictLength - o;
+          data = tr_new (uint8_t, len);
 
-              if (0<l && l<=METADATA_PIECE_SIZE)
-                {
-                  char * buf = tr_new (char, l);
-                  uint64_t n;
-                  if (tr_sys_file_read (fd, buf, l, &n, NULL) && n == l)
-                    {
-                      *len = l;
-                      ret = buf;
-                      buf = NULL;
-                    }
-
-                  tr_free (buf);
-                }
+          if (!tr_sys_file_read_at (fd, data, len, tor->infoDictOffset, &n, NULL)
+              || n != len
+              || !tr_sha1 (sha1, data, (int) len, NULL)
+              || memcmp (sha1, tor->info.hash, SHA_DIGEST_LENGTH) != 0)
+            {
+              tr_free (data);
+              data = NULL;
             }
 
           tr_sys_file_close (fd, NULL);
         }
+
+      if (data != NULL)
+        setMetadataCache (tor, data, len);
+      else
+        tor->metadataCacheFailedAt = tr_time ();
     }
 
-  assert (ret == NULL || *len > 0);
+  if (tor->metadataCache != NULL)
+    tor->metadataCache->usedAt = ++metadataCacheClock;
 
-  return ret;
+  return tor->metadataCache;
+}
+
+size_t
+tr_torrentGetMetadataPiece (tr_torrent * tor, int piece, struct evbuffer * buf)
+{
+  size_t len = 0;
+  struct tr_metadata_cache * mc;
+
+  assert (tr_isTorrent (tor));
+  assert (piece >= 0);
+  assert (buf != NULL);
+
+  if (tr_torrentHasMetadata (tor) && (mc = getMetadataCache (tor)) != NULL)
+    {
+      const size_t o = (size_t) piece * METADATA_PIECE_SIZE;
+
+      if (o < mc->len)
+        {
+          len = MIN (mc->len - o, METADATA_PIECE_SIZE);
+
+          /* the evbuffer holds a reference until the piece has been sent */
+          metadataCacheRef (mc);
+          if (evbuffer_add_reference (buf, mc->data + o, len, onMetadataPieceSent, mc) != 0)
+            {
+              metadataCacheUnref (mc);
+              len = 0;
+            }
+        }
+    }
+
+  tor->session->metadataBytesSent += len;
+
+  return len;
 }
 
 void
@@ -253,6 +438,16 @@ tr_torrentSetMetadataPiece (tr_torrent  * tor, int piece, const void  * data, in
 
   dbgmsg (tor, "saving metainfo piece %d... %d remain", piece, m->piecesNeededCount);
 
+  /* hash as much of the info dict as we have in order */
+  tr_bitfieldAdd (&m->piecesReceived, piece);
+  while (m->hashedCount < m->pieceCount && tr_bitfieldHas (&m->piecesReceived, m->hashedCount))
+    {
+      const int hashOffset = m->hashedCount * METADATA_PIECE_SIZE;
+      const int hashLen = MIN (METADATA_PIECE_SIZE, m->metadata_size - hashOffset);
+      tr_sha1_update (m->sha, m->metadata + hashOffset, hashLen);
+      ++m->hashedCount;
+    }
+
   /* are we done? */
   if (m->piecesNeededCount == 0)
     {
@@ -263,8 +458,10 @@ tr_torrentSetMetadataPiece (tr_torrent  * tor, int piece, const void  * data, in
 
       /* we've got a complete set of metainfo... see if it passes the checksum test */
       dbgmsg (tor, "metainfo piece %d was the last one", piece);
-      tr_sha1 (sha1, m->metadata, m->metadata_size, NULL);
-      if ((checksumPassed = memcmp (sha1, tor->info.hash, SHA_DIGEST_LENGTH) == 0))
+      assert (m->hashedCount == m->pieceCount);
+      checksumPassed = tr_sha1_final (m->sha, sha1);
+      m->sha = NULL;
+      if (checksumPassed && (checksumPassed = memcmp (sha1, tor->info.hash, SHA_DIGEST_LENGTH) == 0))
         {
           /* checksum passed; now try to parse it as benc */
           tr_variant infoDict;
@@ -321,6 +518,14 @@ tr_torrentSetMetadataPiece (tr_torrent  * tor, int piece, const void  * data, in
 
       if (success)
         {
+          /* we've got the info dict in memory already, so keep it
+             for serving it to other peers */
+          if ((size_t) m->metadata_size == tor->infoDictLength)
+            {
+              setMetadataCache (tor, m->metadata, m->metadata_size);
+              m->metadata = NULL;
+            }
+
           incompleteMetadataFree (tor->incompleteMetadata);
           tor->incompleteMetadata = NULL;
           tor->isStopping = true;
@@ -329,14 +534,8 @@ tr_torrentSetMetadataPiece (tr_torrent  * tor, int piece, const void  * data, in
         }
         else /* drat. */
         {
-          const int n = m->pieceCount;
-          for (i=0; i<n; ++i)
-            {
-              m->piecesNeeded[i].piece = i;
-              m->piecesNeeded[i].requestedAt = 0;
-            }
-          m->piecesNeededCount = n;
-          dbgmsg (tor, "metadata error; trying again. %d pieces left", n);
+          incompleteMetadataReset (m);
+          dbgmsg (tor, "metadata error; trying again. %d pieces left", m->piecesNeededCount);
 
           tr_logAddError ("magnet status: checksum passed %d, metainfo parsed %d",
                   (int)checksumPassed, (int)metainfoParsed);
@@ -344,36 +543,102 @@ tr_torrentSetMetadataPiece (tr_torrent  * tor, int piece, const void  * data, in
     }
 }
 
+/* move piece node `i' to the front of the queue so that the next peer
+   looking for a piece to request asks for it */
+static void
+requeueMetadataPiece (struct tr_incomplete_metadata * m, int i)
+{
+  struct metadata_node node = m->piecesNeeded[i];
+
+  memmove (m->piecesNeeded + 1, m->piecesNeeded, sizeof (struct metadata_node) * i);
+  node.requestedAt = 0;
+  node.peer = NULL;
+  m->piecesNeeded[0] = node;
+}
+
 bool
-tr_torrentGetNextMetadataRequest (tr_torrent * tor, time_t now, int * setme_piece)
+tr_torrentGetNextMetadataRequest (tr_torrent * tor,
+                                  const void * peer,
+                                  time_t       now,
+                                  int        * setme_piece)
 {
-  bool have_request = false;
+  int i;
+  int retrySecs;
   struct tr_incomplete_metadata * m;
 
   assert (tr_isTorrent (tor));
 
   m = tor->incompleteMetadata;
+  if (m == NULL)
+    return false;
+
+  retrySecs = m->piecesNeededCount <= METADATA_ENDGAME_PIECES ? 0 : METADATA_RETRY_SECS;
 
-  if ((m != NULL) && (m->piecesNeededCount > 0)
-                  && (m->piecesNeeded[0].requestedAt + MIN_REPEAT_INTERVAL_SECS < now))
+  /* piecesNeeded is sorted by requestedAt, so the pieces nobody's been
+     asked for come first, then the ones that have waited the longest */
+  for (i=0; i<m->piecesNeededCount; ++i)
     {
-      int i;
-      const int piece = m->piecesNeeded[0].piece;
+      const struct metadata_node * node = &m->piecesNeeded[i];
+
+      if (node->requestedAt + retrySecs >= now)
+        break;
+
+      if (node->peer != peer || node->requestedAt + MIN_REPEAT_INTERVAL_SECS < now)
+        {
+          const int piece = node->piece;
+
+          tr_removeElementFromArray (m->piecesNeeded, i,
+                                     sizeof (struct metadata_node),
+                                     m->piecesNeededCount--);
+
+          i = m->piecesNeededCount++;
+          m->piecesNeeded[i].piece = piece;
+          m->piecesNeeded[i].requestedAt = now;
+          m->piecesNeeded[i].peer = peer;
+
+          dbgmsg (tor, "next piece to request: %d", piece);
+          *setme_piece = piece;
+          return true;
+        }
+    }
+
+  return false;
+}
+
+void
+tr_torrentMetadataRequestFailed (tr_torrent * tor, const void * peer, int piece)
+{
+  struct tr_incomplete_metadata * m;
 
-      tr_removeElementFromArray (m->piecesNeeded, 0,
-                                 sizeof (struct metadata_node),
-                                 m->piecesNeededCount--);
+  assert (tr_isTorrent (tor));
 
-      i = m->piecesNeededCount++;
-      m->piecesNeeded[i].piece = piece;
-      m->piecesNeeded[i].requestedAt = now;
+  if ((m = tor->incompleteMetadata) == NULL)
+    return;
 
-      dbgmsg (tor, "next piece to request: %d", piece);
-      *setme_piece = piece;
-      have_request = true;
+  for (int i = 0; i < m->piecesNeededCount; ++i)
+    {
+      if (m->piecesNeeded[i].piece == piece)
+        {
+          if (m->piecesNeeded[i].peer == peer)
+            requeueMetadataPiece (m, i);
+          break;
+        }
     }
+}
+
+void
+tr_torrentCancelMetadataRequests (tr_torrent * tor, const void * peer)
+{
+  struct tr_incomplete_metadata * m;
+
+  assert (tr_isTorrent (tor));
+
+  if ((m = tor->incompleteMetadata) == NULL)
+    return;
 
-  return have_request;
+  for (int i = 0; i < m->piecesNeededCount; ++i)
+    if (m->piecesNeeded[i].peer == peer)
+      requeueMetadataPiece (m, i);
 }
 
 double
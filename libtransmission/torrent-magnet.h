@@ -22,11 +22,41 @@ enum
     METADATA_PIECE_SIZE = (1024 * 16)
 };
 
-void* tr_torrentGetMetadataPiece (tr_torrent * tor, int piece, size_t * len);
+struct evbuffer;
+
+/**
+ * Appends a piece of the torrent's info dict to `buf'. The info dict is
+ * read once and kept in memory, and the piece is added by reference.
+ *
+ * @return the number of bytes added, or 0 if the piece can't be sent
+ */
+size_t tr_torrentGetMetadataPiece (tr_torrent * tor, int piece, struct evbuffer * buf);
+
+/** @brief let go of the in-memory copy of the torrent's info dict */
+void tr_torrentDropMetadataCache (tr_torrent * tor);
+
+/** @brief how many bytes of info dicts to keep in memory. For tests */
+void tr_metadataCacheSetLimit (size_t maxBytes);
 
 void tr_torrentSetMetadataPiece (tr_torrent * tor, int piece, const void * data, int len);
 
-bool tr_torrentGetNextMetadataRequest (tr_torrent * tor, time_t now, int * setme);
+/**
+ * @brief pick the next metadata piece to ask `peer' for.
+ *
+ * Pieces nobody's been asked for go first. A piece that's been asked for
+ * but hasn't arrived is handed to a different peer after a second or two,
+ * or right away when only a few pieces are left.
+ */
+bool tr_torrentGetNextMetadataRequest (tr_torrent * tor,
+                                       const void * peer,
+                                       time_t       now,
+                                       int        * setme);
+
+/** @brief `peer' rejected our request for a metadata piece */
+void tr_torrentMetadataRequestFailed (tr_torrent * tor, const void * peer, int piece);
+
+/** @brief `peer' is going away, so ask other peers for its pieces */
+void tr_torrentCancelMetadataRequests (tr_torrent * tor, const void * peer);
 
 bool tr_torrentSetMetadataSizeHint (tr_torrent * tor, int64_t metadata_size);
 
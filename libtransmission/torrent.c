@@ -32,10 +32,11 @@
 #include "cache.h"
 #include "completion.h"
 #include "crypto-utils.h" /* for tr_sha1 */
+#include "disk-io.h" /* tr_diskIoCancel () */
 #include "error.h"
 #include "fdlimit.h" /* tr_fdTorrentClose */
 #include "file.h"
-#include "inout.h" /* tr_ioTestPiece () */
+#include "inout.h" /* tr_ioFindFileLocation () */
 #include "log.h"
 #include "magnet.h"
 #include "metainfo.h"
@@ -43,6 +44,7 @@
 #include "peer-mgr.h"
 #include "platform.h" /* TR_PATH_DELIMITER_STR */
 #include "ptrarray.h"
+#include "relocate.h"
 #include "resume.h"
 #include "session.h"
 #include "torrent.h"
@@ -1241,6 +1243,17 @@ getVerifyProgress (const tr_torrent * tor)
   return d;
 }
 
+static double
+getVerifySpeed_KBps (const tr_torrent * tor, uint64_t now)
+{
+  const uint64_t msec = now - tor->verifyStartedAt;
+
+  if (tor->verifyStartedAt == 0 || msec == 0)
+    return 0;
+
+  return (tor->verifyBytesDone / (double)tr_speed_K) / (msec / 1000.0);
+}
+
 const tr_stat *
 tr_torrentStat (tr_torrent * tor)
 {
@@ -1279,6 +1292,8 @@ tr_torrentStat (tr_torrent * tor)
   s->webseedsSendingToUs = swarm_stats.activeWebseedCount;
   for (i=0; i<TR_PEER_FROM__MAX; i++)
     s->peersFrom[i] = swarm_stats.peerFromCount[i];
+  s->knownPeerCount      = swarm_stats.knownPeerCount;
+  s->knownPeerBytes      = swarm_stats.knownPeerBytes;
 
   s->rawUploadSpeed_KBps     = toSpeedKBps (tr_bandwidthGetRawSpeed_Bps (&tor->bandwidth, now, TR_UP));
   s->rawDownloadSpeed_KBps   = toSpeedKBps (tr_bandwidthGetRawSpeed_Bps (&tor->bandwidth, now, TR_DOWN));
@@ -1294,6 +1309,9 @@ tr_torrentStat (tr_torrent * tor)
   s->leftUntilDone       = tr_torrentGetLeftUntilDone (tor);
   s->sizeWhenDone        = tr_cpSizeWhenDone (&tor->completion);
   s->recheckProgress     = s->activity == TR_STATUS_CHECK ? getVerifyProgress (tor) : 0;
+  s->recheckSpeed_KBps   = s->activity == TR_STATUS_CHECK ? getVerifySpeed_KBps (tor, now) : 0;
+  s->relocateProgress    = 0;
+  s->isRelocating        = tr_relocateGetProgress (tor, &s->relocateProgress);
   s->activityDate        = tor->activityDate;
   s->addedDate           = tor->addedDate;
   s->doneDate            = tor->doneDate;
@@ -1576,9 +1594,19 @@ freeTorrent (tr_torrent * tor)
 
   tr_peerMgrRemoveTorrent (tor);
 
+  tr_relocateRemove (tor);
+
+  /* this also frees any background piece checks and preallocations */
+  tr_ioStopPreallocations (tor);
+  tr_cacheCancelFlushes (session->cache, tor);
+  tr_diskIoCancel (session->diskIo, tor);
+  tor->pieceChecks = NULL;
+  tor->preallocations = NULL;
+
   tr_announcerRemoveTorrent (session->announcer, tor);
 
   tr_cpDestruct (&tor->completion);
+  tr_torrentDropMetadataCache (tor);
 
   tr_free (tor->downloadDir);
   tr_free (tor->incompleteDir);
@@ -1850,27 +1878,21 @@ tr_torrentSave (tr_torrent * tor)
 }
 
 static void
-stopTorrent (void * vtor)
+onStopFlushed (tr_torrent * tor, int err, void * user_data UNUSED)
 {
-  tr_torrent * tor = vtor;
-  tr_logAddTorInfo (tor, "%s", "Pausing");
-
-  assert (tr_isTorrent (tor));
+  /* the torrent is being freed */
+  if (err == ECANCELED)
+    return;
 
   tr_torrentLock (tor);
 
-  tr_verifyRemove (tor);
-  tr_peerMgrStopTorrent (tor);
-  tr_announcerTorrentStopped (tor);
-  tr_cacheFlushTorrent (tor->session->cache, tor);
-
-  tr_fdTorrentClose (tor->session, tor->uniqueId);
+  /* it may have been started again while the cache was being flushed */
+  if (!tor->isRunning)
+    tr_fdTorrentClose (tor->session, tor->uniqueId);
 
   if (!tor->isDeleting)
     tr_torrentSave (tor);
 
-  torrentSetQueued (tor, false);
-
   tr_torrentUnlock (tor);
 
   if (tor->magnetVerify)
@@ -1882,6 +1904,29 @@ stopTorrent (void * vtor)
     }
 }
 
+static void
+stopTorrent (void * vtor)
+{
+  tr_torrent * tor = vtor;
+  tr_logAddTorInfo (tor, "%s", "Pausing");
+
+  assert (tr_isTorrent (tor));
+
+  tr_torrentLock (tor);
+
+  tr_verifyRemove (tor);
+  tr_peerMgrStopTorrent (tor);
+  tr_announcerTorrentStopped (tor);
+  tr_ioStopPreallocations (tor);
+  torrentSetQueued (tor, false);
+
+  /* the files are closed and the resume file is saved in onStopFlushed (),
+   * once the disk I/O threads have written out the torrent's cached blocks */
+  tr_cacheFlushTorrentAsync (tor->session->cache, tor, onStopFlushed, NULL);
+
+  tr_torrentUnlock (tor);
+}
+
 void
 tr_torrentStop (tr_torrent * tor)
 {
@@ -1917,6 +1962,10 @@ closeTorrent (void * vtor)
   tor->magnetVerify = false;
   stopTorrent (tor);
 
+  /* the torrent is freed below, so this can't wait for onStopFlushed () */
+  tr_cacheFlushTorrent (tor->session->cache, tor);
+  tr_fdTorrentClose (tor->session, tor->uniqueId);
+
   if (tor->isDeleting)
     {
       tr_metainfoRemoveSaved (tor->session, &tor->info);
@@ -2203,6 +2252,10 @@ tr_torrentRecheckCompleteness (tr_torrent * tor)
 {
   tr_completeness completeness;
 
+  /* onFileFlushed () checks again once the finished files are renamed */
+  if (tor->completingFiles > 0)
+    return;
+
   tr_torrentLock (tor);
 
   completeness = tr_cpGetStatus (&tor->completion);
@@ -2631,18 +2684,192 @@ tr_torrentSetChecked (tr_torrent * tor, time_t when)
     tor->info.pieces[i].timeChecked = when;
 }
 
-bool
-tr_torrentCheckPiece (tr_torrent * tor, tr_piece_index_t pieceIndex)
+/***
+****  Checking pieces in the background
+***/
+
+static void onDownloadedPieceChecked (tr_torrent * tor, tr_piece_index_t piece, bool pass);
+
+struct tr_piece_check
 {
-  const bool pass = tr_ioTestPiece (tor, pieceIndex);
+  tr_torrent * tor;
+  tr_piece_index_t piece;
+  bool downloaded; /* the piece's last block just arrived from a peer */
 
-  tr_deeplog_tor (tor, "[LAZY] tr_torrentCheckPiece tested piece %zu, pass==%d", (size_t)pieceIndex, (int)pass);
-  tr_torrentSetHasPiece (tor, pieceIndex, pass);
-  tr_torrentSetPieceChecked (tor, pieceIndex);
-  tor->anyDate = tr_time ();
-  tr_torrentSetDirty (tor);
+  tr_sha1_ctx_t sha; /* the hash of the piece up to offset, or NULL */
+  uint32_t offset;
+
+  uint8_t * buf; /* the rest of the piece, from offset on */
+  uint32_t buflen;
+  int pendingReads;
+  int err;
+  bool pass;
+
+  struct tr_piece_check * next;
+};
 
-  return pass;
+static void
+pieceCheckFree (struct tr_piece_check * check)
+{
+  if (check->sha != NULL)
+    tr_sha1_final (check->sha, NULL);
+
+  tr_free (check->buf);
+  tr_free (check);
+}
+
+static void
+pieceCheckRemove (tr_torrent * tor, struct tr_piece_check * check)
+{
+  struct tr_piece_check ** walk;
+
+  for (walk=&tor->pieceChecks; *walk!=NULL; walk=&(*walk)->next)
+    {
+      if (*walk == check)
+        {
+          *walk = check->next;
+          break;
+        }
+    }
+}
+
+/* called in a worker thread */
+static void
+pieceCheckHash (void * vcheck)
+{
+  bool ok;
+  struct tr_piece_check * check = vcheck;
+  const tr_sha1_ctx_t sha = check->sha != NULL ? check->sha : tr_sha1_init ();
+  uint8_t hash[SHA_DIGEST_LENGTH];
+
+  check->sha = NULL;
+  ok = tr_sha1_update (sha, check->buf, check->buflen);
+  check->pass = tr_sha1_final (sha, ok ? hash : NULL)
+             && ok
+             && memcmp (hash, check->tor->info.pieces[check->piece].hash, SHA_DIGEST_LENGTH) == 0;
+}
+
+static void
+onPieceCheckDone (void * vcheck, bool cancelled)
+{
+  struct tr_piece_check * check = vcheck;
+  tr_torrent * tor = check->tor;
+
+  /* if cancelled, the torrent is being freed */
+  if (!cancelled)
+    {
+      const bool pass = check->pass;
+      const tr_piece_index_t piece = check->piece;
+
+      pieceCheckRemove (tor, check);
+
+      if (check->downloaded)
+        {
+          onDownloadedPieceChecked (tor, piece, pass);
+        }
+      else
+        {
+          tr_deeplog_tor (tor, "[LAZY] background check of piece %zu, pass==%d", (size_t)piece, (int)pass);
+          tr_torrentSetHasPiece (tor, piece, pass);
+          tr_torrentSetPieceChecked (tor, piece);
+          tor->anyDate = tr_time ();
+          tr_torrentSetDirty (tor);
+
+          if (!pass)
+            tr_torrentSetLocalError (tor, _("Please Verify Local Data! Piece #%zu is corrupt."), (size_t)piece);
+        }
+    }
+
+  pieceCheckFree (check);
+}
+
+static void
+onPieceCheckRead (tr_torrent * tor, int err, void * vcheck)
+{
+  struct tr_piece_check * check = vcheck;
+
+  if (err && !check->err)
+    check->err = err;
+
+  if (--check->pendingReads > 0)
+    return;
+
+  if (check->err == ECANCELED)
+    {
+      pieceCheckFree (check);
+    }
+  else if (check->err)
+    {
+      check->pass = false;
+      onPieceCheckDone (check, false);
+    }
+  else
+    {
+      /* we have the whole piece; hash it in a worker thread too */
+      tr_diskIoSubmit (tor->session->diskIo, tor, pieceCheckHash, onPieceCheckDone, check);
+    }
+}
+
+/* read the piece from `offset' on, then finish hashing it from `sha'
+   in a worker thread. The check owns `sha' from here on */
+static void
+pieceCheckStart (tr_torrent       * tor,
+                 tr_piece_index_t   pieceIndex,
+                 bool               downloaded,
+                 tr_sha1_ctx_t      sha,
+                 uint32_t           offset)
+{
+  uint32_t pos;
+  struct tr_piece_check * check;
+
+  check = tr_new0 (struct tr_piece_check, 1);
+  check->tor = tor;
+  check->piece = pieceIndex;
+  check->downloaded = downloaded;
+  check->sha = sha;
+  check->offset = offset;
+  check->buflen = tr_torPieceCountBytes (tor, pieceIndex) - offset;
+  check->buf = tr_valloc (check->buflen);
+  check->next = tor->pieceChecks;
+  tor->pieceChecks = check;
+
+  /* hold a reference so that blocks found in the cache
+     can't finish the check before all the reads are queued */
+  check->pendingReads = 1;
+
+  for (pos=0; pos<check->buflen && !check->err; pos+=tor->blockSize)
+    {
+      int err;
+      const uint32_t len = MIN (tor->blockSize, check->buflen - pos);
+
+      ++check->pendingReads;
+      err = tr_cacheReadBlockAsync (tor->session->cache, tor, pieceIndex, offset + pos, len,
+                                    check->buf + pos, tor, onPieceCheckRead, check);
+      if (err)
+        onPieceCheckRead (tor, err, check);
+    }
+
+  onPieceCheckRead (tor, 0, check);
+}
+
+void
+tr_torrentCheckPieceAsync (tr_torrent * tor, tr_piece_index_t pieceIndex)
+{
+  struct tr_piece_check * check;
+
+  assert (tr_isTorrent (tor));
+  assert (pieceIndex < tor->info.pieceCount);
+  assert (tr_amInEventThread (tor->session));
+
+  /* is it already being checked? */
+  for (check=tor->pieceChecks; check!=NULL; check=check->next)
+    if (check->piece == pieceIndex)
+      return;
+
+  /* the file changed behind our back, so don't trust the read cache */
+  tr_cacheForgetPiece (tor->session->cache, tor, pieceIndex);
+
+  pieceCheckStart (tor, pieceIndex, false, NULL, 0);
 }
 
 time_t
@@ -2771,6 +2998,11 @@ tr_torrentSetAnnounceList (tr_torrent             * tor,
 
           tr_metainfoFree (&tmpInfo);
           tr_variantToFile (&metainfo, TR_VARIANT_FMT_BENC, tor->info.torrent);
+
+          /* the info dict might have moved in the file,
+             and reading it might work this time */
+          tor->infoDictOffsetIsCached = false;
+          tor->metadataCacheFailedAt = 0;
         }
 
       /* cleanup */
@@ -2853,11 +3085,15 @@ tr_torrentGetBytesLeftToAllocate (const tr_torrent * tor)
         {
           tr_sys_path_info info;
           const uint64_t length = tor->info.files[i].length;
+          const uint64_t preallocLeft = tr_ioGetPreallocationBytesLeft (tor, i);
           char * path = tr_torrentFindFile (tor, i);
 
           bytesLeft += length;
 
-          if (path != NULL &&
+          /* a file being preallocated may already have its full size */
+          if (preallocLeft > 0)
+            bytesLeft -= length - preallocLeft;
+          else if (path != NULL &&
               tr_sys_path_get_info (path, 0, &info, NULL) &&
               info.type == TR_SYS_PATH_IS_FILE &&
               info.size <= length)
@@ -3092,6 +3328,9 @@ tr_torrentDeleteLocalData (tr_torrent * tor, tr_fileFunc func)
   if (func == NULL)
     func = tr_sys_path_remove;
 
+  /* don't leave a half-finished copy of the data behind */
+  tr_relocateRemove (tor);
+
   /* close all the files because we're about to delete them */
   tr_cacheFlushTorrent (tor->session->cache, tor);
   tr_fdTorrentClose (tor->session, tor->uniqueId);
@@ -3112,15 +3351,27 @@ struct LocationData
   tr_torrent * tor;
 };
 
+/* called when tr_relocateAdd () has moved all of the files */
+static void
+onRelocated (tr_torrent * tor, const char * location)
+{
+  /* blow away the leftover subdirectories in the old location */
+  tr_torrentDeleteLocalData (tor, tr_sys_path_remove);
+
+  /* set the new location */
+  tr_torrentSetDownloadDir (tor, location);
+  tr_free (tor->incompleteDir);
+  tor->incompleteDir = NULL;
+  tor->currentDir = tor->downloadDir;
+}
+
 static void
 setLocation (void * vdata)
 {
-  bool err = false;
   struct LocationData * data = vdata;
   tr_torrent * tor = data->tor;
   const bool do_move = data->move_from_old_location;
   const char * location = data->location;
-  double bytesHandled = 0;
   tr_torrentLock (tor);
 
   assert (tr_isTorrent (tor));
@@ -3128,77 +3379,39 @@ setLocation (void * vdata)
   tr_logAddDebug ("Moving \"%s\" location from currentDir \"%s\" to \"%s\"",
                   tr_torrentName (tor), tor->currentDir, location);
 
+  /* if the torrent's already being moved somewhere else, stop that */
+  tr_relocateRemove (tor);
+
   tr_sys_dir_create (location, TR_SYS_DIR_CREATE_PARENTS, 0777, NULL);
 
-  if (!tr_sys_path_is_same (location, tor->currentDir, NULL))
+  if (do_move && !tr_sys_path_is_same (location, tor->currentDir, NULL))
     {
-      tr_file_index_t i;
-
       /* bad idea to move files while they're being verified... */
       tr_verifyRemove (tor);
 
-      /* try to move the files.
-       * FIXME: there are still all kinds of nasty cases, like what
-       * if the target directory runs out of space halfway through... */
-      for (i=0; !err && i<tor->info.fileCount; ++i)
-        {
-          char * sub;
-          const char * oldbase;
-          const tr_file * f = &tor->info.files[i];
-
-          if (tr_torrentFindFile2 (tor, i, &oldbase, &sub, NULL))
-            {
-              char * oldpath = tr_buildPath (oldbase, sub, NULL);
-              char * newpath = tr_buildPath (location, sub, NULL);
-
-              tr_logAddDebug ("Found file #%d: %s", (int)i, oldpath);
-
-              if (do_move && !tr_sys_path_is_same (oldpath, newpath, NULL))
-                {
-                  tr_error * error = NULL;
-
-                  tr_logAddTorInfo (tor, "moving \"%s\" to \"%s\"", oldpath, newpath);
-                  if (!tr_moveFile (oldpath, newpath, &error))
-                    {
-                      err = true;
-                      tr_logAddTorErr (tor, "error moving \"%s\" to \"%s\": %s",
-                                       oldpath, newpath, error->message);
-                      tr_error_free (error);
-                    }
-                }
-
-              tr_free (newpath);
-              tr_free (oldpath);
-              tr_free (sub);
-            }
-
-          if (data->setme_progress != NULL)
-            {
-              bytesHandled += f->length;
-              *data->setme_progress = bytesHandled / tor->info.totalSize;
-            }
-        }
+      /* the files are moved in the background while the torrent keeps
+       * running from its old location; when that's done, the torrent
+       * is pointed at the new one and setme_state is set */
+      tr_relocateAdd (tor, location, onRelocated, data->setme_progress, data->setme_state);
+    }
+  else
+    {
+      if (!tr_sys_path_is_same (location, tor->currentDir, NULL))
+        tr_torrentSetDownloadDir (tor, location);
 
-      if (!err)
+      if (do_move)
         {
-          /* blow away the leftover subdirectories in the old location */
-          if (do_move)
-            tr_torrentDeleteLocalData (tor, tr_sys_path_remove);
-
-          /* set the new location and reverify */
-          tr_torrentSetDownloadDir (tor, location);
+          tr_free (tor->incompleteDir);
+          tor->incompleteDir = NULL;
+          tor->currentDir = tor->downloadDir;
         }
-    }
 
-  if (!err && do_move)
-    {
-      tr_free (tor->incompleteDir);
-      tor->incompleteDir = NULL;
-      tor->currentDir = tor->downloadDir;
-    }
+      if (data->setme_progress != NULL)
+        *data->setme_progress = 1;
 
-  if (data->setme_state != NULL)
-    *data->setme_state = err ? TR_LOC_ERROR : TR_LOC_DONE;
+      if (data->setme_state != NULL)
+        *data->setme_state = TR_LOC_DONE;
+    }
 
   /* cleanup */
   tr_torrentUnlock (tor);
@@ -3237,19 +3450,28 @@ tr_torrentSetLocation (tr_torrent       * tor,
 ****
 ***/
 
+/* called when a finished file's blocks have been written to disk */
 static void
-tr_torrentFileCompleted (tr_torrent * tor, tr_file_index_t fileIndex)
+onFileFlushed (tr_torrent * tor, int err, void * vfileIndex)
 {
   char * sub;
   const char * base;
+  const tr_file_index_t fileIndex = *(tr_file_index_t*)vfileIndex;
   const tr_info * inf = &tor->info;
   const tr_file * f = &inf->files[fileIndex];
   tr_piece * p;
   const tr_piece * pend;
   const time_t now = tr_time ();
 
+  tr_free (vfileIndex);
+
+  /* the torrent is being freed */
+  if (err == ECANCELED)
+    return;
+
+  tr_torrentLock (tor);
+
   /* close the file so that we can reopen in read-only mode as needed */
-  tr_cacheFlushFile (tor->session->cache, tor, fileIndex);
   tr_fdFileClose (tor->session, tor, fileIndex);
 
   /* now that the file is complete and closed, we can start watching its
@@ -3280,6 +3502,21 @@ tr_torrentFileCompleted (tr_torrent * tor, tr_file_index_t fileIndex)
 
       tr_free (sub);
     }
+
+  /* the completeness check waited for the files to get their real names */
+  if (--tor->completingFiles == 0)
+    tr_torrentRecheckCompleteness (tor);
+
+  tr_torrentUnlock (tor);
+}
+
+static void
+tr_torrentFileCompleted (tr_torrent * tor, tr_file_index_t fileIndex)
+{
+  /* the file is renamed once the disk I/O threads have written its blocks */
+  ++tor->completingFiles;
+  tr_cacheFlushFileAsync (tor->session->cache, tor, fileIndex,
+                          onFileFlushed, tr_memdup (&fileIndex, sizeof (fileIndex)));
 }
 
 static void
@@ -3289,6 +3526,11 @@ tr_torrentPieceCompleted (tr_torrent * tor, tr_piece_index_t pieceIndex)
 
   tr_peerMgrPieceCompleted (tor, pieceIndex);
 
+  /* a file that's flushed right away mustn't let the completeness check
+   * run before the rest of this piece's files are flushed, too. The
+   * peer manager checks completeness after this */
+  ++tor->completingFiles;
+
   /* if this piece completes any file, invoke the fileCompleted func for it */
   for (i=0; i<tor->info.fileCount; ++i)
     {
@@ -3298,6 +3540,31 @@ tr_torrentPieceCompleted (tr_torrent * tor, tr_piece_index_t pieceIndex)
         if (tr_cpFileIsComplete (&tor->completion, i))
           tr_torrentFileCompleted (tor, i);
     }
+
+  --tor->completingFiles;
+}
+
+static void
+onDownloadedPieceChecked (tr_torrent * tor, tr_piece_index_t p, bool pass)
+{
+  tr_deeplog_tor (tor, "[LAZY] checked just-completed piece %zu, pass==%d", (size_t)p, (int)pass);
+  tr_torrentSetHasPiece (tor, p, pass);
+  tr_torrentSetPieceChecked (tor, p);
+  tor->anyDate = tr_time ();
+  tr_torrentSetDirty (tor);
+
+  if (pass)
+    {
+      tr_torrentPieceCompleted (tor, p);
+    }
+  else
+    {
+      const uint32_t n = tr_torPieceCountBytes (tor, p);
+      tr_logAddTorErr (tor, _("Piece %"PRIu32", which was just downloaded, failed its checksum test"), p);
+      tor->corruptCur += n;
+      tor->downloadedCur -= MIN (tor->downloadedCur, n);
+      tr_peerMgrGotBadPiece (tor, p);
+    }
 }
 
 void
@@ -3318,19 +3585,26 @@ tr_torrentGotBlock (tr_torrent * tor, tr_block_index_t block)
       p = tr_torBlockPiece (tor, block);
       if (tr_torrentPieceIsComplete (tor, p))
         {
+          uint32_t offset;
+          tr_sha1_ctx_t sha;
+
           tr_logAddTorDbg (tor, "[LAZY] checking just-completed piece %zu", (size_t)p);
 
-          if (tr_torrentCheckPiece (tor, p))
+          /* usually the piece was hashed as its blocks were downloaded.
+             If some of them reached the disk first, they're read back
+             and hashed by the disk I/O threads */
+          sha = tr_cacheTakePieceHash (tor->session->cache, tor, p, &offset);
+          if (sha != NULL && offset == tr_torPieceCountBytes (tor, p))
             {
-              tr_torrentPieceCompleted (tor, p);
+              uint8_t hash[SHA_DIGEST_LENGTH];
+              const bool pass = tr_sha1_final (sha, hash)
+                             && memcmp (hash, tor->info.pieces[p].hash, SHA_DIGEST_LENGTH) == 0;
+
+              onDownloadedPieceChecked (tor, p, pass);
             }
           else
             {
-              const uint32_t n = tr_torPieceCountBytes (tor, p);
-              tr_logAddTorErr (tor, _("Piece %"PRIu32", which was just downloaded, failed its checksum test"), p);
-              tor->corruptCur += n;
-              tor->downloadedCur -= MIN (tor->downloadedCur, n);
-              tr_peerMgrGotBadPiece (tor, p);
+              pieceCheckStart (tor, p, true, sha, offset);
             }
         }
     }
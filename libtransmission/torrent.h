@@ -128,6 +128,7 @@ void             tr_torrentSetVerifyState (tr_torrent      * tor,
 tr_torrent_activity tr_torrentGetActivity (const tr_torrent * tor);
 
 struct tr_incomplete_metadata;
+struct tr_piece_check;
 
 /** @brief Torrent object */
 struct tr_torrent
@@ -148,6 +149,13 @@ struct tr_torrent
      * other peers */
     struct tr_incomplete_metadata  * incompleteMetadata;
 
+    /* The info dict, kept in memory to serve it to peers that got
+     * this torrent from a magnet link. See tr_torrentGetMetadataPiece () */
+    struct tr_metadata_cache       * metadataCache;
+
+    /* when reading the info dict from the .torrent file last failed, or 0 */
+    time_t                           metadataCacheFailedAt;
+
     /* If the initiator of the connection receives a handshake in which the
      * peer_id does not match the expected peerid, then the initiator is
      * expected to drop the connection. Note that the initiator presumably
@@ -254,6 +262,10 @@ struct tr_torrent
 
     tr_verify_state            verifyState;
 
+    /* how far along the current verify is, for tr_stat.recheckSpeed_KBps */
+    uint64_t                   verifyStartedAt;
+    uint64_t                   verifyBytesDone;
+
     time_t                     lastStatTime;
     tr_stat                    stats;
 
@@ -265,6 +277,19 @@ struct tr_torrent
 
     struct tr_swarm          * swarm;
 
+    /* pieces being checked by tr_torrentCheckPieceAsync () */
+    struct tr_piece_check    * pieceChecks;
+
+    /* files being preallocated in the background by inout.c */
+    struct tr_preallocation  * preallocations;
+
+    /* files that are done, but whose blocks are still being
+     * flushed; the completeness check waits for them */
+    int                        completingFiles;
+
+    /* set while tr_torrentSetLocation () is moving the files */
+    struct tr_relocation     * relocation;
+
     float                      desiredRatio;
     tr_ratiolimit              ratioLimitMode;
 
@@ -430,10 +455,12 @@ unsigned int tr_torrentGetSpeedLimit_Bps (const tr_torrent *, tr_direction);
 bool tr_torrentPieceNeedsCheck (const tr_torrent * tor, tr_piece_index_t pieceIndex);
 
 /**
- * @brief Test a piece against its info dict checksum
- * @return true if the piece's passes the checksum test
+ * @brief Test a piece against its info dict checksum. The piece is read
+ *        and hashed by the disk I/O threads. When the check is done, the
+ *        piece is marked as checked or, if it failed, as missing.
+ *        Does nothing if the piece is already being checked.
  */
-bool tr_torrentCheckPiece (tr_torrent * tor, tr_piece_index_t pieceIndex);
+void tr_torrentCheckPieceAsync (tr_torrent * tor, tr_piece_index_t pieceIndex);
 
 time_t tr_torrentGetFileMTime (const tr_torrent * tor, tr_file_index_t i);
 
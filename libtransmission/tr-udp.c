@@ -21,6 +21,10 @@ THE SOFTWARE.
 
 */
 
+#if (defined (HAVE_RECVMMSG) || defined (HAVE_SENDMMSG)) && !defined (_GNU_SOURCE)
+ #define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <string.h> /* memcmp (), memcpy (), memset () */
 #include <stdlib.h> /* malloc (), free () */
@@ -29,6 +33,7 @@ THE SOFTWARE.
  #include <io.h> /* dup2 () */
 #else
  #include <unistd.h> /* dup2 () */
+ #include <sys/socket.h> /* recvmmsg (), sendmmsg () */
 #endif
 
 #include <event2/event.h>
@@ -50,6 +55,44 @@ THE SOFTWARE.
 #define SEND_BUFFER_SIZE (1 * 1024 * 1024)
 #define SMALL_BUFFER_SIZE (32 * 1024)
 
+/* Where the platform has recvmmsg () and sendmmsg (), packets are read
+   and sent in batches of up to UDP_BATCH_SIZE, and a wakeup reads at most
+   UDP_MAX_BATCHES of them so that a flood of packets can't starve
+   the rest of the event loop. */
+
+#if defined (HAVE_RECVMMSG) && defined (HAVE_SENDMMSG)
+ #define UDP_USE_MMSG
+#endif
+
+#define UDP_PACKET_SIZE 4096
+#ifdef UDP_USE_MMSG
+ #define UDP_BATCH_SIZE 32
+ #define UDP_MAX_BATCHES 4
+#else
+ #define UDP_BATCH_SIZE 1
+#endif
+
+struct tr_udp_batch
+{
+    /* the packets read in one go */
+    unsigned char in[UDP_BATCH_SIZE][UDP_PACKET_SIZE];
+    struct sockaddr_storage from[UDP_BATCH_SIZE];
+
+    /* the uTP packets waiting to be sent, all to the same socket */
+    int depth;
+    int outCount;
+    tr_socket_t outSocket;
+    unsigned char out[UDP_BATCH_SIZE][UDP_PACKET_SIZE];
+    struct sockaddr_storage to[UDP_BATCH_SIZE];
+
+#ifdef UDP_USE_MMSG
+    struct iovec inIov[UDP_BATCH_SIZE];
+    struct mmsghdr inMsgs[UDP_BATCH_SIZE];
+    struct iovec outIov[UDP_BATCH_SIZE];
+    struct mmsghdr outMsgs[UDP_BATCH_SIZE];
+#endif
+};
+
 static void
 set_socket_buffers (tr_socket_t fd,
                     int         large)
@@ -196,21 +239,9 @@ rebind_ipv6 (tr_session *ss, bool force)
 }
 
 static void
-event_callback (evutil_socket_t s, short type UNUSED, void *sv)
+handle_packet (tr_session *ss, unsigned char *buf, int rc,
+               struct sockaddr *from, socklen_t fromlen)
 {
-    int rc;
-    socklen_t fromlen;
-    unsigned char buf[4096];
-    struct sockaddr_storage from;
-    tr_session *ss = sv;
-
-    assert (tr_isSession (sv));
-    assert (type == EV_READ);
-
-    fromlen = sizeof (from);
-    rc = recvfrom (s, (void *) buf, 4096 - 1, 0,
-                (struct sockaddr*)&from, &fromlen);
-
     /* Since most packets we receive here are ÂµTP, make quick inline
        checks for the other protocols.  The logic is as follows:
        - all DHT packets start with 'd';
@@ -222,7 +253,7 @@ event_callback (evutil_socket_t s, short type UNUSED, void *sv)
         if (buf[0] == 'd') {
             if (tr_sessionAllowsDHT (ss)) {
                 buf[rc] = '\0'; /* required by the DHT code */
-                tr_dhtCallback (buf, rc, (struct sockaddr*)&from, fromlen, sv);
+                tr_dhtCallback (buf, rc, from, fromlen, ss);
             }
         } else if (rc >= 8 &&
                    buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] <= 3) {
@@ -231,7 +262,7 @@ event_callback (evutil_socket_t s, short type UNUSED, void *sv)
                 tr_logAddNamedDbg ("UDP", "Couldn't parse UDP tracker packet.");
         } else {
             if (tr_sessionIsUTPEnabled (ss)) {
-                rc = tr_utpPacket (buf, rc, (struct sockaddr*)&from, fromlen, ss);
+                rc = tr_utpPacket (buf, rc, from, fromlen, ss);
                 if (!rc)
                     tr_logAddNamedDbg ("UDP", "Unexpected UDP packet");
             }
@@ -239,6 +270,153 @@ event_callback (evutil_socket_t s, short type UNUSED, void *sv)
     }
 }
 
+static void
+event_callback (evutil_socket_t s, short type UNUSED, void *sv)
+{
+    tr_session *ss = sv;
+    struct tr_udp_batch *b = ss->udp_batch;
+
+    assert (tr_isSession (sv));
+    assert (type == EV_READ);
+
+    ++ss->udpWakeups;
+
+    /* what libutp sends while the packets are being handled
+       goes out in one go once they all have been */
+    tr_udpBeginBatch (ss);
+
+#ifdef UDP_USE_MMSG
+    {
+        int i, n, batch;
+
+        for (batch=0; batch<UDP_MAX_BATCHES; ++batch) {
+            for (i=0; i<UDP_BATCH_SIZE; ++i) {
+                b->inIov[i].iov_base = b->in[i];
+                b->inIov[i].iov_len = UDP_PACKET_SIZE - 1;
+                memset (&b->inMsgs[i], 0, sizeof (b->inMsgs[i]));
+                b->inMsgs[i].msg_hdr.msg_name = &b->from[i];
+                b->inMsgs[i].msg_hdr.msg_namelen = sizeof (b->from[i]);
+                b->inMsgs[i].msg_hdr.msg_iov = &b->inIov[i];
+                b->inMsgs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            n = recvmmsg (s, b->inMsgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+            if (n <= 0)
+                break;
+
+            ss->udpPacketsReceived += n;
+            for (i=0; i<n; ++i)
+                handle_packet (ss, b->in[i], (int) b->inMsgs[i].msg_len,
+                               (struct sockaddr*)&b->from[i],
+                               b->inMsgs[i].msg_hdr.msg_namelen);
+
+            /* the socket has been drained */
+            if (n < UDP_BATCH_SIZE)
+                break;
+        }
+    }
+#else
+    {
+        int rc;
+        socklen_t fromlen = sizeof (b->from[0]);
+
+        rc = recvfrom (s, (void *) b->in[0], UDP_PACKET_SIZE - 1, 0,
+                       (struct sockaddr*)&b->from[0], &fromlen);
+        if (rc > 0)
+            ++ss->udpPacketsReceived;
+        handle_packet (ss, b->in[0], rc, (struct sockaddr*)&b->from[0], fromlen);
+    }
+#endif
+
+    tr_udpEndBatch (ss);
+}
+
+static void
+flush_batch (tr_session *ss)
+{
+    struct tr_udp_batch *b = ss->udp_batch;
+
+#ifdef UDP_USE_MMSG
+    int i = 0;
+
+    while (i < b->outCount) {
+        const int n = sendmmsg (b->outSocket, b->outMsgs + i, b->outCount - i, 0);
+
+        /* as with sendto () below, lost packets are uTP's problem */
+        if (n <= 0)
+            break;
+
+        ++ss->udpSendCalls;
+        ss->udpPacketsSent += n;
+        i += n;
+    }
+#endif
+
+    b->outCount = 0;
+}
+
+void
+tr_udpSendTo (tr_session *ss, const unsigned char *buf, size_t buflen,
+              const struct sockaddr *to, socklen_t tolen)
+{
+    tr_socket_t s;
+    struct tr_udp_batch *b = ss->udp_batch;
+
+    if (to->sa_family == AF_INET && ss->udp_socket != TR_BAD_SOCKET)
+        s = ss->udp_socket;
+    else if (to->sa_family == AF_INET6 && ss->udp6_socket != TR_BAD_SOCKET)
+        s = ss->udp6_socket;
+    else
+        return;
+
+#ifdef UDP_USE_MMSG
+    if (b != NULL && b->depth > 0 && buflen <= UDP_PACKET_SIZE && tolen <= sizeof (b->to[0])) {
+        int i;
+
+        if (b->outCount > 0 && b->outSocket != s)
+            flush_batch (ss);
+
+        i = b->outCount++;
+        b->outSocket = s;
+        memcpy (b->out[i], buf, buflen);
+        memcpy (&b->to[i], to, tolen);
+        b->outIov[i].iov_base = b->out[i];
+        b->outIov[i].iov_len = buflen;
+        memset (&b->outMsgs[i], 0, sizeof (b->outMsgs[i]));
+        b->outMsgs[i].msg_hdr.msg_name = &b->to[i];
+        b->outMsgs[i].msg_hdr.msg_namelen = tolen;
+        b->outMsgs[i].msg_hdr.msg_iov = &b->outIov[i];
+        b->outMsgs[i].msg_hdr.msg_iovlen = 1;
+
+        if (b->outCount == UDP_BATCH_SIZE)
+            flush_batch (ss);
+        return;
+    }
+#else
+    (void) b;
+#endif
+
+    ++ss->udpSendCalls;
+    ++ss->udpPacketsSent;
+    sendto (s, (const void *) buf, buflen, 0, to, tolen);
+}
+
+void
+tr_udpBeginBatch (tr_session *ss)
+{
+    if (ss->udp_batch != NULL)
+        ++ss->udp_batch->depth;
+}
+
+void
+tr_udpEndBatch (tr_session *ss)
+{
+    struct tr_udp_batch *b = ss->udp_batch;
+
+    if (b != NULL && --b->depth == 0 && b->outCount > 0)
+        flush_batch (ss);
+}
+
 void
 tr_udpInit (tr_session *ss)
 {
@@ -254,6 +432,8 @@ tr_udpInit (tr_session *ss)
     if (ss->udp_port <= 0)
         return;
 
+    ss->udp_batch = tr_new0 (struct tr_udp_batch, 1);
+
     ss->udp_socket = socket (PF_INET, SOCK_DGRAM, 0);
     if (ss->udp_socket == TR_BAD_SOCKET) {
         tr_logAddNamedError ("UDP", "Couldn't create IPv4 socket");
@@ -326,6 +506,9 @@ tr_udpUninit (tr_session *ss)
         ss->udp6_event = NULL;
     }
 
+    tr_free (ss->udp_batch);
+    ss->udp_batch = NULL;
+
     if (ss->udp6_bound) {
         free (ss->udp6_bound);
         ss->udp6_bound = NULL;
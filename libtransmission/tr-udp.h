@@ -31,6 +31,14 @@ void tr_udpInit (tr_session *);
 void tr_udpUninit (tr_session *);
 void tr_udpSetSocketBuffers (tr_session *);
 
+/* Sends a packet from the session's UDP socket for to's address family.
+   Between tr_udpBeginBatch () and tr_udpEndBatch () packets may be queued
+   and sent together, when the outermost batch ends. */
+void tr_udpSendTo (tr_session *, const unsigned char * buf, size_t buflen,
+                   const struct sockaddr * to, socklen_t tolen);
+void tr_udpBeginBatch (tr_session *);
+void tr_udpEndBatch (tr_session *);
+
 bool tau_handle_message (tr_session * session,
                          const uint8_t  * msg, size_t msglen);
 
@@ -33,6 +33,7 @@ THE SOFTWARE.
 #include "session.h"
 #include "crypto-utils.h" /* tr_rand_int_weak () */
 #include "peer-mgr.h"
+#include "tr-udp.h"
 #include "tr-utp.h"
 #include "utils.h"
 
@@ -130,10 +131,7 @@ tr_utpSendTo (void *closure, const unsigned char *buf, size_t buflen,
 {
     tr_session *ss = closure;
 
-    if (to->sa_family == AF_INET && ss->udp_socket != TR_BAD_SOCKET)
-        sendto (ss->udp_socket, (const void *) buf, buflen, 0, to, tolen);
-    else if (to->sa_family == AF_INET6 && ss->udp6_socket != TR_BAD_SOCKET)
-        sendto (ss->udp6_socket, (const void *) buf, buflen, 0, to, tolen);
+    tr_udpSendTo (ss, buf, buflen, to, tolen);
 }
 
 static void
@@ -160,7 +158,9 @@ static void
 timer_callback (evutil_socket_t s UNUSED, short type UNUSED, void *closure)
 {
     tr_session *ss = closure;
+    tr_udpBeginBatch (ss);
     UTP_CheckTimeouts ();
+    tr_udpEndBatch (ss);
     reset_timer (ss);
 }
 
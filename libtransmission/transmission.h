@@ -495,6 +495,79 @@ void tr_sessionGetCumulativeStats (const tr_session * session,
 
 void tr_sessionClearStats (tr_session * session);
 
+typedef struct tr_session_cache_stats
+{
+    uint64_t    readHits;     /* blocks read from the cache */
+    uint64_t    readMisses;   /* blocks that had to be read from disk */
+    uint64_t    readBytes;    /* bytes of torrent data read from disk */
+    uint64_t    readMsec;     /* time spent reading torrent data */
+
+    uint64_t    hashedPieces;   /* pieces checked without reading them back */
+    uint64_t    rehashedPieces; /* pieces that had to be read back to be checked */
+
+    uint64_t    blockWrites;  /* blocks written to the cache */
+    uint64_t    blockWriteBytes;
+
+    uint64_t    flushCount;   /* runs of blocks written to disk */
+    uint64_t    flushBlocks;  /* blocks written in those runs */
+    uint64_t    flushBytes;   /* bytes written in those runs */
+    uint64_t    flushMsec;    /* time from handing a run to the disk threads
+                                 until it was written */
+    uint64_t    writeMsec;    /* time spent writing torrent data */
+
+    uint64_t    suggestCount; /* SUGGEST messages sent for pieces in the cache */
+    uint64_t    suggestHits;  /* blocks of those pieces sent from the cache */
+    uint64_t    reorderHits;  /* blocks sent from the cache ahead of
+                                 requests that would have to be read */
+
+    uint64_t    metadataBytesSent; /* info dict bytes sent to magnet link peers */
+    uint64_t    metadataLoads;     /* times an info dict was read from disk */
+
+    double      bytesPerFlush;
+    double      averageRunLength; /* blocks per flush */
+}
+tr_session_cache_stats;
+
+/** @brief Get the disk cache and disk I/O statistics for the current session */
+void tr_sessionGetCacheStats (const tr_session       * session,
+                              tr_session_cache_stats * setme);
+
+typedef struct tr_session_udp_stats
+{
+    uint64_t    wakeups;          /* times the UDP sockets were readable */
+    uint64_t    packetsReceived;
+    uint64_t    sendCalls;        /* sendto () and sendmmsg () calls */
+    uint64_t    packetsSent;
+
+    double      packetsPerWakeup;
+    double      packetsPerSend;
+}
+tr_session_udp_stats;
+
+/** @brief Get the DHT, uTP and UDP tracker traffic statistics for the current session */
+void tr_sessionGetUdpStats (const tr_session     * session,
+                            tr_session_udp_stats * setme);
+
+typedef struct tr_session_ttfb_stats
+{
+    /* new peer connections that piece data has been moved over,
+       and how many of them got their first block from an allowed
+       fast set while choked */
+    uint64_t    downloadCount;
+    uint64_t    downloadFastCount;
+    uint64_t    uploadCount;
+    uint64_t    uploadFastCount;
+
+    /* the average time from connecting to the first block, in msec */
+    double      downloadMsec;
+    double      uploadMsec;
+}
+tr_session_ttfb_stats;
+
+/** @brief Get how long new peer connections took to start moving piece data */
+void tr_sessionGetTtfbStats (const tr_session      * session,
+                             tr_session_ttfb_stats * setme);
+
 /**
  * @brief Set whether or not torrents are allowed to do peer exchanges.
  *
@@ -516,6 +589,10 @@ void  tr_sessionSetLPDEnabled (tr_session * session, bool enabled);
 void  tr_sessionSetCacheLimit_MB (tr_session * session, int mb);
 int   tr_sessionGetCacheLimit_MB (const tr_session * session);
 
+/** @brief the read cache keeps blocks that were read from disk for uploading */
+void  tr_sessionSetReadCacheLimit_MB (tr_session * session, int mb);
+int   tr_sessionGetReadCacheLimit_MB (const tr_session * session);
+
 tr_encryption_mode tr_sessionGetEncryption (tr_session * session);
 void               tr_sessionSetEncryption (tr_session * session,
                                             tr_encryption_mode    mode);
@@ -1149,6 +1226,11 @@ enum
  * if move_from_previous_location is `true', the torrent's incompleteDir
  * will be clobberred s.t. additional files being added will be saved
  * to the torrent's downloadDir.
+ *
+ * The files are moved in the background and the torrent keeps running
+ * from its old location meanwhile. setme_state is TR_LOC_MOVING until
+ * the move is finished or fails, and tr_stat.relocateProgress shows
+ * how far along it is.
  */
 void tr_torrentSetLocation (tr_torrent       * torrent,
                             const char       * location,
@@ -1885,6 +1967,18 @@ typedef struct tr_stat
         @see tr_stat.activity */
     float recheckProgress;
 
+    /** When tr_stat.activity is TR_STATUS_CHECK, this is how fast
+        the files are being verified, in KiB/s. */
+    double recheckSpeed_KBps;
+
+    /** True while tr_torrentSetLocation () is moving the torrent's files.
+        The torrent keeps using its old location until they're all moved. */
+    bool isRelocating;
+
+    /** When tr_stat.isRelocating is true, this is how much of the
+        torrent's data has been moved. Range is [0..1] */
+    float relocateProgress;
+
     /** How much has been downloaded of the entire torrent.
         Range is [0..1] */
     float percentComplete;
@@ -1937,6 +2031,12 @@ typedef struct tr_stat
         or from incoming connections, or from our resume file. */
     int    peersFrom[TR_PEER_FROM__MAX];
 
+    /** Number of peers we know about, whether or not we're connected to them */
+    int    knownPeerCount;
+
+    /** How much memory we're using to keep track of those peers */
+    size_t knownPeerBytes;
+
     /** Number of peers that are sending data to us. */
     int    peersSendingToUs;
 
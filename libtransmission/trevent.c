@@ -281,11 +281,89 @@ tr_eventInit (tr_session * session)
         tr_wait_msec (100);
 }
 
+static void
+netThreadFunc (void * veh)
+{
+    tr_event_handle * eh = veh;
+
+#ifndef _WIN32
+    /* Don't exit when writing on a broken socket */
+    signal (SIGPIPE, SIG_IGN);
+#endif
+
+    while (!eh->die)
+        event_base_dispatch (eh->base);
+
+    tr_lockFree (eh->lock);
+    event_base_free (eh->base);
+    tr_free (eh);
+    tr_logAddDebug ("Closing network thread");
+}
+
+void
+tr_eventSetNetThreadCount (tr_session * session, int count)
+{
+    assert (tr_isSession (session));
+    assert (count >= 0);
+
+    if (count <= session->netEventCount)
+        return;
+
+    session->netEvents = tr_renew (tr_event_handle *, session->netEvents, count);
+
+    while (session->netEventCount < count)
+    {
+        tr_event_handle * eh = tr_new0 (tr_event_handle, 1);
+
+        eh->lock = tr_lockNew ();
+        if (pipe (eh->fds) == -1)
+          tr_logAddError ("Unable to write to pipe() in libtransmission: %s", tr_strerror(errno));
+        eh->session = session;
+
+        /* the loop is set up here; it's only used by the new thread once that's running */
+        eh->base = event_base_new ();
+        eh->pipeEvent = event_new (eh->base, eh->fds[0], EV_READ | EV_PERSIST, readFromPipe, eh);
+        event_add (eh->pipeEvent, NULL);
+
+        session->netEvents[session->netEventCount++] = eh;
+        eh->thread = tr_threadNew (netThreadFunc, eh);
+    }
+}
+
+int
+tr_eventGetNetThreadCount (const tr_session * session)
+{
+    assert (tr_isSession (session));
+
+    return session->netEventCount;
+}
+
+struct event_base *
+tr_eventGetNetBase (tr_session * session, int thread)
+{
+    assert (tr_isSession (session));
+    assert (0 <= thread && thread < session->netEventCount);
+
+    return session->netEvents[thread]->base;
+}
+
 void
 tr_eventClose (tr_session * session)
 {
+    int i;
+
     assert (tr_isSession (session));
 
+    for (i=0; i<session->netEventCount; ++i)
+    {
+        session->netEvents[i]->die = true;
+        tr_netCloseSocket (session->netEvents[i]->fds[1]);
+    }
+
+    tr_free (session->netEvents);
+    session->netEvents = NULL;
+    session->netEventCount = 0;
+
     if (session->events == NULL)
         return;
 
@@ -311,14 +389,10 @@ tr_amInEventThread (const tr_session * session)
 ***
 **/
 
-void
-tr_runInEventThread (tr_session * session,
-                     void func (void*), void * user_data)
+static void
+runInThread (tr_event_handle * e, void func (void*), void * user_data)
 {
-  assert (tr_isSession (session));
-  assert (session->events != NULL);
-
-  if (tr_amInThread (session->events->thread))
+  if (tr_amInThread (e->thread))
     {
       (func)(user_data);
     }
@@ -328,7 +402,6 @@ tr_runInEventThread (tr_session * session,
       char ch;
       ev_ssize_t res_1;
       ev_ssize_t res_2;
-      tr_event_handle * e = session->events;
       struct tr_run_data data;
 
       tr_lockLock (e->lock);
@@ -347,3 +420,32 @@ tr_runInEventThread (tr_session * session,
         tr_logAddError ("Unable to write to libtransmisison event queue: %s", tr_strerror(errno));
     }
 }
+
+void
+tr_runInEventThread (tr_session * session,
+                     void func (void*), void * user_data)
+{
+  assert (tr_isSession (session));
+  assert (session->events != NULL);
+
+  runInThread (session->events, func, user_data);
+}
+
+bool
+tr_amInNetThread (const tr_session * session, int thread)
+{
+  assert (tr_isSession (session));
+  assert (0 <= thread && thread < session->netEventCount);
+
+  return tr_amInThread (session->netEvents[thread]->thread);
+}
+
+void
+tr_runInNetThread (tr_session * session, int thread,
+                   void func (void*), void * user_data)
+{
+  assert (tr_isSession (session));
+  assert (0 <= thread && thread < session->netEventCount);
+
+  runInThread (session->netEvents[thread], func, user_data);
+}
@@ -24,3 +24,18 @@ bool   tr_amInEventThread (const tr_session *);
 
 void   tr_runInEventThread (tr_session *, void func (void*), void * user_data);
 
+/**
+ * Network threads each run an event loop of their own, for peer I/O that
+ * doesn't need the libtransmission thread. Threads are numbered from 0.
+ * Lowering the count doesn't stop any: the extra ones run until tr_eventClose ().
+ */
+void   tr_eventSetNetThreadCount (tr_session *, int count);
+
+int    tr_eventGetNetThreadCount (const tr_session *);
+
+struct event_base * tr_eventGetNetBase (tr_session *, int thread);
+
+bool   tr_amInNetThread (const tr_session *, int thread);
+
+void   tr_runInNetThread (tr_session *, int thread, void func (void*), void * user_data);
+
@@ -540,6 +540,15 @@ tr_time_msec (void)
   return (uint64_t) tv.tv_sec * 1000 + (tv.tv_usec / 1000);
 }
 
+uint64_t
+tr_time_usec (void)
+{
+  struct timeval tv;
+
+  tr_gettimeofday (&tv);
+  return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 void
 tr_wait_msec (long int msec)
 {
@@ -26,6 +26,7 @@
 #include "list.h"
 #include "log.h"
 #include "platform.h" /* tr_lock () */
+#include "ptrarray.h"
 #include "torrent.h"
 #include "utils.h" /* tr_valloc (), tr_free () */
 #include "verify.h"
@@ -34,139 +35,339 @@
 ****
 ***/
 
+static tr_lock*
+getVerifyLock (void)
+{
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
+/***
+****
+***/
+
 enum
 {
-  MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100
+  /* while one buffer is being hashed, the others are being read */
+  VERIFY_BUFFER_COUNT = 3,
+
+  /* how many whole pieces to hand to tr_sha1_many () at once */
+  VERIFY_HASH_BATCH = 8,
+
+  VERIFY_READ_SIZE_MIN = 16 * 1024,
+  VERIFY_READ_SIZE_MAX = 16 * 1024 * 1024
 };
 
-static bool
-verifyTorrent (tr_torrent * tor, bool * stopFlag)
+static size_t readSize = 1024 * 1024;
+
+struct verify_buffer
+{
+  uint8_t * data;
+  uint64_t length;
+  bool ok; /* false if the data couldn't be read */
+};
+
+/* the verify thread reads the torrent's files in order into a ring of
+ * buffers, while a hashing thread checks the pieces in the filled ones */
+struct verify_pipeline
+{
+  tr_torrent * tor;
+  bool * stopFlag;
+  tr_lock * lock;
+  tr_cond * cond;
+
+  struct verify_buffer buffers[VERIFY_BUFFER_COUNT];
+  int head;   /* the next buffer to be hashed */
+  int filled; /* how many buffers are waiting to be hashed */
+
+  bool readerDone;
+  bool hasherDone;
+  bool changed;
+};
+
+static void
+finishPiece (struct verify_pipeline * pipeline,
+             tr_piece_index_t         pieceIndex,
+             bool                     hadPiece,
+             bool                     hasPiece)
+{
+  tr_torrent * tor = pipeline->tor;
+
+  if (hasPiece || hadPiece)
+    {
+      tr_torrentSetHasPiece (tor, pieceIndex, hasPiece);
+      pipeline->changed |= hasPiece != hadPiece;
+    }
+
+  tr_torrentSetPieceChecked (tor, pieceIndex);
+  tor->anyDate = tr_time ();
+}
+
+/* hash the whole pieces at the start of `data' in one batch and advance
+ * `pieceIndex' past them. returns how many bytes were consumed */
+static uint64_t
+hashWholePieces (struct verify_pipeline * pipeline,
+                 tr_piece_index_t       * pieceIndex,
+                 const uint8_t          * data,
+                 uint64_t                 length)
+{
+  size_t i;
+  size_t n = 0;
+  uint64_t pos = 0;
+  tr_torrent * tor = pipeline->tor;
+  const void * pieces[VERIFY_HASH_BATCH];
+  size_t pieceLengths[VERIFY_HASH_BATCH];
+  uint8_t hashes[VERIFY_HASH_BATCH * SHA_DIGEST_LENGTH];
+
+  while (n < VERIFY_HASH_BATCH && *pieceIndex + n < tor->info.pieceCount)
+    {
+      const uint32_t pieceSize = tr_torPieceCountBytes (tor, *pieceIndex + n);
+
+      if (pieceSize > length - pos)
+        break;
+
+      pieces[n] = data + pos;
+      pieceLengths[n] = pieceSize;
+      pos += pieceSize;
+      ++n;
+    }
+
+  if (n == 0 || !tr_sha1_many (n, pieces, pieceLengths, hashes))
+    return 0;
+
+  for (i=0; i<n; ++i, ++*pieceIndex)
+    {
+      const bool hadPiece = tr_torrentPieceIsComplete (tor, *pieceIndex);
+      const bool hasPiece = memcmp (hashes + i * SHA_DIGEST_LENGTH, tor->info.pieces[*pieceIndex].hash, SHA_DIGEST_LENGTH) == 0;
+
+      finishPiece (pipeline, *pieceIndex, hadPiece, hasPiece);
+    }
+
+  tor->verifyBytesDone += pos;
+  return pos;
+}
+
+static void
+hashThreadFunc (void * vpipeline)
 {
-  time_t end;
-  tr_sha1_ctx_t sha;
-  tr_sys_file_t fd = TR_BAD_SYS_FILE;
-  uint64_t filePos = 0;
-  bool changed = false;
   bool hadPiece = false;
-  time_t lastSleptAt = 0;
+  bool pieceOk = true;
   uint32_t piecePos = 0;
-  tr_file_index_t fileIndex = 0;
-  tr_file_index_t prevFileIndex = !fileIndex;
   tr_piece_index_t pieceIndex = 0;
-  const time_t begin = tr_time ();
-  const size_t buflen = 1024 * 128; /* 128 KiB buffer */
-  uint8_t * buffer = tr_valloc (buflen);
+  struct verify_pipeline * pipeline = vpipeline;
+  tr_torrent * tor = pipeline->tor;
+  tr_sha1_ctx_t sha = tr_sha1_init ();
 
-  sha = tr_sha1_init ();
+  tr_lockLock (pipeline->lock);
 
-  tr_logAddTorDbg (tor, "%s", "verifying torrent...");
-  tr_torrentSetChecked (tor, 0);
-  while (!*stopFlag && (pieceIndex < tor->info.pieceCount))
+  for (;;)
     {
-      uint64_t leftInPiece;
-      uint64_t bytesThisPass;
-      uint64_t leftInFile;
-      const tr_file * file = &tor->info.files[fileIndex];
+      uint64_t pos = 0;
+      struct verify_buffer * buf;
 
-      /* if we're starting a new piece... */
-      if (piecePos == 0)
-        hadPiece = tr_torrentPieceIsComplete (tor, pieceIndex);
+      while (pipeline->filled == 0 && !pipeline->readerDone)
+        tr_condWait (pipeline->cond, pipeline->lock);
 
-      /* if we're starting a new file... */
-      if (filePos == 0 && fd == TR_BAD_SYS_FILE && fileIndex != prevFileIndex)
-        {
-          char * filename = tr_torrentFindFile (tor, fileIndex);
-          fd = filename == NULL ? TR_BAD_SYS_FILE : tr_sys_file_open (filename,
-               TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, NULL);
-          tr_free (filename);
-          prevFileIndex = fileIndex;
-        }
+      if (pipeline->filled == 0)
+        break;
 
-      /* figure out how much we can read this pass */
-      leftInPiece = tr_torPieceCountBytes (tor, pieceIndex) - piecePos;
-      leftInFile = file->length - filePos;
-      bytesThisPass = MIN (leftInFile, leftInPiece);
-      bytesThisPass = MIN (bytesThisPass, buflen);
+      buf = &pipeline->buffers[pipeline->head];
+      tr_lockUnlock (pipeline->lock);
 
-      /* read a bit */
-      if (fd != TR_BAD_SYS_FILE)
+      while (!*pipeline->stopFlag && pos < buf->length && pieceIndex < tor->info.pieceCount)
         {
-          uint64_t numRead;
-          if (tr_sys_file_read_at (fd, buffer, bytesThisPass, filePos, &numRead, NULL) && numRead > 0)
+          uint64_t leftInPiece;
+          uint64_t bytesThisPass;
+
+          /* pieces that are wholly inside the buffer are hashed in batches */
+          if (piecePos == 0 && buf->ok)
             {
-              bytesThisPass = numRead;
-              tr_sha1_update (sha, buffer, bytesThisPass);
-#if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_DONTNEED
-              (void) posix_fadvise (fd, filePos, bytesThisPass, POSIX_FADV_DONTNEED);
-#endif
+              const uint64_t batchBytes = hashWholePieces (pipeline, &pieceIndex, buf->data + pos, buf->length - pos);
+
+              if (batchBytes > 0)
+                {
+                  pos += batchBytes;
+                  continue;
+                }
             }
-        }
 
-      /* move our offsets */
-      leftInPiece -= bytesThisPass;
-      leftInFile -= bytesThisPass;
-      piecePos += bytesThisPass;
-      filePos += bytesThisPass;
+          leftInPiece = tr_torPieceCountBytes (tor, pieceIndex) - piecePos;
+          bytesThisPass = MIN (leftInPiece, buf->length - pos);
 
-      /* if we're finishing a piece... */
-      if (leftInPiece == 0)
-        {
-          time_t now;
-          bool hasPiece;
-          uint8_t hash[SHA_DIGEST_LENGTH];
+          /* if we're starting a new piece... */
+          if (piecePos == 0)
+            hadPiece = tr_torrentPieceIsComplete (tor, pieceIndex);
 
-          tr_sha1_final (sha, hash);
-          hasPiece = memcmp (hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH) == 0;
+          if (buf->ok)
+            tr_sha1_update (sha, buf->data + pos, bytesThisPass);
+          else
+            pieceOk = false;
 
-          if (hasPiece || hadPiece)
+          pos += bytesThisPass;
+          piecePos += bytesThisPass;
+          tor->verifyBytesDone += bytesThisPass;
+
+          /* if we're finishing a piece... */
+          if (bytesThisPass == leftInPiece)
             {
-              tr_torrentSetHasPiece (tor, pieceIndex, hasPiece);
-              changed |= hasPiece != hadPiece;
-            }
+              bool hasPiece;
+              uint8_t hash[SHA_DIGEST_LENGTH];
 
-          tr_torrentSetPieceChecked (tor, pieceIndex);
-          now = tr_time ();
-          tor->anyDate = now;
+              tr_sha1_final (sha, hash);
+              hasPiece = pieceOk && memcmp (hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH) == 0;
+              finishPiece (pipeline, pieceIndex, hadPiece, hasPiece);
 
-          /* sleeping even just a few msec per second goes a long
-           * way towards reducing IO load... */
-          if (lastSleptAt != now)
-            {
-              lastSleptAt = now;
-              tr_wait_msec (MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY);
+              sha = tr_sha1_init ();
+              pieceOk = true;
+              pieceIndex++;
+              piecePos = 0;
             }
+        }
 
-          sha = tr_sha1_init ();
-          pieceIndex++;
-          piecePos = 0;
+      tr_lockLock (pipeline->lock);
+
+      /* if the verify was stopped, drop whatever is still queued */
+      if (*pipeline->stopFlag)
+        {
+          pipeline->filled = 0;
+          break;
         }
 
-      /* if we're finishing a file... */
-      if (leftInFile == 0)
+      pipeline->head = (pipeline->head + 1) % VERIFY_BUFFER_COUNT;
+      --pipeline->filled;
+      tr_condBroadcast (pipeline->cond);
+    }
+
+  tr_sha1_final (sha, NULL);
+
+  pipeline->hasherDone = true;
+  tr_condBroadcast (pipeline->cond);
+  tr_lockUnlock (pipeline->lock);
+}
+
+static bool
+readFully (tr_sys_file_t fd, uint8_t * buf, uint64_t len, uint64_t offset)
+{
+  while (len > 0)
+    {
+      uint64_t numRead;
+
+      if (!tr_sys_file_read_at (fd, buf, len, offset, &numRead, NULL) || numRead == 0)
+        return false;
+
+      buf += numRead;
+      len -= numRead;
+      offset += numRead;
+    }
+
+  return true;
+}
+
+static bool
+verifyTorrent (tr_torrent * tor, bool * stopFlag)
+{
+  int i;
+  uint64_t msec;
+  char mem[128];
+  char speed[128];
+  tr_file_index_t fileIndex;
+  struct verify_pipeline pipeline;
+  const uint64_t begin = tr_time_msec ();
+  size_t buflen;
+
+  tr_lockLock (getVerifyLock ());
+  buflen = readSize;
+  tr_lockUnlock (getVerifyLock ());
+
+  memset (&pipeline, 0, sizeof (pipeline));
+  pipeline.tor = tor;
+  pipeline.stopFlag = stopFlag;
+  pipeline.lock = tr_lockNew ();
+  pipeline.cond = tr_condNew ();
+  for (i=0; i<VERIFY_BUFFER_COUNT; ++i)
+    pipeline.buffers[i].data = tr_valloc (buflen);
+
+  tr_logAddTorDbg (tor, "%s", "verifying torrent...");
+  tr_torrentSetChecked (tor, 0);
+  tor->verifyStartedAt = begin;
+  tor->verifyBytesDone = 0;
+  tr_threadNew (hashThreadFunc, &pipeline);
+
+  for (fileIndex=0; !*stopFlag && fileIndex<tor->info.fileCount; ++fileIndex)
+    {
+      uint64_t filePos = 0;
+      tr_sys_file_t fd = TR_BAD_SYS_FILE;
+      const tr_file * file = &tor->info.files[fileIndex];
+
+      if (file->length != 0)
         {
-          if (fd != TR_BAD_SYS_FILE)
+          char * filename = tr_torrentFindFile (tor, fileIndex);
+          fd = filename == NULL ? TR_BAD_SYS_FILE : tr_sys_file_open (filename,
+               TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, NULL);
+          tr_free (filename);
+        }
+
+      while (!*stopFlag && filePos < file->length)
+        {
+          struct verify_buffer * buf;
+
+          /* wait for a free buffer */
+          tr_lockLock (pipeline.lock);
+          while (pipeline.filled == VERIFY_BUFFER_COUNT && !pipeline.hasherDone)
+            tr_condWait (pipeline.cond, pipeline.lock);
+          if (pipeline.hasherDone)
             {
-              tr_sys_file_close (fd, NULL);
-              fd = TR_BAD_SYS_FILE;
+              tr_lockUnlock (pipeline.lock);
+              break;
             }
-          fileIndex++;
-          filePos = 0;
+          buf = &pipeline.buffers[(pipeline.head + pipeline.filled) % VERIFY_BUFFER_COUNT];
+          tr_lockUnlock (pipeline.lock);
+
+          /* read the next chunk. reads stay aligned to buflen within the file */
+          buf->length = MIN (buflen, file->length - filePos);
+          buf->ok = fd != TR_BAD_SYS_FILE && readFully (fd, buf->data, buf->length, filePos);
+#if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_DONTNEED
+          if (buf->ok)
+            (void) posix_fadvise (fd, filePos, buf->length, POSIX_FADV_DONTNEED);
+#endif
+          filePos += buf->length;
+
+          /* hand it to the hashing thread */
+          tr_lockLock (pipeline.lock);
+          ++pipeline.filled;
+          tr_condBroadcast (pipeline.cond);
+          tr_lockUnlock (pipeline.lock);
         }
+
+      if (fd != TR_BAD_SYS_FILE)
+        tr_sys_file_close (fd, NULL);
     }
 
+  /* wait for the hashing thread to finish */
+  tr_lockLock (pipeline.lock);
+  pipeline.readerDone = true;
+  tr_condBroadcast (pipeline.cond);
+  while (!pipeline.hasherDone)
+    tr_condWait (pipeline.cond, pipeline.lock);
+  tr_lockUnlock (pipeline.lock);
+
   /* cleanup */
-  if (fd != TR_BAD_SYS_FILE)
-    tr_sys_file_close (fd, NULL);
-  tr_sha1_final (sha, NULL);
-  free (buffer);
+  for (i=0; i<VERIFY_BUFFER_COUNT; ++i)
+    tr_free (pipeline.buffers[i].data);
+  tr_condFree (pipeline.cond);
+  tr_lockFree (pipeline.lock);
 
   /* stopwatch */
-  end = tr_time ();
-  tr_logAddTorDbg (tor, "Verification is done. It took %d seconds to verify %"PRIu64" bytes (%"PRIu64" bytes per second)",
-             (int)(end-begin), tor->info.totalSize,
-             (uint64_t)(tor->info.totalSize/ (1+ (end-begin))));
+  msec = tr_time_msec () - begin;
+  tr_formatter_mem_B (mem, tor->verifyBytesDone, sizeof (mem));
+  tr_formatter_speed_KBps (speed, (tor->verifyBytesDone / (double)tr_speed_K) / (msec / 1000.0 + 0.001), sizeof (speed));
+  tr_logAddTorInfo (tor, "Verified %s in %.1f seconds (%s)", mem, msec / 1000.0, speed);
 
-  return changed;
+  return pipeline.changed;
 }
 
 /***
@@ -181,25 +382,134 @@ struct verify_node
   uint64_t              current_size;
 };
 
-static struct verify_node currentNode;
-static tr_list * verifyList = NULL;
-static tr_thread * verifyThread = NULL;
-static bool stopCurrent = false;
+/* torrents on the same device are verified one at a time,
+ * so that we don't make the disk's heads seek back and forth */
+struct verify_device
+{
+  uint64_t             device;
+  tr_list            * queue;
+  struct verify_node   current;
+  bool                 stopCurrent;
+  bool                 hasWorker;
+};
 
-static tr_lock*
-getVerifyLock (void)
+static tr_ptrArray devices = TR_PTR_ARRAY_INIT_STATIC;
+static int workerLimit = 1;
+static int workerCount = 0;
+
+/* aggregate stats since the workers last went idle */
+static uint64_t busySinceMsec = 0;
+static uint64_t bytesVerified = 0;
+
+
+static int
+compareDevices (const void * va, const void * vb)
 {
-  static tr_lock * lock = NULL;
+  const struct verify_device * a = va;
+  const struct verify_device * b = vb;
 
-  if (lock == NULL)
-    lock = tr_lockNew ();
+  if (a->device != b->device)
+    return a->device < b->device ? -1 : 1;
 
-  return lock;
+  return 0;
+}
+
+static struct verify_device *
+getDevice (uint64_t device)
+{
+  struct verify_device key;
+  struct verify_device * dev;
+
+  key.device = device;
+  dev = tr_ptrArrayFindSorted (&devices, &key, compareDevices);
+
+  if (dev == NULL)
+    {
+      dev = tr_new0 (struct verify_device, 1);
+      dev->device = device;
+      tr_ptrArrayInsertSorted (&devices, dev, compareDevices);
+    }
+
+  return dev;
+}
+
+static void
+removeDevice (struct verify_device * dev)
+{
+  tr_ptrArrayRemoveSortedPointer (&devices, dev, compareDevices);
+  tr_free (dev);
+}
+
+static struct verify_device *
+findCurrentDevice (const tr_torrent * tor)
+{
+  int i;
+  const int n = tr_ptrArraySize (&devices);
+
+  for (i=0; i<n; ++i)
+    {
+      struct verify_device * dev = tr_ptrArrayNth (&devices, i);
+      if (dev->current.torrent == tor)
+        return dev;
+    }
+
+  return NULL;
+}
+
+/* the device a torrent's data is on, or 0 if it can't be found */
+static uint64_t
+getTorrentDevice (const tr_torrent * tor)
+{
+  uint64_t device = 0;
+
+  if (tor->currentDir == NULL || !tr_sys_path_get_device (tor->currentDir, &device, NULL))
+    device = 0;
+
+  return device;
 }
 
 static void
-verifyThreadFunc (void * unused UNUSED)
+logAggregateStats (void)
 {
+  const uint64_t msec = tr_time_msec () - busySinceMsec;
+  char mem[128];
+  char speed[128];
+
+  tr_formatter_mem_B (mem, bytesVerified, sizeof (mem));
+  tr_formatter_speed_KBps (speed, (bytesVerified / (double)tr_speed_K) / (msec / 1000.0 + 0.001), sizeof (speed));
+  tr_logAddNamedInfo ("Verify", "Verified %s in %d seconds (%s)", mem, (int)(msec / 1000), speed);
+}
+
+static void verifyThreadFunc (void * vdev);
+
+/* must be called with the verify lock held */
+static void
+startWorkers (void)
+{
+  int i;
+  const int n = tr_ptrArraySize (&devices);
+
+  for (i=0; i<n && workerCount<workerLimit; ++i)
+    {
+      struct verify_device * dev = tr_ptrArrayNth (&devices, i);
+
+      if (!dev->hasWorker && dev->queue != NULL)
+        {
+          if (workerCount == 0 && bytesVerified == 0)
+            busySinceMsec = tr_time_msec ();
+
+          dev->hasWorker = true;
+          ++workerCount;
+          tr_threadNew (verifyThreadFunc, dev);
+        }
+    }
+}
+
+static void
+verifyThreadFunc (void * vdev)
+{
+  struct verify_device * dev = vdev;
+
   for (;;)
     {
       int changed = 0;
@@ -207,34 +517,51 @@ verifyThreadFunc (void * unused UNUSED)
       struct verify_node * node;
 
       tr_lockLock (getVerifyLock ());
-      stopCurrent = false;
-      node = (struct verify_node*) verifyList ? verifyList->data : NULL;
+      dev->stopCurrent = false;
+      node = (struct verify_node*) dev->queue ? dev->queue->data : NULL;
       if (node == NULL)
         {
-          currentNode.torrent = NULL;
+          dev->current.torrent = NULL;
           break;
         }
 
-      currentNode = *node;
-      tor = currentNode.torrent;
-      tr_list_remove_data (&verifyList, node);
+      dev->current = *node;
+      tor = dev->current.torrent;
+      tr_list_remove_data (&dev->queue, node);
       tr_free (node);
       tr_lockUnlock (getVerifyLock ());
 
       tr_logAddTorInfo (tor, "%s", _("Verifying torrent"));
       tr_torrentSetVerifyState (tor, TR_VERIFY_NOW);
-      changed = verifyTorrent (tor, &stopCurrent);
+      changed = verifyTorrent (tor, &dev->stopCurrent);
       tr_torrentSetVerifyState (tor, TR_VERIFY_NONE);
       assert (tr_isTorrent (tor));
 
-      if (!stopCurrent && changed)
+      if (!dev->stopCurrent && changed)
         tr_torrentSetDirty (tor);
 
-      if (currentNode.callback_func)
-        (*currentNode.callback_func)(tor, stopCurrent, currentNode.callback_data);
+      tr_lockLock (getVerifyLock ());
+      if (!dev->stopCurrent)
+        bytesVerified += dev->current.current_size;
+      tr_lockUnlock (getVerifyLock ());
+
+      if (dev->current.callback_func)
+        (*dev->current.callback_func)(tor, dev->stopCurrent, dev->current.callback_data);
+    }
+
+  /* this device is done; let another one have our slot */
+  dev->hasWorker = false;
+  --workerCount;
+  removeDevice (dev);
+  startWorkers ();
+
+  if (workerCount == 0)
+    {
+      if (bytesVerified > 0)
+        logAggregateStats ();
+      bytesVerified = 0;
     }
 
-  verifyThread = NULL;
   tr_lockUnlock (getVerifyLock ());
 }
 
@@ -264,6 +591,8 @@ tr_verifyAdd (tr_torrent           * tor,
               void                 * callback_data)
 {
   struct verify_node * node;
+  struct verify_device * dev;
+  const uint64_t device = getTorrentDevice (tor);
 
   assert (tr_isTorrent (tor));
   tr_logAddTorInfo (tor, "%s", _("Queued for verification"));
@@ -276,9 +605,9 @@ tr_verifyAdd (tr_torrent           * tor,
 
   tr_lockLock (getVerifyLock ());
   tr_torrentSetVerifyState (tor, TR_VERIFY_WAIT);
-  tr_list_insert_sorted (&verifyList, node, compareVerifyByPriorityAndSize);
-  if (verifyThread == NULL)
-    verifyThread = tr_threadNew (verifyThreadFunc, NULL);
+  dev = getDevice (device);
+  tr_list_insert_sorted (&dev->queue, node, compareVerifyByPriorityAndSize);
+  startWorkers ();
   tr_lockUnlock (getVerifyLock ());
 }
 
@@ -293,16 +622,17 @@ compareVerifyByTorrent (const void * va, const void * vb)
 void
 tr_verifyRemove (tr_torrent * tor)
 {
+  struct verify_device * dev;
   tr_lock * lock = getVerifyLock ();
   tr_lockLock (lock);
 
   assert (tr_isTorrent (tor));
 
-  if (tor == currentNode.torrent)
+  if ((dev = findCurrentDevice (tor)) != NULL)
     {
-      stopCurrent = true;
+      dev->stopCurrent = true;
 
-      while (stopCurrent)
+      while (findCurrentDevice (tor) != NULL)
         {
           tr_lockUnlock (lock);
           tr_wait_msec (100);
@@ -311,7 +641,15 @@ tr_verifyRemove (tr_torrent * tor)
     }
   else
     {
-      struct verify_node * node = tr_list_remove (&verifyList, tor, compareVerifyByTorrent);
+      int i;
+      struct verify_node * node = NULL;
+      const int n = tr_ptrArraySize (&devices);
+
+      for (i=0; i<n && node==NULL; ++i)
+        {
+          dev = tr_ptrArrayNth (&devices, i);
+          node = tr_list_remove (&dev->queue, tor, compareVerifyByTorrent);
+        }
 
       tr_torrentSetVerifyState (tor, TR_VERIFY_NONE);
 
@@ -330,11 +668,57 @@ tr_verifyRemove (tr_torrent * tor)
 void
 tr_verifyClose (tr_session * session UNUSED)
 {
+  int i;
+
   tr_lockLock (getVerifyLock ());
 
-  stopCurrent = true;
-  tr_list_free (&verifyList, tr_free);
+  /* devices with a worker are freed by the worker when it notices
+     that its queue is empty */
+  for (i=tr_ptrArraySize (&devices)-1; i>=0; --i)
+    {
+      struct verify_device * dev = tr_ptrArrayNth (&devices, i);
+      dev->stopCurrent = true;
+      tr_list_free (&dev->queue, tr_free);
+
+      if (!dev->hasWorker)
+        removeDevice (dev);
+    }
 
   tr_lockUnlock (getVerifyLock ());
 }
 
+void
+tr_verifySetThreadCount (int count)
+{
+  tr_lockLock (getVerifyLock ());
+
+  workerLimit = MAX (count, 1);
+  startWorkers ();
+
+  tr_lockUnlock (getVerifyLock ());
+}
+
+int
+tr_verifyGetThreadCount (void)
+{
+  return workerLimit;
+}
+
+void
+tr_verifySetReadSize (size_t bytes)
+{
+  tr_lockLock (getVerifyLock ());
+
+  /* keep reads a multiple of the page size */
+  bytes = MAX (bytes, VERIFY_READ_SIZE_MIN);
+  bytes = MIN (bytes, VERIFY_READ_SIZE_MAX);
+  readSize = bytes - (bytes % VERIFY_READ_SIZE_MIN);
+
+  tr_lockUnlock (getVerifyLock ());
+}
+
+size_t
+tr_verifyGetReadSize (void)
+{
+  return readSize;
+}
@@ -26,5 +26,22 @@ void tr_verifyRemove (tr_torrent * tor);
 
 void tr_verifyClose (tr_session *);
 
+/**
+ * Torrents are grouped by the device their data is on, and each device
+ * gets its own verify thread so that several disks can be checked at once.
+ * This sets how many of those threads may run at the same time.
+ */
+void tr_verifySetThreadCount (int count);
+
+int  tr_verifyGetThreadCount (void);
+
+/**
+ * How much of a file is read at a time while verifying. A few reads of
+ * this size are kept in flight while the previous ones are being hashed.
+ */
+void   tr_verifySetReadSize (size_t bytes);
+
+size_t tr_verifyGetReadSize (void);
+
 /* @} */
 
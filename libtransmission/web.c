@@ -37,6 +37,10 @@
  #define USE_LIBCURL_SOCKOPT
 #endif
 
+#if LIBCURL_VERSION_NUM >= 0x071C00 /* curl_multi_wait () was added in 7.28.0 */
+ #define USE_LIBCURL_MULTI_WAIT
+#endif
+
 enum
 {
   THREADFUNC_MAX_SLEEP_MSEC = 200,
@@ -334,6 +338,18 @@ tr_webRunWebseed (tr_torrent        * tor,
                         buffer);
 }
 
+bool
+tr_webUsesSelect (void)
+{
+#ifdef USE_LIBCURL_MULTI_WAIT
+  return false;
+#else
+  return true;
+#endif
+}
+
+#ifndef USE_LIBCURL_MULTI_WAIT
+
 /**
  * Portability wrapper for select ().
  *
@@ -369,6 +385,8 @@ tr_select (int nfds,
 #endif
 }
 
+#endif /* USE_LIBCURL_MULTI_WAIT */
+
 static void
 tr_webThreadFunc (void * vsession)
 {
@@ -459,6 +477,12 @@ tr_webThreadFunc (void * vsession)
         msec = 100; /* on shutdown, call perform () more frequently */
       if (msec > 0)
         {
+#ifdef USE_LIBCURL_MULTI_WAIT
+          if (msec > THREADFUNC_MAX_SLEEP_MSEC)
+            msec = THREADFUNC_MAX_SLEEP_MSEC;
+
+          curl_multi_wait (multi, NULL, 0, (int)msec, NULL);
+#else
           int usec;
           int max_fd;
           struct timeval t;
@@ -477,6 +501,7 @@ tr_webThreadFunc (void * vsession)
           t.tv_sec =  usec / 1000000;
           t.tv_usec = usec % 1000000;
           tr_select (max_fd+1, &r_fd_set, &w_fd_set, &c_fd_set, &t);
+#endif
         }
 
       /* call curl_multi_perform () */
@@ -35,6 +35,10 @@ tr_web_close_mode;
 
 void tr_webClose (tr_session * session, tr_web_close_mode close_mode);
 
+/** @brief true if the web thread waits on its sockets with select (),
+    which can't handle descriptors at or above FD_SETSIZE */
+bool tr_webUsesSelect (void);
+
 typedef void (*tr_web_done_func)(tr_session       * session,
                                  bool               did_connect_flag,
                                  bool               timeout_flag,